@@ -0,0 +1,77 @@
+// blockfs的进程内客户端接口, 不经过FUSE直接调用libblock_fs
+//
+// 语义尽量和同名的POSIX接口保持一致:
+//   - 失败返回-1(指针返回nullptr)并设置errno
+//   - path是blockfs内部的绝对路径, 根目录是"/", 不带挂载点前缀
+//   - fd只在blockfs内部有效, 和内核的fd不是一个命名空间, 不能混用
+//
+// 和POSIX的差别:
+//   - read/write/lseek共享的文件位置没有加锁, 多线程共用一个fd时请用pread/pwrite
+//   - O_APPEND只在open时把文件位置放到文件末尾, 之后的write不会再追加
+//   - fallocate只支持mode为0, 也就是分配空间并扩展文件大小
+//   - 没有硬链接/软链接/权限检查, mode只在创建时记录
+#ifndef BLOCK_FS_H_
+#define BLOCK_FS_H_
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BLOCK_FS_API_VERSION 1
+
+typedef struct block_fs_dir block_fs_dir;
+
+// 加载配置文件并挂载设备, 同一个进程只能挂载一次;
+// 设备已经被别的进程(包括FUSE)挂载时返回-1, errno为EBUSY
+int block_fs_mount(const char *config_path);
+// 元数据全部落盘之后卸载, 之后不能再调用其他接口
+int block_fs_unmount(void);
+
+// 打开目录时flags只能是只读, 得到的fd可以fstat/fsync/close
+int block_fs_open(const char *path, int flags, mode_t mode);
+int block_fs_close(int fd);
+
+ssize_t block_fs_read(int fd, void *buf, size_t count);
+ssize_t block_fs_write(int fd, const void *buf, size_t count);
+off_t block_fs_lseek(int fd, off_t offset, int whence);
+
+ssize_t block_fs_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t block_fs_pwrite(int fd, const void *buf, size_t count, off_t offset);
+ssize_t block_fs_preadv(int fd, const struct iovec *iov, int iovcnt,
+                        off_t offset);
+ssize_t block_fs_pwritev(int fd, const struct iovec *iov, int iovcnt,
+                         off_t offset);
+
+int block_fs_fsync(int fd);
+int block_fs_fdatasync(int fd);
+
+int block_fs_stat(const char *path, struct stat *buf);
+int block_fs_fstat(int fd, struct stat *buf);
+int block_fs_statvfs(struct statvfs *buf);
+
+int block_fs_truncate(const char *path, off_t length);
+int block_fs_ftruncate(int fd, off_t length);
+int block_fs_fallocate(int fd, int mode, off_t offset, off_t len);
+
+// 和rename(2)不同, newpath已经存在时不覆盖, 返回-1并且errno为EEXIST
+int block_fs_rename(const char *oldpath, const char *newpath);
+int block_fs_unlink(const char *path);
+int block_fs_mkdir(const char *path, mode_t mode);
+int block_fs_rmdir(const char *path);
+
+// readdir返回的dirent在下一次readdir或者closedir之前有效
+block_fs_dir *block_fs_opendir(const char *path);
+struct dirent *block_fs_readdir(block_fs_dir *dir);
+int block_fs_closedir(block_fs_dir *dir);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // BLOCK_FS_H_
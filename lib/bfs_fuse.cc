@@ -5,7 +5,9 @@
 #include <string.h>
 #include <sys/file.h> /* flock(2) */
 #include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <map>
 #include <mutex>
 #include <string>
@@ -14,15 +16,20 @@
 
 #include "comm_utils.h"
 #include "file_system.h"
+#include "log_ratelimit.h"
 #include "logging.h"
 #include "spdlog/spdlog.h"
+#include "stats.h"
 
 namespace udisk::blockfs {
 
-// #define BFS_USE_READ_WRITE_BUFFER
-
 #define DIR_FILLER(F, B, N, S, O) F(B, N, S, O, FUSE_FILL_DIR_PLUS)
 
+// 挂载点根目录下的统计虚拟文件
+static inline bool IsStatsPath(const char *path) {
+  return path && path[0] == '/' && Stats::IsStatsFile(path + 1);
+}
+
 class UDiskBFS {
  public:
   UDiskBFS() = default;
@@ -40,6 +47,8 @@ class UDiskBFS {
   void StopFuse() {
   }
 
+  bfs_config_info *info() const { return info_; }
+
   uint64_t PushOpenDirectory(BLOCKFS_DIR *dp) {
     std::lock_guard<std::mutex> lock(mutex_);
     uint64_t key = (uint64_t)dp;
@@ -101,7 +110,8 @@ class UDiskBFS {
 static int mfs_getattr(const char *path, struct stat *stbuf,
                        struct fuse_file_info *fi)
 {
-  SPDLOG_INFO("call mfs_getattr file: {}", path);
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC, "call mfs_getattr file: {}", path);
+  StatTimer timer(kStatFuseGetattr);
 
   int res;
 
@@ -129,6 +139,11 @@ static int mfs_getattr(const char *path, struct stat *stbuf,
     return 0;
   }
 
+  if (IsStatsPath(path)) {
+    block_fs_fuse_stats_attr(0, stbuf);
+    return 0;
+  }
+
   if (fi)
     res = FileSystem::Instance()->StatPath(fi->fh, stbuf);
   else
@@ -146,6 +161,8 @@ static int mfs_getattr(const char *path, struct stat *stbuf,
  */
 static int bfs_mknod(const char *path, mode_t mode, dev_t rdev) {
   SPDLOG_INFO("call bfs_mknod file: {}", path);
+  StatTimer timer(kStatFuseMknod);
+  if (IsStatsPath(path)) return -EEXIST;
 
   int res = FileSystem::Instance()->CreateFile(path, mode);
   if (res < 0) return -errno;
@@ -161,6 +178,8 @@ static int bfs_mknod(const char *path, mode_t mode, dev_t rdev) {
  * */
 static int mfs_mkdir(const char *path, mode_t mode) {
   SPDLOG_INFO("call mfs_mkdir file: {}", path);
+  StatTimer timer(kStatFuseMkdir);
+  if (IsStatsPath(path)) return -EEXIST;
 
   int res = FileSystem::Instance()->dir_handle()->CreateDirectory(path);
   if (res < 0) return -errno;
@@ -171,6 +190,8 @@ static int mfs_mkdir(const char *path, mode_t mode) {
 /** Remove a file */
 static int unlink(const char *path) {
   SPDLOG_INFO("call unlink file: {}", path);
+  StatTimer timer(kStatFuseUnlink);
+  if (IsStatsPath(path)) return -EPERM;
 
   int res = FileSystem::Instance()->file_handle()->unlink(path);
   if (res < 0) return -errno;
@@ -181,6 +202,7 @@ static int unlink(const char *path) {
 /** Remove a directory */
 static int bfs_rmdir(const char *path) {
   SPDLOG_INFO("call bfs_rmdir file: {}", path);
+  StatTimer timer(kStatFuseRmdir);
 
   int res = FileSystem::Instance()->dir_handle()->DeleteDirectory(path, false);
   if (res < 0) return -errno;
@@ -199,6 +221,8 @@ static int bfs_rmdir(const char *path) {
  */
 static int mfs_rename(const char *from, const char *to, unsigned int flags) {
   SPDLOG_INFO("call mfs_rename: {} -> {}", from, to);
+  StatTimer timer(kStatFuseRename);
+  if (IsStatsPath(from) || IsStatsPath(to)) return -EPERM;
 
   int res;
   /* When we have renameat2() in libc, then we can implement flags */
@@ -225,6 +249,8 @@ static int mfs_truncate(const char *path, off_t size,
     return -EINVAL;
   }
   SPDLOG_INFO("call mfs_truncate file: {}", path);
+  StatTimer timer(kStatFuseTruncate);
+  if (IsStatsPath(path)) return -EACCES;
 
   int res;
 
@@ -243,10 +269,18 @@ static int mfs_open(const char *path, struct fuse_file_info *fi) {
     return -EINVAL;
   }
   SPDLOG_INFO("call mfs_open file: {}", path);
+  StatTimer timer(kStatFuseOpen);
+
+  if (IsStatsPath(path)) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+    fi->fh = block_fs_fuse_stats_open(path + 1);
+    fi->direct_io = 1;
+    return 0;
+  }
 
   ino_t fd = FileSystem::Instance()->file_handle()->open(path, fi->flags);
   fi->fh = fd;
-  fi->direct_io = 1;
+  fi->direct_io = !UDiskBFS::Instance()->info()->fuse_writeback_cache_;
   // fi->nonseekable = 1;
 
   /* Make cache persistent even if file is closed,
@@ -266,11 +300,17 @@ static int mfs_open(const char *path, struct fuse_file_info *fi) {
  */
 static int mfs_read(const char *path, char *buf, size_t size, off_t offset,
                     struct fuse_file_info *fi) {
-  SPDLOG_INFO("call mfs_read file: {}", path);
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC, "call mfs_read file: {}", path);
+  StatTimer timer(kStatFuseRead);
 
   ino_t fd;
   int res;
 
+  if (IsStatsPath(path)) {
+    if (fi == nullptr) return -EBADF;
+    return block_fs_fuse_stats_read(fi->fh, buf, size, offset);
+  }
+
   if (fi == nullptr)
     fd = FileSystem::Instance()->file_handle()->open(path, O_RDONLY);
   else
@@ -281,6 +321,7 @@ static int mfs_read(const char *path, char *buf, size_t size, off_t offset,
 
   if (fi == nullptr) FileSystem::Instance()->file_handle()->close(fd);
 
+  timer.set_bytes(res);
   return res;
 }
 
@@ -295,11 +336,14 @@ static int mfs_read(const char *path, char *buf, size_t size, off_t offset,
  */
 static int write(const char *path, const char *buf, size_t size,
                      off_t offset, struct fuse_file_info *fi) {
-  SPDLOG_INFO("call write file: {}", path);
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC, "call write file: {}", path);
+  StatTimer timer(kStatFuseWrite);
 
   ino_t fd;
   int res;
 
+  if (IsStatsPath(path)) return -EBADF;
+
   if (fi == nullptr)
     fd = FileSystem::Instance()->file_handle()->open(path, O_RDONLY);
   else
@@ -310,11 +354,13 @@ static int write(const char *path, const char *buf, size_t size,
 
   if (fi == nullptr) FileSystem::Instance()->file_handle()->close(fd);
 
+  timer.set_bytes(res);
   return res;
 }
 
 static int mfs_statfs(const char *path, struct statvfs *vfs) {
-  SPDLOG_INFO("call mfs_statfs file: {}", path);
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC, "call mfs_statfs file: {}", path);
+  StatTimer timer(kStatFuseStatfs);
 
   int res = FileSystem::Instance()->StatVFS(vfs);
   if (res < 0) return -errno;
@@ -351,11 +397,14 @@ static int mfs_statfs(const char *path, struct statvfs *vfs) {
  * [close]: http://pubs.opengroup.org/onlinepubs/9699919799/functions/close.html
  */
 static int flush(const char *path, struct fuse_file_info *fi) {
-  SPDLOG_INFO("call flush file: {}", path);
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC, "call flush file: {}", path);
+  StatTimer timer(kStatFuseFlush);
 
   ino_t fd;
   int res;
 
+  if (IsStatsPath(path)) return 0;
+
   if (!fi)
     fd = FileSystem::Instance()->file_handle()->open(path, O_RDONLY);
   else
@@ -376,11 +425,13 @@ static int flush(const char *path, struct fuse_file_info *fi) {
 
 static int bfs_release(const char *path, struct fuse_file_info *fi) {
   SPDLOG_INFO("call bfs_release file: {}", path);
+  StatTimer timer(kStatFuseRelease);
 
-  (void)path;
   int res = 0;
 
-  if (fi) {
+  if (fi && IsStatsPath(path)) {
+    block_fs_fuse_stats_release(fi->fh);
+  } else if (fi) {
     res = FileSystem::Instance()->file_handle()->close(fi->fh);
     if (res < 0) return -errno;
   }
@@ -394,11 +445,14 @@ static int bfs_release(const char *path, struct fuse_file_info *fi) {
  */
 static int mfs_fsync(const char *path, int datasync,
                      struct fuse_file_info *fi) {
-  SPDLOG_INFO("call mfs_fsync file: {}", path);
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC, "call mfs_fsync file: {}", path);
+  StatTimer timer(kStatFuseFsync);
 
   ino_t fd;
   int res;
 
+  if (IsStatsPath(path)) return 0;
+
   if (!fi)
     fd = FileSystem::Instance()->file_handle()->open(path, O_RDONLY);
   else
@@ -425,6 +479,7 @@ static int mfs_fsync(const char *path, int datasync,
 
 static int bfs_opendir(const char *path, struct fuse_file_info *fi) {
   SPDLOG_INFO("call bfs_opendir: {}", path);
+  StatTimer timer(kStatFuseOpendir);
 
   BLOCKFS_DIR *dp = FileSystem::Instance()->dir_handle()->OpenDirectory(path);
   if (!dp) {
@@ -457,16 +512,19 @@ static int bfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                        off_t offset, struct fuse_file_info *fi,
                        enum fuse_readdir_flags flags)
 {
-  SPDLOG_INFO("call bfs_readdir: {}", path);
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC, "call bfs_readdir: {} offset: {}",
+                      path, offset);
+  StatTimer timer(kStatFuseReaddir);
 
-  (void)offset;
-  (void)fi;
   (void)flags;
 
+  // 用第2种模式: 每一项都带offset, buffer满了就返回, 下次从offset继续
+  // offset 1和2留给根目录的.和.., 子项的offset是游标加2
   if (::strcmp(path, "/") == 0) {
-    if (DIR_FILLER(filler, buf, ".", nullptr, 0) != 0 ||
-        DIR_FILLER(filler, buf, "..", nullptr, 0) != 0) {
-      SPDLOG_INFO("filler directory: . and ..");
+    if (offset < 1 && DIR_FILLER(filler, buf, ".", nullptr, 1) != 0) {
+      return 0;
+    }
+    if (offset < 2 && DIR_FILLER(filler, buf, "..", nullptr, 2) != 0) {
       return 0;
     }
   }
@@ -475,6 +533,8 @@ static int bfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     SPDLOG_ERROR("failed to find open directory: {}", path);
     return -EINVAL;
   }
+  FileSystem::Instance()->dir_handle()->SeekDirectory(
+      dp, offset > 2 ? offset - 2 : 0);
   block_fs_dirent *de;
   while ((de = FileSystem::Instance()->ReadDirectory(dp)) != nullptr) {
     // struct stat st;
@@ -483,32 +543,10 @@ static int bfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     // st.st_mode = de->d_type << 12;
     // if (filler(buf, de->d_name, &st, 0, (fuse_fill_dir_flags)0))
     //   break;
-#if 0
-    struct stat st;
-    enum fuse_fill_dir_flags fill_flags = (fuse_fill_dir_flags)0;
-    if (flags & FUSE_READDIR_PLUS) {
-      int res;
-
-      res = FileSystem::Instance()->StatPath(de->d_name, &st);
-      if (res != -1) {
-        fill_flags == FUSE_FILL_DIR_PLUS;
-      }
-    }
-    if (!(fill_flags & FUSE_FILL_DIR_PLUS)) {
-      ::memset(&st, 0, sizeof(st));
-      st.st_ino = de->d_ino;
-      st.st_mode = de->d_type << 12;
-    }
-
-    if (DIR_FILLER(filler, buf, de->d_name, &st, de->d_off) != 0) {
-      return -ENOMEM;
-    }
-#else
-    if (DIR_FILLER(filler, buf, de->d_name, 0, 0) != 0) {
-      LOG(INFO) << "filler directory, " << de->d_name;
-      return -ENOMEM;
+    if (DIR_FILLER(filler, buf, de->d_name, nullptr, de->d_off + 2) != 0) {
+      SPDLOG_DEBUG("readdir buffer full at: {}", de->d_name);
+      break;
     }
-#endif
   }
   return 0;
 }
@@ -517,6 +555,7 @@ static int bfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
  */
 static int bfs_releasedir(const char *path, struct fuse_file_info *fi) {
   SPDLOG_INFO("call bfs_releasedir: {}", path);
+  StatTimer timer(kStatFuseReleasedir);
 
   if (fi) {
     BLOCKFS_DIR *dp = UDiskBFS::Instance()->PopOpenDirectory(fi->fh);
@@ -542,8 +581,9 @@ static void *bfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
   SPDLOG_INFO("call bfs_init");
 
   struct fuse_context *cxt = fuse_get_context();
-  (void)cxt;
-  return nullptr;
+  bfs_config_info *info = static_cast<bfs_config_info *>(cxt->private_data);
+  block_fs_fuse_conn_init(info, conn);
+  return info;
 }
 
 /**
@@ -572,6 +612,8 @@ static int mfs_create(const char *path, mode_t mode,
     return -EINVAL;
   }
   SPDLOG_INFO("call mfs_create: {}", path);
+  StatTimer timer(kStatFuseCreate);
+  if (IsStatsPath(path)) return -EEXIST;
 
   ino_t fd = FileSystem::Instance()->file_handle()->open(path, fi->flags, mode);
 
@@ -611,7 +653,9 @@ static int mfs_create(const char *path, mode_t mode,
  */
 int bfs_lock(const char *path, struct fuse_file_info *fi, int cmd,
              struct flock *lock) {
-  LOG(INFO) << "call bfs_lock: " << path << " fd: " << fi->fh;
+  SPDLOG_DEBUG("call bfs_lock: {} fd: {}", path, fi ? fi->fh : 0);
+  StatTimer timer(kStatFuseLock);
+  if (IsStatsPath(path)) return 0;
 
   ino_t fd;
   int res;
@@ -627,7 +671,6 @@ int bfs_lock(const char *path, struct fuse_file_info *fi, int cmd,
   return 0;
 }
 
-#ifdef BFS_USE_READ_WRITE_BUFFER
 /** Write contents of buffer to an open file
  *
  * Similar to the write() method, but data is supplied in a
@@ -639,37 +682,19 @@ int bfs_lock(const char *path, struct fuse_file_info *fi, int cmd,
  */
 static int bfs_write_buf(const char *path, struct fuse_bufvec *buf,
                          off_t offset, struct fuse_file_info *fi) {
-  LOG(INFO) << "call bfs_write_buf: " << path << " fd: " << fi->fh
-            << " offset: " << offset << " count: " << buf->count;
-
-  ino_t fd;
-  uint64_t res;
-
-  if (!fi)
-    fd = FileSystem::Instance()->file_handle()->open(path, O_WRONLY);
-  else
-    fd = fi->fh;
-
-  int64_t write_size = fuse_buf_size(buf);
-  int64_t write_offset = offset;
-  res = FileSystem::Instance()->TruncateFile(fd, write_size + write_offset);
-  if (res < 0) {
-    return -errno;
+  if (fi == nullptr) [[unlikely]] {
+    return -EBADF;
   }
+  SPDLOG_DEBUG("call bfs_write_buf: {} fd: {} offset: {}", path, fi->fh,
+               offset);
+  StatTimer timer(kStatFuseWrite);
+  if (IsStatsPath(path)) return -EBADF;
 
-  struct fuse_buf *buffer;
-  for (size_t i = 0; i < buf->count; ++i) {
-    buffer = &buf->buf[i];
-    LOG(INFO) << "buffer fd: " << buffer->fd << " mem: " << buffer->mem
-              << " size: " << buffer->size << " pos: " << buffer->pos;
-    write_size = FileSystem::Instance()->PwriteFile(fd, buf->buf[i].mem, buffer->size, write_offset);
-    if (write_size < 0) {
-      return -errno;
-    }
-    res += write_size;
-  }
-  if (fi == nullptr) FileSystem::Instance()->file_handle()->close(fd);
+  int64_t res = block_fs_fuse_write_buf(UDiskBFS::Instance()->info(), fi->fh,
+                                        buf, offset);
+  if (res < 0) return -errno;
 
+  timer.set_bytes(res);
   return res;
 }
 
@@ -687,48 +712,62 @@ static int bfs_write_buf(const char *path, struct fuse_bufvec *buf,
  * regions, they too must be allocated using malloc().  The
  * allocated memory will be freed by the caller.
  */
-int bfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
-                 off_t offset, struct fuse_file_info *fi) {
-  LOG(INFO) << "call bfs_read_buf: " << path << " bufp: " << (char *)bufp;
-
-  ino_t fd;
-  ssize_t res;
-
-  if (!fi)
-    fd = FileSystem::Instance()->file_handle()->open(path, O_RDONLY);
-  else
-    fd = fi->fh;
-
-  struct fuse_bufvec *src;
-  src = (struct fuse_bufvec *)::malloc(sizeof(struct fuse_bufvec));
-  if (src == nullptr) return -ENOMEM;
-
-  *src = FUSE_BUFVEC_INIT(size);
+static int bfs_read_buf(const char *path, struct fuse_bufvec **bufp,
+                        size_t size, off_t offset, struct fuse_file_info *fi) {
+  if (fi == nullptr) [[unlikely]] {
+    return -EBADF;
+  }
+  SPDLOG_DEBUG("call bfs_read_buf: {} fd: {} size: {} offset: {}", path,
+               fi->fh, size, offset);
+  StatTimer timer(kStatFuseRead);
+
+  if (IsStatsPath(path)) {
+    // 内存buffer也要单独malloc, 由libfuse释放
+    struct fuse_bufvec *src =
+        (struct fuse_bufvec *)::malloc(sizeof(struct fuse_bufvec));
+    char *mem = (char *)::malloc(std::max<size_t>(size, 1));
+    if (src == nullptr || mem == nullptr) {
+      ::free(src);
+      ::free(mem);
+      return -ENOMEM;
+    }
+    *src = FUSE_BUFVEC_INIT(
+        block_fs_fuse_stats_read(fi->fh, mem, size, offset));
+    src->buf[0].mem = mem;
+    *bufp = src;
+    return 0;
+  }
 
-  src->count = 1;
-  src->buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD);
-  src->buf[0].fd = fi->fh;
-  src->buf[0].pos = offset;
-  src->buf[0].read = block_fs_read;
-  src->buf[0].mem = ::malloc(size);
-  if (!src->buf[0].mem) {
+  // 只返回设备fd和偏移, 由libfuse在返回之后splice到/dev/fuse
+  // 数据搬运的时候已经不持有block锁, 和并发缩小文件之间没有保护,
+  // low-level接口在锁内回复没有这个问题
+  struct fuse_bufvec *src = nullptr;
+  int64_t res = FileSystem::Instance()->PreadFile(
+      fi->fh,
+      [&src](int32_t dev_fd, const DeviceIo *ios, uint32_t num) -> int64_t {
+        src = block_fs_fuse_device_bufvec(dev_fd, ios, num);
+        if (src == nullptr) {
+          errno = ENOMEM;
+          return -1;
+        }
+        return fuse_buf_size(src);
+      },
+      size, offset);
+  if (res < 0) {
     ::free(src);
-    return -ENOMEM;
+    return -errno;
+  }
+  if (src == nullptr) {
+    // 读到文件末尾
+    src = (struct fuse_bufvec *)::malloc(sizeof(struct fuse_bufvec));
+    if (src == nullptr) return -ENOMEM;
+    *src = FUSE_BUFVEC_INIT(0);
   }
-
-  res = FileSystem::Instance()->SeekFile(fd, offset, SEEK_SET);
-  if (res < 0) return -errno;
-
-  res = block_fs_read(fd, src->buf[0].mem, size);
-  if (res < 0) return -errno;
-
   *bufp = src;
-
-  if (fi == nullptr) FileSystem::Instance()->file_handle()->close(fd);
+  timer.set_bytes(res);
 
   return 0;
 }
-#endif
 
 /**
  * Perform BSD file locking operation
@@ -749,7 +788,9 @@ int bfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
  * interesting for network filesystems and similar.
  */
 static int bfs_flock(const char *path, struct fuse_file_info *fi, int op) {
-  LOG(INFO) << "call bfs_flock: " << path;
+  SPDLOG_DEBUG("call bfs_flock: {}", path);
+  StatTimer timer(kStatFuseFlock);
+  if (IsStatsPath(path)) return 0;
 
   ino_t fd;
   int res;
@@ -785,6 +826,8 @@ ssize_t bfs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in,
                             size_t size, int flags) {
   LOG(INFO) << "call bfs_copy_file_range: " << path_in
             << " path_out: " << path_out;
+  StatTimer timer(kStatFuseCopyFileRange);
+  if (IsStatsPath(path_in) || IsStatsPath(path_out)) return -EOPNOTSUPP;
 
   int fd_in, fd_out;
   ssize_t res;
@@ -820,7 +863,9 @@ ssize_t bfs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in,
  */
 off_t bfs_lseek(const char *path, off_t off, int whence,
                 struct fuse_file_info *fi) {
-  SPDLOG_INFO("call bfs_lseek: {}", path);
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC, "call bfs_lseek: {}", path);
+  StatTimer timer(kStatFuseLseek);
+  if (IsStatsPath(path)) return -ESPIPE;
 
   ino_t fd;
   off_t res;
@@ -864,110 +909,212 @@ static const struct fuse_operations kBFSOps = {
     .access = nullptr,
     .create = mfs_create,
     .lock = bfs_lock,
-#ifdef BFS_USE_READ_WRITE_BUFFER
     .write_buf = bfs_write_buf,
     .read_buf = bfs_read_buf,
-#else
-    .write_buf = nullptr,
-    .read_buf = nullptr,
-#endif
     .flock = bfs_flock,
     .copy_file_range = bfs_copy_file_range,
     .lseek = bfs_lseek,
 };
 
-void UDiskBFS::FuseLoop(bfs_config_info *info) {
-  ::umask(0);
-  LOG(INFO) << "FUSE version: " << fuse_pkgversion();
+std::vector<std::string> block_fs_fuse_args(const bfs_config_info *info) {
+  std::vector<std::string> args;
+  args.push_back("BFS:test");
+  if (info->fuse_debug_) {
+    args.push_back("-d");  // libfuse debug
+  }
+  args.push_back("-oallow_other");
+  args.push_back("-odefault_permissions");
+  args.push_back("-orw");
+  args.push_back("-oauto_unmount");
+  if (info->fuse_max_read_ > 0) {
+    args.push_back("-omax_read=" + std::to_string(info->fuse_max_read_));
+  }
+  return args;
+}
 
-#if 0
-  auto fuse_thread_func = [](bfs_config_info *info) {
-    pthread_setname_np(pthread_self(), "fuse");
-    struct fuse_cmdline_opts opts;
-    int ret = 0;
-
-    char *mountpoint = (char *)malloc(info->fuse_mount_point.size() + 1);
-    memcpy(mountpoint, info->fuse_mount_point.c_str(), info->fuse_mount_point.size());
-    mountpoint[info->fuse_mount_point.size()] = 0;
-    std::string fsname = "BFS:test";
-    char *fsname_str = (char *)malloc(fsname.size() + 1);
-    memcpy(fsname_str, fsname.c_str(), fsname.size());
-    fsname_str[fsname.size()] = 0;
-    std::vector<char *> argv;
-    argv.push_back(fsname_str);
-    argv.push_back("-f");
-    argv.push_back(mountpoint);
-    argv.push_back("-oallow_other");
-    argv.push_back("-odefault_permissions");
-    argv.push_back("-orw"); // 读写权限
-    for (size_t i = 0; i < argv.size(); ++i) {
-      LOG(INFO) << "fuse args: " << argv[i];
+void block_fs_fuse_conn_init(bfs_config_info *info,
+                             struct fuse_conn_info *conn) {
+  // 配置关闭的能力从want里去掉, 内核不支持的打印告警
+  auto want = [conn](uint32_t cap, bool enable, const char *name) {
+    if (!enable) {
+      conn->want &= ~cap;
+      return false;
     }
-
-    int argc = argv.size();
-    char **argv_ptr = argv.data();
-    struct fuse_args args = FUSE_ARGS_INIT(argc, argv_ptr);
-    if (fuse_parse_cmdline(&args, &opts) != 0) {
-      LOG(ERROR) << "failed to parse fuse command line";
-      return;
+    if (!(conn->capable & cap)) {
+      SPDLOG_WARN("fuse kernel does not support {}", name);
+      return false;
     }
+    conn->want |= cap;
+    return true;
+  };
+  want(FUSE_CAP_ASYNC_READ, info->fuse_async_read_, "async_read");
+  want(FUSE_CAP_SPLICE_READ, info->fuse_splice_read_, "splice_read");
+  want(FUSE_CAP_SPLICE_WRITE, info->fuse_splice_write_, "splice_write");
+  want(FUSE_CAP_SPLICE_MOVE, info->fuse_splice_move_, "splice_move");
+  info->fuse_writeback_cache_ = want(
+      FUSE_CAP_WRITEBACK_CACHE, info->fuse_writeback_cache_, "writeback_cache");
+
+  // libfuse按max_write和内核协商每个请求的页数, max_pages只能往下限制
+  uint32_t max_write = info->fuse_max_write_;
+  if (info->fuse_max_pages_ > 0) {
+    uint32_t limit = info->fuse_max_pages_ * ::getpagesize();
+    max_write = max_write > 0 ? std::min(max_write, limit) : limit;
+  }
+  if (max_write > 0) {
+    conn->max_write = max_write;
+  }
+  SPDLOG_INFO(
+      "fuse conn proto: {}.{} want: {:#x} capable: {:#x} max_write: {} "
+      "max_read: {} max_readahead: {}",
+      conn->proto_major, conn->proto_minor, conn->want, conn->capable,
+      conn->max_write, conn->max_read, conn->max_readahead);
+}
+
+int block_fs_fuse_copy_flags(const bfs_config_info *info) {
+  return info->fuse_splice_move_ ? FUSE_BUF_SPLICE_MOVE : 0;
+}
 
-    struct fuse_session *se = fuse_session_new(
-        &args, &kBFSOps, sizeof(kBFSOps), nullptr);
-    if (se == nullptr) {
-      LOG(FATAL) << "fuse create session failed";
+struct fuse_bufvec *block_fs_fuse_device_bufvec(int32_t dev_fd,
+                                                const DeviceIo *ios,
+                                                uint32_t num) {
+  // fuse_bufvec末尾是变长的buf数组
+  size_t count = std::max(num, 1U);
+  struct fuse_bufvec *bufv = (struct fuse_bufvec *)::calloc(
+      1, sizeof(struct fuse_bufvec) + (count - 1) * sizeof(struct fuse_buf));
+  if (bufv == nullptr) {
+    return nullptr;
+  }
+  bufv->count = num;
+  for (uint32_t i = 0; i < num; ++i) {
+    struct fuse_buf &buf = bufv->buf[i];
+    buf.size = ios[i].len;
+    buf.flags = static_cast<enum fuse_buf_flags>(
+        FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY);
+    buf.fd = dev_fd;
+    buf.pos = ios[i].offset;
+  }
+  return bufv;
+}
+
+int64_t block_fs_fuse_copy_to_device(const bfs_config_info *info,
+                                     struct fuse_bufvec *src, int32_t dev_fd,
+                                     const DeviceIo *ios, uint32_t num) {
+  enum fuse_buf_copy_flags flags =
+      static_cast<enum fuse_buf_copy_flags>(block_fs_fuse_copy_flags(info));
+  int64_t total = 0;
+  for (uint32_t i = 0; i < num; ++i) {
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(ios[i].len);
+    dst.buf[0].flags = static_cast<enum fuse_buf_flags>(
+        FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY);
+    dst.buf[0].fd = dev_fd;
+    dst.buf[0].pos = ios[i].offset;
+    // fuse_buf_copy会推进src, 下一个段从剩下的数据接着拷贝
+    ssize_t ret = fuse_buf_copy(&dst, src, flags);
+    if (ret < 0) {
+      if (total == 0) {
+        errno = -ret;
+        return -1;
+      }
+      break;
+    }
+    total += ret;
+    if (static_cast<uint64_t>(ret) < ios[i].len) {
+      break;
     }
-    if ((ret = fuse_set_signal_handlers(se)) != 0) {
-      LOG(FATAL) << "fuse set signal handlers failed, ret:" << ret;
+  }
+  return total;
+}
+
+int64_t block_fs_fuse_write_buf(const bfs_config_info *info, uint64_t fd,
+                                struct fuse_bufvec *buf, off_t offset) {
+  // 从buf->idx/off开始都是内存buffer时直接作为iovec写下去
+  std::vector<struct iovec> iov;
+  iov.reserve(buf->count - buf->idx);
+  for (size_t i = buf->idx; i < buf->count; ++i) {
+    const struct fuse_buf &b = buf->buf[i];
+    if (b.flags & FUSE_BUF_IS_FD) {
+      iov.clear();
+      break;
     }
-    if ((ret = fuse_session_mount(se, opts.mountpoint)) != 0) {
-      LOG(FATAL) << "fuse mount dir failed, ret:" << ret;
+    size_t skip = i == buf->idx ? buf->off : 0;
+    if (b.size > skip) {
+      iov.push_back({static_cast<char *>(b.mem) + skip, b.size - skip});
     }
-    // 这里面会fork
-    // fuse_daemonize(1);
-    LOG(INFO) << "fuse opts idle_threads " << opts.max_idle_threads
-              << " max_threads " << opts.max_threads << " clone_fd "
-              << opts.clone_fd;
-    struct fuse_loop_config *config = fuse_loop_cfg_create();
-    fuse_loop_cfg_set_idle_threads(config, -1);
-    fuse_loop_cfg_set_max_threads(config, 4);
-    fuse_loop_cfg_set_clone_fd(config, 1);
-    fuse_session_loop_mt(se, config);
-    fuse_session_unmount(se);
-    fuse_loop_cfg_destroy(config);
-
-    LOG(INFO) << "fuse umount";
-    exit(0);
-  };
-  std::thread fuse_thread(fuse_thread_func, info);
-  fuse_thread.detach();
-#endif
-
-  char *mountpoint = (char *)malloc(info->fuse_mount_point.size() + 1);
-  memcpy(mountpoint, info->fuse_mount_point.c_str(), info->fuse_mount_point.size());
-  mountpoint[info->fuse_mount_point.size()] = 0;
-  std::string fsname = "BFS:test";
-  char *fsname_str = (char *)malloc(fsname.size() + 1);
-  memcpy(fsname_str, fsname.c_str(), fsname.size());
-  fsname_str[fsname.size()] = 0;
+  }
+  if (!iov.empty()) {
+    return FileSystem::Instance()->PwritevFile(fd, iov.data(), iov.size(),
+                                               offset);
+  }
+  // buf是splice过来的pipe时直接splice到设备, 不经过用户态
+  return FileSystem::Instance()->PwriteFile(
+      fd,
+      [info, buf](int32_t dev_fd, const DeviceIo *ios, uint32_t num) {
+        return block_fs_fuse_copy_to_device(info, buf, dev_fd, ios, num);
+      },
+      fuse_buf_size(buf), offset);
+}
+
+void block_fs_fuse_stats_attr(uint64_t ino, struct stat *st) {
+  ::memset(st, 0, sizeof(struct stat));
+  // 大小填0, 和/proc一样靠direct_io读到末尾
+  st->st_ino = ino;
+  st->st_mode = S_IFREG | 0444;
+  st->st_nlink = 1;
+  st->st_uid = ::getuid();
+  st->st_gid = ::getgid();
+  st->st_blksize = 4096;
+  time_t now = ::time(NULL);
+  st->st_atime = now;
+  st->st_mtime = now;
+  st->st_ctime = now;
+}
+
+uint64_t block_fs_fuse_stats_open(std::string_view name) {
+  return reinterpret_cast<uint64_t>(new std::string(Stats::DumpFile(name)));
+}
+
+size_t block_fs_fuse_stats_read(uint64_t fh, char *buf, size_t size,
+                                off_t offset) {
+  const std::string *content = reinterpret_cast<const std::string *>(fh);
+  if (offset < 0 || static_cast<size_t>(offset) >= content->size()) {
+    return 0;
+  }
+  size_t len = std::min(size, content->size() - offset);
+  ::memcpy(buf, content->data() + offset, len);
+  return len;
+}
+
+void block_fs_fuse_stats_release(uint64_t fh) {
+  delete reinterpret_cast<std::string *>(fh);
+}
+
+void UDiskBFS::FuseLoop(bfs_config_info *info) {
+  ::umask(0);
+  LOG(INFO) << "FUSE version: " << fuse_pkgversion();
+  if (info->fuse_low_level_) {
+    block_fs_fuse_lowlevel_loop(info);
+    return;
+  }
+
+  // 高层接口的线程数通过命令行参数传给fuse_main
+  std::vector<std::string> args = block_fs_fuse_args(info);
+  args.push_back("-f");
+  args.push_back(info->fuse_mount_point);
+  args.push_back("-omax_threads=" + std::to_string(info->fuse_max_threads_));
+  if (info->fuse_max_idle_threads_ >= 0) {
+    args.push_back("-omax_idle_threads=" +
+                   std::to_string(info->fuse_max_idle_threads_));
+  }
+  if (info->fuse_clone_fd_) {
+    args.push_back("-oclone_fd");
+  }
   std::vector<char *> argv;
-  argv.push_back(fsname_str);
-  argv.push_back((char *)"-d"); // libfuse debug
-  argv.push_back((char *)"-f");
-  argv.push_back(mountpoint);
-  argv.push_back((char *)"-oallow_other");
-  argv.push_back((char *)"-odefault_permissions");
-  argv.push_back((char *)"-orw");
-  argv.push_back((char *)"-oauto_unmount");
-  for (size_t i = 0; i < argv.size(); ++i) {
-    LOG(INFO) << "fuse args: " << argv[i];
-  }
-
-  int argc = argv.size();
-  char **argv_ptr = argv.data();
-  struct fuse_args args = FUSE_ARGS_INIT(argc, argv_ptr);
-
-  if (!fuse_main(args.argc, args.argv, &kBFSOps, info)) {
+  for (std::string &arg : args) {
+    LOG(INFO) << "fuse args: " << arg;
+    argv.push_back(arg.data());
+  }
+
+  if (fuse_main(argv.size(), argv.data(), &kBFSOps, info) != 0) {
     LOG(WARNING) << "fuse mount loop exit";
   }
 }
@@ -4,20 +4,95 @@
 #define FUSE_USE_VERSION FUSE_MAKE_VERSION(3, 17)
 #endif
 
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
 #include <string>
+#include <string_view>
+#include <vector>
+
+struct fuse_conn_info;
+struct fuse_bufvec;
 
 namespace udisk::blockfs {
 
+struct DeviceIo;
+
 struct bfs_config_info {
   std::string log_level_;
   std::string log_path_;
+  // spdlog writes from a background thread through a bounded queue
+  bool log_async_ = true;
+  uint32_t log_queue_size_ = 8192;
+  bool log_overflow_block_ = false;  // otherwise the oldest message is dropped
 
   std::string device;
   std::string device_uuid_;
+  std::string io_engine_;  // psync or io_uring
+  uint32_t io_depth_ = 0;
+  uint32_t io_threads_ = 0;  // psync engine concurrent segments
+  // metadata writeback, 0 means writing through on every change
+  uint32_t meta_flush_interval_ms_ = 0;
+  bool meta_sync_on_fsync_ = true;
+  bool meta_sync_on_close_ = false;
+  // per-thread latency histograms, read from <mount point>/.bfs_stats
+  bool stats_enable_ = true;
 
   std::string fuse_mount_point;
+  // low-level frontend keyed by nodeid, otherwise the path based fuse_main
+  bool fuse_low_level_ = true;
+  // seconds the kernel may cache dentries and attributes
+  double fuse_entry_timeout_ = 1.0;
+  double fuse_attr_timeout_ = 1.0;
+
+  // session loop
+  bool fuse_debug_ = false;             // libfuse debug output
+  uint32_t fuse_max_threads_ = 0;       // workers, 0 means io_depth_
+  int32_t fuse_max_idle_threads_ = -1;  // negative keeps libfuse default
+  bool fuse_clone_fd_ = true;           // one /dev/fuse fd per worker
+  // connection, 0 keeps the kernel / libfuse default
+  uint32_t fuse_max_read_ = 0;
+  uint32_t fuse_max_write_ = 1 << 20;
+  uint32_t fuse_max_pages_ = 0;
+  bool fuse_writeback_cache_ = false;  // cleared when the kernel refuses it
+  bool fuse_splice_read_ = false;
+  bool fuse_splice_write_ = false;
+  bool fuse_splice_move_ = false;
+  bool fuse_async_read_ = true;
 };
 
 void block_fs_fuse_mount(bfs_config_info *info);
+int block_fs_fuse_lowlevel_loop(bfs_config_info *info);
+// arguments shared by both frontends, argv[0] is the fsname
+std::vector<std::string> block_fs_fuse_args(const bfs_config_info *info);
+// negotiate the [fuse] connection options in the init callback
+void block_fs_fuse_conn_init(bfs_config_info *info,
+                             struct fuse_conn_info *conn);
+// zero copy helpers: one fd buffer per contiguous device run, so that libfuse
+// can splice between the device and /dev/fuse
+// the returned bufvec is malloc'ed, nullptr when out of memory
+struct fuse_bufvec *block_fs_fuse_device_bufvec(int32_t dev_fd,
+                                                const DeviceIo *ios,
+                                                uint32_t num);
+// copy src into the device runs, returns the bytes copied from the first run
+// on, -1 with errno when the first run fails
+int64_t block_fs_fuse_copy_to_device(const bfs_config_info *info,
+                                     struct fuse_bufvec *src, int32_t dev_fd,
+                                     const DeviceIo *ios, uint32_t num);
+// libfuse copy flags for the [fuse] splice options
+int block_fs_fuse_copy_flags(const bfs_config_info *info);
+// write a request buffer at offset of an open file: memory buffers go down
+// as one pwritev per contiguous device run, pipes are spliced to the device
+int64_t block_fs_fuse_write_buf(const bfs_config_info *info, uint64_t fd,
+                                struct fuse_bufvec *buf, off_t offset);
+// <mount point>/.bfs_stats*: read only virtual files, the content is rendered
+// once at open and kept behind fh until release
+void block_fs_fuse_stats_attr(uint64_t ino, struct stat *st);
+uint64_t block_fs_fuse_stats_open(std::string_view name);
+// returns the bytes copied into buf
+size_t block_fs_fuse_stats_read(uint64_t fh, char *buf, size_t size,
+                                off_t offset);
+void block_fs_fuse_stats_release(uint64_t fh);
 
 }
\ No newline at end of file
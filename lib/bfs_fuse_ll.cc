@@ -0,0 +1,917 @@
+#include <fuse3/fuse_lowlevel.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bfs_fuse.h"
+#include "file_system.h"
+#include "log_ratelimit.h"
+#include "logging.h"
+#include "sharded_map.h"
+#include "spdlog/spdlog.h"
+#include "stats.h"
+
+// 低版本头文件没有导出setattr的掩码
+#ifndef FUSE_SET_ATTR_SIZE
+#define FUSE_SET_ATTR_SIZE (1 << 3)
+#endif
+
+namespace udisk::blockfs {
+
+// FUSE low-level接口: 内核按nodeid访问, 不再每次传完整路径
+// nodeid由fh/dh编码, 最低位区分文件和文件夹, 根目录固定是FUSE_ROOT_ID:
+//   文件夹: (dh << 1) + 2, 文件: (fh << 1) + 3
+// 内核每次lookup成功会给nodeid加一次引用, forget时减掉, 引用期间记住
+// nodeid对应的对象; 元数据槽位被删除后复用时, 老的nodeid返回ESTALE
+static inline fuse_ino_t DirNodeId(ino_t dh) { return (dh << 1) + 2; }
+static inline fuse_ino_t FileNodeId(ino_t fh) { return (fh << 1) + 3; }
+// FUSE_ROOT_ID是1, 也是奇数, 不能当成文件
+static inline bool IsFileNode(fuse_ino_t ino) {
+  return ino != FUSE_ROOT_ID && (ino & 1);
+}
+static inline ino_t NodeIdToHandle(fuse_ino_t ino) {
+  return IsFileNode(ino) ? (ino - 3) >> 1 : (ino - 2) >> 1;
+}
+
+// 根目录下的统计虚拟文件, nodeid取文件句柄用不到的最大奇数, 不加引用
+static constexpr fuse_ino_t kStatsJsonNodeId = ~0ULL;
+static constexpr fuse_ino_t kStatsPromNodeId = ~0ULL - 2;
+static inline bool IsStatsNode(fuse_ino_t ino) {
+  return ino == kStatsJsonNodeId || ino == kStatsPromNodeId;
+}
+static inline bool IsStatsEntry(fuse_ino_t parent, const char *name) {
+  return parent == FUSE_ROOT_ID && Stats::IsStatsFile(name);
+}
+
+struct FuseNode {
+  uint64_t nlookup = 0;
+  uint64_t generation = 0;
+  FilePtr file;
+  DirectoryPtr dir;
+};
+
+class UDiskBFSLowLevel {
+ public:
+  UDiskBFSLowLevel() = default;
+  ~UDiskBFSLowLevel() = default;
+
+  static UDiskBFSLowLevel *Instance() {
+    static UDiskBFSLowLevel g_instance;
+    return &g_instance;
+  }
+
+  void Init(bfs_config_info *info) {
+    info_ = info;
+    root_ = FileSystem::Instance()->dir_handle()->GetCreatedDirectory("/");
+  }
+
+  const bfs_config_info *info() const { return info_; }
+  double entry_timeout() const { return info_->fuse_entry_timeout_; }
+  double attr_timeout() const { return info_->fuse_attr_timeout_; }
+  // 开了writeback cache时读写经过内核的page cache, 不能再用direct_io
+  bool direct_io() const { return !info_->fuse_writeback_cache_; }
+
+  fuse_ino_t NodeId(const DirectoryPtr &dir) const {
+    return dir == root_ ? FUSE_ROOT_ID : DirNodeId(dir->dh());
+  }
+
+  // lookup/create成功回复之前调用, 返回nodeid当前的generation
+  uint64_t Ref(fuse_ino_t ino, const FilePtr &file, const DirectoryPtr &dir) {
+    uint64_t generation = 0;
+    nodes_.Update(ino, [&](FuseNode &node) {
+      if (node.file != file || node.dir != dir) {
+        node.file = file;
+        node.dir = dir;
+        node.generation = ++generation_;
+      }
+      ++node.nlookup;
+      generation = node.generation;
+      return true;
+    });
+    return generation;
+  }
+
+  void Forget(fuse_ino_t ino, uint64_t nlookup) {
+    nodes_.Update(ino, [nlookup](FuseNode &node) {
+      node.nlookup -= std::min(node.nlookup, nlookup);
+      return node.nlookup > 0;
+    });
+  }
+
+  // nodeid对应的对象还是当前创建的那个才有效, 失败时返回errno
+  int ResolveDirectory(fuse_ino_t ino, DirectoryPtr *dir) const {
+    if (ino == FUSE_ROOT_ID) {
+      *dir = root_;
+      return 0;
+    }
+    if (IsFileNode(ino)) [[unlikely]] {
+      return ENOTDIR;
+    }
+    FuseNode node = nodes_.Find(ino);
+    if (!node.dir) [[unlikely]] {
+      return ESTALE;
+    }
+    if (FileSystem::Instance()->dir_handle()->GetCreatedDirectory(
+            NodeIdToHandle(ino)) != node.dir) [[unlikely]] {
+      return ENOENT;
+    }
+    *dir = std::move(node.dir);
+    return 0;
+  }
+
+  int ResolveFile(fuse_ino_t ino, FilePtr *file) const {
+    if (!IsFileNode(ino)) [[unlikely]] {
+      return EISDIR;
+    }
+    FuseNode node = nodes_.Find(ino);
+    if (!node.file) [[unlikely]] {
+      return ESTALE;
+    }
+    if (FileSystem::Instance()->file_handle()->GetCreatedFile(
+            NodeIdToHandle(ino)) != node.file) [[unlikely]] {
+      return ENOENT;
+    }
+    *file = std::move(node.file);
+    return 0;
+  }
+
+ private:
+  bfs_config_info *info_ = nullptr;
+  DirectoryPtr root_;
+  ShardedMap<fuse_ino_t, FuseNode> nodes_;
+  std::atomic<uint64_t> generation_ = 0;
+};
+
+static inline UDiskBFSLowLevel *LL() { return UDiskBFSLowLevel::Instance(); }
+
+// 修改类的操作很少, 直接拼出路径调用已有的路径接口
+static std::string ChildPath(const DirectoryPtr &parent, const char *name) {
+  std::string path = parent->dir_name();
+  path += name;
+  return path;
+}
+
+static int StatNode(fuse_ino_t ino, struct stat *st) {
+  int err;
+  if (IsFileNode(ino)) {
+    FilePtr file;
+    if ((err = LL()->ResolveFile(ino, &file)) != 0) {
+      return err;
+    }
+    file->stat(st);
+  } else {
+    DirectoryPtr dir;
+    if ((err = LL()->ResolveDirectory(ino, &dir)) != 0) {
+      return err;
+    }
+    dir->stat(st);
+  }
+  // 文件和文件夹的句柄会重复, st_ino统一用nodeid
+  st->st_ino = ino;
+  return 0;
+}
+
+// 在parent下查找name并加一次引用, 失败时返回errno
+static int LookupEntry(fuse_ino_t parent, const char *name,
+                       struct fuse_entry_param *e) {
+  if (IsStatsEntry(parent, name)) {
+    ::memset(e, 0, sizeof(*e));
+    e->ino = Stats::kPrometheusFile == name ? kStatsPromNodeId
+                                            : kStatsJsonNodeId;
+    block_fs_fuse_stats_attr(e->ino, &e->attr);
+    return 0;
+  }
+  DirectoryPtr dir;
+  int err = LL()->ResolveDirectory(parent, &dir);
+  if (err != 0) {
+    return err;
+  }
+  ::memset(e, 0, sizeof(*e));
+  std::string_view child_name(name);
+  DirectoryPtr child_dir =
+      FileSystem::Instance()->dir_handle()->GetChildDirectory(dir->dh(),
+                                                              child_name);
+  if (child_dir) {
+    e->ino = LL()->NodeId(child_dir);
+    child_dir->stat(&e->attr);
+    e->generation = LL()->Ref(e->ino, nullptr, child_dir);
+  } else {
+    FilePtr file = FileSystem::Instance()->file_handle()->GetCreatedFileNolock(
+        dir->dh(), child_name);
+    if (!file) {
+      return ENOENT;
+    }
+    e->ino = FileNodeId(file->fh());
+    file->stat(&e->attr);
+    e->generation = LL()->Ref(e->ino, file, nullptr);
+  }
+  e->attr.st_ino = e->ino;
+  e->attr_timeout = LL()->attr_timeout();
+  e->entry_timeout = LL()->entry_timeout();
+  return 0;
+}
+
+static void ReplyEntry(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  struct fuse_entry_param e;
+  int err = LookupEntry(parent, name, &e);
+  if (err != 0) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  // 请求被中断时内核不会记下这次引用
+  if (fuse_reply_entry(req, &e) != 0) {
+    LL()->Forget(e.ino, 1);
+  }
+}
+
+static void bfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+  SPDLOG_INFO("call bfs_ll_init");
+  block_fs_fuse_conn_init(static_cast<bfs_config_info *>(userdata), conn);
+}
+
+static void bfs_ll_destroy(void *userdata) {
+  SPDLOG_INFO("call bfs_ll_destroy");
+}
+
+static void bfs_ll_lookup(fuse_req_t req, fuse_ino_t parent,
+                          const char *name) {
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC,
+                      "call bfs_ll_lookup parent: {} name: {}", parent, name);
+  StatTimer timer(kStatFuseLookup);
+  ReplyEntry(req, parent, name);
+}
+
+static void bfs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+  StatTimer timer(kStatFuseForget);
+  LL()->Forget(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+static void bfs_ll_forget_multi(fuse_req_t req, size_t count,
+                                struct fuse_forget_data *forgets) {
+  StatTimer timer(kStatFuseForget);
+  for (size_t i = 0; i < count; ++i) {
+    LL()->Forget(forgets[i].ino, forgets[i].nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+static void bfs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_file_info *fi) {
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC, "call bfs_ll_getattr ino: {}", ino);
+  StatTimer timer(kStatFuseGetattr);
+  struct stat st;
+  ::memset(&st, 0, sizeof(st));
+  if (IsStatsNode(ino)) {
+    block_fs_fuse_stats_attr(ino, &st);
+    fuse_reply_attr(req, &st, 0);
+    return;
+  }
+  // 打开的文件按fd取, 已经unlink但没有close的文件也能stat
+  if (fi && IsFileNode(ino)) {
+    if (FileSystem::Instance()->StatPath(static_cast<int32_t>(fi->fh), &st) <
+        0) {
+      fuse_reply_err(req, errno);
+      return;
+    }
+    st.st_ino = ino;
+  } else {
+    int err = StatNode(ino, &st);
+    if (err != 0) {
+      fuse_reply_err(req, err);
+      return;
+    }
+  }
+  fuse_reply_attr(req, &st, LL()->attr_timeout());
+}
+
+/**
+ * 只支持修改文件大小, 权限/属主/时间不保存在元数据里, 直接忽略
+ */
+static void bfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                           int to_set, struct fuse_file_info *fi) {
+  SPDLOG_DEBUG("call bfs_ll_setattr ino: {} to_set: {}", ino, to_set);
+  StatTimer timer(kStatFuseSetattr);
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    if (IsStatsNode(ino)) {
+      fuse_reply_err(req, EACCES);
+      return;
+    }
+    if (!IsFileNode(ino)) {
+      fuse_reply_err(req, EISDIR);
+      return;
+    }
+    int res;
+    if (fi) {
+      res = FileSystem::Instance()->TruncateFile(
+          static_cast<int32_t>(fi->fh), attr->st_size);
+    } else {
+      FilePtr file;
+      int err = LL()->ResolveFile(ino, &file);
+      if (err != 0) {
+        fuse_reply_err(req, err);
+        return;
+      }
+      res = file->ftruncate(attr->st_size);
+    }
+    if (res < 0) {
+      fuse_reply_err(req, errno);
+      return;
+    }
+  }
+  bfs_ll_getattr(req, ino, fi);
+}
+
+static void bfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                         mode_t mode, dev_t rdev) {
+  SPDLOG_INFO("call bfs_ll_mknod parent: {} name: {}", parent, name);
+  StatTimer timer(kStatFuseMknod);
+  if (IsStatsEntry(parent, name)) {
+    fuse_reply_err(req, EEXIST);
+    return;
+  }
+  if (!S_ISREG(mode)) {
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+  DirectoryPtr dir;
+  int err = LL()->ResolveDirectory(parent, &dir);
+  if (err != 0) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  if (FileSystem::Instance()->CreateFile(ChildPath(dir, name), mode) < 0) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  ReplyEntry(req, parent, name);
+}
+
+static void bfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                         mode_t mode) {
+  SPDLOG_INFO("call bfs_ll_mkdir parent: {} name: {}", parent, name);
+  StatTimer timer(kStatFuseMkdir);
+  if (IsStatsEntry(parent, name)) {
+    fuse_reply_err(req, EEXIST);
+    return;
+  }
+  DirectoryPtr dir;
+  int err = LL()->ResolveDirectory(parent, &dir);
+  if (err != 0) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  if (FileSystem::Instance()->dir_handle()->CreateDirectory(
+          ChildPath(dir, name)) < 0) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  ReplyEntry(req, parent, name);
+}
+
+static void bfs_ll_unlink(fuse_req_t req, fuse_ino_t parent,
+                          const char *name) {
+  SPDLOG_INFO("call bfs_ll_unlink parent: {} name: {}", parent, name);
+  StatTimer timer(kStatFuseUnlink);
+  if (IsStatsEntry(parent, name)) {
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+  DirectoryPtr dir;
+  int err = LL()->ResolveDirectory(parent, &dir);
+  if (err == 0 && FileSystem::Instance()->file_handle()->unlink(
+                      ChildPath(dir, name)) < 0) {
+    err = errno;
+  }
+  fuse_reply_err(req, err);
+}
+
+static void bfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  SPDLOG_INFO("call bfs_ll_rmdir parent: {} name: {}", parent, name);
+  StatTimer timer(kStatFuseRmdir);
+  DirectoryPtr dir;
+  int err = LL()->ResolveDirectory(parent, &dir);
+  if (err == 0 && FileSystem::Instance()->dir_handle()->DeleteDirectory(
+                      ChildPath(dir, name), false) < 0) {
+    err = errno;
+  }
+  fuse_reply_err(req, err);
+}
+
+static void bfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          fuse_ino_t newparent, const char *newname,
+                          unsigned int flags) {
+  SPDLOG_INFO("call bfs_ll_rename {}/{} -> {}/{}", parent, name, newparent,
+              newname);
+  StatTimer timer(kStatFuseRename);
+  if (flags) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+  if (IsStatsEntry(parent, name) || IsStatsEntry(newparent, newname)) {
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+  DirectoryPtr dir, newdir;
+  int err = LL()->ResolveDirectory(parent, &dir);
+  if (err == 0) {
+    err = LL()->ResolveDirectory(newparent, &newdir);
+  }
+  if (err == 0 && FileSystem::Instance()->RenamePath(
+                      ChildPath(dir, name), ChildPath(newdir, newname)) < 0) {
+    err = errno ? errno : EEXIST;
+  }
+  fuse_reply_err(req, err);
+}
+
+static void bfs_ll_open(fuse_req_t req, fuse_ino_t ino,
+                        struct fuse_file_info *fi) {
+  SPDLOG_DEBUG("call bfs_ll_open ino: {} flags: {}", ino, fi->flags);
+  StatTimer timer(kStatFuseOpen);
+  if (IsStatsNode(ino)) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+      fuse_reply_err(req, EACCES);
+      return;
+    }
+    fi->fh = block_fs_fuse_stats_open(ino == kStatsPromNodeId
+                                          ? Stats::kPrometheusFile
+                                          : Stats::kJsonFile);
+    fi->direct_io = 1;
+    if (fuse_reply_open(req, fi) != 0) {
+      block_fs_fuse_stats_release(fi->fh);
+    }
+    return;
+  }
+  FilePtr file;
+  int err = LL()->ResolveFile(ino, &file);
+  if (err != 0) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  int fd = FileSystem::Instance()->file_handle()->open(file, fi->flags);
+  if (fd < 0) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  fi->fh = fd;
+  fi->direct_io = LL()->direct_io();
+  if (fuse_reply_open(req, fi) != 0) {
+    FileSystem::Instance()->file_handle()->close(fd);
+  }
+}
+
+static void bfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode, struct fuse_file_info *fi) {
+  SPDLOG_DEBUG("call bfs_ll_create parent: {} name: {}", parent, name);
+  StatTimer timer(kStatFuseCreate);
+  if (IsStatsEntry(parent, name)) {
+    fuse_reply_err(req, EEXIST);
+    return;
+  }
+  DirectoryPtr dir;
+  int err = LL()->ResolveDirectory(parent, &dir);
+  if (err != 0) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  int fd = FileSystem::Instance()->file_handle()->open(
+      ChildPath(dir, name), fi->flags | O_CREAT, mode);
+  if (fd < 0) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  struct fuse_entry_param e;
+  if ((err = LookupEntry(parent, name, &e)) != 0) {
+    FileSystem::Instance()->file_handle()->close(fd);
+    fuse_reply_err(req, err);
+    return;
+  }
+  fi->fh = fd;
+  fi->direct_io = LL()->direct_io();
+  if (fuse_reply_create(req, &e, fi) != 0) {
+    FileSystem::Instance()->file_handle()->close(fd);
+    LL()->Forget(e.ino, 1);
+  }
+}
+
+// 每个物理连续的block段回复一个设备fd的buffer, libfuse把数据从设备
+// splice到/dev/fuse; 回复在block锁内完成, 不会读到被并发回收的block
+static void bfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                        off_t off, struct fuse_file_info *fi) {
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC,
+                      "call bfs_ll_read fd: {} size: {} off: {}", fi->fh, size,
+                      off);
+  StatTimer timer(kStatFuseRead);
+  if (IsStatsNode(ino)) {
+    std::unique_ptr<char[]> buf(new char[size]);
+    size_t len = block_fs_fuse_stats_read(fi->fh, buf.get(), size, off);
+    fuse_reply_buf(req, buf.get(), len);
+    return;
+  }
+  bool replied = false;
+  int64_t res = FileSystem::Instance()->PreadFile(
+      fi->fh,
+      [req, &replied](int32_t dev_fd, const DeviceIo *ios,
+                      uint32_t num) -> int64_t {
+        struct fuse_bufvec *bufv =
+            block_fs_fuse_device_bufvec(dev_fd, ios, num);
+        if (bufv == nullptr) {
+          errno = ENOMEM;
+          return -1;
+        }
+        int64_t len = fuse_buf_size(bufv);
+        // 不管成功与否请求都已经结束, 不能再回复
+        int ret = fuse_reply_data(
+            req, bufv,
+            static_cast<enum fuse_buf_copy_flags>(
+                block_fs_fuse_copy_flags(LL()->info())));
+        ::free(bufv);
+        replied = true;
+        if (ret != 0) {
+          errno = -ret;
+          return -1;
+        }
+        return len;
+      },
+      size, off);
+  timer.set_bytes(res);
+  if (replied) {
+    return;
+  }
+  if (res < 0) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  // 读到文件末尾
+  fuse_reply_buf(req, nullptr, 0);
+}
+
+// 内存中的请求数据按iovec写, splice过来的pipe直接splice到设备
+static void bfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+                             struct fuse_bufvec *bufv, off_t off,
+                             struct fuse_file_info *fi) {
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC,
+                      "call bfs_ll_write_buf fd: {} size: {} off: {}", fi->fh,
+                      fuse_buf_size(bufv), off);
+  StatTimer timer(kStatFuseWrite);
+  if (IsStatsNode(ino)) {
+    fuse_reply_err(req, EBADF);
+    return;
+  }
+  int64_t res = block_fs_fuse_write_buf(LL()->info(), fi->fh, bufv, off);
+  if (res < 0) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  timer.set_bytes(res);
+  fuse_reply_write(req, res);
+}
+
+// 每次close都会调用, 和高层接口一样关闭一个dup出来的fd, 不真正关闭文件
+static void bfs_ll_flush(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi) {
+  StatTimer timer(kStatFuseFlush);
+  FileHandle *handle = FileSystem::Instance()->file_handle();
+  int err = 0;
+  if (!IsStatsNode(ino) && handle->close(handle->dup(fi->fh)) < 0) {
+    err = errno;
+  }
+  fuse_reply_err(req, err);
+}
+
+static void bfs_ll_release(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_file_info *fi) {
+  SPDLOG_DEBUG("call bfs_ll_release fd: {}", fi->fh);
+  StatTimer timer(kStatFuseRelease);
+  int err = 0;
+  if (IsStatsNode(ino)) {
+    block_fs_fuse_stats_release(fi->fh);
+  } else if (FileSystem::Instance()->file_handle()->close(fi->fh) < 0) {
+    err = errno;
+  }
+  fuse_reply_err(req, err);
+}
+
+static void bfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                         struct fuse_file_info *fi) {
+  StatTimer timer(kStatFuseFsync);
+  // 文件大小和block分配都是journal里的元数据页, fdatasync也要落盘,
+  // 时间戳没有单独跟踪, datasync和fsync走同一条路径
+  int err = 0;
+  if (!IsStatsNode(ino) &&
+      FileSystem::Instance()->file_handle()->fsync(fi->fh) < 0) {
+    err = errno;
+  }
+  fuse_reply_err(req, err);
+}
+
+static void bfs_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_file_info *fi) {
+  SPDLOG_DEBUG("call bfs_ll_opendir ino: {}", ino);
+  StatTimer timer(kStatFuseOpendir);
+  DirectoryPtr dir;
+  int err = LL()->ResolveDirectory(ino, &dir);
+  if (err != 0) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  BLOCKFS_DIR *dp = FileSystem::Instance()->dir_handle()->OpenDirectory(dir);
+  if (!dp) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  // low-level接口fh由文件系统自己解释, 直接存BLOCKFS_DIR指针
+  fi->fh = reinterpret_cast<uint64_t>(dp);
+  if (fuse_reply_open(req, fi) != 0) {
+    FileSystem::Instance()->dir_handle()->CloseDirectory(dp);
+  }
+}
+
+/**
+ * offset 1和2是.和.., 子项的offset是游标加2, buffer满了就返回
+ */
+static void bfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                           off_t off, struct fuse_file_info *fi) {
+  SPDLOG_DEBUG("call bfs_ll_readdir ino: {} off: {}", ino, off);
+  StatTimer timer(kStatFuseReaddir);
+  BLOCKFS_DIR *dp = reinterpret_cast<BLOCKFS_DIR *>(fi->fh);
+  std::unique_ptr<char[]> buf(new char[size]);
+  size_t pos = 0;
+  struct stat st;
+  ::memset(&st, 0, sizeof(st));
+  auto add_entry = [&](const char *name, fuse_ino_t entry_ino, mode_t mode,
+                       off_t entry_off) {
+    st.st_ino = entry_ino;
+    st.st_mode = mode;
+    size_t len = fuse_add_direntry(req, buf.get() + pos, size - pos, name, &st,
+                                   entry_off);
+    if (len > size - pos) {
+      return false;
+    }
+    pos += len;
+    return true;
+  };
+
+  if (off < 1 && !add_entry(".", ino, S_IFDIR, 1)) {
+    fuse_reply_buf(req, buf.get(), pos);
+    return;
+  }
+  // ..的ino内核不使用, 填本目录即可
+  if (off < 2 && !add_entry("..", ino, S_IFDIR, 2)) {
+    fuse_reply_buf(req, buf.get(), pos);
+    return;
+  }
+  DirHandle *handle = FileSystem::Instance()->dir_handle();
+  handle->SeekDirectory(dp, off > 2 ? off - 2 : 0);
+  block_fs_dirent *de;
+  while ((de = handle->ReadDirectory(dp)) != nullptr) {
+    bool is_dir = de->d_type == DT_DIR;
+    fuse_ino_t entry_ino = is_dir ? DirNodeId(de->d_ino) : FileNodeId(de->d_ino);
+    if (!add_entry(de->d_name, entry_ino, is_dir ? S_IFDIR : S_IFREG,
+                   de->d_off + 2)) {
+      break;
+    }
+  }
+  fuse_reply_buf(req, buf.get(), pos);
+}
+
+static void bfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+                              struct fuse_file_info *fi) {
+  SPDLOG_DEBUG("call bfs_ll_releasedir ino: {}", ino);
+  StatTimer timer(kStatFuseReleasedir);
+  BLOCKFS_DIR *dp = reinterpret_cast<BLOCKFS_DIR *>(fi->fh);
+  fuse_reply_err(req, FileSystem::Instance()->dir_handle()->CloseDirectory(dp));
+}
+
+static void bfs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+  StatTimer timer(kStatFuseStatfs);
+  struct statvfs vfs;
+  if (FileSystem::Instance()->StatVFS(&vfs) < 0) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  fuse_reply_statfs(req, &vfs);
+}
+
+// 文件上只有一个锁标记, 不区分锁的持有者, 和高层接口的bfs_lock一致
+static void bfs_ll_getlk(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi, struct flock *lock) {
+  SPDLOG_DEBUG("call bfs_ll_getlk ino: {} fd: {}", ino, fi->fh);
+  StatTimer timer(kStatFuseLock);
+  if (IsStatsNode(ino)) {
+    lock->l_type = F_UNLCK;
+    fuse_reply_lock(req, lock);
+    return;
+  }
+  OpenFilePtr open_file =
+      FileSystem::Instance()->file_handle()->GetOpenFile(fi->fh);
+  if (!open_file) {
+    fuse_reply_err(req, EBADF);
+    return;
+  }
+  if (open_file->file()->locked()) {
+    lock->l_type = F_WRLCK;
+    lock->l_whence = SEEK_SET;
+    lock->l_start = 0;
+    lock->l_len = 0;
+    lock->l_pid = 0;
+  } else {
+    lock->l_type = F_UNLCK;
+  }
+  fuse_reply_lock(req, lock);
+}
+
+static void bfs_ll_setlk(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi, struct flock *lock,
+                         int sleep) {
+  SPDLOG_DEBUG("call bfs_ll_setlk ino: {} fd: {} type: {}", ino, fi->fh,
+               lock->l_type);
+  StatTimer timer(kStatFuseLock);
+  int err = 0;
+  if (!IsStatsNode(ino) &&
+      FileSystem::Instance()->FcntlFile(fi->fh, lock->l_type) < 0) {
+    err = errno;
+  }
+  fuse_reply_err(req, err);
+}
+
+static void bfs_ll_flock(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi, int op) {
+  SPDLOG_DEBUG("call bfs_ll_flock ino: {} fd: {} op: {}", ino, fi->fh, op);
+  StatTimer timer(kStatFuseFlock);
+  if (IsStatsNode(ino)) {
+    fuse_reply_err(req, 0);
+    return;
+  }
+  int16_t lock_type = F_UNLCK;
+  if (op & LOCK_SH) {
+    lock_type = F_RDLCK;
+  } else if (op & LOCK_EX) {
+    lock_type = F_WRLCK;
+  }
+  int err = 0;
+  if (FileSystem::Instance()->FcntlFile(fi->fh, lock_type) < 0) {
+    // flock(2)锁冲突返回EWOULDBLOCK
+    err = errno == EACCES ? EWOULDBLOCK : errno;
+  }
+  fuse_reply_err(req, err);
+}
+
+// 数据不经过内核, 按块读出来再写到目标文件, 部分成功时返回已经拷贝的长度
+static void bfs_ll_copy_file_range(fuse_req_t req, fuse_ino_t ino_in,
+                                   off_t off_in, struct fuse_file_info *fi_in,
+                                   fuse_ino_t ino_out, off_t off_out,
+                                   struct fuse_file_info *fi_out, size_t len,
+                                   int flags) {
+  SPDLOG_DEBUG("call bfs_ll_copy_file_range fd: {} -> {} len: {}", fi_in->fh,
+               fi_out->fh, len);
+  StatTimer timer(kStatFuseCopyFileRange);
+  if (IsStatsNode(ino_in) || IsStatsNode(ino_out)) {
+    fuse_reply_err(req, EOPNOTSUPP);
+    return;
+  }
+  if (flags != 0) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+  constexpr size_t kCopyChunkSize = 1 * M;
+  std::unique_ptr<char[]> buf(new char[std::min(len, kCopyChunkSize)]);
+  size_t copied = 0;
+  int err = 0;
+  while (copied < len) {
+    size_t size = std::min(len - copied, kCopyChunkSize);
+    int64_t rd = FileSystem::Instance()->PreadFile(fi_in->fh, buf.get(), size,
+                                                   off_in + copied);
+    if (rd <= 0) {
+      err = rd < 0 ? errno : 0;
+      break;
+    }
+    int64_t wr = FileSystem::Instance()->PwriteFile(fi_out->fh, buf.get(), rd,
+                                                    off_out + copied);
+    if (wr < 0) {
+      err = errno;
+      break;
+    }
+    copied += wr;
+    if (wr < rd || static_cast<size_t>(rd) < size) {
+      break;
+    }
+  }
+  if (copied == 0 && err != 0) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  timer.set_bytes(copied);
+  fuse_reply_write(req, copied);
+}
+
+static void bfs_ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t off,
+                         int whence, struct fuse_file_info *fi) {
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC, "call bfs_ll_lseek fd: {} off: {}",
+                      fi->fh, off);
+  StatTimer timer(kStatFuseLseek);
+  if (IsStatsNode(ino)) {
+    fuse_reply_err(req, ESPIPE);
+    return;
+  }
+  off_t res = FileSystem::Instance()->SeekFile(fi->fh, off, whence);
+  if (res < 0) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  fuse_reply_lseek(req, res);
+}
+
+static const struct fuse_lowlevel_ops kBFSLowLevelOps = {
+    .init = bfs_ll_init,
+    .destroy = bfs_ll_destroy,
+    .lookup = bfs_ll_lookup,
+    .forget = bfs_ll_forget,
+    .getattr = bfs_ll_getattr,
+    .setattr = bfs_ll_setattr,
+    .mknod = bfs_ll_mknod,
+    .mkdir = bfs_ll_mkdir,
+    .unlink = bfs_ll_unlink,
+    .rmdir = bfs_ll_rmdir,
+    .rename = bfs_ll_rename,
+    .open = bfs_ll_open,
+    .read = bfs_ll_read,
+    .flush = bfs_ll_flush,
+    .release = bfs_ll_release,
+    .fsync = bfs_ll_fsync,
+    .opendir = bfs_ll_opendir,
+    .readdir = bfs_ll_readdir,
+    .releasedir = bfs_ll_releasedir,
+    .statfs = bfs_ll_statfs,
+    .create = bfs_ll_create,
+    .getlk = bfs_ll_getlk,
+    .setlk = bfs_ll_setlk,
+    .write_buf = bfs_ll_write_buf,
+    .forget_multi = bfs_ll_forget_multi,
+    .flock = bfs_ll_flock,
+    .copy_file_range = bfs_ll_copy_file_range,
+    .lseek = bfs_ll_lseek,
+};
+
+int block_fs_fuse_lowlevel_loop(bfs_config_info *info) {
+  LL()->Init(info);
+
+  std::vector<std::string> fuse_args = block_fs_fuse_args(info);
+  std::vector<char *> argv;
+  for (std::string &arg : fuse_args) {
+    LOG(INFO) << "fuse args: " << arg;
+    argv.push_back(arg.data());
+  }
+  SPDLOG_INFO("fuse low level entry timeout: {}s attr timeout: {}s",
+              info->fuse_entry_timeout_, info->fuse_attr_timeout_);
+
+  struct fuse_args args = FUSE_ARGS_INIT((int)argv.size(), argv.data());
+  struct fuse_session *se =
+      fuse_session_new(&args, &kBFSLowLevelOps, sizeof(kBFSLowLevelOps), info);
+  if (se == nullptr) {
+    LOG(ERROR) << "fuse create session failed";
+    return -1;
+  }
+  int ret = fuse_set_signal_handlers(se);
+  if (ret != 0) {
+    LOG(ERROR) << "fuse set signal handlers failed, ret: " << ret;
+    fuse_session_destroy(se);
+    return -1;
+  }
+  ret = fuse_session_mount(se, info->fuse_mount_point.c_str());
+  if (ret != 0) {
+    LOG(ERROR) << "fuse mount dir failed, ret: " << ret;
+    fuse_remove_signal_handlers(se);
+    fuse_session_destroy(se);
+    return -1;
+  }
+
+  // clone_fd时每个worker有自己的/dev/fuse fd, 请求不在一个fd上排队
+  struct fuse_loop_config *config = fuse_loop_cfg_create();
+  fuse_loop_cfg_set_max_threads(config, info->fuse_max_threads_);
+  if (info->fuse_max_idle_threads_ >= 0) {
+    fuse_loop_cfg_set_idle_threads(config, info->fuse_max_idle_threads_);
+  }
+  fuse_loop_cfg_set_clone_fd(config, info->fuse_clone_fd_);
+  SPDLOG_INFO("fuse session loop max threads: {} max idle threads: {} "
+              "clone fd: {}",
+              info->fuse_max_threads_, info->fuse_max_idle_threads_,
+              info->fuse_clone_fd_);
+  ret = fuse_session_loop_mt(se, config);
+  fuse_loop_cfg_destroy(config);
+  LOG(WARNING) << "fuse mount loop exit, ret: " << ret;
+
+  fuse_session_unmount(se);
+  fuse_remove_signal_handlers(se);
+  fuse_session_destroy(se);
+  fuse_opt_free_args(&args);
+  return ret;
+}
+
+}  // namespace udisk::blockfs
@@ -0,0 +1,289 @@
+#include "block_bitmap.h"
+
+#include <algorithm>
+
+namespace udisk::blockfs {
+
+static inline uint32_t WordNum(uint32_t bits) { return (bits + 63) / 64; }
+
+void BlockBitmap::UpdateSummary(uint32_t word_index) {
+  regions_[word_index / kWordsPerRegion].stale = true;
+  uint64_t mask = 1ULL << (word_index % kBitsPerWord);
+  if (words_[word_index] != 0) {
+    summary_[word_index / kBitsPerWord] |= mask;
+  } else {
+    summary_[word_index / kBitsPerWord] &= ~mask;
+  }
+}
+
+uint32_t BlockBitmap::NextFreeWord(uint32_t word_index) const {
+  uint32_t word_num = words_.size();
+  if (word_index >= word_num) {
+    return UINT32_MAX;
+  }
+  uint32_t summary_index = word_index / kBitsPerWord;
+  uint64_t summary =
+      summary_[summary_index] & (~0ULL << (word_index % kBitsPerWord));
+  while (summary == 0) {
+    if (++summary_index >= summary_.size()) {
+      return UINT32_MAX;
+    }
+    summary = summary_[summary_index];
+  }
+  return summary_index * kBitsPerWord + __builtin_ctzll(summary);
+}
+
+void BlockBitmap::Resize(uint32_t size) {
+  if (size <= size_) {
+    return;
+  }
+  uint32_t old_size = size_;
+  words_.resize(WordNum(size), 0);
+  summary_.resize(WordNum(words_.size()), 0);
+  regions_.resize(summary_.size());
+  for (uint32_t id = old_size; id < size;) {
+    uint32_t word_index = id / kBitsPerWord;
+    uint32_t bit = id % kBitsPerWord;
+    uint32_t len = std::min(kBitsPerWord - bit, size - id);
+    uint64_t mask = (len == kBitsPerWord) ? ~0ULL : ((1ULL << len) - 1) << bit;
+    words_[word_index] |= mask;
+    UpdateSummary(word_index);
+    id += len;
+  }
+  free_num_ += size - old_size;
+  size_ = size;
+}
+
+bool BlockBitmap::IsFree(uint32_t block_id) const noexcept {
+  if (block_id >= size_) {
+    return false;
+  }
+  return words_[block_id / kBitsPerWord] & (1ULL << (block_id % kBitsPerWord));
+}
+
+bool BlockBitmap::Acquire(uint32_t block_id) {
+  if (!IsFree(block_id)) {
+    return false;
+  }
+  uint32_t word_index = block_id / kBitsPerWord;
+  words_[word_index] &= ~(1ULL << (block_id % kBitsPerWord));
+  UpdateSummary(word_index);
+  --free_num_;
+  return true;
+}
+
+bool BlockBitmap::Release(uint32_t block_id) {
+  if (block_id >= size_ || IsFree(block_id)) {
+    return false;
+  }
+  uint32_t word_index = block_id / kBitsPerWord;
+  words_[word_index] |= 1ULL << (block_id % kBitsPerWord);
+  UpdateSummary(word_index);
+  ++free_num_;
+  return true;
+}
+
+bool BlockBitmap::FindRun(uint32_t start_word, uint32_t end_word, uint32_t num,
+                          uint32_t *run_start) const {
+  uint64_t run_len = 0;
+  uint32_t expect_word = UINT32_MAX;
+  for (uint32_t w = NextFreeWord(start_word); w < end_word;
+       w = NextFreeWord(w + 1)) {
+    // 中间跳过了全满的字, 连续区间断开
+    if (w != expect_word) {
+      run_len = 0;
+    }
+    expect_word = w + 1;
+    uint64_t word = words_[w];
+    if (word == ~0ULL) {
+      if (run_len == 0) {
+        *run_start = w * kBitsPerWord;
+      }
+      run_len += kBitsPerWord;
+      if (run_len >= num) {
+        return true;
+      }
+      continue;
+    }
+    uint32_t bit = 0;
+    while (bit < kBitsPerWord) {
+      uint64_t rest = word >> bit;
+      if (rest == 0) {
+        run_len = 0;
+        break;
+      }
+      if (!(rest & 1)) {
+        bit += __builtin_ctzll(rest);
+        run_len = 0;
+        continue;
+      }
+      // rest的高位是0, 所以~rest一定不为0
+      uint32_t ones = __builtin_ctzll(~rest);
+      if (run_len == 0) {
+        *run_start = w * kBitsPerWord + bit;
+      }
+      run_len += ones;
+      if (run_len >= num) {
+        return true;
+      }
+      bit += ones;
+    }
+  }
+  return false;
+}
+
+const BlockBitmap::RegionRun &BlockBitmap::GetRegion(uint32_t region_index) {
+  RegionRun &region = regions_[region_index];
+  if (!region.stale) {
+    return region;
+  }
+  region = RegionRun();
+  region.stale = false;
+  // 整个区域都没有空闲位
+  if (summary_[region_index] == 0) {
+    return region;
+  }
+  uint32_t first = region_index * kWordsPerRegion;
+  uint32_t last = std::min<uint32_t>(first + kWordsPerRegion, words_.size());
+  uint32_t run_len = 0;
+  bool closed = false;  // 是否遇到过已占用的位, 之前的部分就是prefix
+  for (uint32_t w = first; w < last; ++w) {
+    uint64_t word = words_[w];
+    if (word == ~0ULL) {
+      run_len += kBitsPerWord;
+      continue;
+    }
+    uint32_t bit = 0;
+    while (bit < kBitsPerWord) {
+      uint64_t rest = word >> bit;
+      // bit为0时word不是全1, 否则rest的高位是0, 所以~rest一定不为0
+      uint32_t ones = __builtin_ctzll(~rest);
+      run_len += ones;
+      bit += ones;
+      if (bit >= kBitsPerWord) {
+        break;
+      }
+      region.longest = std::max(region.longest, run_len);
+      if (!closed) {
+        region.prefix = run_len;
+        closed = true;
+      }
+      run_len = 0;
+      rest = word >> bit;
+      if (rest == 0) {
+        break;
+      }
+      bit += __builtin_ctzll(rest);
+    }
+  }
+  region.longest = std::max(region.longest, run_len);
+  region.suffix = run_len;
+  if (!closed) {
+    region.prefix = run_len;
+  }
+  return region;
+}
+
+bool BlockBitmap::FindRunInRegions(uint32_t start_region, uint32_t end_region,
+                                   uint32_t start_word, uint32_t num,
+                                   uint32_t *run_start) {
+  uint32_t word_num = words_.size();
+  // 上一个区域结尾处的空闲区间, 可能和当前区域的开头连起来
+  uint64_t carry = 0;
+  uint32_t carry_start = 0;
+  for (uint32_t r = start_region; r < end_region; ++r) {
+    const RegionRun &region = GetRegion(r);
+    uint32_t first = r * kWordsPerRegion;
+    uint32_t last = std::min(first + kWordsPerRegion, word_num);
+    uint32_t region_bits = (last - first) * kBitsPerWord;
+    if (carry > 0 && carry + region.prefix >= num) {
+      *run_start = carry_start;
+      return true;
+    }
+    if (region.longest >= num) {
+      if ((start_word > first && start_word < last &&
+           FindRun(start_word, last, num, run_start)) ||
+          FindRun(first, last, num, run_start)) {
+        return true;
+      }
+    }
+    if (region.prefix == region_bits) {
+      if (carry == 0) {
+        carry_start = first * kBitsPerWord;
+      }
+      carry += region_bits;
+    } else {
+      carry = region.suffix;
+      carry_start = last * kBitsPerWord - region.suffix;
+    }
+  }
+  return false;
+}
+
+void BlockBitmap::ClearRange(uint32_t start, uint32_t num) {
+  uint32_t end = start + num;
+  for (uint32_t id = start; id < end;) {
+    uint32_t word_index = id / kBitsPerWord;
+    uint32_t bit = id % kBitsPerWord;
+    uint32_t len = std::min(kBitsPerWord - bit, end - id);
+    uint64_t mask = (len == kBitsPerWord) ? ~0ULL : ((1ULL << len) - 1) << bit;
+    words_[word_index] &= ~mask;
+    UpdateSummary(word_index);
+    id += len;
+  }
+  free_num_ -= num;
+}
+
+bool BlockBitmap::Allocate(uint32_t num, std::vector<uint32_t> *block_ids) {
+  block_ids->clear();
+  if (num == 0 || free_num_ < num) {
+    return false;
+  }
+  block_ids->reserve(num);
+  uint32_t word_num = words_.size();
+  uint32_t start_word = hint_ < word_num ? hint_ : 0;
+
+  // 优先找一段连续的空闲区间, 从上次分配的位置往后找, 找不到再从头找
+  // 跨过起始位置的区间在第二遍里找到
+  uint32_t region_num = regions_.size();
+  uint32_t start_region = start_word / kWordsPerRegion;
+  uint32_t run_start = 0;
+  if (FindRunInRegions(start_region, region_num, start_word, num,
+                       &run_start) ||
+      FindRunInRegions(0, std::min(region_num, start_region + 1), 0, num,
+                       &run_start)) {
+    ClearRange(run_start, num);
+    for (uint32_t i = 0; i < num; ++i) {
+      block_ids->push_back(run_start + i);
+    }
+    hint_ = (run_start + num) / kBitsPerWord;
+    return true;
+  }
+
+  // 碎片化严重, 按地址顺序拼凑, 尽量保持局部有序
+  uint32_t w = NextFreeWord(start_word);
+  if (w == UINT32_MAX) {
+    w = NextFreeWord(0);
+  }
+  while (block_ids->size() < num) {
+    uint64_t word = words_[w];
+    while (word != 0 && block_ids->size() < num) {
+      uint32_t bit = __builtin_ctzll(word);
+      word &= word - 1;
+      block_ids->push_back(w * kBitsPerWord + bit);
+    }
+    words_[w] = word;
+    UpdateSummary(w);
+    hint_ = w;
+    if (block_ids->size() < num) {
+      w = NextFreeWord(w + 1);
+      if (w == UINT32_MAX) {
+        w = NextFreeWord(0);
+      }
+    }
+  }
+  free_num_ -= num;
+  return true;
+}
+
+}  // namespace udisk::blockfs
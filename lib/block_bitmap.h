@@ -0,0 +1,68 @@
+#ifndef LIB_BLOCK_BITMAP_H_
+#define LIB_BLOCK_BITMAP_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+namespace udisk::blockfs {
+
+// 空闲block的位图, 1表示空闲
+// summary_的每一位对应words_中的一个字是否还有空闲位, 扫描时可以整段跳过
+// 每64个字(summary_的一个字)为一个区域, 记录区域内的空闲区间长度,
+// 找连续区间时按区域跳过, 碎片化的时候不用每次扫描整个位图
+// 128T/4M的盘只需要4M的位图, 非线程安全, 由BlockHandle加锁
+class BlockBitmap {
+ private:
+  static constexpr uint32_t kBitsPerWord = 64;
+  static constexpr uint32_t kWordsPerRegion = kBitsPerWord;
+
+  // 区域内的空闲区间, 区域修改后置为stale, 下次查找时重新统计
+  struct RegionRun {
+    uint32_t prefix = 0;   // 从区域开头开始的空闲长度
+    uint32_t suffix = 0;   // 到区域结尾为止的空闲长度
+    uint32_t longest = 0;  // 区域内最长的空闲区间
+    bool stale = true;
+  };
+
+  std::vector<uint64_t> words_;
+  std::vector<uint64_t> summary_;
+  std::vector<RegionRun> regions_;
+  uint32_t size_ = 0;      // 总的block个数
+  uint32_t free_num_ = 0;  // 空闲的block个数
+  uint32_t hint_ = 0;      // 下一次分配开始扫描的字, 尽量顺序分配
+
+ private:
+  void UpdateSummary(uint32_t word_index);
+  // 从word_index开始(包括)找到下一个有空闲位的字, 没有返回UINT32_MAX
+  uint32_t NextFreeWord(uint32_t word_index) const;
+  // 在[start_word, end_word)之间找长度为num的连续空闲区间
+  bool FindRun(uint32_t start_word, uint32_t end_word, uint32_t num,
+               uint32_t *run_start) const;
+  const RegionRun &GetRegion(uint32_t region_index);
+  // 在[start_region, end_region)之间找, start_word所在的区域优先从它开始
+  bool FindRunInRegions(uint32_t start_region, uint32_t end_region,
+                        uint32_t start_word, uint32_t num,
+                        uint32_t *run_start);
+  void ClearRange(uint32_t start, uint32_t num);
+
+ public:
+  BlockBitmap() = default;
+  ~BlockBitmap() = default;
+
+  uint32_t size() const noexcept { return size_; }
+  uint32_t free_num() const noexcept { return free_num_; }
+
+  // 扩容, 新增的block都是空闲的
+  void Resize(uint32_t size);
+  bool IsFree(uint32_t block_id) const noexcept;
+  // 占用指定的block, 已经被占用返回false
+  bool Acquire(uint32_t block_id);
+  // 释放指定的block, 已经是空闲返回false
+  bool Release(uint32_t block_id);
+  // 申请num个block, 优先返回一段连续的block, 否则按顺序拼凑多段
+  bool Allocate(uint32_t num, std::vector<uint32_t> *block_ids);
+};
+
+}  // namespace udisk::blockfs
+#endif
@@ -0,0 +1,387 @@
+#include "block_fs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+
+#include <atomic>
+#include <string>
+
+#include "file_system.h"
+#include "spdlog/spdlog.h"
+
+using udisk::blockfs::BLOCKFS_DIR;
+using udisk::blockfs::block_fs_dirent;
+using udisk::blockfs::DirectoryPtr;
+using udisk::blockfs::FileSystem;
+using udisk::blockfs::kMetaSyncFsync;
+
+// 对外的dir句柄, 把内部的记录转换成标准的dirent
+struct block_fs_dir {
+  BLOCKFS_DIR *dir;
+  struct dirent entry;
+};
+
+namespace {
+
+std::atomic<bool> g_mounted{false};
+
+// 没有挂载的时候元数据handle都还不存在, 直接失败
+bool CheckMounted() {
+  if (!g_mounted.load(std::memory_order_acquire)) [[unlikely]] {
+    errno = ENODEV;
+    return false;
+  }
+  return true;
+}
+
+bool CheckPath(const char *path) {
+  if (!CheckMounted()) [[unlikely]] {
+    return false;
+  }
+  if (!path || path[0] != '/') [[unlikely]] {
+    errno = path ? EINVAL : EFAULT;
+    return false;
+  }
+  return true;
+}
+
+bool CheckIov(const struct iovec *iov, int iovcnt) {
+  if (iovcnt < 0 || iovcnt > IOV_MAX) [[unlikely]] {
+    errno = EINVAL;
+    return false;
+  }
+  if (iovcnt > 0 && !iov) [[unlikely]] {
+    errno = EFAULT;
+    return false;
+  }
+  return true;
+}
+
+// 目录的fd只用来fstat/fsync, 不需要BLOCKFS_DIR的readdir游标
+int OpenDirectoryFd(const char *path, int flags) {
+  if ((flags & O_ACCMODE) != O_RDONLY || (flags & O_CREAT)) {
+    errno = EISDIR;
+    return -1;
+  }
+  DirectoryPtr dir =
+      FileSystem::Instance()->dir_handle()->GetCreatedDirectory(path);
+  if (!dir) {
+    errno = ENOENT;
+    return -1;
+  }
+  int32_t fd = FileSystem::Instance()->fd_handle()->AllocFd(dir);
+  if (fd < 0) {
+    return -1;
+  }
+  dir->IncLinkCount();
+  return fd;
+}
+
+}  // namespace
+
+extern "C" {
+
+int block_fs_mount(const char *config_path) {
+  if (!config_path) [[unlikely]] {
+    errno = EFAULT;
+    return -1;
+  }
+  bool expected = false;
+  if (!g_mounted.compare_exchange_strong(expected, true)) {
+    errno = EBUSY;
+    return -1;
+  }
+  if (FileSystem::Instance()->MountFileSystem(config_path) < 0) {
+    g_mounted.store(false, std::memory_order_release);
+    if (errno == 0) {
+      errno = EIO;
+    }
+    return -1;
+  }
+  SPDLOG_INFO("block_fs client mounted, config: {}", config_path);
+  return 0;
+}
+
+int block_fs_unmount(void) {
+  bool expected = true;
+  if (!g_mounted.compare_exchange_strong(expected, false)) {
+    errno = EINVAL;
+    return -1;
+  }
+  FileSystem::Instance()->UnmountFileSystem();
+  return 0;
+}
+
+int block_fs_open(const char *path, int flags, mode_t mode) {
+  if (!CheckPath(path)) [[unlikely]] {
+    return -1;
+  }
+  if ((flags & O_DIRECTORY) ||
+      (!(flags & O_CREAT) &&
+       FileSystem::Instance()->dir_handle()->GetCreatedDirectory(path))) {
+    return OpenDirectoryFd(path, flags);
+  }
+  return FileSystem::Instance()->file_handle()->open(path, flags, mode);
+}
+
+int block_fs_close(int fd) {
+  if (!CheckMounted()) [[unlikely]] {
+    return -1;
+  }
+  if (FileSystem::Instance()->fd_handle()->GetFile(fd)) {
+    return FileSystem::Instance()->file_handle()->close(fd);
+  }
+  DirectoryPtr dir = FileSystem::Instance()->fd_handle()->ReleaseDirectory(fd);
+  if (!dir) {
+    errno = EBADF;
+    return -1;
+  }
+  dir->DecLinkCount();
+  return 0;
+}
+
+ssize_t block_fs_read(int fd, void *buf, size_t count) {
+  off_t pos = block_fs_lseek(fd, 0, SEEK_CUR);
+  if (pos < 0) [[unlikely]] {
+    return -1;
+  }
+  ssize_t ret = block_fs_pread(fd, buf, count, pos);
+  if (ret > 0) {
+    block_fs_lseek(fd, pos + ret, SEEK_SET);
+  }
+  return ret;
+}
+
+ssize_t block_fs_write(int fd, const void *buf, size_t count) {
+  off_t pos = block_fs_lseek(fd, 0, SEEK_CUR);
+  if (pos < 0) [[unlikely]] {
+    return -1;
+  }
+  ssize_t ret = block_fs_pwrite(fd, buf, count, pos);
+  if (ret > 0) {
+    block_fs_lseek(fd, pos + ret, SEEK_SET);
+  }
+  return ret;
+}
+
+off_t block_fs_lseek(int fd, off_t offset, int whence) {
+  if (!CheckMounted()) [[unlikely]] {
+    return -1;
+  }
+  off_t ret = FileSystem::Instance()->SeekFile(fd, offset, whence);
+  if (ret < 0 && errno == 0) {
+    errno = EBADF;
+  }
+  return ret;
+}
+
+ssize_t block_fs_pread(int fd, void *buf, size_t count, off_t offset) {
+  if (!CheckMounted()) [[unlikely]] {
+    return -1;
+  }
+  if (offset < 0) [[unlikely]] {
+    errno = EINVAL;
+    return -1;
+  }
+  if (count == 0) {
+    return 0;
+  }
+  return FileSystem::Instance()->PreadFile(fd, buf, count, offset);
+}
+
+ssize_t block_fs_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+  if (!CheckMounted()) [[unlikely]] {
+    return -1;
+  }
+  if (offset < 0) [[unlikely]] {
+    errno = EINVAL;
+    return -1;
+  }
+  if (count == 0) {
+    return 0;
+  }
+  return FileSystem::Instance()->PwriteFile(fd, buf, count, offset);
+}
+
+ssize_t block_fs_preadv(int fd, const struct iovec *iov, int iovcnt,
+                        off_t offset) {
+  if (!CheckMounted() || !CheckIov(iov, iovcnt)) [[unlikely]] {
+    return -1;
+  }
+  if (offset < 0) [[unlikely]] {
+    errno = EINVAL;
+    return -1;
+  }
+  return FileSystem::Instance()->PreadvFile(fd, iov, iovcnt, offset);
+}
+
+ssize_t block_fs_pwritev(int fd, const struct iovec *iov, int iovcnt,
+                         off_t offset) {
+  if (!CheckMounted() || !CheckIov(iov, iovcnt)) [[unlikely]] {
+    return -1;
+  }
+  if (offset < 0) [[unlikely]] {
+    errno = EINVAL;
+    return -1;
+  }
+  return FileSystem::Instance()->PwritevFile(fd, iov, iovcnt, offset);
+}
+
+int block_fs_fsync(int fd) {
+  if (!CheckMounted()) [[unlikely]] {
+    return -1;
+  }
+  if (FileSystem::Instance()->fd_handle()->GetFile(fd)) {
+    return FileSystem::Instance()->file_handle()->fsync(fd);
+  }
+  // 目录没有数据, 只需要把元数据的journal刷下去
+  if (!FileSystem::Instance()->fd_handle()->GetDirectory(fd)) {
+    errno = EBADF;
+    return -1;
+  }
+  if (!FileSystem::Instance()->journal()->Sync(kMetaSyncFsync)) [[unlikely]] {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+int block_fs_fdatasync(int fd) { return block_fs_fsync(fd); }
+
+int block_fs_stat(const char *path, struct stat *buf) {
+  if (!CheckPath(path)) [[unlikely]] {
+    return -1;
+  }
+  return FileSystem::Instance()->StatPath(path, buf);
+}
+
+int block_fs_fstat(int fd, struct stat *buf) {
+  if (!CheckMounted()) [[unlikely]] {
+    return -1;
+  }
+  if (FileSystem::Instance()->StatPath(fd, buf) < 0) {
+    errno = EBADF;
+    return -1;
+  }
+  return 0;
+}
+
+int block_fs_statvfs(struct statvfs *buf) {
+  if (!CheckMounted()) [[unlikely]] {
+    return -1;
+  }
+  return FileSystem::Instance()->StatVFS(buf);
+}
+
+int block_fs_truncate(const char *path, off_t length) {
+  if (!CheckPath(path)) [[unlikely]] {
+    return -1;
+  }
+  if (length < 0) [[unlikely]] {
+    errno = EINVAL;
+    return -1;
+  }
+  return FileSystem::Instance()->TruncateFile(std::string(path), length);
+}
+
+int block_fs_ftruncate(int fd, off_t length) {
+  if (!CheckMounted()) [[unlikely]] {
+    return -1;
+  }
+  if (length < 0) [[unlikely]] {
+    errno = EINVAL;
+    return -1;
+  }
+  if (FileSystem::Instance()->TruncateFile(static_cast<int32_t>(fd), length) <
+      0) {
+    if (errno == ENOENT) {
+      errno = EBADF;
+    }
+    return -1;
+  }
+  return 0;
+}
+
+int block_fs_fallocate(int fd, int mode, off_t offset, off_t len) {
+  if (!CheckMounted()) [[unlikely]] {
+    return -1;
+  }
+  return FileSystem::Instance()->FallocateFile(fd, mode, offset, len);
+}
+
+int block_fs_rename(const char *oldpath, const char *newpath) {
+  if (!CheckPath(oldpath) || !CheckPath(newpath)) [[unlikely]] {
+    return -1;
+  }
+  return FileSystem::Instance()->RenamePath(oldpath, newpath);
+}
+
+int block_fs_unlink(const char *path) {
+  if (!CheckPath(path)) [[unlikely]] {
+    return -1;
+  }
+  return FileSystem::Instance()->file_handle()->unlink(path);
+}
+
+int block_fs_mkdir(const char *path, mode_t mode) {
+  if (!CheckPath(path)) [[unlikely]] {
+    return -1;
+  }
+  return FileSystem::Instance()->dir_handle()->CreateDirectory(path);
+}
+
+int block_fs_rmdir(const char *path) {
+  if (!CheckPath(path)) [[unlikely]] {
+    return -1;
+  }
+  return FileSystem::Instance()->dir_handle()->DeleteDirectory(path, false);
+}
+
+block_fs_dir *block_fs_opendir(const char *path) {
+  if (!CheckPath(path)) [[unlikely]] {
+    return nullptr;
+  }
+  BLOCKFS_DIR *dir = FileSystem::Instance()->dir_handle()->OpenDirectory(path);
+  if (!dir) {
+    if (errno == 0) {
+      errno = ENOENT;
+    }
+    return nullptr;
+  }
+  block_fs_dir *d = new block_fs_dir();
+  d->dir = dir;
+  return d;
+}
+
+struct dirent *block_fs_readdir(block_fs_dir *d) {
+  if (!d) [[unlikely]] {
+    errno = EBADF;
+    return nullptr;
+  }
+  block_fs_dirent *de = FileSystem::Instance()->ReadDirectory(d->dir);
+  if (!de) {
+    return nullptr;
+  }
+  struct dirent *entry = &d->entry;
+  entry->d_ino = de->d_ino;
+  entry->d_off = de->d_off;
+  entry->d_reclen = sizeof(struct dirent);
+  entry->d_type = de->d_type;
+  ::strncpy(entry->d_name, de->d_name, sizeof(entry->d_name) - 1);
+  entry->d_name[sizeof(entry->d_name) - 1] = '\0';
+  return entry;
+}
+
+int block_fs_closedir(block_fs_dir *d) {
+  if (!d) [[unlikely]] {
+    errno = EBADF;
+    return -1;
+  }
+  int ret = FileSystem::Instance()->dir_handle()->CloseDirectory(d->dir);
+  delete d;
+  return ret;
+}
+
+}  // extern "C"
@@ -1,52 +1,175 @@
 #include "block_handle.h"
 
+#include <sched.h>
+
+#include <algorithm>
+#include <functional>
+
 #include "file_system.h"
+#include "stats.h"
 
 namespace udisk::blockfs {
 
 bool BlockHandle::InitializeMeta() {
   uint32_t new_max_block_num = FileSystem::Instance()->super_meta()->curr_block_num;
   std::lock_guard<std::mutex> lock(mutex_);
-  for (uint32_t i = max_block_num_; i < new_max_block_num; ++i) {
-    block_id_pool_.emplace(i);
-  }
+  block_bitmap_.Resize(new_max_block_num);
   max_block_num_ = new_max_block_num;
   return true;
 }
 
+BlockHandle::BlockCache &BlockHandle::LocalBlockCache() {
+  int cpu = ::sched_getcpu();
+  if (cpu < 0) [[unlikely]] {
+    cpu = 0;
+  }
+  return block_caches_[cpu % kBlockCacheNum];
+}
+
+bool BlockHandle::GetFreeBlockIdGlobal(uint32_t block_id_num,
+                                       std::vector<uint32_t> *block_ids) {
+  for (uint32_t retry = 0; retry < 2; ++retry) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+      LockWithStat(lock, kStatLockBlockBitmap);
+      if (block_bitmap_.free_num() >= block_id_num) [[likely]] {
+        SPDLOG_INFO("current free block num: {} apply block_id_num: {}",
+                    block_bitmap_.free_num(), block_id_num);
+        // 优先分配物理连续的block
+        if (!block_bitmap_.Allocate(block_id_num, block_ids)) [[unlikely]] {
+          SPDLOG_ERROR("allocate block id failed, wanted: {}", block_id_num);
+          return false;
+        }
+        SPDLOG_INFO("apply for new file block id: {} num: {}",
+                    block_ids->front(), block_ids->size());
+        return true;
+      }
+    }
+    // 全局不够时把各个CPU预留的还回来再试一次
+    if (retry > 0 || DrainBlockCacheLock() == 0) {
+      break;
+    }
+  }
+  SPDLOG_ERROR("block id not enough, left: {} wanted: {}", GetFreeBlockNum(),
+               block_id_num);
+  return false;
+}
+
+void BlockHandle::PutFreeBlockIdGlobal(const uint32_t *block_ids,
+                                       uint32_t num) {
+  std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+  LockWithStat(lock, kStatLockBlockBitmap);
+  for (uint32_t i = 0; i < num; ++i) {
+    if (!block_bitmap_.Release(block_ids[i])) [[unlikely]] {
+      SPDLOG_ERROR("put block id: {} already free or invalid", block_ids[i]);
+      continue;
+    }
+    SPDLOG_DEBUG("put block id: {} to free pool done", block_ids[i]);
+  }
+}
+
 bool BlockHandle::GetFreeBlockIdLock(uint32_t block_id_num,
                                      std::vector<uint32_t> *block_ids) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  if (block_id_pool_.size() < block_id_num) [[unlikely]] {
-    SPDLOG_ERROR("block id not enough, left: {} wanted: {}",
-                 block_id_pool_.size(), block_id_num);
-    return false;
-  }
-  SPDLOG_INFO("current block pool size: {} apply block_id_num: {}",
-              block_id_pool_.size(), block_id_num);
+  StatTimer timer(kStatAllocBlock);
   block_ids->clear();
-  auto iter = block_id_pool_.begin();
+  if (block_id_num > kBlockCacheBatch) {
+    return GetFreeBlockIdGlobal(block_id_num, block_ids);
+  }
+  BlockCache &cache = LocalBlockCache();
+  std::unique_lock<std::mutex> cache_lock(cache.mutex);
+  if (cache.block_ids.size() < block_id_num) {
+    // 一次补充一批, 位图按next-fit分配, 补充的block基本是连续的
+    std::vector<uint32_t> refill;
+    uint32_t need = block_id_num - cache.block_ids.size();
+    std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+    LockWithStat(lock, kStatLockBlockBitmap);
+    uint32_t refill_num = std::min<uint64_t>(need + kBlockCacheBatch,
+                                             block_bitmap_.free_num());
+    if (refill_num >= need && block_bitmap_.Allocate(refill_num, &refill)) {
+      cache.block_ids.insert(cache.block_ids.end(), refill.begin(),
+                             refill.end());
+      std::sort(cache.block_ids.begin(), cache.block_ids.end(),
+                std::greater<uint32_t>());
+      cached_block_num_ += refill_num;
+    }
+  }
+  if (cache.block_ids.size() < block_id_num) [[unlikely]] {
+    cache_lock.unlock();
+    return GetFreeBlockIdGlobal(block_id_num, block_ids);
+  }
   for (uint32_t i = 0; i < block_id_num; ++i) {
-    SPDLOG_INFO("apply for a new file block id: {}", *iter);
-    block_ids->emplace_back(*iter);
-    iter = block_id_pool_.erase(iter);
+    block_ids->push_back(cache.block_ids.back());
+    cache.block_ids.pop_back();
+  }
+  cached_block_num_ -= block_id_num;
+  SPDLOG_DEBUG("apply for new file block id: {} num: {} from cpu cache",
+               block_ids->front(), block_id_num);
+  return true;
+}
+
+bool BlockHandle::PutFreeBlockIdLock(uint32_t block_id) {
+  StatTimer timer(kStatFreeBlock);
+  return PutFreeBlockIdCached(block_id);
+}
+
+bool BlockHandle::PutFreeBlockIdCached(uint32_t block_id) {
+  if (block_id >= max_block_num_) [[unlikely]] {
+    SPDLOG_ERROR("put block id: {} invalid, max: {}", block_id, max_block_num_);
+    return false;
   }
-  SPDLOG_DEBUG("current block pool size: {}", block_id_pool_.size());
+  BlockCache &cache = LocalBlockCache();
+  {
+    std::lock_guard<std::mutex> cache_lock(cache.mutex);
+    if (cache.block_ids.size() < kBlockCacheMax) {
+      auto pos = std::lower_bound(cache.block_ids.begin(),
+                                  cache.block_ids.end(), block_id,
+                                  std::greater<uint32_t>());
+      if (pos != cache.block_ids.end() && *pos == block_id) [[unlikely]] {
+        SPDLOG_ERROR("put block id: {} already free", block_id);
+        return false;
+      }
+      cache.block_ids.insert(pos, block_id);
+      ++cached_block_num_;
+      return true;
+    }
+  }
+  PutFreeBlockIdGlobal(&block_id, 1);
   return true;
 }
 
 bool BlockHandle::PutFreeBlockIdLock(const std::vector<uint32_t> &block_ids) {
-  std::lock_guard<std::mutex> lock(mutex_);
   if (block_ids.size() == 0) [[unlikely]] {
     SPDLOG_ERROR("block id list empty");
     return false;
   }
-  SPDLOG_INFO("current block pool size: {} put block_id_num: {}",
-              block_id_pool_.size(), block_ids.size());
-  for (auto id : block_ids) {
-    block_id_pool_.emplace(id);
-    SPDLOG_DEBUG("put block id: {} to free pool done", id);
+  StatTimer timer(kStatFreeBlock);
+  SPDLOG_INFO("current free block num: {} put block_id_num: {}",
+              GetFreeBlockNum(), block_ids.size());
+  if (block_ids.size() > kBlockCacheBatch) {
+    PutFreeBlockIdGlobal(block_ids.data(), block_ids.size());
+    return true;
+  }
+  for (uint32_t block_id : block_ids) {
+    PutFreeBlockIdCached(block_id);
   }
   return true;
 }
-}
\ No newline at end of file
+
+uint32_t BlockHandle::DrainBlockCacheLock() {
+  uint32_t drain_num = 0;
+  for (BlockCache &cache : block_caches_) {
+    std::lock_guard<std::mutex> cache_lock(cache.mutex);
+    if (cache.block_ids.empty()) {
+      continue;
+    }
+    PutFreeBlockIdGlobal(cache.block_ids.data(), cache.block_ids.size());
+    drain_num += cache.block_ids.size();
+    cached_block_num_ -= cache.block_ids.size();
+    cache.block_ids.clear();
+  }
+  if (drain_num > 0) {
+    SPDLOG_INFO("drain {} block ids from cpu caches", drain_num);
+  }
+  return drain_num;
+}
+}
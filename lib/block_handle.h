@@ -1,36 +1,51 @@
 #pragma once
 
-#include <new>
+#include <atomic>
 #include <shared_mutex>
 #include <vector>
-#include <unordered_set>
 
+#include "block_bitmap.h"
+#include "comm_utils.h"
 #include "device.h"
 #include "meta_handle.h"
 #include "spdlog/spdlog.h"
 
 namespace udisk::blockfs {
 
-#ifdef __cpp_lib_hardware_interference_size
-  using std::hardware_constructive_interference_size;
-  using std::hardware_destructive_interference_size;
-#else
-  // 64 bytes on x86-64 │ L1_CACHE_BYTES │ L1_CACHE_SHIFT │ __cacheline_aligned │ ...
-  constexpr std::size_t hardware_constructive_interference_size = 64;
-  constexpr std::size_t hardware_destructive_interference_size = 64;
-#endif
-
 // 主要管理空闲的BlockId资源
 class BlockHandle : public MetaHandle {
  private:
   // 当前支持最大的block的个数
   // 总的udisk的容量减去元数据的空间后剩余的4M的个数
   uint32_t max_block_num_ = 0;
-  std::unordered_set<uint32_t> block_id_pool_;
+  // 空闲block的位图, 由mutex_保护
+  BlockBitmap block_bitmap_;
   struct alignas(hardware_destructive_interference_size) Mutex {
     std::shared_mutex m;
   };
-  std::array<Mutex, 100000> block_locks_; // TODO: 精确的大小
+  // block锁按照block id取模分片, 不同的block可能共享同一把锁
+  static constexpr uint32_t kBlockLockNum = 100000;
+  std::array<Mutex, kBlockLockNum> block_locks_;
+
+  // 每个CPU预留一批空闲block id, 小的申请和释放不需要竞争mutex_
+  // 预留的block在磁盘上仍然是空闲的, 异常退出不会泄漏
+  static constexpr uint32_t kBlockCacheNum = 64;
+  static constexpr uint32_t kBlockCacheBatch = 32;
+  static constexpr uint32_t kBlockCacheMax = kBlockCacheBatch * 2;
+  struct alignas(hardware_destructive_interference_size) BlockCache {
+    std::mutex mutex;
+    std::vector<uint32_t> block_ids;  // 降序, 从尾部取保证分配递增
+  };
+  std::array<BlockCache, kBlockCacheNum> block_caches_;
+  std::atomic<uint64_t> cached_block_num_ = 0;
+
+ private:
+  BlockCache &LocalBlockCache();
+  bool GetFreeBlockIdGlobal(uint32_t block_id_num,
+                            std::vector<uint32_t> *block_ids);
+  void PutFreeBlockIdGlobal(const uint32_t *block_ids, uint32_t num);
+  // 优先放进当前CPU的预留, 预留满了还给全局位图
+  bool PutFreeBlockIdCached(uint32_t block_id);
 
  public:
   BlockHandle() = default;
@@ -40,13 +55,12 @@ class BlockHandle : public MetaHandle {
 
   const uint64_t GetFreeBlockNum() {
     std::lock_guard<std::mutex> lock(mutex_);
-    return block_id_pool_.size();
+    return block_bitmap_.free_num() + cached_block_num_;
   }
 
   // 主要用于元数据加载,不需要加锁
   bool GetSpecificBlockId(uint32_t block_id) {
-    if (block_id_pool_.contains(block_id)) {
-      block_id_pool_.erase(block_id);
+    if (block_bitmap_.Acquire(block_id)) {
       return true;
     } else {
       SPDLOG_CRITICAL("block id: {} cannot be in used", block_id);
@@ -57,17 +71,22 @@ class BlockHandle : public MetaHandle {
   bool GetFreeBlockIdLock(uint32_t block_id_num,
                           std::vector<uint32_t> *block_ids);
 
-  bool PutFreeBlockIdLock(uint32_t block_id) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    block_id_pool_.emplace(block_id);
-    return true;
-  }
+  bool PutFreeBlockIdLock(uint32_t block_id);
   bool PutFreeBlockIdLock(const std::vector<uint32_t> &block_ids);
+  // 把所有CPU预留的block id还给全局位图, 空间不足或者卸载时调用
+  uint32_t DrainBlockCacheLock();
 
   virtual bool InitializeMeta() override;
 
+  // 同一个请求需要按照锁的索引排序去重后加锁, 避免重复加同一把锁
+  static uint32_t block_lock_index(uint32_t block_id) noexcept {
+    return block_id % kBlockLockNum;
+  }
+  std::shared_mutex &block_lock_at(uint32_t lock_index) {
+    return block_locks_[lock_index].m;
+  }
   std::shared_mutex &block_lock(uint32_t block_id) {
-    return block_locks_[block_id].m;
+    return block_lock_at(block_lock_index(block_id));
   }
 };
 }
\ No newline at end of file
@@ -2,12 +2,23 @@
 #define LIB_COMM_UTILS_H_
 
 #include <filesystem>
+#include <new>
 #include <string>
+#include <string_view>
 
 namespace fs = std::filesystem;
 
 namespace udisk::blockfs {
 
+#ifdef __cpp_lib_hardware_interference_size
+  using std::hardware_constructive_interference_size;
+  using std::hardware_destructive_interference_size;
+#else
+  // 64 bytes on x86-64 │ L1_CACHE_BYTES │ L1_CACHE_SHIFT │ __cacheline_aligned │ ...
+  constexpr std::size_t hardware_constructive_interference_size = 64;
+  constexpr std::size_t hardware_destructive_interference_size = 64;
+#endif
+
 /* Meta 区域大小保证4K对齐 */
 #define ALIGN_UP(size, align) (((size) + (align - 1)) / (align))
 // #define ALIGN_UP(size, align) (((size) + (align - 1)) & (~(align - 1)))
@@ -39,5 +50,23 @@ inline std::string GetDirName(const std::string &path) {
   }
 }
 
+// 不拷贝的版本, 返回值指向path, 查找路径时使用
+inline std::string_view GetFileNameView(std::string_view path) {
+  size_t pos = path.rfind('/');
+  if (pos == std::string_view::npos)
+    return path;
+  else
+    return path.substr(pos + 1);
+}
+
+// 文件路径(末尾不带'/')的父目录, 末尾带'/', 没有'/'时返回根目录
+inline std::string_view GetDirNameView(std::string_view path) {
+  size_t pos = path.rfind('/');
+  if (pos == std::string_view::npos) {
+    return "/";
+  }
+  return path.substr(0, pos + 1);
+}
+
 }
 #endif
\ No newline at end of file
@@ -1,19 +1,70 @@
 #include "config_load.h"
 
+#include <algorithm>
+
 #include "config_parser.h"
 #include "logging.h"
 #include "spdlog/spdlog.h"
+#include "spdlog/async.h"
 #include "spdlog/cfg/env.h"   // support for loading levels from the environment variable
 #include "spdlog/fmt/ostr.h"  // support for user defined types
 #include "spdlog/sinks/rotating_file_sink.h"
 
-#ifdef SPDLOG_ACTIVE_LEVEL
-#undef SPDLOG_ACTIVE_LEVEL
-#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
-#endif
+// 编译期的最低级别由cmake的BLOCK_FS_LOG_LEVEL决定, 见顶层CMakeLists.txt
 
 namespace udisk::blockfs {
 
+static const char *kSpdlogName = "mfs_spdlog";
+
+static spdlog::level::level_enum SpdlogLevel(LogLevel level) {
+  switch (level) {
+    case TRACE:
+      return spdlog::level::trace;
+    case DEBUG:
+      return spdlog::level::debug;
+    case INFO:
+      return spdlog::level::info;
+    case WARNING:
+      return spdlog::level::warn;
+    case ERROR:
+      return spdlog::level::err;
+    default:
+      return spdlog::level::critical;
+  }
+}
+
+// 同一个进程可能多次挂载(进程内客户端), logger只创建一次
+static void SetupSpdlog(const bfs_config_info *config) {
+  std::shared_ptr<spdlog::logger> logger = spdlog::get(kSpdlogName);
+  if (!logger) {
+    // Create a file rotating logger with 100 MB size max and 3 rotated files
+    auto max_size = 1024 * 1024 * 100;
+    auto max_files = 3;
+    auto sink = std::make_shared<spdlog::sinks::rotating_file_sink_mt>(
+        "/var/log/mfs/mfs_spdlog.log", max_size, max_files);
+    if (config->log_async_) {
+      // 格式化和写文件都在后台线程, 队列满的时候按配置阻塞或者丢掉最老的
+      spdlog::init_thread_pool(config->log_queue_size_, 1);
+      logger = std::make_shared<spdlog::async_logger>(
+          kSpdlogName, sink, spdlog::thread_pool(),
+          config->log_overflow_block_
+              ? spdlog::async_overflow_policy::block
+              : spdlog::async_overflow_policy::overrun_oldest);
+    } else {
+      logger = std::make_shared<spdlog::logger>(kSpdlogName, sink);
+    }
+    spdlog::register_logger(logger);
+  }
+  spdlog::set_default_logger(logger);
+  spdlog::set_level(SpdlogLevel(Logger::LogLevelConvert(config->log_level_)));
+  // SPDLOG_LEVEL环境变量可以临时覆盖配置文件里的级别
+  spdlog::cfg::load_env_levels();
+  // https://github.com/gabime/spdlog/wiki/3.-Custom-formatting
+  spdlog::set_pattern("%Y%m%d %H:%M:%S.%e %t %l %@ %! - %v");
+  spdlog::flush_on(spdlog::level::warn);
+  spdlog::flush_every(std::chrono::seconds(3));
+}
+
 bool ConfigLoader::ParseConfig(bfs_config_info *config) {
   if (config_path_.empty()) {
     LOG(ERROR) << "config path empty";
@@ -37,23 +88,107 @@ bool ConfigLoader::ParseConfig(bfs_config_info *config) {
     config->log_path_ = "/var/log/mfs/";
   }
   LOG(DEBUG) << "log path: " << config->log_path_;
-  // Create a file rotating logger with 100 MB size max and 3 rotated files
-  auto max_size = 1024 * 1024 * 100;
-  auto max_files = 3;
-  auto logger = spdlog::rotating_logger_mt("mfs_spdlog", "/var/log/mfs/mfs_spdlog.log", max_size, max_files);
-  spdlog::set_default_logger(logger);
-  spdlog::set_level(spdlog::level::debug);
-  // https://github.com/gabime/spdlog/wiki/3.-Custom-formatting
-  spdlog::set_pattern("%Y%m%d %H:%M:%S.%e %t %l %@ %! - %v");
-  spdlog::flush_on(spdlog::level::warn);
-  spdlog::flush_every(std::chrono::seconds(3));
+  ini.GetBoolValueOrDefault("common", "log_async", &config->log_async_, true);
+  int log_queue_size;
+  ini.GetIntValueOrDefault("common", "log_queue_size", &log_queue_size, 8192);
+  config->log_queue_size_ = std::max(log_queue_size, 1);
+  std::string log_overflow;
+  ini.GetStringValueOrDefault("common", "log_overflow", &log_overflow,
+                              "overrun");
+  config->log_overflow_block_ = log_overflow == "block";
+  SetupSpdlog(config);
   SPDLOG_INFO("Welcome to spdlog version {}.{}.{}!", SPDLOG_VER_MAJOR, SPDLOG_VER_MINOR, SPDLOG_VER_PATCH);
+  SPDLOG_INFO("log level: {} async: {} queue size: {} overflow: {}",
+              config->log_level_, config->log_async_, config->log_queue_size_,
+              config->log_overflow_block_ ? "block" : "overrun");
 
   Logger::set_min_level(Logger::LogLevelConvert(config->log_level_));
 
   if (ini.GetStringValue("bfs", "device_uuid", &config->device_uuid_) != 0) {
     return false;
   }
+  ini.GetStringValueOrDefault("bfs", "io_engine", &config->io_engine_, "psync");
+  int io_depth;
+  ini.GetIntValueOrDefault("bfs", "io_depth", &io_depth, 64);
+  config->io_depth_ = io_depth;
+  int io_threads;
+  ini.GetIntValueOrDefault("bfs", "io_threads", &io_threads, 8);
+  config->io_threads_ = io_threads;
+  SPDLOG_INFO("io engine: {} io depth: {} io threads: {}", config->io_engine_,
+              config->io_depth_, config->io_threads_);
+  int meta_flush_interval_ms;
+  ini.GetIntValueOrDefault("bfs", "meta_flush_interval_ms",
+                           &meta_flush_interval_ms, 0);
+  config->meta_flush_interval_ms_ = std::max(meta_flush_interval_ms, 0);
+  ini.GetBoolValueOrDefault("bfs", "meta_sync_on_fsync",
+                            &config->meta_sync_on_fsync_, true);
+  ini.GetBoolValueOrDefault("bfs", "meta_sync_on_close",
+                            &config->meta_sync_on_close_, false);
+  SPDLOG_INFO("meta flush interval: {}ms sync on fsync: {} sync on close: {}",
+              config->meta_flush_interval_ms_, config->meta_sync_on_fsync_,
+              config->meta_sync_on_close_);
+  ini.GetBoolValueOrDefault("bfs", "stats_enable", &config->stats_enable_,
+                            true);
+  SPDLOG_INFO("stats enable: {}", config->stats_enable_);
+
+  // block_fs_mount会用命令行的-m覆盖, 这里给进程内客户端的LD_PRELOAD用
+  ini.GetStringValueOrDefault("fuse", "fuse_mount_point",
+                              &config->fuse_mount_point, "");
+  SPDLOG_INFO("fuse mount point: {}", config->fuse_mount_point);
+
+  ini.GetBoolValueOrDefault("fuse", "fuse_low_level", &config->fuse_low_level_,
+                            true);
+  ini.GetDoubleValueOrDefault("fuse", "fuse_entry_timeout",
+                              &config->fuse_entry_timeout_, 1.0);
+  ini.GetDoubleValueOrDefault("fuse", "fuse_attr_timeout",
+                              &config->fuse_attr_timeout_, 1.0);
+  config->fuse_entry_timeout_ = std::max(config->fuse_entry_timeout_, 0.0);
+  config->fuse_attr_timeout_ = std::max(config->fuse_attr_timeout_, 0.0);
+  SPDLOG_INFO("fuse low level: {} entry timeout: {}s attr timeout: {}s",
+              config->fuse_low_level_, config->fuse_entry_timeout_,
+              config->fuse_attr_timeout_);
+
+  ini.GetBoolValueOrDefault("fuse", "fuse_debug", &config->fuse_debug_, false);
+  int fuse_max_threads;
+  ini.GetIntValueOrDefault("fuse", "fuse_max_threads", &fuse_max_threads, 0);
+  // 默认和设备队列深度一致, 并发的fuse请求正好能填满io队列
+  config->fuse_max_threads_ = fuse_max_threads > 0
+                                  ? static_cast<uint32_t>(fuse_max_threads)
+                                  : std::max(config->io_depth_, 1U);
+  int fuse_max_idle_threads;
+  ini.GetIntValueOrDefault("fuse", "fuse_max_idle_threads",
+                           &fuse_max_idle_threads, -1);
+  config->fuse_max_idle_threads_ = fuse_max_idle_threads;
+  ini.GetBoolValueOrDefault("fuse", "fuse_clone_fd", &config->fuse_clone_fd_,
+                            true);
+  int fuse_max_read, fuse_max_write, fuse_max_pages;
+  ini.GetIntValueOrDefault("fuse", "fuse_max_read", &fuse_max_read, 0);
+  ini.GetIntValueOrDefault("fuse", "fuse_max_write", &fuse_max_write,
+                           1 << 20);
+  ini.GetIntValueOrDefault("fuse", "fuse_max_pages", &fuse_max_pages, 0);
+  config->fuse_max_read_ = std::max(fuse_max_read, 0);
+  config->fuse_max_write_ = std::max(fuse_max_write, 0);
+  config->fuse_max_pages_ = std::max(fuse_max_pages, 0);
+  ini.GetBoolValueOrDefault("fuse", "fuse_writeback_cache",
+                            &config->fuse_writeback_cache_, false);
+  ini.GetBoolValueOrDefault("fuse", "fuse_splice_read",
+                            &config->fuse_splice_read_, false);
+  ini.GetBoolValueOrDefault("fuse", "fuse_splice_write",
+                            &config->fuse_splice_write_, false);
+  ini.GetBoolValueOrDefault("fuse", "fuse_splice_move",
+                            &config->fuse_splice_move_, false);
+  ini.GetBoolValueOrDefault("fuse", "fuse_async_read",
+                            &config->fuse_async_read_, true);
+  SPDLOG_INFO(
+      "fuse debug: {} max threads: {} max idle threads: {} clone fd: {} "
+      "max read: {} max write: {} max pages: {} writeback cache: {} "
+      "splice read: {} write: {} move: {} async read: {}",
+      config->fuse_debug_, config->fuse_max_threads_,
+      config->fuse_max_idle_threads_, config->fuse_clone_fd_,
+      config->fuse_max_read_, config->fuse_max_write_, config->fuse_max_pages_,
+      config->fuse_writeback_cache_, config->fuse_splice_read_,
+      config->fuse_splice_write_, config->fuse_splice_move_,
+      config->fuse_async_read_);
 
   return true;
 }
@@ -0,0 +1,242 @@
+#include "crc.h"
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+
+#include <string.h>
+
+namespace {
+
+// CRC32C(Castagnoli)多项式, bit反转表示
+constexpr uint32_t kCrc32cPoly = 0x82F63B78;
+
+// 软件实现用的slicing-by-8表, 第一次使用时生成
+struct Crc32cTable {
+  uint32_t table_[8][256];
+
+  Crc32cTable() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int k = 0; k < 8; ++k) {
+        crc = (crc & 1) ? (crc >> 1) ^ kCrc32cPoly : crc >> 1;
+      }
+      table_[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+      for (int k = 1; k < 8; ++k) {
+        table_[k][i] =
+            (table_[k - 1][i] >> 8) ^ table_[0][table_[k - 1][i] & 0xFF];
+      }
+    }
+  }
+};
+
+const Crc32cTable &GetCrc32cTable() {
+  static const Crc32cTable table;
+  return table;
+}
+
+inline uint64_t LoadU64(const uint8_t *p) {
+  uint64_t v;
+  ::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// 参数和返回值都是没有取反的crc寄存器
+uint32_t Crc32cSoftware(uint32_t crc, const uint8_t *p, size_t len) {
+  const auto &t = GetCrc32cTable().table_;
+  while (len > 0 && (reinterpret_cast<uintptr_t>(p) & 7) != 0) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+    --len;
+  }
+  while (len >= 8) {
+    uint64_t v = LoadU64(p) ^ crc;
+    crc = t[7][v & 0xFF] ^ t[6][(v >> 8) & 0xFF] ^ t[5][(v >> 16) & 0xFF] ^
+          t[4][(v >> 24) & 0xFF] ^ t[3][(v >> 32) & 0xFF] ^
+          t[2][(v >> 40) & 0xFF] ^ t[1][(v >> 48) & 0xFF] ^ t[0][v >> 56];
+    p += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+    --len;
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+
+// GF(2)上的乘法取模, a和b都是bit反转表示
+uint32_t MultModP(uint32_t a, uint32_t b) {
+  uint32_t m = 1U << 31;
+  uint32_t p = 0;
+  while (true) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0) {
+        break;
+      }
+    }
+    m >>= 1;
+    b = (b & 1) ? (b >> 1) ^ kCrc32cPoly : b >> 1;
+  }
+  return p;
+}
+
+// x^n mod P
+uint32_t XPowModP(uint32_t n) {
+  uint32_t p = 1U << 31;  // x^0
+  uint32_t x = 1U << 30;  // x^1
+  while (n > 0) {
+    if (n & 1) {
+      p = MultModP(x, p);
+    }
+    x = MultModP(x, x);
+    n >>= 1;
+  }
+  return p;
+}
+
+// 三路并行计算时每一路的长度, 4K的元数据页走kLong + kShort + 剩余的256B
+constexpr size_t kLong = 1024;
+constexpr size_t kShort = 256;
+
+// clmul(crc, k)的结果再经过一次crc32指令等于crc * k * x^33 mod P,
+// 所以把crc往后推n字节需要的常数是x^(8n - 33) mod P
+struct ShiftConstants {
+  uint64_t long1_, long2_;
+  uint64_t short1_, short2_;
+
+  ShiftConstants()
+      : long1_(XPowModP(kLong * 8 - 33)),
+        long2_(XPowModP(kLong * 2 * 8 - 33)),
+        short1_(XPowModP(kShort * 8 - 33)),
+        short2_(XPowModP(kShort * 2 * 8 - 33)) {}
+};
+
+const ShiftConstants &GetShiftConstants() {
+  static const ShiftConstants constants;
+  return constants;
+}
+
+__attribute__((target("sse4.2,pclmul"))) inline uint32_t ShiftCrc(
+    uint32_t crc, uint64_t k) {
+  __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+                                         _mm_cvtsi64_si128(k), 0x00);
+  return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+}
+
+// 三路数据互相没有依赖, 可以填满crc32指令的流水线, 最后用pclmul合并
+__attribute__((target("sse4.2,pclmul"))) inline uint32_t Crc32cBlocks(
+    uint32_t crc, const uint8_t **p, size_t *len, size_t block, uint64_t k1,
+    uint64_t k2) {
+  while (*len >= block * 3) {
+    uint64_t crc0 = crc;
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    const uint8_t *p0 = *p;
+    const uint8_t *p1 = p0 + block;
+    const uint8_t *p2 = p1 + block;
+    for (size_t i = 0; i < block; i += 8) {
+      crc0 = _mm_crc32_u64(crc0, LoadU64(p0 + i));
+      crc1 = _mm_crc32_u64(crc1, LoadU64(p1 + i));
+      crc2 = _mm_crc32_u64(crc2, LoadU64(p2 + i));
+    }
+    crc = ShiftCrc(crc0, k2) ^ ShiftCrc(crc1, k1) ^ crc2;
+    *p += block * 3;
+    *len -= block * 3;
+  }
+  return crc;
+}
+
+__attribute__((target("sse4.2,pclmul"))) uint32_t Crc32cPclmul(
+    uint32_t crc, const uint8_t *p, size_t len) {
+  const ShiftConstants &k = GetShiftConstants();
+  while (len > 0 && (reinterpret_cast<uintptr_t>(p) & 7) != 0) {
+    crc = _mm_crc32_u8(crc, *p++);
+    --len;
+  }
+  crc = Crc32cBlocks(crc, &p, &len, kLong, k.long1_, k.long2_);
+  crc = Crc32cBlocks(crc, &p, &len, kShort, k.short1_, k.short2_);
+  uint64_t crc64 = crc;
+  while (len >= 8) {
+    crc64 = _mm_crc32_u64(crc64, LoadU64(p));
+    p += 8;
+    len -= 8;
+  }
+  crc = crc64;
+  while (len > 0) {
+    crc = _mm_crc32_u8(crc, *p++);
+    --len;
+  }
+  return crc;
+}
+
+__attribute__((target("sse4.2"))) uint32_t Crc32cSse42(uint32_t crc,
+                                                         const uint8_t *p,
+                                                         size_t len) {
+  uint64_t crc64 = crc;
+  while (len >= 8) {
+    crc64 = _mm_crc32_u64(crc64, LoadU64(p));
+    p += 8;
+    len -= 8;
+  }
+  crc = crc64;
+  while (len > 0) {
+    crc = _mm_crc32_u8(crc, *p++);
+    --len;
+  }
+  return crc;
+}
+
+#elif defined(__aarch64__)
+
+__attribute__((target("+crc"))) uint32_t Crc32cArm(uint32_t crc,
+                                                     const uint8_t *p,
+                                                     size_t len) {
+  while (len >= 8) {
+    crc = __crc32cd(crc, LoadU64(p));
+    p += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    crc = __crc32cb(crc, *p++);
+    --len;
+  }
+  return crc;
+}
+
+#endif
+
+using Crc32cFunc = uint32_t (*)(uint32_t, const uint8_t *, size_t);
+
+Crc32cFunc ChooseCrc32c() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_PCLMUL)) {
+      return Crc32cPclmul;
+    }
+    return Crc32cSse42;
+  }
+#elif defined(__aarch64__) && defined(HWCAP_CRC32)
+  if (::getauxval(AT_HWCAP) & HWCAP_CRC32) {
+    return Crc32cArm;
+  }
+#endif
+  return Crc32cSoftware;
+}
+
+}  // namespace
+
+uint32_t Crc32c(uint32_t crc, const uint8_t *chunk, size_t len) {
+  static const Crc32cFunc func = ChooseCrc32c();
+  return ~func(~crc, chunk, len);
+}
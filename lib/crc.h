@@ -9,6 +9,14 @@ inline uint32_t Crc32(uint8_t *chunk, size_t len) {
   return crc;
 }
 
+// CRC32C(Castagnoli), 运行时选择SSE4.2+PCLMUL/ARMv8 CRC指令, 都不支持时查表
+// 和zlib的crc32一样可以在多个数据块上累积计算, 第一次传入的crc为0
+uint32_t Crc32c(uint32_t crc, const uint8_t *chunk, size_t len);
+
+inline uint32_t Crc32c(const uint8_t *chunk, size_t len) {
+  return Crc32c(0, chunk, len);
+}
+
 /*
 在 zlib 库中，crc32 函数的设计允许你在多个数据块上累积计算 CRC。第一次调用 crc32 函数是为了初始化 CRC 值，第二次调用则是为了计算给定数据块的 CRC。
 
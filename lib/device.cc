@@ -2,11 +2,19 @@
 
 #include <fcntl.h>
 #include <limits.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/uio.h>
 #include <linux/fs.h>
 
+#include <algorithm>
+#include <latch>
+
+#include "io_uring_engine.h"
 #include "logging.h"
+#include "spdlog/spdlog.h"
+#include "stats.h"
+#include "thread_pool.h"
 
 namespace udisk::blockfs {
 
@@ -19,6 +27,14 @@ static const int kBlkOpenWithDirect =
     O_RDWR | O_LARGEFILE | O_DIRECT | O_CLOEXEC;
 static const int kBlkOpenWithoutDirect = O_RDWR | O_LARGEFILE | O_CLOEXEC;
 
+// io_uring注册文件的下标
+static const int kEngineFileDirect = 0;
+static const int kEngineFileCache = 1;
+static const uint32_t kDefaultIoDepth = 64;
+// 每个线程允许排队的段数
+static const uint32_t kIoPoolQueuePerThread = 64;
+static const uint32_t kImageSectorSize = 4096;
+
 inline void incr(int64_t /* n */) {}
 inline void incr(int64_t n, off_t &offset) { offset += off_t(n); }
 
@@ -60,6 +76,52 @@ ssize_t pwriteFull(int fd, const void* buf, size_t count, off_t offset) {
   return wrapFull(pwrite, fd, const_cast<void*>(buf), count, offset);
 }
 
+// 和wrapFull一样补齐短IO, 第一个iovec只完成一部分的时候复制一份再调整
+template <class F>
+ssize_t wrapvFull(F f, int fd, const struct iovec* iov, int iovcnt,
+                  off_t offset) {
+  std::vector<struct iovec> rest;
+  ssize_t totalBytes = 0;
+  while (iovcnt > 0) {
+    ssize_t r = f(fd, iov, std::min(iovcnt, IOV_MAX), offset);
+    if (r == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return r;
+    }
+    if (r == 0) {  // EOF
+      break;
+    }
+    totalBytes += r;
+    offset += r;
+    while (iovcnt > 0 && static_cast<size_t>(r) >= iov->iov_len) {
+      r -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (r > 0) {
+      if (rest.empty()) {
+        rest.assign(iov, iov + iovcnt);
+        iov = rest.data();
+      }
+      struct iovec& first = rest[iov - rest.data()];
+      first.iov_base = static_cast<char*>(first.iov_base) + r;
+      first.iov_len -= r;
+    }
+  }
+  return totalBytes;
+}
+
+ssize_t preadvFull(int fd, const struct iovec* iov, int iovcnt, off_t offset) {
+  return wrapvFull(preadv, fd, iov, iovcnt, offset);
+}
+
+ssize_t pwritevFull(int fd, const struct iovec* iov, int iovcnt,
+                    off_t offset) {
+  return wrapvFull(pwritev, fd, iov, iovcnt, offset);
+}
+
 Device::~Device() { Close(); }
 
 bool Device::IsBlkDev() {
@@ -150,7 +212,46 @@ bool Device::Open(const std::string &dev_name) {
   return true;
 }
 
+bool Device::OpenImage(const std::string &path) {
+  struct stat file_stat;
+  if (::stat(path.c_str(), &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+    LOG(ERROR) << "given path not regular file: " << path;
+    errno = EINVAL;
+    return false;
+  }
+  dev_name_ = path;
+  dev_fd_direct_ = ::open(path.c_str(), kBlkOpenWithDirect);
+  if (dev_fd_direct_ < 0) {
+    LOG(ERROR) << "failed to open image: " << path << " errno: " << errno;
+    return false;
+  }
+  dev_fd_cache_ = ::open(path.c_str(), kBlkOpenWithoutDirect);
+  if (dev_fd_cache_ < 0) {
+    LOG(ERROR) << "failed to open image: " << path << " errno: " << errno;
+    return false;
+  }
+  dev_size_ = file_stat.st_size;
+  // O_DIRECT按照文件系统的块对齐, 4K对所有的文件系统都够
+  sector_size_ = kImageSectorSize;
+  LOG(DEBUG) << "open image " << path << " size: " << dev_size_;
+  return true;
+}
+
+bool Device::LockExclusive() {
+  if (::flock(dev_fd_direct_, LOCK_EX | LOCK_NB) < 0) {
+    if (errno == EWOULDBLOCK) {
+      errno = EBUSY;
+    }
+    LOG(ERROR) << "failed to lock device: " << dev_name_
+               << ", already mounted by other process? errno: " << errno;
+    return false;
+  }
+  return true;
+}
+
 void Device::Close() {
+  SetIoThreads(0);
+  DestroyEngines();
   if (dev_fd_cache_ > 0) {
     Fsync();
     ::close(dev_fd_cache_);
@@ -190,7 +291,10 @@ int64_t Device::PreadCache(void *buf, uint64_t len, off_t offset) {
                << " dev_size: " << dev_size_;
     return -1;
   }
-  return preadFull(dev_fd_cache_, buf, len, offset);
+  StatTimer timer(kStatDevReadCache);
+  int64_t ret = preadFull(dev_fd_cache_, buf, len, offset);
+  timer.set_bytes(ret);
+  return ret;
 }
 
 int64_t Device::PwriteCache(void *buf, uint64_t len, off_t offset) {
@@ -200,7 +304,10 @@ int64_t Device::PwriteCache(void *buf, uint64_t len, off_t offset) {
                << " dev_size: " << dev_size_;
     return -1;
   }
-  return pwriteFull(dev_fd_cache_, buf, len, offset);
+  StatTimer timer(kStatDevWriteCache);
+  int64_t ret = pwriteFull(dev_fd_cache_, buf, len, offset);
+  timer.set_bytes(ret);
+  return ret;
 }
 
 int64_t Device::PreadDirect(void *buf, uint64_t len, off_t offset) {
@@ -210,7 +317,10 @@ int64_t Device::PreadDirect(void *buf, uint64_t len, off_t offset) {
                << " dev_size: " << dev_size_;
     return -1;
   }
-  return preadFull(dev_fd_direct_, buf, len, offset);
+  StatTimer timer(kStatDevReadDirect);
+  int64_t ret = preadFull(dev_fd_direct_, buf, len, offset);
+  timer.set_bytes(ret);
+  return ret;
 }
 
 int64_t Device::PwriteDirect(void *buf, uint64_t len, off_t offset) {
@@ -220,6 +330,208 @@ int64_t Device::PwriteDirect(void *buf, uint64_t len, off_t offset) {
                << " dev_size: " << dev_size_;
     return -1;
   }
-  return pwriteFull(dev_fd_direct_, buf, len, offset);
+  StatTimer timer(kStatDevWriteDirect);
+  int64_t ret = pwriteFull(dev_fd_direct_, buf, len, offset);
+  timer.set_bytes(ret);
+  return ret;
+}
+
+IoEngineType Device::IoEngineConvert(const std::string &name) {
+  if (name == "io_uring") {
+    return kIoEngineIoUring;
+  }
+  return kIoEnginePsync;
+}
+
+bool Device::SetIoEngine(IoEngineType type, uint32_t depth) {
+  DestroyEngines();
+  io_depth_ = depth > 0 ? depth : kDefaultIoDepth;
+  io_engine_ = type;
+  if (type != kIoEngineIoUring) {
+    SPDLOG_INFO("device {} using psync io engine", dev_name_);
+    return true;
+  }
+  // 先试探一次, 内核不支持的时候退回psync
+  IoUringEngine *engine = NewEngine();
+  if (!engine) {
+    SPDLOG_WARN("device {} io_uring not available, fallback to psync",
+                dev_name_);
+    io_engine_ = kIoEnginePsync;
+    return false;
+  }
+  PutEngine(engine, false);
+  SPDLOG_INFO("device {} using io_uring io engine, depth: {}", dev_name_,
+              io_depth_);
+  return true;
+}
+
+void Device::SetIoThreads(uint32_t thread_num) {
+  if (io_pool_) {
+    delete io_pool_;
+    io_pool_ = nullptr;
+  }
+  if (thread_num > 0) {
+    io_pool_ = new ThreadPool("bfs_io", thread_num,
+                              thread_num * kIoPoolQueuePerThread);
+  }
+}
+
+IoUringEngine *Device::NewEngine() {
+  IoUringEngine *engine = new IoUringEngine();
+  if (!engine->Initialize(io_depth_)) {
+    delete engine;
+    return nullptr;
+  }
+  const int fds[] = {dev_fd_direct_, dev_fd_cache_};
+  static_assert(kEngineFileDirect == 0 && kEngineFileCache == 1);
+  if (!engine->RegisterFiles(fds, 2)) {
+    delete engine;
+    return nullptr;
+  }
+  return engine;
+}
+
+IoUringEngine *Device::GetEngine() {
+  {
+    std::lock_guard<std::mutex> lock(engine_mutex_);
+    if (!free_engines_.empty()) {
+      IoUringEngine *engine = free_engines_.back();
+      free_engines_.pop_back();
+      return engine;
+    }
+  }
+  return NewEngine();
+}
+
+void Device::PutEngine(IoUringEngine *engine, bool broken) {
+  {
+    std::lock_guard<std::mutex> lock(engine_mutex_);
+    if (!broken) {
+      free_engines_.push_back(engine);
+      return;
+    }
+  }
+  delete engine;
+}
+
+void Device::DestroyEngines() {
+  std::lock_guard<std::mutex> lock(engine_mutex_);
+  for (IoUringEngine *engine : free_engines_) {
+    delete engine;
+  }
+  free_engines_.clear();
+}
+
+bool Device::CheckRange(const DeviceIo *ios, uint32_t num) {
+  for (uint32_t i = 0; i < num; ++i) {
+    if ((ios[i].offset + ios[i].len) > dev_size_) [[unlikely]] {
+      LOG(ERROR) << "device size is less than (offset + length),"
+                 << " offset: " << ios[i].offset << " length: " << ios[i].len
+                 << " dev_size: " << dev_size_;
+      return false;
+    }
+  }
+  return true;
+}
+
+int32_t Device::TransferFd(const DeviceIo *ios, uint32_t num, bool direct) {
+  if (!CheckRange(ios, num)) [[unlikely]] {
+    errno = EINVAL;
+    return -1;
+  }
+  return direct ? dev_fd_direct_ : dev_fd_cache_;
+}
+
+void Device::SyncBatch(DeviceIo *ios, uint32_t num, bool write, bool direct) {
+  int fd = direct ? dev_fd_direct_ : dev_fd_cache_;
+  auto do_io = [fd, ios, write](uint32_t i) {
+    ssize_t ret;
+    if (ios[i].iovcnt > 0) {
+      // 一个段对应用户的多个iovec, 一次preadv/pwritev
+      ret = write ? pwritevFull(fd, ios[i].iov, ios[i].iovcnt, ios[i].offset)
+                  : preadvFull(fd, ios[i].iov, ios[i].iovcnt, ios[i].offset);
+    } else {
+      ret = write ? pwriteFull(fd, ios[i].buf, ios[i].len, ios[i].offset)
+                  : preadFull(fd, ios[i].buf, ios[i].len, ios[i].offset);
+    }
+    ios[i].ret = ret < 0 ? -errno : ret;
+  };
+
+  if (io_pool_ && num > 1) {
+    // 第一个段在当前线程执行, 其余的段交给线程池, 全部完成才返回
+    std::latch done(num - 1);
+    for (uint32_t i = 1; i < num; ++i) {
+      io_pool_->Submit([&do_io, &done, i] {
+        do_io(i);
+        done.count_down();
+      });
+    }
+    do_io(0);
+    done.wait();
+    return;
+  }
+
+  for (uint32_t i = 0; i < num; ++i) {
+    do_io(i);
+    if (ios[i].ret != static_cast<int64_t>(ios[i].len)) {
+      // 顺序执行的时候后面的段没必要再继续
+      for (uint32_t j = i + 1; j < num; ++j) {
+        ios[j].ret = 0;
+      }
+      break;
+    }
+  }
+}
+
+int64_t Device::SubmitBatch(DeviceIo *ios, uint32_t num, bool write,
+                            bool direct) {
+  if (num == 0) [[unlikely]] {
+    return 0;
+  }
+  if (!CheckRange(ios, num)) [[unlikely]] {
+    errno = EINVAL;
+    return -1;
+  }
+  StatTimer timer(write ? (direct ? kStatDevWriteDirect : kStatDevWriteCache)
+                        : (direct ? kStatDevReadDirect : kStatDevReadCache));
+
+  bool submitted = false;
+  if (io_engine_ == kIoEngineIoUring && num > 1) {
+    IoUringEngine *engine = GetEngine();
+    if (engine) {
+      submitted = engine->SubmitAndWait(
+          ios, num, write, direct ? kEngineFileDirect : kEngineFileCache);
+      PutEngine(engine, !submitted || engine->broken());
+    }
+  }
+  if (!submitted) {
+    SyncBatch(ios, num, write, direct);
+  }
+
+  // 和pread/pwrite语义保持一致, 只统计从头开始连续完成的部分
+  int64_t total = 0;
+  for (uint32_t i = 0; i < num; ++i) {
+    if (ios[i].ret < 0) {
+      if (total == 0) {
+        errno = static_cast<int>(-ios[i].ret);
+        return -1;
+      }
+      break;
+    }
+    total += ios[i].ret;
+    if (ios[i].ret != static_cast<int64_t>(ios[i].len)) {
+      break;
+    }
+  }
+  timer.set_bytes(total);
+  return total;
+}
+
+int64_t Device::PreadBatch(DeviceIo *ios, uint32_t num, bool direct) {
+  return SubmitBatch(ios, num, false, direct);
+}
+
+int64_t Device::PwriteBatch(DeviceIo *ios, uint32_t num, bool direct) {
+  return SubmitBatch(ios, num, true, direct);
 }
 }
\ No newline at end of file
@@ -1,11 +1,35 @@
 #ifndef LIB_BLOCK_DEVICE_H_
 #define LIB_BLOCK_DEVICE_H_
 
+#include <sys/uio.h>
+
+#include <mutex>
+#include <vector>
+
 #include "comm_utils.h"
 #include "meta_defines.h"
 
 namespace udisk::blockfs {
 
+class IoUringEngine;
+class ThreadPool;
+
+enum IoEngineType {
+  kIoEnginePsync,
+  kIoEngineIoUring,
+};
+
+// 批量提交中的单个IO段
+struct DeviceIo {
+  void *buf;
+  uint64_t len;
+  uint64_t offset;
+  int64_t ret;  // 完成的字节数, 失败为-errno
+  // 非空时数据分散在这组iovec中(不超过IOV_MAX个), 长度之和是len, buf不用
+  const struct iovec *iov = nullptr;
+  uint32_t iovcnt = 0;
+};
+
 class Device {
  private:
   std::string dev_name_;
@@ -14,6 +38,23 @@ class Device {
   uint64_t dev_size_ = 0;
   uint32_t sector_size_ = 0;
 
+  // io_uring实例不支持多线程同时提交, 每次批量IO从池子里取一个
+  IoEngineType io_engine_ = kIoEnginePsync;
+  uint32_t io_depth_ = 0;
+  std::mutex engine_mutex_;
+  std::vector<IoUringEngine *> free_engines_;
+  // psync方式下多个段并发执行的线程池
+  ThreadPool *io_pool_ = nullptr;
+
+ private:
+  IoUringEngine *NewEngine();
+  IoUringEngine *GetEngine();
+  void PutEngine(IoUringEngine *engine, bool broken);
+  void DestroyEngines();
+  bool CheckRange(const DeviceIo *ios, uint32_t num);
+  void SyncBatch(DeviceIo *ios, uint32_t num, bool write, bool direct);
+  int64_t SubmitBatch(DeviceIo *ios, uint32_t num, bool write, bool direct);
+
  public:
   Device() {}
   virtual ~Device();
@@ -25,6 +66,11 @@ class Device {
   bool BlkDevGetSize();
   bool BlkDevGetSectorSize();
   bool Open(const std::string &dev_name);
+  // 普通文件当作设备使用, 用于测试
+  bool OpenImage(const std::string &path);
+  // 对设备加排他的flock, 已经被别的进程持有时返回false并设置EBUSY,
+  // 进程退出或者Close时内核自动释放
+  bool LockExclusive();
   void Close();
   int Fsync();
 
@@ -33,6 +79,21 @@ class Device {
 
   int64_t PreadDirect(void *buf, uint64_t len, off_t offset);
   int64_t PwriteDirect(void *buf, uint64_t len, off_t offset);
+
+  // 选择批量IO的后端: psync 或者 io_uring
+  bool SetIoEngine(IoEngineType type, uint32_t depth);
+  IoEngineType io_engine() const { return io_engine_; }
+  static IoEngineType IoEngineConvert(const std::string &name);
+  // psync方式下批量IO的并发线程数, 0表示在调用线程中顺序执行
+  void SetIoThreads(uint32_t thread_num);
+
+  // 批量读写, 返回从第一个段开始连续完成的字节数
+  // 第一个段就失败的时候返回-1并设置errno
+  int64_t PreadBatch(DeviceIo *ios, uint32_t num, bool direct);
+  int64_t PwriteBatch(DeviceIo *ios, uint32_t num, bool direct);
+  // 零拷贝时数据由调用者直接在设备fd上搬运(比如splice), 这里只检查范围
+  // 返回数据所在的fd, 越界时返回-1并设置errno
+  int32_t TransferFd(const DeviceIo *ios, uint32_t num, bool direct);
 };
 }
 #endif
\ No newline at end of file
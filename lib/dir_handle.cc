@@ -1,6 +1,8 @@
 #include <assert.h>
 #include <libgen.h>
 
+#include <algorithm>
+
 #include "crc.h"
 #include "file_system.h"
 #include "spdlog/spdlog.h"
@@ -10,57 +12,85 @@ namespace udisk::blockfs {
 const static DirectoryPtr kEmptyDirectoryPtr;
 
 bool DirHandle::InitializeMeta() {
-  DirMeta *meta;
-  for (ino_t dh = 0; dh < FileSystem::Instance()->super_meta()->max_file_num;
-       ++dh) {
-    meta = reinterpret_cast<DirMeta *>(
-        base_addr() +
-        FileSystem::Instance()->super_meta()->dir_meta_size_ * dh);
-    uint32_t crc = Crc32(reinterpret_cast<uint8_t *>(meta) + sizeof(meta->crc_),
-                         FileSystem::Instance()->super_meta()->dir_meta_size_ -
-                             sizeof(meta->crc_));
-    uint32_t meta_crc = meta->crc_;
-    if (meta->crc_ != crc) [[unlikely]] {
-      SPDLOG_ERROR("directory meta {} {} crc error, read: {} cal: {}", dh,
-                   meta->dir_name_, meta_crc, crc);
-      return false;
-    }
-
-    if (meta->used_) {
-      SPDLOG_DEBUG("directory handle: {} name: {} crc: {}", dh,
-                   meta->dir_name_, crc);
-      if (::strnlen(meta->dir_name_, sizeof(meta->dir_name_)) == 0)
-          [[unlikely]] {
-        SPDLOG_ERROR("directory meta {} used but name empty", dh);
+  // 分段并行校验, 再按段的顺序合并, 结果和顺序扫描一致
+  uint32_t part_num = FileSystem::Instance()->scan_part_num();
+  std::vector<std::vector<DirectoryPtr>> part_dirs(part_num);
+  std::vector<std::list<ino_t>> part_free_dhs(part_num);
+  auto scan = [&](uint32_t part, uint64_t begin, uint64_t end) {
+    uint64_t dir_meta_size = FileSystem::Instance()->super_meta()->dir_meta_size_;
+    for (ino_t dh = begin; dh < static_cast<ino_t>(end); ++dh) {
+      DirMeta *meta =
+          reinterpret_cast<DirMeta *>(base_addr() + dir_meta_size * dh);
+      uint32_t crc = FileSystem::Instance()->MetaCrc(
+          reinterpret_cast<uint8_t *>(meta) + sizeof(meta->crc_),
+          dir_meta_size - sizeof(meta->crc_));
+      uint32_t meta_crc = meta->crc_;
+      if (meta->crc_ != crc) [[unlikely]] {
+        SPDLOG_ERROR("directory meta {} {} crc error, read: {} cal: {}", dh,
+                     meta->dir_name_, meta_crc, crc);
         return false;
       }
-      if (meta->dh_ != static_cast<ino_t>(dh)) [[unlikely]] {
-        SPDLOG_ERROR("directory meta {} used but dh invalid", dh);
+
+      if (meta->used_) {
+        SPDLOG_DEBUG("directory handle: {} name: {} crc: {}", dh,
+                     meta->dir_name_, crc);
+        if (::strnlen(meta->dir_name_, sizeof(meta->dir_name_)) == 0)
+            [[unlikely]] {
+          SPDLOG_ERROR("directory meta {} used but name empty", dh);
+          return false;
+        }
+        if (meta->dh_ != static_cast<ino_t>(dh)) [[unlikely]] {
+          SPDLOG_ERROR("directory meta {} used but dh invalid", dh);
+          return false;
+        }
+        part_dirs[part].push_back(std::make_shared<Directory>(meta));
+      } else {
+        part_free_dhs[part].push_back(dh);
+      }
+    }
+    return true;
+  };
+  if (!FileSystem::Instance()->ParallelScan(
+          FileSystem::Instance()->super_meta()->max_file_num, scan)) {
+    return false;
+  }
+  // 磁盘上存的是全路径, 用临时的全路径映射找到父文件夹,
+  // 把子文件夹加入到父文件夹里面, 建立目录树
+  std::unordered_map<std::string, DirectoryPtr> path_dirs;
+  for (uint32_t part = 0; part < part_num; ++part) {
+    for (const DirectoryPtr &dir : part_dirs[part]) {
+      path_dirs.emplace(TrimDirName(dir->dir_name()), dir);
+    }
+    free_dhs_.splice(free_dhs_.end(), part_free_dhs[part]);
+  }
+  for (const auto &dirs : part_dirs) {
+    for (const DirectoryPtr &dir : dirs) {
+      // 挂载点没有父目录
+      if (IsMountPoint(dir->dir_name())) [[unlikely]] {
+        continue;
+      }
+      std::string dir_name = dir->dir_name();
+      std::string_view path = TrimDirName(dir_name);
+      std::string_view parent_dir_name = TrimDirName(GetDirNameView(path));
+      auto it = path_dirs.find(std::string(parent_dir_name));
+      if (it == path_dirs.end()) [[unlikely]] {
+        SPDLOG_ERROR("parent directory of {} not exist", dir_name);
         return false;
       }
-      DirectoryPtr dir = std::make_shared<Directory>(meta);
-      if (!dir || !AddDirectory2CreateNolock(dir)) {
+      dir->set_dentry(it->second->dh(), GetFileNameView(path));
+      SPDLOG_DEBUG("add child directory: {} to parent: {}", dir_name,
+                   it->first);
+      if (!it->second->AddChildDirectoryNolock(dir)) {
         return false;
       }
-    } else {
-      free_dhs_.push_back(dh);
     }
   }
-
-  // 扫面所有文件夹,把子文件夹加入到父文件夹里面
   // 后面扫面文件的时候, 再把子文件加到父文件中.
-  for (const auto &d : created_dirs_) {
-    // 挂载点没有父目录
-    if (IsMountPoint(d.second->dir_name())) [[unlikely]] {
-      continue;
-    }
-    std::string dir_name = d.second->dir_name();
-    std::string parent_dir_name = GetDirName(dir_name);
-    SPDLOG_DEBUG("add child directory: {} to parent: {}", dir_name,
-                 parent_dir_name);
-    const DirectoryPtr &parent_dir = GetCreatedDirectoryNolock(parent_dir_name);
-    if (!parent_dir || !parent_dir->AddChildDirectoryNolock(d.second)) {
-      return false;
+  for (const auto &dirs : part_dirs) {
+    for (const DirectoryPtr &dir : dirs) {
+      if (!AddDirectory2CreateNolock(dir)) {
+        return false;
+      }
     }
   }
 
@@ -95,9 +125,10 @@ bool DirHandle::FormatAllMeta() {
         FileSystem::Instance()->super_meta()->dir_meta_size_ * dh);
     meta->used_ = false;
     meta->dh_ = dh;
-    meta->crc_ = Crc32(reinterpret_cast<uint8_t *>(meta) + sizeof(meta->crc_),
-                       FileSystem::Instance()->super_meta()->dir_meta_size_ -
-                           sizeof(meta->crc_));
+    meta->crc_ = FileSystem::Instance()->MetaCrc(
+        reinterpret_cast<uint8_t *>(meta) + sizeof(meta->crc_),
+        FileSystem::Instance()->super_meta()->dir_meta_size_ -
+            sizeof(meta->crc_));
   }
   int64_t ret = FileSystem::Instance()->dev()->PwriteDirect(
       buffer->data(), dir_meta_total_size,
@@ -131,7 +162,7 @@ bool DirHandle::TransformPath(const std::string &path, std::string &dir_name) {
  *
  * \param dirname UXDB-UDISK约定: DB创建的绝对目录
  */
-bool DirHandle::IsMountPoint(const std::string &dirname) const noexcept {
+bool DirHandle::IsMountPoint(std::string_view dirname) const noexcept {
   return dirname == "/";
 }
 
@@ -140,24 +171,18 @@ bool DirHandle::IsMountPoint(const std::string &dirname) const noexcept {
  *
  * \param dirname UXDB-UDISK约定: DB创建的绝对目录
  */
-bool DirHandle::CheckFileExist(const std::string &dirname,
+bool DirHandle::CheckFileExist(std::string_view dirname,
                                bool check_parent) const noexcept {
   if (!IsMountPoint(dirname)) {
-    std::string path = dirname;
-    if (path[path.size() - 1] == '/') {
-      path.erase(path.size() - 1);
-    }
+    std::string_view path = TrimDirName(dirname);
     // 检查同名的文件是否存在
     if (FileSystem::Instance()->file_handle()->GetCreatedFile(path)) {
       SPDLOG_ERROR("the same file path exist: {}", dirname);
       errno = check_parent ? EEXIST : ENOTDIR;
       return false;
     }
-    std::string parent_path = GetDirName(dirname);
+    std::string_view parent_path = TrimDirName(GetDirNameView(path));
     if (!IsMountPoint(parent_path) && check_parent) {
-      if (parent_path[parent_path.size() - 1] == '/') {
-        parent_path.erase(parent_path.size() - 1);
-      }
       // 检查上一层是否目录是否存在并且为文件
       if (FileSystem::Instance()->file_handle()->GetCreatedFile(parent_path)) {
         SPDLOG_ERROR("the same parent path file exist: {}", dirname);
@@ -218,68 +243,83 @@ DirectoryPtr DirHandle::NewFreeDirectoryNolock(const std::string &dirname) {
 }
 
 /**
- * 分配新的文件夹
+ * 分配新的文件夹, 需要在mutex_里面
  *
  * \param dirname UXDB-UDISK约定: DB创建的绝对目录
  * \param dirs 返回父文件夹和新申请文件夹
  *
  * \return strip success or failed
  */
-bool DirHandle::NewDirectory(const std::string &dirname,
-                             std::pair<DirectoryPtr, DirectoryPtr> *dirs) {
-  std::lock_guard lock(mutex_);
-  if (created_dirs_.contains(dirname)) [[unlikely]] {
+bool DirHandle::NewDirectoryNolock(const std::string &dirname,
+                                   std::pair<DirectoryPtr, DirectoryPtr> *dirs) {
+  std::string_view path = TrimDirName(dirname);
+  if (LookupDirectory(path)) [[unlikely]] {
     SPDLOG_ERROR("directory has already exist: {}", dirname);
     errno = EEXIST;
     return false;
   }
+  std::string dir_name = dirname;
+  std::string_view name;
   if (!IsMountPoint(dirname)) {
-    std::string parent_dir_name = GetDirName(dirname);
-    auto itor = created_dirs_.find(parent_dir_name);
-    if (itor == created_dirs_.end()) [[unlikely]] {
+    std::string_view parent_dir_name = GetDirNameView(path);
+    // 找到父文件夹
+    dirs->first = LookupDirectory(parent_dir_name);
+    if (!dirs->first) [[unlikely]] {
       SPDLOG_ERROR("parent directory not exist: {}", parent_dir_name);
       errno = ENOENT;
       return false;
     }
-    // 找到父文件夹
-    dirs->first = itor->second;
+    // 用父文件夹的全路径拼接, 磁盘上存的路径和目录树保持一致
+    name = GetFileNameView(path);
+    dir_name = dirs->first->dir_name();
+    dir_name.append(name).push_back('/');
   }
 
-  DirectoryPtr dir = NewFreeDirectoryNolock(dirname);
+  DirectoryPtr dir = NewFreeDirectoryNolock(dir_name);
   if (!dir) {
     SPDLOG_ERROR("failed to new directory, dirname: {}", dirname);
     return false;
   }
+  if (dirs->first) {
+    dir->set_dentry(dirs->first->dh(), name);
+  }
   dirs->second = dir;
   return true;
 }
 
 bool DirHandle::AddDirectory2CreateNolock(const DirectoryPtr &child) {
   // 当前文件夹加入内存映射表
-  if (created_dirs_.contains(child->dir_name())) {
-    SPDLOG_CRITICAL("directory name has exist, name: {}", child->dir_name());
+  if (created_dhs_.Contains(child->dh())) {
+    SPDLOG_CRITICAL("directory dh has exist, name: {}", child->dir_name());
     return false;
   }
-  if (created_dhs_.contains(child->dh())) {
-    SPDLOG_CRITICAL("directory dh has exist, name: {}", child->dir_name());
+  if (IsMountPoint(child->dir_name())) [[unlikely]] {
+    if (root_) {
+      SPDLOG_CRITICAL("mount point has exist, dh: {}", root_->dh());
+      return false;
+    }
+    root_ = child;
+  } else if (!created_dentries_.Insert(
+                 FileNameKey(child->parent_dh(), child->name()), child)) {
+    SPDLOG_CRITICAL("directory name has exist, name: {}", child->dir_name());
     return false;
   }
-  created_dirs_[child->dir_name()] = child;
-  created_dhs_[child->dh()] = child;
+  created_dhs_.InsertOrAssign(child->dh(), child);
   return true;
 }
 
-bool DirHandle::AddDirectory(const DirectoryPtr &parent,
-                             const DirectoryPtr &child) {
+bool DirHandle::AddDirectoryNolock(const DirectoryPtr &parent,
+                                   const DirectoryPtr &child) {
   // 创建的目录不是挂载点的根目录才更新内存文件映射
   if (!IsMountPoint(child->dir_name())) {
     if (!parent->AddChildDirectory(child)) {
       return false;
     }
   }
-  std::lock_guard lock(mutex_);
   if (!AddDirectory2CreateNolock(child)) {
-    assert(!parent->RemovChildDirectory(child));
+    if (parent) {
+      parent->RemovChildDirectory(child);
+    }
     return false;
   }
   return true;
@@ -287,90 +327,143 @@ bool DirHandle::AddDirectory(const DirectoryPtr &parent,
 
 bool DirHandle::FindDirectory(const std::string &dirname,
                               std::pair<DirectoryPtr, DirectoryPtr> *dirs) {
-  std::lock_guard lock(mutex_);
-  std::string parent_dir_name = GetDirName(dirname);
-  auto itor = created_dirs_.find(parent_dir_name);
-  if (itor == created_dirs_.end()) [[unlikely]] {
-    SPDLOG_ERROR("parent directory not exist: {}", parent_dir_name);
+  dirs->second = LookupDirectory(dirname);
+  if (!dirs->second) [[unlikely]] {
+    SPDLOG_ERROR("directory not exist: {}", dirname);
     errno = ENOENT;
     return false;
   }
-  dirs->first = itor->second;
 
-  itor = created_dirs_.find(dirname);
-  if (itor == created_dirs_.end()) [[unlikely]] {
-    SPDLOG_ERROR("directory not exist: {}", dirname);
+  dirs->first = created_dhs_.Find(dirs->second->parent_dh());
+  if (!dirs->first) [[unlikely]] {
+    SPDLOG_ERROR("parent directory not exist: {}", dirname);
     errno = ENOENT;
     return false;
   }
-  dirs->second = itor->second;
   return true;
 }
 
 bool DirHandle::RemoveDirectoryFromCreateNolock(const DirectoryPtr &child) {
   // 从创建文件的映射中删除
-  if (created_dirs_.erase(child->dir_name()) != 1) {
+  if (child == root_) [[unlikely]] {
+    root_.reset();
+  } else if (!created_dentries_.Erase(
+                 FileNameKeyView(child->parent_dh(), child->name()))) {
     SPDLOG_ERROR("failed to remove directory name map: {}", child->dir_name());
     return false;
   }
-  if (created_dhs_.erase(child->dh()) != 1) {
+  if (!created_dhs_.Erase(child->dh())) {
     SPDLOG_ERROR("failed to remove directory dh map: {}", child->dir_name());
     return false;
   }
   return true;
 }
 
-bool DirHandle::RemoveDirectory(const DirectoryPtr &parent,
-                                const DirectoryPtr &child) {
+bool DirHandle::RenameDirectoryNolock(const DirectoryPtr &child,
+                                      const DirectoryPtr &new_parent,
+                                      std::string_view new_name) {
+  DirectoryPtr old_parent = created_dhs_.Find(child->parent_dh());
+  if (!old_parent) [[unlikely]] {
+    SPDLOG_ERROR("old parent directory not exist: {}", child->parent_dh());
+    errno = ENOENT;
+    return false;
+  }
+  if (!created_dentries_.Insert(FileNameKey(new_parent->dh(), new_name),
+                                child)) [[unlikely]] {
+    SPDLOG_ERROR("directory name has exist, name: {}", new_name);
+    errno = EEXIST;
+    return false;
+  }
+  if (!created_dentries_.Erase(
+          FileNameKeyView(child->parent_dh(), child->name()))) [[unlikely]] {
+    SPDLOG_ERROR("failed to remove directory name map: {}", child->name());
+    created_dentries_.Erase(FileNameKeyView(new_parent->dh(), new_name));
+    errno = ENOENT;
+    return false;
+  }
+  if (old_parent != new_parent) {
+    old_parent->RemovChildDirectory(child);
+    new_parent->AddChildDirectory(child);
+  }
+  child->set_dentry(new_parent->dh(), new_name);
+  return true;
+}
+
+bool DirHandle::RemoveDirectoryNolock(const DirectoryPtr &parent,
+                                      const DirectoryPtr &child) {
   if (!parent->RemovChildDirectory(child)) {
     return false;
   }
-  std::lock_guard lock(mutex_);
   return RemoveDirectoryFromCreateNolock(child);
 }
 
-const DirectoryPtr &DirHandle::GetOpenDirectory(ino_t fd) {
-  std::lock_guard lock(mutex_);
-  auto itor = open_dirs_.find(fd);
-  if (itor == open_dirs_.end()) [[unlikely]] {
+DirectoryPtr DirHandle::GetOpenDirectory(ino_t fd) {
+  DirectoryPtr dir = FileSystem::Instance()->fd_handle()->GetDirectory(fd);
+  if (!dir) [[unlikely]] {
     SPDLOG_ERROR("directory not been opened: {}", fd);
-    return kEmptyDirectoryPtr;
   }
-  return itor->second;
+  return dir;
 }
 
-const DirectoryPtr &DirHandle::GetCreatedDirectory(ino_t dh) {
-  std::lock_guard lock(mutex_);
+DirectoryPtr DirHandle::GetCreatedDirectory(ino_t dh) {
   return GetCreatedDirectoryNolock(dh);
 }
 
-const DirectoryPtr &DirHandle::GetCreatedDirectoryNolock(ino_t dh) {
-  auto itor = created_dhs_.find(dh);
-  if (itor == created_dhs_.end()) [[unlikely]] {
+DirectoryPtr DirHandle::GetCreatedDirectoryNolock(ino_t dh) {
+  DirectoryPtr dir = created_dhs_.Find(dh);
+  if (!dir) [[unlikely]] {
     SPDLOG_WARN("directory handle not exist: {}", dh);
-    return kEmptyDirectoryPtr;
   }
-  return itor->second;
+  return dir;
 }
 
-const DirectoryPtr &DirHandle::GetCreatedDirectory(const std::string &dirname) {
-  std::lock_guard lock(mutex_);
+// 从挂载点开始逐级查找, 每一级是一次(dh, 名字)的查找, 不拷贝字符串
+DirectoryPtr DirHandle::LookupDirectory(std::string_view path) const {
+  DirectoryPtr dir = root_;
+  std::size_t pos = 0;
+  while (dir && pos < path.size()) {
+    if (path[pos] == '/') {
+      ++pos;
+      continue;
+    }
+    std::size_t end = path.find('/', pos);
+    if (end == std::string_view::npos) {
+      end = path.size();
+    }
+    dir = created_dentries_.Find(
+        FileNameKeyView(dir->dh(), path.substr(pos, end - pos)));
+    pos = end;
+  }
+  return dir;
+}
+
+DirectoryPtr DirHandle::GetCreatedDirectory(std::string_view dirname) {
   return GetCreatedDirectoryNolock(dirname);
 }
 
-const DirectoryPtr &DirHandle::GetCreatedDirectoryNolock(
-    const std::string &dirname) {
-  std::string dir_name;
-  if (!TransformPath(dirname, dir_name)) {
-    SPDLOG_ERROR("directory path transform failed: {}", dirname);
+DirectoryPtr DirHandle::GetChildDirectory(ino_t parent_dh,
+                                          std::string_view name) const {
+  return created_dentries_.Find(FileNameKeyView(parent_dh, name));
+}
+
+DirectoryPtr DirHandle::GetCreatedDirectoryNolock(std::string_view dirname) {
+  if (dirname.empty()) [[unlikely]] {
+    errno = ENOENT;
     return kEmptyDirectoryPtr;
   }
-  auto itor = created_dirs_.find(dir_name);
-  if (itor == created_dirs_.end()) {
-    SPDLOG_WARN("directory not exist: {}", dir_name);
+  // 和TransformPath一样按带'/'的长度检查
+  std::size_t size = dirname.size() + (dirname.back() == '/' ? 0 : 1);
+  if (size >= kBlockFsMaxDirNameLen) [[unlikely]] {
+    SPDLOG_ERROR("directory path: {} too long, size: {} max limit: {}",
+                 dirname, size, kBlockFsMaxDirNameLen);
+    errno = ENAMETOOLONG;
     return kEmptyDirectoryPtr;
   }
-  return itor->second;
+  DirectoryPtr dir = LookupDirectory(dirname);
+  if (!dir) {
+    SPDLOG_WARN("directory not exist: {}", dirname);
+  }
+  return dir;
 }
 
 /**
@@ -417,18 +510,13 @@ int32_t DirHandle::DeleteDirectoryNolock(ino_t dh) {
   }
 
   // 删除内存文件夹
-  std::string parent_dir_name = GetDirName(dir->dir_name());
-  auto itor = created_dirs_.find(parent_dir_name);
-  if (itor == created_dirs_.end()) [[unlikely]] {
-    SPDLOG_ERROR("parent directory not exist: {}", parent_dir_name);
+  DirectoryPtr parent_dir = created_dhs_.Find(dir->parent_dh());
+  if (!parent_dir) [[unlikely]] {
+    SPDLOG_ERROR("parent directory not exist: {}", dir->parent_dh());
     errno = ENOENT;
     return -1;
   }
-  const DirectoryPtr &parent_dir = itor->second;
-  if (!parent_dir->RemovChildDirectory(dir)) {
-    return -1;
-  }
-  if (!RemoveDirectoryFromCreateNolock(dir)) {
+  if (!RemoveDirectoryNolock(parent_dir, dir)) {
     return -1;
   }
 
@@ -455,30 +543,34 @@ int32_t DirHandle::CreateDirectory(const std::string &path) {
     return -1;
   }
 
+  // 从分配到加入目录树都在mutex_里面, 父文件夹不会中途被重命名
+  std::lock_guard lock(mutex_);
+  // 和rename一样先mutex_后事务, 避免Flush拍到一半的页
+  MetaTransaction txn;
   // 申请新的文件夹元数据
   std::pair<DirectoryPtr, DirectoryPtr> dirs;
-  if (!NewDirectory(dir_name, &dirs)) {
+  if (!NewDirectoryNolock(dir_name, &dirs)) {
     return -1;
   }
   const DirectoryPtr &parent_dir = dirs.first;
   const DirectoryPtr &curr_dir = dirs.second;
 
-  {
-    std::lock_guard lock(mutex_);
-    // 持久化文件夹元数据
-    int retry_count = 0;
-    while (!curr_dir->WriteMeta()) {
-      if (++retry_count >= 3) {
-        // 重试3次后仍失败，返回错误
-        return -1;
-      }
-      // 可以在这里添加一些延时，避免立即重试
-      // std::this_thread::sleep_for(std::chrono::seconds(1));
+  // 持久化文件夹元数据
+  int retry_count = 0;
+  while (!curr_dir->WriteMeta()) {
+    if (++retry_count >= 3) {
+      // 重试3次后仍失败，返回错误
+      return -1;
     }
+    // 可以在这里添加一些延时，避免立即重试
+    // std::this_thread::sleep_for(std::chrono::seconds(1));
   }
 
   // 添加到内存文件夹
-  if (!AddDirectory(parent_dir, curr_dir)) {
+  if (!AddDirectoryNolock(parent_dir, curr_dir)) {
+    return -1;
+  }
+  if (!txn.Commit()) {
     return -1;
   }
 
@@ -512,6 +604,7 @@ int32_t DirHandle::DeleteDirectory(const std::string &path, bool recursive) {
     return -1;
   }
 
+  std::lock_guard lock(mutex_);
   // 查找已经创建的文件夹
   std::pair<DirectoryPtr, DirectoryPtr> dirs;
   if (!FindDirectory(dir_name, &dirs)) {
@@ -534,13 +627,13 @@ int32_t DirHandle::DeleteDirectory(const std::string &path, bool recursive) {
   }
 
   // 持久化删除文件夹元数据
-  if (!curr_dir->Suicide()) {
+  if (!curr_dir->SuicideNolock()) {
     // TODO:失败处理
     return -1;
   }
 
   // 删除内存文件夹
-  if (!RemoveDirectory(parent_dir, curr_dir)) {
+  if (!RemoveDirectoryNolock(parent_dir, curr_dir)) {
     return -1;
   }
 
@@ -580,7 +673,7 @@ int32_t DirHandle::RenameDirectory(const std::string &from,
   const DirectoryPtr &curr_dir = dirs.second;
 
   // 持久化文件夹元数据
-  if (!curr_dir->rename(to_dir_name)) {
+  if (curr_dir->rename(to_dir_name) != 0) {
     // TODO:失败处理
     return -1;
   }
@@ -603,13 +696,15 @@ BLOCKFS_DIR *DirHandle::OpenDirectory(const std::string &path) {
     errno = ENOENT;
     return nullptr;
   }
-  int32_t fd = FileSystem::Instance()->fd_handle()->get_fd();
+  return OpenDirectory(dir);
+}
+
+BLOCKFS_DIR *DirHandle::OpenDirectory(const DirectoryPtr &dir) {
+  int32_t fd = FileSystem::Instance()->fd_handle()->AllocFd(dir);
   if (fd < 0) {
     return nullptr;
   }
   BLOCKFS_DIR *d = new BLOCKFS_DIR();
-  // TODO
-  open_dirs_[fd] = dir;
   d->fd_ = fd;
   d->dir_ = dir;
   d->inited_ = false;
@@ -617,36 +712,86 @@ BLOCKFS_DIR *DirHandle::OpenDirectory(const std::string &path) {
   return d;
 }
 
+// 从快照的pos位置开始生成一批记录, 替换arena中原来的批次
+void DirHandle::FillDirentBatch(BLOCKFS_DIR *d, uint64_t pos) {
+  d->arena_.Reset();
+  d->offset_ = 0;
+  d->batch_begin_ = pos;
+  d->batch_end_ = std::min<uint64_t>(pos + kReadDirBatchNum, d->entry_num());
+  // 子文件夹的名字在rename时修改, 每一批只取一次全局锁
+  std::lock_guard lock(mutex_);
+  for (; pos < d->batch_end_; ++pos) {
+    if (pos < d->child_dirs_.size()) {
+      const DirectoryPtr &dir = d->child_dirs_[pos];
+      d->arena_.Append(pos, dir->dh(), 0, dir->atime(), DT_DIR, dir->name());
+    } else {
+      const FilePtr &file = d->child_files_[pos - d->child_dirs_.size()];
+      d->arena_.Append(pos, file->fh(), file->file_size(), file->atime(),
+                       DT_REG, file->file_name_view());
+    }
+  }
+}
+
+void DirHandle::SeekDirectory(BLOCKFS_DIR *d, uint64_t pos) {
+  std::lock_guard cursor_lock(d->mutex_);
+  if (!d->inited_ || pos < d->batch_begin_ || pos >= d->batch_end_) {
+    // 不在当前批次里, 下一次readdir从pos重新生成
+    d->batch_begin_ = d->batch_end_ = pos;
+    d->arena_.Reset();
+    d->offset_ = 0;
+    return;
+  }
+  d->offset_ = 0;
+  while (d->offset_ < d->arena_.size() && d->arena_.at(d->offset_)->pos < pos) {
+    d->offset_ = d->arena_.next(d->offset_);
+  }
+}
+
 // https://download.csdn.net/download/fronteer/4995825
 // https://blog.csdn.net/chenleng8306/article/details/100790301
 block_fs_dirent *DirHandle::ReadDirectory(BLOCKFS_DIR *d) {
-  std::lock_guard lock(mutex_);
+  std::lock_guard cursor_lock(d->mutex_);
   if (!d->inited_) {
-    d->dir_->ScanDir(d->dir_items_);
-    d->dir_->UpdateTimeStamp(false, true, true);
+    // 快照只持有目录自己的锁, 大目录也不会挡住mkdir/rmdir/rename
+    d->dir_->SnapshotChildren(&d->child_dirs_, &d->child_files_);
+    {
+      std::lock_guard lock(mutex_);
+      d->dir_->UpdateTimeStamp(false, true, true);
+    }
     d->inited_ = true;
   }
-  if (d->index_ < d->dir_items_.size()) {
-    return d->dir_items_[d->index_++];
-  }
-  return nullptr;
+  if (d->offset_ >= d->arena_.size()) {
+    if (d->batch_end_ >= d->entry_num()) {
+      return nullptr;
+    }
+    FillDirentBatch(d, d->batch_end_);
+  }
+  const DirentRecord *record = d->arena_.at(d->offset_);
+  d->offset_ = d->arena_.next(d->offset_);
+
+  block_fs_dirent *entry = &d->entry_;
+  entry->d_ino = record->ino;
+  entry->d_off = record->pos + 1;
+  entry->d_reclen = record->size;
+  entry->d_type = record->type;
+  entry->d_link = 0;
+  entry->d_time_ = record->time;
+  uint32_t name_len = std::min<uint32_t>(record->name_len, NAME_MAX);
+  ::memcpy(entry->d_name, record->name(), name_len);
+  entry->d_name[name_len] = '\0';
+  return entry;
 }
 
 int32_t DirHandle::CloseDirectory(BLOCKFS_DIR *d) {
   SPDLOG_INFO("close directory name: {} fd: {}", d->dir_->dir_name(), d->fd());
-  FileSystem::Instance()->fd_handle()->put_fd(d->fd_);
-  for (uint32_t i = 0; i < d->dir_items_.size(); ++i) {
-    delete d->dir_items_[i];
-  }
-  d->inited_ = false;
-  d->ClearItem();
+  FileSystem::Instance()->fd_handle()->ReleaseDirectory(d->fd_);
   d->dir_->DecLinkCount();
   delete d;
   return 0;
 }
 
 void DirHandle::Dump(const std::string &path) noexcept {
-  const DirectoryPtr &dir = GetCreatedDirectory(path);
+  DirectoryPtr dir = GetCreatedDirectory(path);
   dir->DumpMeta();
 }
 
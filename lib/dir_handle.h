@@ -7,34 +7,56 @@
 #include "directory.h"
 #include "file_handle.h"
 #include "meta_handle.h"
+#include "sharded_map.h"
 
 namespace udisk::blockfs {
 
 // guard directory in directory handle mutex
 typedef std::function<bool()> DirectoryCallback;
 
+// readdir每次生成这么多条记录到arena, 大目录不会一次全部展开
+constexpr uint32_t kReadDirBatchNum = 512;
+
+// 去掉文件夹路径末尾的'/', 根目录保持'/'
+inline std::string_view TrimDirName(std::string_view dir_name) noexcept {
+  if (dir_name.size() > 1 && dir_name.back() == '/') {
+    dir_name.remove_suffix(1);
+  }
+  return dir_name;
+}
+
 class DirHandle : public MetaHandle {
  private:
   std::list<ino_t> free_dhs_;  // 目录Meta的空闲链表
 
-  typedef std::unordered_map<std::string, DirectoryPtr> DirectoryNameMap;
-  DirectoryNameMap created_dirs_;   // 已创建的目录
-  std::unordered_map<ino_t, DirectoryPtr> created_dhs_;  // 文件句柄名字映射
-  std::unordered_map<ino_t, DirectoryPtr> open_dirs_;    // 已打开的目录
+  // 映射表分片加锁, 查找不需要mutex_, mutex_串行化修改目录树的操作
+  // 内存中按(父文件夹dh, 本级名字)索引目录树, 路径从挂载点逐级查找,
+  // 重命名只改一项; 磁盘上的DirMeta仍然存全路径
+  // 打开的目录在FdHandle的fd表中
+  typedef ShardedMap<FileNameKey, DirectoryPtr, FileNameKeyHash,
+                     FileNameKeyEqual>
+      DentryMap;
+  DentryMap created_dentries_;                   // 已创建的目录
+  ShardedMap<ino_t, DirectoryPtr> created_dhs_;  // 文件句柄名字映射
+  DirectoryPtr root_;                            // 挂载点, 挂载之后不再变化
 
  private:
   bool TransformPath(const std::string &path, std::string &dir_name);
 
-  bool IsMountPoint(const std::string &dirname) const noexcept;
-  bool CheckFileExist(const std::string &dirname,
+  bool IsMountPoint(std::string_view dirname) const noexcept;
+  bool CheckFileExist(std::string_view dirname,
                       bool check_parent = true) const noexcept;
+  DirectoryPtr LookupDirectory(std::string_view path) const;
   DirectoryPtr NewFreeDirectoryNolock(const std::string &dirname);
-  bool NewDirectory(const std::string &dirname,
-                    std::pair<DirectoryPtr, DirectoryPtr> *dirs);
-  bool AddDirectory(const DirectoryPtr &parent, const DirectoryPtr &child);
+  bool NewDirectoryNolock(const std::string &dirname,
+                          std::pair<DirectoryPtr, DirectoryPtr> *dirs);
+  bool AddDirectoryNolock(const DirectoryPtr &parent,
+                          const DirectoryPtr &child);
   bool FindDirectory(const std::string &dirname,
                      std::pair<DirectoryPtr, DirectoryPtr> *dirs);
-  bool RemoveDirectory(const DirectoryPtr &parent, const DirectoryPtr &child);
+  bool RemoveDirectoryNolock(const DirectoryPtr &parent,
+                             const DirectoryPtr &child);
+  void FillDirentBatch(BLOCKFS_DIR *dir, uint64_t pos);
 
  public:
   DirHandle() = default;
@@ -42,11 +64,14 @@ class DirHandle : public MetaHandle {
 
   const uint32_t GetFreeMetaSize() const noexcept { return free_dhs_.size(); }
 
-  const DirectoryPtr &GetOpenDirectory(ino_t fd);
-  const DirectoryPtr &GetCreatedDirectory(ino_t dh);
-  const DirectoryPtr &GetCreatedDirectoryNolock(ino_t dh);
-  const DirectoryPtr &GetCreatedDirectory(const std::string &dirname);
-  const DirectoryPtr &GetCreatedDirectoryNolock(const std::string &dirname);
+  DirectoryPtr GetOpenDirectory(ino_t fd);
+  DirectoryPtr GetCreatedDirectory(ino_t dh);
+  DirectoryPtr GetCreatedDirectoryNolock(ino_t dh);
+  // dirname末尾带不带'/'都可以, 查找过程中不拷贝字符串
+  DirectoryPtr GetCreatedDirectory(std::string_view dirname);
+  DirectoryPtr GetCreatedDirectoryNolock(std::string_view dirname);
+  // 按父文件夹dh和本级名字查找子文件夹
+  DirectoryPtr GetChildDirectory(ino_t parent_dh, std::string_view name) const;
   int32_t DeleteDirectory(const ino_t dh);
   int32_t DeleteDirectoryNolock(const ino_t dh);
 
@@ -66,9 +91,17 @@ class DirHandle : public MetaHandle {
   int32_t RenameDirectory(const std::string &from, const std::string &to);
   bool AddDirectory2CreateNolock(const DirectoryPtr &child);
   bool RemoveDirectoryFromCreateNolock(const DirectoryPtr &child);
+  // 把child挂到new_parent下面并改名, 先加入新的索引项再去掉老的,
+  // 查找不会看到文件夹消失, 子树里的索引项都不用动
+  bool RenameDirectoryNolock(const DirectoryPtr &child,
+                             const DirectoryPtr &new_parent,
+                             std::string_view new_name);
 
   BLOCKFS_DIR *OpenDirectory(const std::string &path);
+  BLOCKFS_DIR *OpenDirectory(const DirectoryPtr &dir);
   block_fs_dirent *ReadDirectory(BLOCKFS_DIR *dir);
+  // pos是已经读过的子项个数, 即上一次返回项的d_off, 0表示从头开始
+  void SeekDirectory(BLOCKFS_DIR *dir, uint64_t pos);
   int32_t CloseDirectory(BLOCKFS_DIR *dir);
 };
 
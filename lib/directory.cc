@@ -4,6 +4,7 @@
 
 #include "file_system.h"
 #include "spdlog/spdlog.h"
+#include "stats.h"
 
 // common dir/file functions
 void Directory::stat(struct stat *buf) {
@@ -32,14 +33,18 @@ void Directory::UpdateTimeStamp(bool a, bool m, bool c) {
   using namespace std::chrono;
   system_clock::time_point now = system_clock::now();
   time_t seconds = system_clock::to_time_t(now);
+  // 没有页要写, 只为了在修改crc期间挡住Flush
+  MetaTransaction txn;
   if (a) set_atime(seconds);
   if (m) set_mtime(seconds);
   if (c) set_ctime(seconds);
 
   // 更新内存元数据的CRC
-  meta_->crc_ = Crc32(reinterpret_cast<uint8_t *>(meta_) + sizeof(meta_->crc_),
-                      FileSystem::Instance()->super_meta()->dir_meta_size_ -
-                          sizeof(meta_->crc_));
+  meta_->crc_ = FileSystem::Instance()->MetaCrc(
+      reinterpret_cast<uint8_t *>(meta_) + sizeof(meta_->crc_),
+      FileSystem::Instance()->super_meta()->dir_meta_size_ -
+          sizeof(meta_->crc_));
+  txn.Commit();
 }
 
 
@@ -55,9 +60,10 @@ void Directory::ClearMeta() const noexcept {
   // 后面从内存删除还需要用文件夹名,这个地方只置位回收状态
   // ::memset(meta_->dir_name_, 0, sizeof(meta_->dir_name_));
   meta_->size_ = 0;
-  meta_->crc_ = Crc32(reinterpret_cast<uint8_t *>(meta_) + sizeof(meta_->crc_),
-                      FileSystem::Instance()->super_meta()->dir_meta_size_ -
-                          sizeof(meta_->crc_));
+  meta_->crc_ = FileSystem::Instance()->MetaCrc(
+      reinterpret_cast<uint8_t *>(meta_) + sizeof(meta_->crc_),
+      FileSystem::Instance()->super_meta()->dir_meta_size_ -
+          sizeof(meta_->crc_));
 }
 
 void Directory::ClearMeta(ino_t dh) noexcept {
@@ -66,9 +72,10 @@ void Directory::ClearMeta(ino_t dh) noexcept {
       FileSystem::Instance()->super_meta()->dir_meta_size_ * dh);
   meta->used_ = false;
   meta->size_ = 0;
-  meta->crc_ = Crc32(reinterpret_cast<uint8_t *>(meta) + sizeof(meta->crc_),
-                      FileSystem::Instance()->super_meta()->dir_meta_size_ -
-                          sizeof(meta->crc_));
+  meta->crc_ = FileSystem::Instance()->MetaCrc(
+      reinterpret_cast<uint8_t *>(meta) + sizeof(meta->crc_),
+      FileSystem::Instance()->super_meta()->dir_meta_size_ -
+          sizeof(meta->crc_));
 }
 
 /**
@@ -95,35 +102,18 @@ uint32_t Directory::ChildCount() noexcept {
   return (item_maps_.size() + child_dir_maps_.size());
 }
 
-void Directory::ScanDir(std::vector<block_fs_dirent *> &dir_infos) {
-  SPDLOG_INFO("init scan directory: {}", dir_name());
+void Directory::SnapshotChildren(std::vector<DirectoryPtr> *dirs,
+                                 std::vector<FilePtr> *files) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  SPDLOG_DEBUG("snapshot directory: {} dirs: {} files: {}", dh(),
+               child_dir_maps_.size(), item_maps_.size());
+  dirs->reserve(child_dir_maps_.size());
   for (const auto &d : child_dir_maps_) {
-    SPDLOG_INFO("scan directory: {}", d.second->dir_name());
-    block_fs_dirent *info = new block_fs_dirent();
-    info->d_ino = d.second->dh();
-    info->d_type = DT_DIR;
-    // 全路径: 去掉'/', 返回整齐的名字
-    std::string dir_name = d.second->dir_name();
-    if (dir_name[dir_name.size() - 1] == '/') {
-      dir_name[dir_name.size() - 1] = '\0';
-    }
-    dir_name = GetFileName(dir_name);
-    ::memset(info->d_name, 0, sizeof(info->d_name));
-    ::memcpy(info->d_name, dir_name.c_str(), dir_name.size());
-    info->d_reclen = 0;
-    info->d_time_ = d.second->atime();
-    dir_infos.push_back(info);
+    dirs->push_back(d.second);
   }
+  files->reserve(item_maps_.size());
   for (const auto &item : item_maps_) {
-    const FilePtr &file = item.second;
-    SPDLOG_INFO("scan file: {}", file->file_name());
-    block_fs_dirent *info = new block_fs_dirent();
-    info->d_ino = file->fh();
-    info->d_type = DT_REG;
-    ::memcpy(info->d_name, file->file_name().c_str(), file->file_name().size());
-    info->d_reclen = file->file_size();
-    info->d_time_ = file->atime();
-    dir_infos.push_back(info);
+    files->push_back(item.second);
   }
 }
 
@@ -132,27 +122,29 @@ void Directory::DumpMeta() {
 }
 
 bool Directory::WriteMeta() {
+  StatTimer timer(kStatMetaWriteDir);
   uint32_t align_index =
       FileSystem::Instance()->dir_handle()->PageAlignIndex(dh());
-  SPDLOG_INFO("directory handle: {} align_index: {}", dh(), align_index);
+  SPDLOG_DEBUG("directory handle: {} align_index: {}", dh(), align_index);
   uint64_t offset =
       FileSystem::Instance()->super_meta()->dir_meta_size_ * align_index;
   void *align_meta = FileSystem::Instance()->dir_handle()->base_addr() + offset;
-  meta_->crc_ = Crc32(reinterpret_cast<uint8_t *>(meta_) + sizeof(meta_->crc_),
-                      FileSystem::Instance()->super_meta()->dir_meta_size_ -
-                          sizeof(meta_->crc_));
-  int64_t ret = FileSystem::Instance()->dev()->PwriteDirect(
-      align_meta, kBlockFsPageSize,
-      FileSystem::Instance()->super_meta()->dir_meta_offset_ + offset);
-  if (ret != kBlockFsPageSize) [[unlikely]] {
-    SPDLOG_ERROR("write directory meta {} error size: {} need: {}", dh(), ret,
-                 kBlockFsPageSize);
+  meta_->crc_ = FileSystem::Instance()->MetaCrc(
+      reinterpret_cast<uint8_t *>(meta_) + sizeof(meta_->crc_),
+      FileSystem::Instance()->super_meta()->dir_meta_size_ -
+          sizeof(meta_->crc_));
+  if (!FileSystem::Instance()->WriteMetaPage(
+          align_meta, kBlockFsPageSize,
+          FileSystem::Instance()->super_meta()->dir_meta_offset_ + offset))
+      [[unlikely]] {
+    SPDLOG_ERROR("write directory meta {} failed", dh());
     return false;
   }
   return true;
 }
 
 bool Directory::WriteMeta(ino_t dh) {
+  StatTimer timer(kStatMetaWriteDir);
   DirMeta *meta = reinterpret_cast<DirMeta *>(
       FileSystem::Instance()->dir_handle()->base_addr() +
       FileSystem::Instance()->super_meta()->dir_meta_size_ * dh);
@@ -161,18 +153,18 @@ bool Directory::WriteMeta(ino_t dh) {
   uint64_t offset =
       FileSystem::Instance()->super_meta()->dir_meta_size_ * align_index;
   void *align_meta = FileSystem::Instance()->dir_handle()->base_addr() + offset;
-  uint32_t crc = Crc32(reinterpret_cast<uint8_t *>(meta) + sizeof(meta->crc_),
-                      FileSystem::Instance()->super_meta()->dir_meta_size_ -
-                          sizeof(meta->crc_));
+  uint32_t crc = FileSystem::Instance()->MetaCrc(
+      reinterpret_cast<uint8_t *>(meta) + sizeof(meta->crc_),
+      FileSystem::Instance()->super_meta()->dir_meta_size_ -
+          sizeof(meta->crc_));
   meta->crc_ = crc;
-  SPDLOG_INFO("write dir meta, name: {} dh: {} align_index: {} crc: {}",
-              meta->dir_name_, dh, align_index, crc);
-  int64_t ret = FileSystem::Instance()->dev()->PwriteDirect(
-      align_meta, kBlockFsPageSize,
-      FileSystem::Instance()->super_meta()->dir_meta_offset_ + offset);
-  if (ret != kBlockFsPageSize) [[unlikely]] {
-    SPDLOG_ERROR("write directory meta {} error size: {} need: {}", dh, ret,
-                 kBlockFsPageSize);
+  SPDLOG_DEBUG("write dir meta, name: {} dh: {} align_index: {} crc: {}",
+               meta->dir_name_, dh, align_index, crc);
+  if (!FileSystem::Instance()->WriteMetaPage(
+          align_meta, kBlockFsPageSize,
+          FileSystem::Instance()->super_meta()->dir_meta_offset_ + offset))
+      [[unlikely]] {
+    SPDLOG_ERROR("write directory meta {} failed", dh);
     return false;
   }
   return true;
@@ -230,6 +222,23 @@ bool Directory::RemovChildDirectory(const DirectoryPtr &child) {
   return true;
 }
 
+void Directory::GetSubDirectories(std::vector<DirectoryPtr> *dirs) {
+  std::size_t index = dirs->size();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &child : child_dir_maps_) {
+      dirs->push_back(child.second);
+    }
+  }
+  for (; index < dirs->size(); ++index) {
+    DirectoryPtr dir = (*dirs)[index];
+    std::lock_guard<std::mutex> lock(dir->mutex_);
+    for (const auto &child : dir->child_dir_maps_) {
+      dirs->push_back(child.second);
+    }
+  }
+}
+
 bool Directory::ForceRemoveAllFiles() {
   std::lock_guard<std::mutex> lock(mutex_);
   std::unordered_map<int32_t, FilePtr>::iterator it;
@@ -252,39 +261,109 @@ bool Directory::ForceRemoveAllFiles() {
 但是我在upfs中操作, 没有这个问题
 */
 int Directory::rename(const std::string &to) {
-  bool success =
-      FileSystem::Instance()->dir_handle()->RunInMetaGuard([this, to] {
-        SPDLOG_INFO("rename dir {} -> {}", dir_name(), to);
-
-        std::string new_parent_dir_name = GetDirName(to);
-        const DirectoryPtr &new_parent_dir =
-            FileSystem::Instance()->dir_handle()->GetCreatedDirectoryNolock(new_parent_dir_name);
-        if (!new_parent_dir) {
-          SPDLOG_ERROR("new parent dir {} not exist", new_parent_dir_name);
-          return false;
-        }
+  DirHandle *dir_handle = FileSystem::Instance()->dir_handle();
+  bool success = dir_handle->RunInMetaGuard([this, &to, dir_handle] {
+    SPDLOG_INFO("rename dir {} -> {}", dir_name(), to);
 
-        std::string old_parent_dir_name = GetDirName(dir_name());
-        const DirectoryPtr &old_parent_dir =
-            FileSystem::Instance()->dir_handle()->GetCreatedDirectoryNolock(old_parent_dir_name);
-        if (!old_parent_dir) {
-          SPDLOG_ERROR("old parent dir {} not exist", old_parent_dir_name);
-          return false;
-        }
-        old_parent_dir->RemovChildDirectory(shared_from_this());
-        if (!FileSystem::Instance()->dir_handle()->RemoveDirectoryFromCreateNolock(shared_from_this())) {
-          return false;
-        }
-
-        set_dir_name(to);
+    std::string_view to_path = TrimDirName(to);
+    std::string_view new_parent_dir_name = GetDirNameView(to_path);
+    std::string_view new_name = GetFileNameView(to_path);
+    DirectoryPtr new_parent_dir =
+        dir_handle->GetCreatedDirectoryNolock(new_parent_dir_name);
+    if (!new_parent_dir) {
+      SPDLOG_ERROR("new parent dir {} not exist", new_parent_dir_name);
+      errno = ENOENT;
+      return false;
+    }
+    if (dir_handle->GetCreatedDirectoryNolock(to_path)) {
+      SPDLOG_ERROR("new dir {} has exist", to);
+      errno = EEXIST;
+      return false;
+    }
+    // 不能移动到自己的子树下面
+    for (DirectoryPtr dir = new_parent_dir; dir && !dir->name().empty();
+         dir = dir_handle->GetCreatedDirectoryNolock(dir->parent_dh())) {
+      if (dir.get() == this) {
+        SPDLOG_ERROR("cannot move dir {} into itself {}", dir_name(), to);
+        errno = EINVAL;
+        return false;
+      }
+    }
 
-        FileSystem::Instance()->dir_handle()->AddDirectory2CreateNolock(shared_from_this());
-        new_parent_dir->AddChildDirectory(shared_from_this());
+    // 磁盘上每个文件夹存的是全路径, 子树里的都要换成新的前缀,
+    // 内存的目录树只需要改这一项
+    std::string old_prefix = dir_name();
+    std::string new_prefix = new_parent_dir->dir_name();
+    new_prefix.append(new_name).push_back('/');
+    std::vector<DirectoryPtr> dirs{shared_from_this()};
+    GetSubDirectories(&dirs);
+    std::vector<std::string> new_dir_names;
+    new_dir_names.reserve(dirs.size());
+    for (const DirectoryPtr &dir : dirs) {
+      std::string name = dir->dir_name();
+      new_dir_names.push_back(new_prefix + name.substr(old_prefix.size()));
+      if (new_dir_names.back().size() >= kBlockFsMaxDirNameLen) [[unlikely]] {
+        SPDLOG_ERROR("directory path: {} too long after rename",
+                     new_dir_names.back());
+        errno = ENAMETOOLONG;
+        return false;
+      }
+    }
 
-        if (!WriteMeta()) {
-          return false;
+    // 失败时整个子树恢复成老的元数据, 不能一部分是新前缀一部分是老前缀
+    uint64_t dir_meta_size =
+        FileSystem::Instance()->super_meta()->dir_meta_size_;
+    std::vector<std::string> old_metas;
+    old_metas.reserve(dirs.size());
+    for (const DirectoryPtr &dir : dirs) {
+      old_metas.emplace_back(reinterpret_cast<const char *>(dir->meta()),
+                             dir_meta_size);
+    }
+    MetaTransaction txn;
+    // 先恢复内存再放弃事务, 后台落盘看不到改了一半的子树
+    auto rollback = [&](std::size_t num) {
+      for (std::size_t i = 0; i < num; ++i) {
+        ::memcpy(dirs[i]->meta(), old_metas[i].data(), dir_meta_size);
+      }
+      txn.Abort();
+      // 没有journal的老文件系统已经原地写下去了, 尽量写回老的内容
+      if (!FileSystem::Instance()->journal()->enabled()) {
+        for (std::size_t i = 0; i < num; ++i) {
+          dirs[i]->WriteMeta();
         }
-        return true;
-      });
+      }
+    };
+    for (std::size_t i = 0; i < dirs.size(); ++i) {
+      dirs[i]->set_dir_name(new_dir_names[i]);
+      if (!dirs[i]->WriteMeta()) {
+        int error = errno;
+        rollback(i + 1);
+        errno = error;
+        return false;
+      }
+    }
+    DirectoryPtr old_parent_dir =
+        dir_handle->GetCreatedDirectoryNolock(parent_dh());
+    std::string old_name = name();
+    if (!dir_handle->RenameDirectoryNolock(shared_from_this(), new_parent_dir,
+                                           new_name)) {
+      int error = errno;
+      rollback(dirs.size());
+      errno = error;
+      return false;
+    }
+    if (!txn.Commit()) [[unlikely]] {
+      // 目录树也要挂回老的父文件夹, 和恢复的元数据保持一致
+      if (!old_parent_dir ||
+          !dir_handle->RenameDirectoryNolock(shared_from_this(),
+                                             old_parent_dir, old_name)) {
+        SPDLOG_ERROR("failed to restore dentry of dir: {}", old_name);
+      }
+      rollback(dirs.size());
+      errno = EIO;
+      return false;
+    }
+    return true;
+  });
   return success ? 0 : -1;
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "device.h"
+#include "dirent_arena.h"
 #include "file_handle.h"
 #include "inode.h"
 
@@ -11,6 +12,9 @@ class Directory : public Inode<DirMeta, File>,
  private:
   int32_t nlink_ = 0;
   std::unordered_map<ino_t, DirectoryPtr> child_dir_maps_;
+  // 目录树中的位置, 只在内存里, 修改在DirHandle的mutex_里面
+  ino_t parent_dh_ = 0;
+  std::string name_;  // 本级的名字, 不带'/', 挂载点为空
 
  private:
   void ClearMeta() const noexcept;
@@ -25,6 +29,12 @@ class Directory : public Inode<DirMeta, File>,
     ::memcpy(meta_->dir_name_, to.c_str(), sizeof(meta_->dir_name_));
   }
   std::string dir_name() const { return std::string(meta_->dir_name_); }
+  void set_dentry(ino_t parent_dh, std::string_view name) {
+    parent_dh_ = parent_dh;
+    name_ = name;
+  }
+  ino_t parent_dh() const noexcept { return parent_dh_; }
+  const std::string &name() const noexcept { return name_; }
   void set_dh(ino_t dh) const noexcept { meta_->dh_ = dh; }
   ino_t dh() const { return meta_->dh_; }
   void set_used(bool used) const noexcept { meta_->used_ = used; }
@@ -52,7 +62,9 @@ class Directory : public Inode<DirMeta, File>,
   bool Suicide();
   bool SuicideNolock();
 
-  void ScanDir(std::vector<block_fs_dirent *> &dir_infos);
+  // 只拷贝子项的智能指针, 名字等读到的时候再取
+  void SnapshotChildren(std::vector<DirectoryPtr> *dirs,
+                        std::vector<FilePtr> *files);
 
   bool ForceRemoveAllFiles();
   bool AddChildFile(const FilePtr &file);
@@ -62,6 +74,8 @@ class Directory : public Inode<DirMeta, File>,
   bool AddChildDirectoryNolock(const DirectoryPtr &child);
   bool AddChildDirectory(const DirectoryPtr &child);
   bool RemovChildDirectory(const DirectoryPtr &child);
+  // 按层次追加所有子孙文件夹, 不包括自己
+  void GetSubDirectories(std::vector<DirectoryPtr> *dirs);
 
   // common dir/file functions
   void stat(struct stat *buf) override;
@@ -75,28 +89,27 @@ class Directory : public Inode<DirMeta, File>,
 };
 typedef std::shared_ptr<Directory> DirectoryPtr;
 
+// 打开的目录, 第一次readdir时给子项拍快照, 之后按游标分批生成记录
 struct BLOCKFS_DIR {
+  std::mutex mutex_;    /* 保护下面的游标和arena, 不占用DirHandle的锁 */
   bool inited_ = false; /* Scan directory yet */
   int32_t fd_;          /* Open directory file descriptor */
-  uint32_t index_ = 0;  /* Current index into the entry */
   DirectoryPtr dir_;    /* Directory block */
-  uint64_t size_;       /* Total valid data in the block  */
-  std::mutex mutex_;
-  /* Entry item `dir_' corresponds to */
-  std::vector<block_fs_dirent *> dir_items_;
+  /* 子项快照, 先文件夹后文件, 位置就是readdir的游标 */
+  std::vector<DirectoryPtr> child_dirs_;
+  std::vector<FilePtr> child_files_;
+  /* arena中是[batch_begin_, batch_end_)位置的记录 */
+  uint64_t batch_begin_ = 0;
+  uint64_t batch_end_ = 0;
+  uint32_t offset_ = 0; /* 下一条记录在arena中的偏移 */
+  DirentArena arena_;
+  /* readdir返回的项, 下一次readdir之前有效 */
+  block_fs_dirent entry_;
 
   int32_t fd() const noexcept { return fd_; }
-  uint32_t entry_num() const noexcept { return dir_items_.size(); }
-  void AddItem(block_fs_dirent *info) noexcept {
-    std::lock_guard<std::mutex> lock(mutex_);
-    dir_items_.push_back(info);
-  }
-  void ClearItem() noexcept {
-    std::lock_guard<std::mutex> lock(mutex_);
-    dir_items_.clear();
+  uint64_t entry_num() const noexcept {
+    return child_dirs_.size() + child_files_.size();
   }
-
-  uint32_t ItemSize() const noexcept { return dir_items_.size(); }
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,88 @@
+#ifndef LIB_DIRENT_ARENA_H_
+#define LIB_DIRENT_ARENA_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <memory>
+#include <string_view>
+
+namespace udisk::blockfs {
+
+// readdir的一条记录, 名字紧跟在后面, 按8字节对齐
+struct DirentRecord {
+  uint64_t pos;       // 在子项快照中的位置
+  ino_t ino;
+  uint64_t size;
+  time_t time;
+  uint32_t type;
+  uint32_t name_len;  // 不包括结尾的'\0'
+
+  const char *name() const noexcept {
+    return reinterpret_cast<const char *>(this + 1);
+  }
+};
+
+// BLOCKFS_DIR私有的arena, 记录按变长紧凑追加, 分配只移动偏移
+// 一批记录读完之后Reset复用同一块内存, 不会每一项一次malloc
+class DirentArena {
+ private:
+  std::unique_ptr<char[]> data_;
+  uint32_t capacity_ = 0;
+  uint32_t size_ = 0;
+
+  static uint32_t RecordSize(std::size_t name_len) noexcept {
+    return (sizeof(DirentRecord) + name_len + 1 + 7) & ~7U;
+  }
+
+ public:
+  DirentArena() = default;
+  DirentArena(const DirentArena &) = delete;
+  DirentArena &operator=(const DirentArena &) = delete;
+
+  void Append(uint64_t pos, ino_t ino, uint64_t size, time_t time,
+              uint32_t type, std::string_view name) {
+    uint32_t len = RecordSize(name.size());
+    if (size_ + len > capacity_) {
+      // 只在第一批或者名字特别长的时候扩容, 之后的批次复用
+      uint32_t capacity = capacity_ ? capacity_ : 16 * 1024;
+      while (size_ + len > capacity) {
+        capacity <<= 1;
+      }
+      std::unique_ptr<char[]> data(new char[capacity]);
+      if (size_ > 0) {
+        ::memcpy(data.get(), data_.get(), size_);
+      }
+      data_ = std::move(data);
+      capacity_ = capacity;
+    }
+    DirentRecord *record = reinterpret_cast<DirentRecord *>(data_.get() + size_);
+    record->pos = pos;
+    record->ino = ino;
+    record->size = size;
+    record->time = time;
+    record->type = type;
+    record->name_len = name.size();
+    char *record_name = data_.get() + size_ + sizeof(DirentRecord);
+    ::memcpy(record_name, name.data(), name.size());
+    record_name[name.size()] = '\0';
+    size_ += len;
+  }
+
+  // offset是记录的起始偏移, 返回下一条记录的偏移
+  const DirentRecord *at(uint32_t offset) const noexcept {
+    return reinterpret_cast<const DirentRecord *>(data_.get() + offset);
+  }
+  uint32_t next(uint32_t offset) const noexcept {
+    return offset + RecordSize(at(offset)->name_len);
+  }
+
+  void Reset() noexcept { size_ = 0; }
+  uint32_t size() const noexcept { return size_; }
+  uint32_t capacity() const noexcept { return capacity_; }
+};
+
+}  // namespace udisk::blockfs
+#endif  // LIB_DIRENT_ARENA_H_
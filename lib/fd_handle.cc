@@ -0,0 +1,138 @@
+#include "fd_handle.h"
+
+#include "directory.h"
+#include "file.h"
+#include "spdlog/spdlog.h"
+
+namespace udisk::blockfs {
+
+FdHandle::FdHandle() : slots_(new Slot[kMaxFdNum]) {
+  // 下标小的fd在栈顶, 先分配
+  for (uint32_t index = 0; index < kMaxFdNum; ++index) {
+    slots_[index].next_free.store(index + 1 < kMaxFdNum ? index + 1 : kFdNil,
+                                  std::memory_order_relaxed);
+  }
+  free_head_.store(0, std::memory_order_release);
+}
+
+int32_t FdHandle::PopFree() {
+  uint64_t head = free_head_.load(std::memory_order_acquire);
+  while (true) {
+    uint32_t index = static_cast<uint32_t>(head);
+    if (index == kFdNil) [[unlikely]] {
+      return -1;
+    }
+    uint32_t next = slots_[index].next_free.load(std::memory_order_relaxed);
+    uint64_t new_head = ((head >> 32) + 1) << 32 | next;
+    if (free_head_.compare_exchange_weak(head, new_head,
+                                         std::memory_order_acq_rel)) {
+      used_num_.fetch_add(1, std::memory_order_relaxed);
+      return index;
+    }
+  }
+}
+
+void FdHandle::PushFree(uint32_t index) {
+  uint64_t head = free_head_.load(std::memory_order_relaxed);
+  while (true) {
+    slots_[index].next_free.store(static_cast<uint32_t>(head),
+                                  std::memory_order_relaxed);
+    uint64_t new_head = ((head >> 32) + 1) << 32 | index;
+    if (free_head_.compare_exchange_weak(head, new_head,
+                                         std::memory_order_acq_rel)) {
+      used_num_.fetch_sub(1, std::memory_order_relaxed);
+      return;
+    }
+  }
+}
+
+FdHandle::Slot *FdHandle::GetSlot(int32_t fd, uint32_t *generation) const {
+  if (fd < 0) [[unlikely]] {
+    return nullptr;
+  }
+  uint32_t index = static_cast<uint32_t>(fd) & kFdIndexMask;
+  if (index >= kMaxFdNum) [[unlikely]] {
+    return nullptr;
+  }
+  *generation = static_cast<uint32_t>(fd) >> kFdIndexBits;
+  return &slots_[index];
+}
+
+template <typename T>
+std::shared_ptr<T> FdHandle::Load(
+    int32_t fd, std::atomic<std::shared_ptr<T>> Slot::*field) const {
+  uint32_t generation;
+  Slot *slot = GetSlot(fd, &generation);
+  if (!slot || slot->generation.load(std::memory_order_acquire) != generation)
+      [[unlikely]] {
+    return nullptr;
+  }
+  std::shared_ptr<T> ptr = (slot->*field).load(std::memory_order_acquire);
+  if (slot->generation.load(std::memory_order_acquire) != generation)
+      [[unlikely]] {
+    return nullptr;
+  }
+  return ptr;
+}
+
+template <typename T>
+std::shared_ptr<T> FdHandle::Release(
+    int32_t fd, std::atomic<std::shared_ptr<T>> Slot::*field) {
+  uint32_t generation;
+  Slot *slot = GetSlot(fd, &generation);
+  if (!slot || !(slot->*field).load(std::memory_order_acquire)) [[unlikely]] {
+    return nullptr;
+  }
+  // 换代成功的线程拥有这个槽位, 老的fd从这里开始都是无效的
+  if (!slot->generation.compare_exchange_strong(
+          generation, (generation + 1) & kFdGenerationMask,
+          std::memory_order_acq_rel)) [[unlikely]] {
+    return nullptr;
+  }
+  std::shared_ptr<T> ptr =
+      (slot->*field).exchange(nullptr, std::memory_order_acq_rel);
+  PushFree(slot - slots_.get());
+  return ptr;
+}
+
+int32_t FdHandle::AllocFd(const std::shared_ptr<OpenFile> &file) {
+  int32_t index = PopFree();
+  if (index < 0) [[unlikely]] {
+    SPDLOG_ERROR("fd pool is exhausted");
+    errno = EMFILE;
+    return -1;
+  }
+  Slot &slot = slots_[index];
+  slot.file.store(file, std::memory_order_release);
+  return MakeFd(index, slot.generation.load(std::memory_order_relaxed));
+}
+
+int32_t FdHandle::AllocFd(const std::shared_ptr<Directory> &dir) {
+  int32_t index = PopFree();
+  if (index < 0) [[unlikely]] {
+    SPDLOG_ERROR("fd pool is exhausted");
+    errno = EMFILE;
+    return -1;
+  }
+  Slot &slot = slots_[index];
+  slot.dir.store(dir, std::memory_order_release);
+  return MakeFd(index, slot.generation.load(std::memory_order_relaxed));
+}
+
+std::shared_ptr<OpenFile> FdHandle::GetFile(int32_t fd) const {
+  return Load(fd, &Slot::file);
+}
+
+std::shared_ptr<Directory> FdHandle::GetDirectory(int32_t fd) const {
+  return Load(fd, &Slot::dir);
+}
+
+std::shared_ptr<OpenFile> FdHandle::ReleaseFile(int32_t fd) {
+  return Release(fd, &Slot::file);
+}
+
+std::shared_ptr<Directory> FdHandle::ReleaseDirectory(int32_t fd) {
+  return Release(fd, &Slot::dir);
+}
+
+}  // namespace udisk::blockfs
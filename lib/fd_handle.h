@@ -1,51 +1,72 @@
 #pragma once
 
-#include <list>
-#include <mutex>
+#include <atomic>
+#include <memory>
 
-#include "spdlog/spdlog.h"
+#include "comm_utils.h"
+#include "meta_defines.h"
 
 namespace udisk::blockfs {
 
+class OpenFile;
+class Directory;
+
+// 打开的文件和文件夹共用的fd表
+// fd的低位是表的下标, 高位是槽位的代数, 关闭之后代数加1, 用老的fd访问会失败
+// 空闲的槽位组成无锁栈, 栈顶带版本号避免ABA, 查找只需要按下标原子地读槽位
 class FdHandle {
   FdHandle(const FdHandle &) = delete;
   FdHandle &operator=(const FdHandle &) = delete;
 
  private:
-  int max_fd_num_ = kMaxFileNum << 1;
-  std::list<int> free_fd_pool_;
-  std::mutex mutex_;
+  static constexpr uint32_t kFdIndexBits = 18;
+  static constexpr uint32_t kFdIndexMask = (1U << kFdIndexBits) - 1;
+  // fd是非负的int, 剩下的13位给代数
+  static constexpr uint32_t kFdGenerationMask = (1U << (31 - kFdIndexBits)) - 1;
+  static constexpr uint32_t kFdNil = UINT32_MAX;
+  static constexpr uint32_t kMaxFdNum = kMaxFileNum << 1;
+  static_assert(kMaxFdNum <= kFdIndexMask + 1, "fd index bits not enough");
 
- public:
-  FdHandle() {
-    std::lock_guard<std::mutex> lock(mutex_);
-    for (int fd = 0; fd < max_fd_num_; ++fd) {
-      free_fd_pool_.push_back(fd);
-    }
-  }
-  ~FdHandle() { free_fd_pool_.clear(); }
-
-  int get_fd() noexcept {
-    std::lock_guard<std::mutex> lock(mutex_);
-    if (free_fd_pool_.empty()) [[unlikely]] {
-      SPDLOG_ERROR("fd pool is exhausted");
-      errno = EMFILE;
-      return -1;
-    }
-    SPDLOG_INFO("current fd pool size: {}", free_fd_pool_.size());
-    int fd = free_fd_pool_.front();
-    free_fd_pool_.pop_front();
-    SPDLOG_INFO("current fd: {} pool size: {}", fd, free_fd_pool_.size());
-    return fd;
-  }
+  struct alignas(hardware_destructive_interference_size) Slot {
+    std::atomic<std::shared_ptr<OpenFile>> file;
+    std::atomic<std::shared_ptr<Directory>> dir;
+    std::atomic<uint32_t> generation = 1;
+    std::atomic<uint32_t> next_free = kFdNil;
+  };
+  std::unique_ptr<Slot[]> slots_;
+  // 高32位是版本号, 低32位是栈顶的下标
+  std::atomic<uint64_t> free_head_;
+  std::atomic<uint32_t> used_num_ = 0;
 
-  void put_fd(int fd) noexcept {
-    std::lock_guard<std::mutex> lock(mutex_);
-    if (fd > max_fd_num_) [[unlikely]] {
-      SPDLOG_ERROR("fd large than max_fd_num: {}", max_fd_num_);
-      return;
-    }
-    free_fd_pool_.push_back(fd);
+ private:
+  int32_t PopFree();
+  void PushFree(uint32_t index);
+  Slot *GetSlot(int32_t fd, uint32_t *generation) const;
+  static int32_t MakeFd(uint32_t index, uint32_t generation) {
+    return static_cast<int32_t>((generation << kFdIndexBits) | index);
   }
+  // 读取槽位前后的代数都和fd一致, 读到的才是这个fd的内容
+  template <typename T>
+  std::shared_ptr<T> Load(int32_t fd,
+                          std::atomic<std::shared_ptr<T>> Slot::*field) const;
+  template <typename T>
+  std::shared_ptr<T> Release(int32_t fd,
+                             std::atomic<std::shared_ptr<T>> Slot::*field);
+
+ public:
+  FdHandle();
+  ~FdHandle() = default;
+
+  // 分配fd并绑定打开的文件或者文件夹, fd用完时返回-1, errno为EMFILE
+  int32_t AllocFd(const std::shared_ptr<OpenFile> &file);
+  int32_t AllocFd(const std::shared_ptr<Directory> &dir);
+  // fd无效或者已经关闭时返回空
+  std::shared_ptr<OpenFile> GetFile(int32_t fd) const;
+  std::shared_ptr<Directory> GetDirectory(int32_t fd) const;
+  // 解除绑定并回收fd, 同一个fd并发释放只有一个能拿到返回值
+  std::shared_ptr<OpenFile> ReleaseFile(int32_t fd);
+  std::shared_ptr<Directory> ReleaseDirectory(int32_t fd);
+
+  uint32_t used_num() const noexcept { return used_num_; }
 };
-}
+}  // namespace udisk::blockfs
@@ -1,6 +1,7 @@
 #include "file.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <stdarg.h>
 
 #include <algorithm>
@@ -9,11 +10,14 @@
 #include <mutex>
 
 #include "file_system.h"
+#include "log_ratelimit.h"
+#include "stats.h"
 #include "spdlog/spdlog.h"
 
 namespace udisk::blockfs {
 
 bool File::WriteMeta(int32_t fh) {
+  StatTimer timer(kStatMetaWriteFile);
   FileMeta *meta = reinterpret_cast<FileMeta *>(
       FileSystem::Instance()->file_handle()->base_addr() +
       FileSystem::Instance()->super_meta()->file_meta_size_ * fh);
@@ -24,18 +28,18 @@ bool File::WriteMeta(int32_t fh) {
   void *align_meta =
       static_cast<char *>(FileSystem::Instance()->file_handle()->base_addr()) +
       offset;
-  meta->crc_ = Crc32(reinterpret_cast<uint8_t *>(meta) + sizeof(meta->crc_),
-                     FileSystem::Instance()->super_meta()->file_meta_size_ -
-                         sizeof(meta->crc_));
-  uint32_t crc = meta->crc_;
-  SPDLOG_INFO("write file meta, name: {} fh: {} align_index: {} crc: {}", meta->file_name_, fh, align_index, crc);
-  // TODO: 需要全局统一枷锁
-  int64_t ret = FileSystem::Instance()->dev()->PwriteDirect(
-      align_meta, kBlockFsPageSize,
-      FileSystem::Instance()->super_meta()->file_meta_offset_ + offset);
-  if (ret != kBlockFsPageSize) [[unlikely]] {
+  meta->crc_ = FileSystem::Instance()->MetaCrc(
+      reinterpret_cast<uint8_t *>(meta) + sizeof(meta->crc_),
+      FileSystem::Instance()->super_meta()->file_meta_size_ -
+          sizeof(meta->crc_));
+  SPDLOG_DEBUG("write file meta, name: {} fh: {} align_index: {} crc: {}",
+               meta->file_name_, fh, align_index, meta->crc_);
+  if (!FileSystem::Instance()->WriteMetaPage(
+          align_meta, kBlockFsPageSize,
+          FileSystem::Instance()->super_meta()->file_meta_offset_ + offset))
+      [[unlikely]] {
     LOG(ERROR) << "write file meta, name: " << meta->file_name_ << " fh: " << fh
-               << " error size:" << ret << " need:" << kBlockFsPageSize;
+               << " failed";
     return false;
   }
   return true;
@@ -62,14 +66,14 @@ void File::ClearMeta(FileMeta *meta) {
 }
 
 ParentFilePtr ParentFile::NewParentFile(FileMeta *meta, uint64_t offset,
-                                        FileBlockMap &fbs, bool tmpfile) {
+                                        FileBlockVector &fbs, bool tmpfile) {
   return std::make_shared<ParentFile>(meta, offset, fbs, tmpfile);
 }
 
-ParentFile::ParentFile(FileMeta *meta, uint64_t offset, FileBlockMap &fbs,
+ParentFile::ParentFile(FileMeta *meta, uint64_t offset, FileBlockVector &fbs,
                        bool tmpfile)
     : meta_(meta), offset_(offset), tmp_file_(tmpfile) {
-  fbs.swap(fb_maps_);
+  fbs.swap(file_blocks_);
 }
 
 ParentFile::~ParentFile() {
@@ -83,17 +87,18 @@ bool ParentFile::Recycle() {
   uint32_t block_id_index = 0;
 
   // TODO: 从最后开始释放
-  for (uint32_t i = 0; i < fb_maps_.size(); ++i) {
-    const FileBlockPtr &fb = fb_maps_[i];
-    for (uint32_t j = 0; j < fb->used_block_num(); ++j) {
+  for (uint32_t i = 0; i < file_blocks_.size(); ++i) {
+    const FileBlockPtr &fb = file_blocks_[i];
+    std::vector<uint32_t> block_ids;
+    fb->GetBlockIds(&block_ids);
+    for (uint32_t block_id : block_ids) {
       // 前面被子文件继承的Block不能被释放
       if (block_id_index < block_num) {
         ++block_id_index;
       } else {
-        LOG(INFO) << meta_->file_name_ << " put block id "
-                  << fb->meta()->block_id_[j] << " to freelist";
-        FileSystem::Instance()->block_handle()->PutFreeBlockIdLock(
-            fb->meta()->block_id_[j]);
+        SPDLOG_TRACE("{} put block id {} to freelist", meta_->file_name_,
+                     block_id);
+        FileSystem::Instance()->block_handle()->PutFreeBlockIdLock(block_id);
       }
     }
     // TODO: FileBlock需要释放
@@ -116,7 +121,9 @@ int File::rename(const std::string &to) {
   bool success =
       FileSystem::Instance()->file_handle()->RunInMetaGuard([this, to] {
         SPDLOG_INFO("rename file {} -> {}", file_name(), to);
-        // 先把之前的文件映射去掉
+        // 修改内存元数据期间持有事务, 避免Flush拍到一半的页
+        MetaTransaction txn;
+        // 找到新老父文件夹
         const DirectoryPtr &old_dir =
             FileSystem::Instance()->dir_handle()->GetCreatedDirectory(dh());
         if (!old_dir) {
@@ -134,9 +141,7 @@ int File::rename(const std::string &to) {
         if (!old_dir->RemoveChildFile(file)) {
           return false;
         }
-        if (!FileSystem::Instance()->file_handle()->RemoveFileNoLock(file)) [[unlikely]] {
-          return false;
-        }
+        FileNameKey old_key(dh(), file_name());
 
         std::string file_name = GetFileName(to);
         set_file_name(file_name);
@@ -146,8 +151,11 @@ int File::rename(const std::string &to) {
         time_t seconds = system_clock::to_time_t(now);
         UpdateTimeStamp(seconds);
 
-        // 添加新的文件映射
-        FileSystem::Instance()->file_handle()->AddFileNoLock(file);
+        // 换成新的文件映射
+        if (!FileSystem::Instance()->file_handle()->RenameFileNoLock(
+                file, old_key)) [[unlikely]] {
+          return false;
+        }
         if (!new_dir->AddChildFile(file)) {
           return false;
         }
@@ -155,16 +163,18 @@ int File::rename(const std::string &to) {
         if (!WriteMeta()) {
           return false;
         }
-        return true;
+        return txn.Commit();
       });
   return success ? 0 : -1;
 }
 
 const uint32_t File::GetBlockNumber() const noexcept {
   uint32_t num = 0;
-  for (const auto &it : item_maps_) {
-    const FileBlockPtr &fb = it.second;
-    num += fb->used_block_num();
+  std::shared_lock lock(file_blocks_mutex_);
+  for (const FileBlockPtr &fb : file_blocks_) {
+    if (fb) {
+      num += fb->used_block_num();
+    }
   }
   LOG(DEBUG) << file_name() << " has block number: " << num;
   return num;
@@ -212,9 +222,11 @@ void File::DumpMeta() {
             << " fh: " << fh() << " dh: " << dh()
             << " crc: " << meta_->crc_ << " parent fh: " << parent_fh()
             << " parent size: " << parent_size() << " child fh: " << child_fh();
-  for (const auto &it : item_maps_) {
-    const FileBlockPtr &fb = it.second;
-    fb->DumpMeta();
+  std::shared_lock lock(file_blocks_mutex_);
+  for (const FileBlockPtr &fb : file_blocks_) {
+    if (fb) {
+      fb->DumpMeta();
+    }
   }
 }
 
@@ -224,41 +236,47 @@ bool File::AddFileBlockLock(const FileBlockPtr &fb) noexcept {
 }
 
 bool File::AddFileBlockNoLock(const FileBlockPtr &fb) noexcept {
-  auto it = item_maps_.find(fb->file_cut());
-  if (it != item_maps_.end()) [[unlikely]] {
+  std::unique_lock lock(file_blocks_mutex_);
+  // 加载的时候file cut可能是乱序的
+  if (fb->file_cut() >= file_blocks_.size()) {
+    file_blocks_.resize(fb->file_cut() + 1);
+  }
+  if (file_blocks_[fb->file_cut()]) [[unlikely]] {
     SPDLOG_INFO("{} failed to add fb because already exist: {}", file_name(), fb->index());
     return false;
   }
-  item_maps_[fb->file_cut()] = fb;
+  file_blocks_[fb->file_cut()] = fb;
   LOG(TRACE) << "file block idx: " << fb->index()
              << " add to file: " << file_name()
-             << " file block size: " << item_maps_.size()
+             << " file block size: " << file_blocks_.size()
              << " block id num: " << fb->used_block_num();
   return true;
 }
 
 bool File::RemoveAllFileBlock() {
-  for (auto iter = item_maps_.begin(); iter != item_maps_.end(); ++iter) {
-    FileBlockPtr fb = iter->second;
-    if (!fb->ReleaseAll()) {
+  std::unique_lock lock(file_blocks_mutex_);
+  for (const FileBlockPtr &fb : file_blocks_) {
+    if (fb && !fb->ReleaseAll()) {
       return false;
     }
   }
-  item_maps_.clear();
-  // 清空列表
-  assert(item_maps_.empty());
+  file_blocks_.clear();
   return true;
 }
 
-FileBlockPtr File::GetFileBlock(int32_t file_cut) {
-  SPDLOG_INFO("{} get file block cut: {} file block size: {}", file_name(), file_cut, item_maps_.size());
-  auto iter = item_maps_.find(file_cut);
-  if (iter == item_maps_.end()) [[unlikely]] {
-    LOG(ERROR) << "cannot find file cut: " << file_cut;
+FileBlockPtr File::GetFileBlock(uint32_t file_cut) const {
+  std::shared_lock lock(file_blocks_mutex_);
+  if (file_cut >= file_blocks_.size() || !file_blocks_[file_cut]) [[unlikely]] {
+    LOG(ERROR) << file_name() << " cannot find file cut: " << file_cut
+               << " file block size: " << file_blocks_.size();
     return nullptr;
   }
-  return iter->second;
-  // return GetMetaItem(file_cut);
+  return file_blocks_[file_cut];
+}
+
+uint32_t File::GetFileBlockNum() const {
+  std::shared_lock lock(file_blocks_mutex_);
+  return file_blocks_.size();
 }
 
 int File::ExtendFile(uint64_t offset) {
@@ -270,7 +288,8 @@ int File::ExtendFile(uint64_t offset) {
   }
   // 计算需要扩大偏移的位置
   uint64_t expand_size = offset - meta_->size_;
-  SPDLOG_INFO("{} need expand size: {} offset: {} current size: {}", file_name(), expand_size, offset, file_size());
+  SPDLOG_DEBUG("{} need expand size: {} offset: {} current size: {}",
+               file_name(), expand_size, offset, file_size());
 
   // 1. Count last block space left
   uint64_t last_block_left;
@@ -287,78 +306,131 @@ int File::ExtendFile(uint64_t offset) {
   } else {
     num_blocks_needed = ALIGN_UP((expand_size - last_block_left), kBlockSize);
   }
-  LOG(INFO) << file_name() << " last block left: " << last_block_left
-            << " need alloc block num: " << num_blocks_needed;
+  SPDLOG_DEBUG("{} last block left: {} need alloc block num: {}", file_name(),
+               last_block_left, num_blocks_needed);
 
-  // 是否需要申请fileblock
-  FileBlockPtr file_block = nullptr;
-  bool need_new_file_block = false;
-  if (meta_->size_ == 0) {
-    assert(item_maps_.size() == 0);
-    file_block = FileSystem::Instance()->file_block_handle()->GetFileBlockLock();
-    if (!file_block) {
-      return -1;
-    }
-    need_new_file_block = true;
-  } else {
-    // 找到的最大的file cut的file block
-    assert(item_maps_.size() > 0);
-    file_block = GetFileBlock(item_maps_.size() - 1);
-    if (nullptr == file_block) [[unlikely]] {
+  // 最后一个file cut填满之后, 剩余的block需要申请新的file cut来承载
+  FileBlockPtr last_file_block = nullptr;
+  uint32_t file_block_num = GetFileBlockNum();
+  if (file_block_num > 0) {
+    last_file_block = GetFileBlock(file_block_num - 1);
+    if (nullptr == last_file_block) [[unlikely]] {
       return -1;
     }
-    if (file_block->is_block_full()) {
-      LOG(ERROR) << file_name() << " file block is full";
+  }
+  uint32_t last_file_block_left =
+      last_file_block ? kFileBlockCapacity - last_file_block->used_block_num()
+                      : 0;
+  uint32_t new_file_block_num = 0;
+  if (num_blocks_needed > last_file_block_left) {
+    new_file_block_num = ALIGN_UP(num_blocks_needed - last_file_block_left,
+                                  kFileBlockCapacity);
+  }
+
+  // 先把需要的资源都申请到, 失败的时候回退
+  std::vector<FileBlockPtr> new_file_blocks;
+  for (uint32_t i = 0; i < new_file_block_num; ++i) {
+    FileBlockPtr file_block =
+        FileSystem::Instance()->file_block_handle()->GetFileBlockLock();
+    if (!file_block) {
+      for (const FileBlockPtr &fb : new_file_blocks) {
+        FileSystem::Instance()->file_block_handle()->PutFileBlockLock(fb);
+      }
       return -1;
     }
-    need_new_file_block = false;
+    new_file_blocks.push_back(file_block);
   }
-
   std::vector<uint32_t> block_ids;
   if (num_blocks_needed > 0) {
     if (!FileSystem::Instance()->block_handle()->GetFreeBlockIdLock(
             num_blocks_needed, &block_ids)) {
-      // 此处需要释放fileblock, 回退资源
-      if (need_new_file_block) {
-        FileSystem::Instance()->file_block_handle()->PutFileBlockLock(file_block);
+      for (const FileBlockPtr &fb : new_file_blocks) {
+        FileSystem::Instance()->file_block_handle()->PutFileBlockLock(fb);
       }
       return -1;
     }
   }
-  if (need_new_file_block) {
+
+  // 修改之前的元数据, 失败时恢复, 否则之后的提交会把放弃的修改写下去
+  std::string last_file_block_meta =
+      last_file_block ? last_file_block->SaveMeta() : std::string();
+  std::vector<std::string> new_file_block_metas;
+  for (const FileBlockPtr &fb : new_file_blocks) {
+    new_file_block_metas.push_back(fb->SaveMeta());
+  }
+  uint64_t old_size = file_size();
+  // fileblock和文件的元数据修改作为一个事务落盘
+  MetaTransaction txn;
+  auto rollback = [&]() {
+    int error = errno;
+    {
+      // 提交失败时事务已经结束, 恢复的内容单独提交
+      MetaTransaction undo;
+      {
+        std::unique_lock lock(file_blocks_mutex_);
+        file_blocks_.resize(file_block_num);
+      }
+      if (last_file_block) {
+        last_file_block->RestoreMeta(last_file_block_meta);
+        FileBlock::WriteMeta(last_file_block->index());
+      }
+      for (uint32_t i = 0; i < new_file_blocks.size(); ++i) {
+        new_file_blocks[i]->RestoreMeta(new_file_block_metas[i]);
+        FileBlock::WriteMeta(new_file_blocks[i]->index());
+      }
+      FileSystem::Instance()->file_handle()->RunInMetaGuard(
+          [this, old_size] {
+            set_file_size(old_size);
+            return WriteMeta();
+          });
+      undo.Commit();
+    }
+    txn.Abort();
+    for (const FileBlockPtr &fb : new_file_blocks) {
+      FileSystem::Instance()->file_block_handle()->PutFileBlockLock(fb);
+    }
+    if (!block_ids.empty()) {
+      FileSystem::Instance()->block_handle()->PutFreeBlockIdLock(block_ids);
+    }
+    errno = error;
+    return -1;
+  };
+
+  for (uint32_t i = 0; i < new_file_blocks.size(); ++i) {
+    const FileBlockPtr &file_block = new_file_blocks[i];
     file_block->set_used(true);
-    file_block->set_file_cut(0);
+    file_block->set_file_cut(file_block_num + i);
     file_block->set_fh(meta_->fh_);
     file_block->set_is_temp(this->is_temp());
   }
 
-  // 开始填充fileblock的参数
-  uint32_t block_ids_cursor = 0;
-  // 存在新申请block的的场景
-  while (block_ids_cursor < block_ids.size()) {
-    if (file_block && !file_block->is_block_full()) {
-      // 如果fileblock没有填满,并且blockid还没填充使用完
-      SPDLOG_INFO("{} fill file block, used_block_num: {} block id: {}", file_name(), file_block->used_block_num(), block_ids[block_ids_cursor]);
-      file_block->add_block_id(block_ids[block_ids_cursor++]);
-      SPDLOG_INFO("{} fill file block, used_block_num: {} left block ids num: {}", file_name(), file_block->used_block_num(), (block_ids.size() - block_ids_cursor));
-    } else {
-      LOG(ERROR) << file_name() << " file block is full";
-      return -1;
+  // 开始填充fileblock的参数, 记录修改过的fileblock
+  std::vector<FileBlockPtr> dirty_file_blocks;
+  FileBlockPtr file_block = last_file_block;
+  uint32_t new_file_block_cursor = 0;
+  for (uint32_t block_id : block_ids) {
+    if (!file_block || file_block->is_block_full()) {
+      file_block = new_file_blocks[new_file_block_cursor++];
+    }
+    if (dirty_file_blocks.empty() || dirty_file_blocks.back() != file_block) {
+      dirty_file_blocks.push_back(file_block);
     }
+    file_block->add_block_id(block_id);
   }
+  SPDLOG_DEBUG("{} fill file block, block ids num: {} new file block num: {}", file_name(), block_ids.size(), new_file_blocks.size());
 
   // 开始持久化fileblock元数据
   // 新增了block才会涉及到fileblock的更新
   // 否则就是在原来的block的基础上更新下文件offset即可
-  if (block_ids.size() > 0) {
-    if (!file_block->WriteMeta()) {
-      return -1;
-    }
-    if (need_new_file_block) {
-      // 更新文件内存中fileblock信息
-      AddFileBlockNoLock(file_block);
+  for (const FileBlockPtr &fb : dirty_file_blocks) {
+    if (!fb->WriteMeta()) {
+      return rollback();
     }
   }
+  // 更新文件内存中fileblock信息
+  for (const FileBlockPtr &fb : new_file_blocks) {
+    AddFileBlockNoLock(fb);
+  }
 
   bool success =
       FileSystem::Instance()->file_handle()->RunInMetaGuard([this, offset] {
@@ -371,7 +443,11 @@ int File::ExtendFile(uint64_t offset) {
         return true;
       });
   if (!success) [[unlikely]] {
-    return -1;
+    return rollback();
+  }
+  if (!txn.Commit()) [[unlikely]] {
+    errno = EIO;
+    return rollback();
   }
   return 0;
 }
@@ -440,23 +516,25 @@ int File::RecycleParentFh(int32_t fh, bool immediately) {
 }
 
 // truncate变小的场景 需要新申请文件fh继承来自老的fh
+// 新老文件和FileBlock的元数据作为一个事务落盘, 提交之后再回收老的fh
 int File::ShrinkFile(uint64_t offset) {
+  const DirectoryPtr &dir =
+      FileSystem::Instance()->dir_handle()->GetCreatedDirectory(dh());
+  if (!dir) [[unlikely]] {
+    return -1;
+  }
   // 先保证申请fh成功, 并且如果需要涉及到block的申请和拷贝
-  // TODO: 可以先使用临时的meta保证不被写入到磁盘上去
   FileMeta *new_meta =
       FileSystem::Instance()->file_handle()->NewFreeFileMeta(dh(), file_name());
   if (!new_meta) [[unlikely]] {
     return -1;
   }
   FileMeta *old_meta = meta();
+  int32_t old_child_fh = old_meta->child_fh_;
 
   uint32_t block_num = offset / kBlockSize;
   uint64_t block_offset = offset % kBlockSize;
 
-  // uint32_t file_cut = block_num / kFileBlockCapacity;
-  uint32_t file_cut = 0;
-  uint32_t file_block_offset = block_num % kFileBlockCapacity;
-
   // 继承临时文件属性
   new_meta->is_temp_ = old_meta->is_temp_;
   new_meta->parent_fh_ = old_meta->fh_;
@@ -464,86 +542,110 @@ int File::ShrinkFile(uint64_t offset) {
   // 先赋值继承父文件的size,如果需要单独申请 一个block,做单独的申请
   new_meta->size_ = block_num * kBlockSize;
 
+  // 新文件继承前block_num个完整的block
+  // 在block中间截断需要单独申请一个block来承载最后的部分
+  // 0 1 2 3 4 ............ 998 999 [1000个] 0 1 2 3 4 ......
+  // x x x x x ............  x  [8M|8M]
+  uint32_t new_block_num = block_num + (block_offset > 0 ? 1 : 0);
+  uint32_t file_block_num = ALIGN_UP(new_block_num, kFileBlockCapacity);
+
+  std::vector<FileBlockPtr> new_file_blocks;
+  std::vector<std::string> new_file_block_metas;
+  std::vector<uint32_t> block_ids;
+  // 切换到新的fh之后, 老的FileBlock暂存在这里, 提交之后交给父文件回收
+  FileBlockVector old_file_blocks;
+  bool switched = false;
+  MetaTransaction txn;
+  // 失败时恢复内存中的元数据再放弃事务, 申请的资源都还回去
+  auto rollback = [&]() {
+    int error = errno;
+    {
+      // 提交失败时事务已经结束, 恢复的内容单独提交
+      MetaTransaction undo;
+      if (switched) {
+        {
+          std::unique_lock lock(file_blocks_mutex_);
+          file_blocks_.swap(old_file_blocks);
+        }
+        FileSystem::Instance()->file_handle()->RemoveFileFromoDirectory(
+            dir, shared_from_this());
+        set_meta(old_meta);
+        FileSystem::Instance()->file_handle()->AddFileToDirectory(
+            dir, shared_from_this());
+        old_meta->child_fh_ = old_child_fh;
+        File::WriteMeta(old_meta->fh_);
+      }
+      for (uint32_t i = 0; i < new_file_blocks.size(); ++i) {
+        new_file_blocks[i]->RestoreMeta(new_file_block_metas[i]);
+        FileBlock::WriteMeta(new_file_blocks[i]->index());
+      }
+      File::ClearMeta(new_meta);
+      File::WriteMeta(new_meta->fh_);
+      undo.Commit();
+    }
+    txn.Abort();
+    for (const FileBlockPtr &fb : new_file_blocks) {
+      FileSystem::Instance()->file_block_handle()->PutFileBlockLock(fb);
+    }
+    FileSystem::Instance()->file_handle()->AddFile2Free(new_meta->fh_);
+    if (!block_ids.empty()) {
+      FileSystem::Instance()->block_handle()->PutFreeBlockIdLock(block_ids);
+    }
+    errno = error;
+    return -1;
+  };
+
   // 新申请FileBlock把blockid拷贝过来
-  // 开始申请资源
-  uint32_t file_block_num = file_cut;
-  // 多申请一个FileBlock
-  // 有可能是为了有多个剩余的block
-  // 有可能是为了放最后一个copy的block
-  if (file_block_offset > 0 || block_offset > 0) {
-    file_block_num = 1;
-  }
-  FileBlockPtr file_block = nullptr;
-  if (file_block_num > 0) {
-    file_block = FileSystem::Instance()->file_block_handle()->GetFileBlockLock();
+  for (uint32_t i = 0; i < file_block_num; ++i) {
+    FileBlockPtr file_block =
+        FileSystem::Instance()->file_block_handle()->GetFileBlockLock();
     if (!file_block) {
-      return -1;
+      return rollback();
     }
-    // 拷贝block_num, 可能还需要单独申请一个
-    uint32_t copy_block_num = 0;
-    bool copy_compelted = false;
-    FileBlockPtr old_fb = nullptr;
-    FileBlockPtr new_fb = nullptr;
-    for (uint32_t i = 0; i < file_block_num; ++i) {
-      old_fb = GetMetaItem(i);
-      new_fb = file_block;
-      assert(old_fb->file_cut() == i);
-      new_fb->set_used(true);
-      new_fb->set_file_cut(old_fb->file_cut());
-      new_fb->set_fh(new_meta->fh_);
-      new_fb->set_is_temp(new_meta->is_temp_);
-      if (block_num == 0) {
-        LOG(INFO) << file_name()
-                  << " no completed block inherited from parent file";
-        break;
-      }
+    new_file_block_metas.push_back(file_block->SaveMeta());
+    new_file_blocks.push_back(file_block);
+    file_block->set_used(true);
+    file_block->set_file_cut(i);
+    file_block->set_fh(new_meta->fh_);
+    file_block->set_is_temp(new_meta->is_temp_);
+  }
 
-      for (uint32_t j = 0; j < kFileBlockCapacity; ++j) {
-        LOG(INFO) << file_name() << " now copy parent block index: " << i
-                  << " block id: " << old_fb->meta()->block_id_[j];
-        new_fb->add_block_id(old_fb->meta()->block_id_[j]);
-        ++copy_block_num;
-        if (copy_block_num == block_num) {
-          SPDLOG_INFO("{} copy block id compelted", file_name());
-          copy_compelted = true;
-          break;
-        }
+  FileBlockPtr old_fb = nullptr;
+  for (uint32_t i = 0; i < block_num; ++i) {
+    if (i % kFileBlockCapacity == 0) {
+      old_fb = GetFileBlock(i / kFileBlockCapacity);
+      if (!old_fb) [[unlikely]] {
+        return rollback();
       }
-      if (copy_compelted) break;
     }
-    // 在block中间截断需要单独申请一个block来承载
-    if (block_offset > 0) {
-      std::vector<uint32_t> block_ids;
-      if (!FileSystem::Instance()->block_handle()->GetFreeBlockIdLock(
-              1, &block_ids)) {
-        return -1;
-      }
-      uint32_t new_block_id = block_ids[0];
-      LOG(INFO) << file_name() << " new block id: " << new_block_id;
-      LOG(INFO) << file_name() << " new file block id: " << new_fb->index();
-
-      // 可能已经在下一个fileblock
-      // 0 1 2 3 4 ............ 998 999 [1000个] 0 1 2 3 4 ......
-      // x x x x x ............  x  [8M|8M]
-      if (!CopyData(old_fb->meta()->block_id_[file_block_offset], new_block_id,
-                    0, block_offset)) {
-        return -1;
-      }
-      SPDLOG_INFO("{} file_block_num: {}", file_name(), file_block_num);
-      // 填充到申请最后一个fileblock
-      new_fb = file_block;
-      new_fb->add_block_id(new_block_id);
+    new_file_blocks[i / kFileBlockCapacity]->add_block_id(
+        old_fb->get_block_id(i % kFileBlockCapacity));
+  }
+  SPDLOG_INFO("{} inherit {} blocks from parent file", file_name(), block_num);
+
+  if (block_offset > 0) {
+    if (!FileSystem::Instance()->block_handle()->GetFreeBlockIdLock(
+            1, &block_ids)) {
+      return rollback();
+    }
+    uint32_t new_block_id = block_ids[0];
+    old_fb = GetFileBlock(block_num / kFileBlockCapacity);
+    if (!old_fb) [[unlikely]] {
+      return rollback();
+    }
+    const FileBlockPtr &new_fb = new_file_blocks[block_num / kFileBlockCapacity];
+    SPDLOG_TRACE("{} new block id: {} new file block id: {}", file_name(),
+                 new_block_id, new_fb->index());
+    if (!CopyData(old_fb->get_block_id(block_num % kFileBlockCapacity),
+                  new_block_id, 0, block_offset)) {
+      return rollback();
     }
+    new_fb->add_block_id(new_block_id);
   }
 
   // 老的文件需要找到子文件
   old_meta->child_fh_ = new_meta->fh_;
 
-  const DirectoryPtr &dir =
-      FileSystem::Instance()->dir_handle()->GetCreatedDirectory(dh());
-  if (!dir) [[unlikely]] {
-    return -1;
-  }
   // 删除之前的meta的fh映射
   FileSystem::Instance()->file_handle()->RemoveFileFromoDirectory(
       dir, shared_from_this());
@@ -552,16 +654,15 @@ int File::ShrinkFile(uint64_t offset) {
   this->set_meta(new_meta);
   FileSystem::Instance()->file_handle()->AddFileToDirectory(dir,
                                                            shared_from_this());
-
-  ParentFilePtr parent =
-      ParentFile::NewParentFile(old_meta, offset, item_maps_);
-  if (!parent || !FileSystem::Instance()->file_handle()->AddParentFile(parent)) {
-    return -1;
+  {
+    std::unique_lock lock(file_blocks_mutex_);
+    file_blocks_.swap(old_file_blocks);
   }
+  switched = true;
 
-  if (file_block) {
-    // 添加到文件内存的filecut映射中
-    AddFileBlockNoLock(file_block);
+  // 添加到文件内存的filecut映射中
+  for (const FileBlockPtr &fb : new_file_blocks) {
+    AddFileBlockNoLock(fb);
   }
 
   // 更新到实际truncate后的size
@@ -569,52 +670,92 @@ int File::ShrinkFile(uint64_t offset) {
 
   // 先写新文件file元数据, 如果失败自然没有fileblock的元数据
   if (!WriteMeta()) {
-    return -1;
+    return rollback();
   }
   // 写新文件FileBlock的元数据
-  if (file_block) {
-    if (!file_block->WriteMeta()) {
-      return -1;
+  for (const FileBlockPtr &fb : new_file_blocks) {
+    if (!fb->WriteMeta()) {
+      return rollback();
     }
   }
 
   // 新文件落盘, 再删除老文件
   if (!WriteMeta(old_meta->fh_)) {
-    return -1;
+    return rollback();
+  }
+  if (!txn.Commit()) [[unlikely]] {
+    errno = EIO;
+    return rollback();
   }
 
   LOG(INFO) << "shrink for: " << file_name()
             << " block_offset: " << block_offset;
 
+  // 老的fh在磁盘上已经是父文件, 回收失败时和挂载时遇到的父文件一样留着
+  ParentFilePtr parent =
+      ParentFile::NewParentFile(old_meta, offset, old_file_blocks);
+  if (!FileSystem::Instance()->file_handle()->AddParentFile(parent))
+      [[unlikely]] {
+    return -1;
+  }
+  // 回收会释放block, 内存无法恢复, 出错时也要把已经做的修改提交下去
+  MetaTransaction recycle_txn;
+  int ret = RecycleParentFh(old_meta->fh_, true);
+  if (!recycle_txn.Commit() && ret == 0) [[unlikely]] {
+    errno = EIO;
+    return -1;
+  }
   // 等从节点响应之后再回收父fh
-  return RecycleParentFh(old_meta->fh_, true);
+  return ret;
 }
 
 int File::ftruncate(uint64_t offset) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  SPDLOG_INFO("file name: {} file size: {} ftruncate offset: {}", file_name(), file_size(), offset);
-  if (offset > file_size()) {
-    return ExtendFile(offset);
-  } else if (offset < file_size()) {
-    return ShrinkFile(offset);
+  std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+  LockWithStat(lock, kStatLockFile);
+  SPDLOG_DEBUG("file name: {} file size: {} ftruncate offset: {}", file_name(),
+               file_size(), offset);
+  if (offset != file_size()) {
+    // 失败时内存中的修改已经在里面恢复了
+    return offset > file_size() ? ExtendFile(offset) : ShrinkFile(offset);
   } else {
-    LOG(WARNING) << file_name() << " truncate offset: " << offset
-                 << " file size: " << file_size() << ", no need to truncate";
+    SPDLOG_DEBUG("{} truncate offset: {} file size: {}, no need to truncate",
+                 file_name(), offset, file_size());
     return 0;
   }
 }
 
-int File::fsync() { return FileSystem::Instance()->dev()->Fsync(); }
+int File::fallocate(uint64_t end) {
+  std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+  LockWithStat(lock, kStatLockFile);
+  if (end <= file_size()) {
+    return 0;
+  }
+  SPDLOG_DEBUG("file name: {} file size: {} fallocate end: {}", file_name(),
+               file_size(), end);
+  return ExtendFile(end);
+}
+
+int File::fsync(MetaSyncPoint point) {
+  if (!FileSystem::Instance()->journal()->Sync(point)) [[unlikely]] {
+    errno = EIO;
+    return -1;
+  }
+  return FileSystem::Instance()->dev()->Fsync();
+}
 
 void File::UpdateTimeStamp(time_t seconds) {
+  // 没有页要写, 只为了在修改crc期间挡住Flush
+  MetaTransaction txn;
   std::lock_guard<std::mutex> lock(mutex_);
 
   set_mtime(seconds);
   set_ctime(seconds);
 
-  meta_->crc_ = Crc32(reinterpret_cast<uint8_t *>(meta_) + sizeof(meta_->crc_),
-                      FileSystem::Instance()->super_meta()->file_meta_size_ -
-                          sizeof(meta_->crc_));
+  meta_->crc_ = FileSystem::Instance()->MetaCrc(
+      reinterpret_cast<uint8_t *>(meta_) + sizeof(meta_->crc_),
+      FileSystem::Instance()->super_meta()->file_meta_size_ -
+          sizeof(meta_->crc_));
+  txn.Commit();
 }
 
 bool File::UpdateMeta() { return WriteMeta(); }
@@ -629,7 +770,8 @@ off_t OpenFile::lseek(off_t offset, int whence) {
   /* get current file position */
   off_t current_pos = append_pos();
 
-  SPDLOG_DEBUG("{} lseek fh: {} offset: {}", file_->file_name(), file_->fh(), current_pos);
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC, "{} lseek fh: {} offset: {}",
+                      file_->file_name(), file_->fh(), current_pos);
 
   switch (whence) {
     case SEEK_SET:
@@ -655,55 +797,192 @@ off_t OpenFile::lseek(off_t offset, int whence) {
 }
 
 int64_t OpenFile::read(void *buf, uint64_t size, uint64_t append_pos) {
-  LOG(INFO) << "file name: " << file_->file_name()
-            << " file size: " << file_->file_size() << " read size: " << size
-            << " offset: " << append_pos;
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC,
+                      "file name: {} file size: {} read size: {} offset: {}",
+                      file_->file_name(), file_->file_size(), size, append_pos);
   if (size == 0 || append_pos >= file_->file_size()) [[unlikely]] {
-    LOG(ERROR) << file_->file_name() << " read nothing,"
-                 << " read size: " << size << " read offset: " << append_pos
-                 << " file size: " << file_->file_size();
+    // 读到文件末尾是正常情况, 不能按WARNING打印
+    BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC,
+                        "{} read nothing, read size: {} read offset: {} "
+                        "file size: {}",
+                        file_->file_name(), size, append_pos,
+                        file_->file_size());
     return 0;
   }
   uint64_t need_read_size = size;
   if (append_pos + size > file_->file_size()) {
     need_read_size = file_->file_size() - append_pos;
-    SPDLOG_WARN("{} read file from offset to end, file size: {} offset: {}", file_->file_name(), file_->file_size(), append_pos);
+    BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC,
+                        "{} read file from offset to end, file size: {} "
+                        "offset: {}",
+                        file_->file_name(), file_->file_size(), append_pos);
   }
 
-  FileReader reader =
-      FileReader(shared_from_this(), buf, need_read_size, append_pos, false);
+  struct iovec iov = {buf, need_read_size};
+  FileReader reader = FileReader(shared_from_this(), &iov, 1, need_read_size,
+                                 append_pos, false);
   int64_t ret = reader.ReadData();
   return ret;
 }
 
-int64_t OpenFile::FileReader::ReadBlockData(BlockData *block) {
-  SPDLOG_INFO("{} read udisk offset: {} read size: {} buffer addr: 0x{}", open_file_->file()->file_name(), block->dev_offset, block->read_size_, (uint64_t)block->extern_buffer);
-  if (direct_) {
-    return FileSystem::Instance()->dev()->PreadDirect(
-        block->extern_buffer, block->read_size_, block->dev_offset);
-  } else {
-    return FileSystem::Instance()->dev()->PreadCache(
-        block->extern_buffer, block->read_size_, block->dev_offset);
+// 一次请求涉及的block需要同时加锁, 按照block id升序加锁避免请求之间死锁
+// 和上一个段在磁盘上首尾相接的时候直接合并, 减少IO的个数
+// 用户数据在请求内总是连续的, 跨越多个iovec由BuildDeviceIo切分
+void OpenFile::AppendBlockData(std::vector<BlockData> *blocks,
+                               const BlockData &block) {
+  if (!blocks->empty()) {
+    BlockData &last = blocks->back();
+    if (last.block_id + last.block_num == block.block_id &&
+        last.dev_offset + last.read_size_ == block.dev_offset) {
+      last.block_num += block.block_num;
+      last.read_size_ += block.read_size_;
+      return;
+    }
+  }
+  blocks->emplace_back(block);
+}
+
+std::vector<uint32_t> OpenFile::SortedBlockLocks(
+    const std::vector<BlockData> &blocks) {
+  std::vector<uint32_t> lock_indexes;
+  lock_indexes.reserve(blocks.size());
+  for (const BlockData &block : blocks) {
+    for (uint32_t i = 0; i < block.block_num; ++i) {
+      lock_indexes.push_back(
+          BlockHandle::block_lock_index(block.block_id + i));
+    }
+  }
+  // block锁是分片的, 不同的block可能映射到同一把锁
+  std::sort(lock_indexes.begin(), lock_indexes.end());
+  lock_indexes.erase(std::unique(lock_indexes.begin(), lock_indexes.end()),
+                     lock_indexes.end());
+  return lock_indexes;
+}
+
+// 把物理连续的段映射到用户的iovec上, 段落在单个iovec内的时候直接用buf
+// 跨越多个iovec时切出对应的片段, 设备上一次preadv/pwritev完成
+// iov为空(零拷贝)时只有设备的偏移和长度
+void OpenFile::BuildDeviceIo(const std::vector<BlockData> &blocks,
+                             const struct iovec *iov, int iovcnt,
+                             std::vector<DeviceIo> *ios,
+                             std::vector<struct iovec> *pieces) {
+  ios->reserve(blocks.size());
+  if (!iov) {
+    for (const BlockData &block : blocks) {
+      ios->push_back({nullptr, block.read_size_, block.dev_offset, 0});
+    }
+    return;
+  }
+  // 片段数不会超过iovec个数加上段的个数, 提前分配好, 指针不会失效
+  pieces->reserve(iovcnt + blocks.size());
+  int index = 0;         // 当前的iovec
+  uint64_t consumed = 0; // 当前iovec已经映射的字节数
+  for (const BlockData &block : blocks) {
+    while (consumed == iov[index].iov_len) {
+      ++index;
+      consumed = 0;
+    }
+    uint8_t *base = static_cast<uint8_t *>(iov[index].iov_base);
+    if (iov[index].iov_len - consumed >= block.read_size_) {
+      ios->push_back({base + consumed, block.read_size_, block.dev_offset, 0});
+      consumed += block.read_size_;
+      continue;
+    }
+    uint64_t left = block.read_size_;
+    uint64_t dev_offset = block.dev_offset;
+    std::size_t first = pieces->size();
+    uint64_t len = 0;
+    while (left > 0) {
+      while (consumed == iov[index].iov_len) {
+        ++index;
+        consumed = 0;
+      }
+      base = static_cast<uint8_t *>(iov[index].iov_base);
+      uint64_t n = std::min(left, iov[index].iov_len - consumed);
+      pieces->push_back({base + consumed, n});
+      consumed += n;
+      left -= n;
+      len += n;
+      // 单次preadv/pwritev最多IOV_MAX个iovec, 超过的部分拆成下一个io
+      if (left == 0 || pieces->size() - first == IOV_MAX) {
+        DeviceIo io = {nullptr, len, dev_offset, 0};
+        io.iov = pieces->data() + first;
+        io.iovcnt = pieces->size() - first;
+        ios->push_back(io);
+        dev_offset += len;
+        first = pieces->size();
+        len = 0;
+      }
+    }
   }
 }
 
+int64_t OpenFile::FileReader::ReadBlocks() {
+  std::vector<DeviceIo> ios;
+  std::vector<struct iovec> pieces;
+  BuildDeviceIo(read_blocks_, iov_, iovcnt_, &ios, &pieces);
+  BFS_DEBUG_RATELIMIT(
+      BFS_HOT_LOG_PER_SEC,
+      "{} read block segments: {} device ios: {} iovec pieces: {}",
+      open_file_->file()->file_name(), read_blocks_.size(), ios.size(),
+      pieces.size());
+  std::vector<uint32_t> lock_indexes = SortedBlockLocks(read_blocks_);
+  std::vector<std::shared_lock<std::shared_mutex>> locks;
+  locks.reserve(lock_indexes.size());
+  for (uint32_t lock_index : lock_indexes) {
+    locks.emplace_back(
+        FileSystem::Instance()->block_handle()->block_lock_at(lock_index),
+        std::defer_lock);
+    LockWithStat(locks.back(), kStatLockBlockRead);
+  }
+  if (transfer_) {
+    int32_t fd = FileSystem::Instance()->dev()->TransferFd(ios.data(),
+                                                           ios.size(), direct_);
+    return fd < 0 ? -1 : (*transfer_)(fd, ios.data(), ios.size());
+  }
+  // 所有的block段一次提交
+  return FileSystem::Instance()->dev()->PreadBatch(ios.data(), ios.size(),
+                                                   direct_);
+}
+
 int64_t OpenFile::FileReader::ReadData() {
   // 按照block来切分递增计数直到和需要读取的size相等
   uint64_t curr_read_count = 0;
   uint32_t block_id = 0;   // 读取的是全局block的索引
   uint32_t block_read_offset = 0;  // 读取的block的偏移,初始为偏移为0
   uint64_t block_read_size = 0;    // 读取当前block的大小
-  int32_t block_index_in_file_block = offset_ / kBlockSize;
+  // 文件内的block索引, 除以kFileBlockCapacity就是file cut
+  uint32_t block_index_in_file = offset_ / kBlockSize;
   uint64_t block_offset_in_block = offset_ % kBlockSize;
 
   const FilePtr &file = open_file_->file();
-  FileBlockPtr file_block = file->GetFileBlock(0);
-  // 删除文件发生故障, 只删除了fileblock的情形
-  if (nullptr == file_block) [[unlikely]] {
-    return -1;
-  }
+  FileBlockPtr file_block = nullptr;
+  uint32_t file_cut = UINT32_MAX;
+  uint32_t run_left = 0;  // 当前extent剩余的物理连续block个数
   do {
-    block_id = file_block->get_block_id(block_index_in_file_block);
+    // 跨越file cut的时候才需要重新定位fileblock
+    if (block_index_in_file / kFileBlockCapacity != file_cut) {
+      file_cut = block_index_in_file / kFileBlockCapacity;
+      file_block = file->GetFileBlock(file_cut);
+      run_left = 0;
+      // 删除文件发生故障, 只删除了fileblock的情形
+      if (nullptr == file_block) [[unlikely]] {
+        errno = EIO;
+        return -1;
+      }
+    }
+    // 一次查找得到一段物理连续的block, 后续的block直接递增
+    if (run_left == 0) {
+      run_left = file_block->GetBlockRun(
+          block_index_in_file % kFileBlockCapacity, &block_id);
+      if (run_left == 0) [[unlikely]] {
+        errno = EIO;
+        return -1;
+      }
+    } else {
+      ++block_id;
+    }
+    --run_left;
     // 第一次填充的可能是在某个block中间的偏移
     if (block_offset_in_block > 0) {
       block_read_offset = block_offset_in_block;
@@ -720,39 +999,31 @@ int64_t OpenFile::FileReader::ReadData() {
         FileSystem::Instance()->super_meta()->block_data_start_offset_ +
         FileSystem::Instance()->super_meta()->block_size_ * block_id +
         block_read_offset;
-    // TODO: 如果连续的block的话,读写可以考虑聚合优化
-    uint64_t block_data_start_offset = FileSystem::Instance()->super_meta()->block_data_start_offset_;
-    SPDLOG_INFO("{} data_start_offset: {} need read offset: {} block_id: {} block_read_offset: {} block_read_size: {} dev_offset: {}", file->file_name(), block_data_start_offset, curr_read_count, block_id, block_read_offset, block_read_size, dev_offset);
+    SPDLOG_TRACE("{} need read offset: {} block_id: {} block_read_offset: {} "
+                 "block_read_size: {} dev_offset: {}",
+                 file->file_name(), curr_read_count, block_id,
+                 block_read_offset, block_read_size, dev_offset);
     BlockData block {
       .block_id = block_id,
-      .extern_buffer = read_buffer_ + curr_read_count,
+      .block_num = 1,
       .dev_offset = dev_offset,
       .read_size_ = block_read_size
     };
-    read_blocks_.emplace_back(block);
+    AppendBlockData(&read_blocks_, block);
     curr_read_count += block_read_size;
     if (curr_read_count >= size_) {
-      SPDLOG_DEBUG("finshed fill read block");
+      SPDLOG_TRACE("finshed fill read block");
       break;
     }
     // 按照block的粒度读取, 处理完一个block即block索引增加
-    ++block_index_in_file_block;
+    ++block_index_in_file;
   } while (true);
 
-  int64_t ret = 0;
-  int64_t block_read;
-  uint32_t block_num = read_blocks_.size();
-  for (uint32_t i = 0; i < block_num; ++i) {
-    uint32_t block_id = read_blocks_[i].block_id;
-    std::shared_lock lock(FileSystem::Instance()->block_handle()->block_lock(block_id));
-    block_read = ReadBlockData(&read_blocks_[i]);
-    if (block_read <= 0) [[unlikely]] {
-      LOG(ERROR) << open_file_->file()->file_name()
-                 << " read block data ret: " << block_read
-                 << " errno: " << errno;
-      break;
-    }
-    ret += block_read;
+  int64_t ret = ReadBlocks();
+  if (ret <= 0) [[unlikely]] {
+    LOG(ERROR) << open_file_->file()->file_name()
+               << " read block data ret: " << ret << " errno: " << errno;
+    return ret;
   }
   if (!direct_) {
     open_file_->set_append_pos(open_file_->append_pos() + ret);
@@ -760,28 +1031,47 @@ int64_t OpenFile::FileReader::ReadData() {
   return ret;
 }
 
-OpenFile::FileWriter::FileWriter(OpenFilePtr file, void *buffer, uint64_t size,
-                                 uint64_t offset, bool direct)
+OpenFile::FileWriter::FileWriter(OpenFilePtr file, const struct iovec *iov,
+                                 int iovcnt, uint64_t size, uint64_t offset,
+                                 bool direct, const DeviceTransfer *transfer)
     : open_file_(file),
-      write_buffer_(static_cast<uint8_t *>(buffer)),
+      iov_(iov),
+      iovcnt_(iovcnt),
       size_(size),
       offset_(offset),
-      direct_(direct) {
+      direct_(direct),
+      transfer_(transfer) {
 }
 
-int64_t OpenFile::FileWriter::WriteBlockData(BlockData *block) {
-  SPDLOG_INFO("{} write disk offset: {} write size: {} buffer addr: 0x{}", open_file_->file()->file_name(), block->dev_offset, block->write_size_, (uint64_t)block->extern_buffer);
-  if (direct_) {
-    return FileSystem::Instance()->dev()->PwriteDirect(
-        block->extern_buffer, block->write_size_, block->dev_offset);
-  } else {
-    return FileSystem::Instance()->dev()->PwriteCache(
-        block->extern_buffer, block->write_size_, block->dev_offset);
+int64_t OpenFile::FileWriter::WriteBlocks() {
+  std::vector<DeviceIo> ios;
+  std::vector<struct iovec> pieces;
+  BuildDeviceIo(write_blocks_, iov_, iovcnt_, &ios, &pieces);
+  BFS_DEBUG_RATELIMIT(
+      BFS_HOT_LOG_PER_SEC,
+      "{} write block segments: {} device ios: {} iovec pieces: {}",
+      open_file_->file()->file_name(), write_blocks_.size(), ios.size(),
+      pieces.size());
+  std::vector<uint32_t> lock_indexes = SortedBlockLocks(write_blocks_);
+  std::vector<std::unique_lock<std::shared_mutex>> locks;
+  locks.reserve(lock_indexes.size());
+  for (uint32_t lock_index : lock_indexes) {
+    locks.emplace_back(
+        FileSystem::Instance()->block_handle()->block_lock_at(lock_index),
+        std::defer_lock);
+    LockWithStat(locks.back(), kStatLockBlockWrite);
+  }
+  if (transfer_) {
+    int32_t fd = FileSystem::Instance()->dev()->TransferFd(ios.data(),
+                                                           ios.size(), direct_);
+    return fd < 0 ? -1 : (*transfer_)(fd, ios.data(), ios.size());
   }
+  return FileSystem::Instance()->dev()->PwriteBatch(ios.data(), ios.size(),
+                                                    direct_);
 }
 
 int64_t OpenFile::FileWriter::WriteData() {
-  int32_t block_index_in_file_block = offset_ / kBlockSize;
+  uint32_t block_index_in_file = offset_ / kBlockSize;
   uint64_t block_offset_in_block = offset_ % kBlockSize;
 
   uint64_t curr_write_count = 0;
@@ -790,9 +1080,31 @@ int64_t OpenFile::FileWriter::WriteData() {
   uint64_t block_write_size = 0;
 
   const FilePtr &file = open_file_->file();
-  FileBlockPtr file_block = file->GetFileBlock(0);
+  FileBlockPtr file_block = nullptr;
+  uint32_t file_cut = UINT32_MAX;
+  uint32_t run_left = 0;  // 当前extent剩余的物理连续block个数
   do {
-    block_id = file_block->get_block_id(block_index_in_file_block);
+    if (block_index_in_file / kFileBlockCapacity != file_cut) {
+      file_cut = block_index_in_file / kFileBlockCapacity;
+      file_block = file->GetFileBlock(file_cut);
+      run_left = 0;
+      if (nullptr == file_block) [[unlikely]] {
+        errno = EIO;
+        return -1;
+      }
+    }
+    // 一次查找得到一段物理连续的block, 后续的block直接递增
+    if (run_left == 0) {
+      run_left = file_block->GetBlockRun(
+          block_index_in_file % kFileBlockCapacity, &block_id);
+      if (run_left == 0) [[unlikely]] {
+        errno = EIO;
+        return -1;
+      }
+    } else {
+      ++block_id;
+    }
+    --run_left;
 
     //  第一次填充的可能是在某个block中间的偏移
     if (block_offset_in_block > 0) {
@@ -809,38 +1121,30 @@ int64_t OpenFile::FileWriter::WriteData() {
         FileSystem::Instance()->super_meta()->block_data_start_offset_ +
         FileSystem::Instance()->super_meta()->block_size_ * block_id +
         block_write_offset;
-    // TODO: 如果连续的block的话,读写可以考虑聚合优化
-    uint64_t block_data_start_offset = FileSystem::Instance()->super_meta()->block_data_start_offset_;
-    SPDLOG_INFO("{} data_start_offset: {} need wirte offset: {} block_id: {} block_write_offset: {} block_write_size: {} dev_offset: {}", file->file_name(), block_data_start_offset, curr_write_count, block_id, block_write_offset, block_write_size, dev_offset);
+    SPDLOG_TRACE("{} need write offset: {} block_id: {} block_write_offset: {} "
+                 "block_write_size: {} dev_offset: {}",
+                 file->file_name(), curr_write_count, block_id,
+                 block_write_offset, block_write_size, dev_offset);
     BlockData block {
       .block_id = block_id,
-      .extern_buffer = write_buffer_ + curr_write_count,
+      .block_num = 1,
       .dev_offset = dev_offset,
       .write_size_ = block_write_size
     };
-    write_blocks_.emplace_back(block);
+    AppendBlockData(&write_blocks_, block);
     curr_write_count += block_write_size;
     if (curr_write_count >= size_) {
-      SPDLOG_DEBUG("{} finshed fill write block", file->file_name());
+      SPDLOG_TRACE("{} finshed fill write block", file->file_name());
       break;
     }
-    ++block_index_in_file_block;
+    ++block_index_in_file;
   } while (true);
 
-  int64_t ret = 0;
-  int64_t block_write;
-  uint32_t block_num = write_blocks_.size();
-  for (uint32_t i = 0; i < block_num; ++i) {
-    uint32_t block_id = write_blocks_[i].block_id;
-    std::unique_lock lock(FileSystem::Instance()->block_handle()->block_lock(block_id));
-    block_write = WriteBlockData(&write_blocks_[i]);
-    if (block_write <= 0) [[unlikely]] {
-      LOG(ERROR) << open_file_->file()->file_name()
-                 << " write block data ret: " << block_write
-                 << " errno: " << errno;
-      break;
-    }
-    ret += block_write;
+  int64_t ret = WriteBlocks();
+  if (ret <= 0) [[unlikely]] {
+    LOG(ERROR) << open_file_->file()->file_name()
+               << " write block data ret: " << ret << " errno: " << errno;
+    return ret;
   }
   if (!direct_) {
     open_file_->set_append_pos(open_file_->append_pos() + ret);
@@ -854,23 +1158,62 @@ int64_t OpenFile::FileWriter::WriteData() {
  * retcount will be less than count only if an error occurs
  * or end of file is reached */
 int64_t OpenFile::pread(void *buf, uint64_t size, uint64_t offset) {
-  SPDLOG_INFO("file name: {} file size: {} pread size: {} offset: {}", file_->file_name(), file_->file_size(), size, offset);
+  struct iovec iov = {buf, size};
+  return PreadData(&iov, 1, nullptr, size, offset);
+}
+
+int64_t OpenFile::pread(const DeviceTransfer &transfer, uint64_t size,
+                        uint64_t offset) {
+  return PreadData(nullptr, 0, &transfer, size, offset);
+}
+
+// iovec的总长度, 溢出ssize_t的时候返回-1
+static int64_t IovecLength(const struct iovec *iov, int iovcnt) {
+  uint64_t size = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    size += iov[i].iov_len;
+    if (size > SSIZE_MAX) [[unlikely]] {
+      return -1;
+    }
+  }
+  return size;
+}
+
+int64_t OpenFile::preadv(const struct iovec *iov, int iovcnt,
+                         uint64_t offset) {
+  int64_t size = IovecLength(iov, iovcnt);
+  if (size < 0) [[unlikely]] {
+    errno = EINVAL;
+    return -1;
+  }
+  return PreadData(iov, iovcnt, nullptr, size, offset);
+}
+
+int64_t OpenFile::PreadData(const struct iovec *iov, int iovcnt,
+                            const DeviceTransfer *transfer, uint64_t size,
+                            uint64_t offset) {
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC,
+                      "file name: {} file size: {} pread size: {} offset: {}",
+                      file_->file_name(), file_->file_size(), size, offset);
   if (size == 0 || offset >= file_->file_size()) [[unlikely]] {
-    LOG(WARNING) << file_->file_name() << " read nothing,"
-                 << " read size: " << size << " read offset: " << offset
-                 << " file size: " << file_->file_size();
+    // 读到文件末尾是正常情况, 不能按WARNING打印
+    BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC,
+                        "{} read nothing, read size: {} read offset: {} "
+                        "file size: {}",
+                        file_->file_name(), size, offset, file_->file_size());
     return 0;
   }
   uint64_t need_read_size = size;
   if (offset + size > file_->file_size()) {
     need_read_size = file_->file_size() - offset;
-    LOG(WARNING) << file_->file_name()
-                 << " read file from offset to end, file size:"
-                 << file_->file_size() << " offset: " << offset;
+    BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC,
+                        "{} read file from offset to end, file size: {} "
+                        "offset: {}",
+                        file_->file_name(), file_->file_size(), offset);
   }
 
-  FileReader reader =
-      FileReader(shared_from_this(), buf, need_read_size, offset, false);
+  FileReader reader = FileReader(shared_from_this(), iov, iovcnt,
+                                 need_read_size, offset, false, transfer);
   int64_t ret = reader.ReadData();
   return ret;
 }
@@ -879,16 +1222,39 @@ int64_t OpenFile::pread(void *buf, uint64_t size, uint64_t offset) {
  * allocates new bytes and updates file size as necessary,
  * fills any gaps with zeros */
 int64_t OpenFile::pwrite(const void *buf, uint64_t size, uint64_t offset) {
-  SPDLOG_INFO("file name: {} file size: {} pwrite size: {} offset: {}", file_->file_name(), file_->file_size(), size, offset);
-  void *buffer = const_cast<void *>(buf);
+  struct iovec iov = {const_cast<void *>(buf), size};
+  return PwriteData(&iov, 1, nullptr, size, offset);
+}
+
+int64_t OpenFile::pwrite(const DeviceTransfer &transfer, uint64_t size,
+                         uint64_t offset) {
+  return PwriteData(nullptr, 0, &transfer, size, offset);
+}
+
+int64_t OpenFile::pwritev(const struct iovec *iov, int iovcnt,
+                          uint64_t offset) {
+  int64_t size = IovecLength(iov, iovcnt);
+  if (size < 0) [[unlikely]] {
+    errno = EINVAL;
+    return -1;
+  }
+  return PwriteData(iov, iovcnt, nullptr, size, offset);
+}
+
+int64_t OpenFile::PwriteData(const struct iovec *iov, int iovcnt,
+                             const DeviceTransfer *transfer, uint64_t size,
+                             uint64_t offset) {
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC,
+                      "file name: {} file size: {} pwrite size: {} offset: {}",
+                      file_->file_name(), file_->file_size(), size, offset);
   if (size == 0) [[unlikely]] {
     return 0;
   }
 
   if ((offset + size) > file_->file_size()) {
-    LOG(INFO) << file_->file_name() << " pwrite exceed file size,"
-                 << " file size: " << file_->file_size()
-                 << " write offset: " << offset << " write size: " << size;
+    SPDLOG_DEBUG("{} pwrite exceed file size, file size: {} write offset: {} "
+                 "write size: {}",
+                 file_->file_name(), file_->file_size(), offset, size);
     if (file_->ftruncate(offset + size) < 0) {
       return -1;
     }
@@ -903,7 +1269,8 @@ int64_t OpenFile::pwrite(const void *buf, uint64_t size, uint64_t offset) {
   }
 
   // 目前不能以direct方式打开, 因为如果以direct方式打开, 必须要扇区对齐写入
-  FileWriter writer = FileWriter(shared_from_this(), buffer, size, offset, false);
+  FileWriter writer = FileWriter(shared_from_this(), iov, iovcnt, size, offset,
+                                 false, transfer);
   int64_t ret = writer.WriteData();
   return ret;
 }
@@ -2,11 +2,13 @@
 #define LIB_FILE_H_
 
 #include <atomic>
+#include <functional>
 #include <shared_mutex>
 #include <vector>
 
 #include "device.h"
 #include "inode.h"
+#include "journal.h"
 #include "logging.h"
 
 namespace udisk::blockfs {
@@ -14,22 +16,29 @@ namespace udisk::blockfs {
 class FileBlock;
 typedef std::shared_ptr<FileBlock> FileBlockPtr;
 
-typedef std::unordered_map<int32_t, FileBlockPtr> FileBlockMap;
+// 下标就是file cut, 每个cut管理kFileBlockCapacity个block
+typedef std::vector<FileBlockPtr> FileBlockVector;
 
 class OpenFile;
 typedef std::shared_ptr<OpenFile> OpenFilePtr;
 
+// 零拷贝读写时代替用户buffer, 在持有block锁的时候调用
+// ios是物理连续的设备段(buf为空), 在fd上直接搬运数据(比如splice)
+// 返回从第一个段开始连续完成的字节数, 第一个段就失败时返回-1并设置errno
+typedef std::function<int64_t(int32_t fd, const DeviceIo *ios, uint32_t num)>
+    DeviceTransfer;
+
 class ParentFile {
  private:
   FileMeta *meta_;
   uint64_t offset_;
-  std::unordered_map<int32_t, FileBlockPtr> fb_maps_;
+  FileBlockVector file_blocks_;
   bool tmp_file_ = false;
 
  public:
   static std::shared_ptr<ParentFile> NewParentFile(FileMeta *meta, uint64_t offset,
-                                     FileBlockMap &fbs, bool tmp_file = false);
-  ParentFile(FileMeta *meta, uint64_t offset, FileBlockMap &fbs, bool tmp_file);
+                                     FileBlockVector &fbs, bool tmp_file = false);
+  ParentFile(FileMeta *meta, uint64_t offset, FileBlockVector &fbs, bool tmp_file);
   ~ParentFile();
   int32_t fh() { return meta_->fh_; }
   bool tmp_file() const noexcept { return tmp_file_; }
@@ -45,6 +54,11 @@ class File : public Inode<FileMeta, FileBlock>,
   bool locked_ = false;
   bool deleted_ = false;
 
+  // 按照file cut索引FileBlock, IO路径上直接下标定位
+  // 只有扩展/截断/加载的时候修改, 读写只需要共享锁
+  FileBlockVector file_blocks_;
+  mutable std::shared_mutex file_blocks_mutex_;
+
  private:
   int ExtendFile(uint64_t offset);
   bool CopyData(uint32_t src_block_id, uint32_t dst_block_id, uint64_t offset,
@@ -81,6 +95,11 @@ class File : public Inode<FileMeta, FileBlock>,
     ::memcpy(meta_->file_name_, file_name.c_str(), sizeof(meta_->file_name_));
   }
   std::string file_name() const { return std::string(meta_->file_name_); }
+  std::string_view file_name_view() const noexcept {
+    return std::string_view(
+        meta_->file_name_,
+        ::strnlen(meta_->file_name_, sizeof(meta_->file_name_)));
+  }
 
   void set_child_fh(int32_t child_fh) noexcept { meta_->child_fh_ = child_fh; }
   int32_t child_fh() const noexcept { return meta_->child_fh_; }
@@ -103,7 +122,8 @@ class File : public Inode<FileMeta, FileBlock>,
   bool AddFileBlockLock(const FileBlockPtr &fb) noexcept;
   bool AddFileBlockNoLock(const FileBlockPtr &fb) noexcept;
   bool RemoveAllFileBlock();
-  FileBlockPtr GetFileBlock(int32_t file_cut);
+  FileBlockPtr GetFileBlock(uint32_t file_cut) const;
+  uint32_t GetFileBlockNum() const;
 
   bool WriteMeta() override;
   void DumpMeta() override;
@@ -120,7 +140,10 @@ class File : public Inode<FileMeta, FileBlock>,
 
   // open file functions
   int ftruncate(uint64_t offset);
-  int fsync();
+  // 只扩展不截断, 文件已经不小于end时什么都不做
+  int fallocate(uint64_t end);
+  // point是调用的时机, 决定延迟落盘的元数据是否需要一起写下去
+  int fsync(MetaSyncPoint point = kMetaSyncFsync);
 };
 typedef std::shared_ptr<File> FilePtr;
 
@@ -131,58 +154,83 @@ class OpenFile : public std::enable_shared_from_this<OpenFile> {
   uint64_t append_pos_ = 0; /* current open file offset */
  private:
   // Transform info of block read or write
+  // 物理上连续的block会合并成一个段, block_id是第一个block
   struct BlockData {
     uint32_t block_id;
-    uint8_t *extern_buffer;  // 读或者写buffer的地址,如果超过block会转换
+    uint32_t block_num;      // 合并的block的个数
     uint64_t dev_offset;  // 写入block的在udisk逻辑盘上的偏移地址
     union {
       uint64_t read_size_;
       uint64_t write_size_;
     };
   };
+  static void AppendBlockData(std::vector<BlockData> *blocks,
+                              const BlockData &block);
+  static std::vector<uint32_t> SortedBlockLocks(
+      const std::vector<BlockData> &blocks);
+  static void BuildDeviceIo(const std::vector<BlockData> &blocks,
+                            const struct iovec *iov, int iovcnt,
+                            std::vector<DeviceIo> *ios,
+                            std::vector<struct iovec> *pieces);
   class FileReader {
    private:
-    OpenFilePtr open_file_; /* file object */
-    uint8_t *read_buffer_;  /* user buffer holding data */
+    OpenFilePtr open_file_;   /* file object */
+    const struct iovec *iov_; /* user buffers holding data */
+    int iovcnt_;              /* number of user buffers */
     uint64_t size_;         /* number of bytes to read */
     uint64_t offset_;       /* position within file to read from */
     bool direct_ = true;    /* whether using direct fd */
+    const DeviceTransfer *transfer_ = nullptr; /* zero copy instead of buffer */
 
    private:
     std::vector<BlockData> read_blocks_;
-    int64_t ReadBlockData(BlockData *block);
+    int64_t ReadBlocks();
 
    public:
-    FileReader(OpenFilePtr file, void *buffer, uint64_t size, uint64_t offset,
-               bool direct = true)
+    FileReader(OpenFilePtr file, const struct iovec *iov, int iovcnt,
+               uint64_t size, uint64_t offset, bool direct = true,
+               const DeviceTransfer *transfer = nullptr)
         : open_file_(file),
-          read_buffer_(static_cast<uint8_t *>(buffer)),
+          iov_(iov),
+          iovcnt_(iovcnt),
           size_(size),
           offset_(offset),
-          direct_(direct) {
+          direct_(direct),
+          transfer_(transfer) {
     }
     ~FileReader() = default;
     int64_t ReadData();
   };
   class FileWriter {
    private:
-    OpenFilePtr open_file_; /* file object */
-    uint8_t *write_buffer_; /* user buffer holding data */
+    OpenFilePtr open_file_;   /* file object */
+    const struct iovec *iov_; /* user buffers holding data */
+    int iovcnt_;              /* number of user buffers */
     uint64_t size_;         /* number of bytes to write */
     uint64_t offset_;       /* position within file to write to */
     bool direct_ = true;    /* whether using direct fd */
+    const DeviceTransfer *transfer_ = nullptr; /* zero copy instead of buffer */
 
    private:
     std::vector<BlockData> write_blocks_;
-    int64_t WriteBlockData(BlockData *block);
+    int64_t WriteBlocks();
 
    public:
-    FileWriter(OpenFilePtr file, void *buffer, uint64_t size, uint64_t offset,
-               bool direct = true);
+    FileWriter(OpenFilePtr file, const struct iovec *iov, int iovcnt,
+               uint64_t size, uint64_t offset, bool direct = true,
+               const DeviceTransfer *transfer = nullptr);
     ~FileWriter() = default;
     int64_t WriteData();
   };
 
+  // iov为空时是零拷贝, 由transfer搬运数据
+  int64_t PreadData(const struct iovec *iov, int iovcnt,
+                    const DeviceTransfer *transfer, uint64_t size,
+                    uint64_t offset);
+  int64_t PwriteData(const struct iovec *iov, int iovcnt,
+                     const DeviceTransfer *transfer, uint64_t size,
+                     uint64_t offset);
+
  public:
   OpenFile(const FilePtr &file) : file_(file) {}
   ~OpenFile() = default;
@@ -196,6 +244,13 @@ class OpenFile : public std::enable_shared_from_this<OpenFile> {
   int64_t read(void *buf, uint64_t size, uint64_t append_pos);
   int64_t pread(void *buf, uint64_t size, uint64_t offset);
   int64_t pwrite(const void *buf, uint64_t size, uint64_t offset);
+  // 分散的用户buffer, 每个物理连续的段一次preadv/pwritev
+  int64_t preadv(const struct iovec *iov, int iovcnt, uint64_t offset);
+  int64_t pwritev(const struct iovec *iov, int iovcnt, uint64_t offset);
+  // 零拷贝读写, 数据不经过用户态buffer
+  int64_t pread(const DeviceTransfer &transfer, uint64_t size, uint64_t offset);
+  int64_t pwrite(const DeviceTransfer &transfer, uint64_t size,
+                 uint64_t offset);
 
  private:
   friend class File;
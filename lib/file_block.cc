@@ -1,7 +1,11 @@
 #include "file_block.h"
 
+#include <algorithm>
+
+#include "crc.h"
 #include "file_system.h"
 #include "spdlog/spdlog.h"
+#include "stats.h"
 
 namespace udisk::blockfs {
 
@@ -14,49 +18,187 @@ void FileBlock::ClearMeta(FileBlockMeta *meta) {
   meta->fh_ = -1;
   meta->file_cut_ = 0;
   meta->used_block_num_ = 0;
+  meta->format_ = kFileBlockFormatIds;
   // TODO
   ::memset(meta->block_id_, 0, sizeof(meta->block_id_));
 }
 
+uint32_t FileBlock::CalcCrc(FileBlockMeta *meta) {
+  uint8_t *start = reinterpret_cast<uint8_t *>(meta) + sizeof(meta->crc_);
+  if (meta->format_ == kFileBlockFormatExtent &&
+      meta->extent_num_ <= kFileBlockMaxExtentNum) {
+    uint8_t *end = reinterpret_cast<uint8_t *>(&meta->extents_[meta->extent_num_]);
+    uint32_t crc = FileSystem::Instance()->MetaCrc(start, end - start);
+    return FileSystem::Instance()->MetaCrc(&meta->format_,
+                                           sizeof(meta->format_), crc);
+  }
+  return FileSystem::Instance()->MetaCrc(
+      start, FileSystem::Instance()->super_meta()->file_block_meta_size -
+                 sizeof(meta->crc_));
+}
+
+void FileBlock::LoadExtents() {
+  extents_.clear();
+  if (meta_->format_ == kFileBlockFormatExtent) {
+    uint32_t block_index = 0;
+    for (uint32_t i = 0; i < meta_->extent_num_; ++i) {
+      const FileBlockExtent &extent = meta_->extents_[i];
+      extents_.push_back({block_index, extent.start_block_, extent.block_num_});
+      block_index += extent.block_num_;
+    }
+    assert(block_index == meta_->used_block_num_);
+    return;
+  }
+  for (uint32_t i = 0; i < meta_->used_block_num_; ++i) {
+    uint32_t block_id = meta_->block_id_[i];
+    if (!extents_.empty()) {
+      BlockExtent &last = extents_.back();
+      if (last.block_id_ + last.block_num_ == block_id) {
+        ++last.block_num_;
+        continue;
+      }
+    }
+    extents_.push_back({i, block_id, 1});
+  }
+}
+
+void FileBlock::StoreExtents() {
+  std::shared_lock<std::shared_mutex> lock(extent_mutex_);
+  if (FileSystem::Instance()->super_meta()->file_block_format_ ==
+          kFileBlockFormatExtent &&
+      extents_.size() <= kFileBlockMaxExtentNum) {
+    meta_->format_ = kFileBlockFormatExtent;
+    meta_->extent_num_ = extents_.size();
+    for (uint32_t i = 0; i < extents_.size(); ++i) {
+      meta_->extents_[i].start_block_ = extents_[i].block_id_;
+      meta_->extents_[i].block_num_ = extents_[i].block_num_;
+    }
+    return;
+  }
+  // 碎片太多或者老的格式, 使用block id数组
+  meta_->format_ = kFileBlockFormatIds;
+  for (const BlockExtent &extent : extents_) {
+    for (uint32_t i = 0; i < extent.block_num_; ++i) {
+      meta_->block_id_[extent.block_index_ + i] = extent.block_id_ + i;
+    }
+  }
+}
+
+uint32_t FileBlock::GetBlockRun(uint32_t block_index,
+                                uint32_t *block_id) const {
+  assert(block_index < kFileBlockCapacity);
+  std::shared_lock<std::shared_mutex> lock(extent_mutex_);
+  auto iter = std::upper_bound(
+      extents_.begin(), extents_.end(), block_index,
+      [](uint32_t index, const BlockExtent &extent) {
+        return index < extent.block_index_;
+      });
+  if (iter == extents_.begin()) [[unlikely]] {
+    return 0;
+  }
+  --iter;
+  uint32_t offset = block_index - iter->block_index_;
+  if (offset >= iter->block_num_) [[unlikely]] {
+    return 0;
+  }
+  *block_id = iter->block_id_ + offset;
+  return iter->block_num_ - offset;
+}
+
+void FileBlock::GetBlockIds(std::vector<uint32_t> *block_ids) const {
+  std::shared_lock<std::shared_mutex> lock(extent_mutex_);
+  for (const BlockExtent &extent : extents_) {
+    for (uint32_t i = 0; i < extent.block_num_; ++i) {
+      block_ids->push_back(extent.block_id_ + i);
+    }
+  }
+}
+
+void FileBlock::add_block_id(uint32_t block_id) {
+  std::unique_lock<std::shared_mutex> lock(extent_mutex_);
+  if (is_block_full()) {
+    return;
+  }
+  if (!extents_.empty()) {
+    BlockExtent &last = extents_.back();
+    if (last.block_id_ + last.block_num_ == block_id) {
+      ++last.block_num_;
+      ++meta_->used_block_num_;
+      return;
+    }
+  }
+  extents_.push_back({meta_->used_block_num_, block_id, 1});
+  ++meta_->used_block_num_;
+}
+
+std::string FileBlock::SaveMeta() const {
+  std::shared_lock<std::shared_mutex> lock(extent_mutex_);
+  return std::string(reinterpret_cast<const char *>(meta_),
+                     FileSystem::Instance()->super_meta()->file_block_meta_size);
+}
+
+void FileBlock::RestoreMeta(const std::string &saved) {
+  std::unique_lock<std::shared_mutex> lock(extent_mutex_);
+  ::memcpy(meta_, saved.data(), saved.size());
+  LoadExtents();
+}
+
 bool FileBlock::WriteMeta(int32_t index) {
+  StatTimer timer(kStatMetaWriteFileBlock);
   uint64_t file_block_meta_size =
       FileSystem::Instance()->super_meta()->file_block_meta_size;
   uint64_t offset = file_block_meta_size * index;
   FileBlockMeta *meta = reinterpret_cast<FileBlockMeta *>(
       FileSystem::Instance()->file_block_handle()->base_addr() + offset);
-  uint32_t crc = Crc32(reinterpret_cast<uint8_t *>(meta) + sizeof(meta->crc_),
-                     file_block_meta_size - sizeof(meta->crc_));
+  uint32_t crc = CalcCrc(meta);
   meta->crc_ = crc;
-  int64_t ret = FileSystem::Instance()->dev()->PwriteDirect(
-      meta, file_block_meta_size,
-      FileSystem::Instance()->super_meta()->file_block_meta_offset_ + offset);
-  if (ret != static_cast<int64_t>(file_block_meta_size)) [[unlikely]] {
-    SPDLOG_ERROR("write file block meta index: {} error size: {} need: {}",
-                 index, ret, file_block_meta_size);
+  // FileBlockMeta和使用索引在同一个事务中落盘
+  MetaTransaction txn;
+  if (!FileSystem::Instance()->WriteMetaPage(
+          meta, file_block_meta_size,
+          FileSystem::Instance()->super_meta()->file_block_meta_offset_ +
+              offset)) [[unlikely]] {
+    SPDLOG_ERROR("write file block meta index: {} failed", index);
+    return false;
+  }
+  if (!FileSystem::Instance()->file_block_handle()->UpdateIndex(
+          index, meta->used_) ||
+      !txn.Commit()) [[unlikely]] {
+    SPDLOG_ERROR("write file block index: {} failed", index);
     return false;
   }
-  SPDLOG_INFO("write file block meta index: {} crc: {}", index, crc);
+  SPDLOG_DEBUG("write file block meta index: {} crc: {}", index, crc);
   return true;
 }
 
 void FileBlock::DumpMeta() {
-  SPDLOG_INFO("dump file block meta:\n crc: {} used: {} fh: {} file_cut: {} used_block_num: {}",
-              crc(), used(), fh(), file_cut(), used_block_num());
-  for (uint32_t i = 0; i < meta_->used_block_num_; ++i) {
-    SPDLOG_INFO("block index: {} block id: {}", i, get_block_id(i));
+  SPDLOG_INFO("dump file block meta:\n crc: {} used: {} fh: {} file_cut: {} used_block_num: {} format: {} extent_num: {}",
+              crc(), used(), fh(), file_cut(), used_block_num(),
+              meta_->format_, extent_num());
+  std::shared_lock<std::shared_mutex> lock(extent_mutex_);
+  for (const BlockExtent &extent : extents_) {
+    SPDLOG_INFO("block index: {} block id: {} block num: {}",
+                extent.block_index_, extent.block_id_, extent.block_num_);
   }
 }
 
-bool FileBlock::WriteMeta() { return FileBlock::WriteMeta(index_); }
+bool FileBlock::WriteMeta() {
+  StoreExtents();
+  return FileBlock::WriteMeta(index_);
+}
 
 bool FileBlock::ReleaseAll() {
   std::vector<uint32_t> block_list;
-  for (uint32_t i = 0; i < meta_->used_block_num_; ++i) {
-    block_list.push_back(meta_->block_id_[i]);
+  GetBlockIds(&block_list);
+  if (!block_list.empty()) {
+    FileSystem::Instance()->block_handle()->PutFreeBlockIdLock(block_list);
   }
-  FileSystem::Instance()->block_handle()->PutFreeBlockIdLock(block_list);
 
-  FileBlock::ClearMeta(meta_);
+  {
+    std::unique_lock<std::shared_mutex> lock(extent_mutex_);
+    extents_.clear();
+    FileBlock::ClearMeta(meta_);
+  }
   if (!WriteMeta()) {
     return false;
   }
@@ -66,11 +208,15 @@ bool FileBlock::ReleaseAll() {
 
 bool FileBlock::ReleaseMyself() {
   SPDLOG_INFO("relase fh: {} file block index: {}", fh(), index_);
-  FileBlock::ClearMeta(meta_);
+  {
+    std::unique_lock<std::shared_mutex> lock(extent_mutex_);
+    extents_.clear();
+    FileBlock::ClearMeta(meta_);
+  }
   if (!WriteMeta()) {
     return false;
   }
   FileSystem::Instance()->file_block_handle()->PutFileBlockLock(index_);
   return true;
 }
-}  // namespace udisk::blockfs
\ No newline at end of file
+}  // namespace udisk::blockfs
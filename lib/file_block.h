@@ -2,19 +2,40 @@
 
 #include <assert.h>
 
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
 #include "device.h"
 
 namespace udisk::blockfs {
 
 class FileBlock : public std::enable_shared_from_this<FileBlock> {
  private:
+  // 内存中的extent, 按照file内的block索引有序, 查找时二分
+  struct BlockExtent {
+    uint32_t block_index_;  // 第一个block在file cut中的索引
+    uint32_t block_id_;     // 第一个block的id
+    uint32_t block_num_;
+  };
+
   int32_t file_cut_;
   int32_t index_;
   FileBlockMeta *meta_;
+  mutable std::shared_mutex extent_mutex_;
+  std::vector<BlockExtent> extents_;
+
+ private:
+  // 从磁盘格式解析出内存中的extent
+  void LoadExtents();
+  // 把内存中的extent序列化到元数据页, 能放下的时候用extent格式
+  void StoreExtents();
 
  public:
   FileBlock() = default;
-  FileBlock(int32_t index, FileBlockMeta *meta) : index_(index), meta_(meta) {}
+  FileBlock(int32_t index, FileBlockMeta *meta) : index_(index), meta_(meta) {
+    LoadExtents();
+  }
   ~FileBlock() = default;
 
   bool ReleaseAll();
@@ -37,29 +58,26 @@ class FileBlock : public std::enable_shared_from_this<FileBlock> {
   const bool is_temp() const noexcept { return meta_->is_temp_; }
   void set_is_temp(bool is_temp) noexcept { meta_->is_temp_ = is_temp; }
 
-  void set_used_block_num(uint32_t used_block_num) noexcept {
-    meta_->used_block_num_ = used_block_num;
-  }
   uint32_t used_block_num() const noexcept { return meta_->used_block_num_; }
-
-  uint32_t get_block_id(const uint32_t block_index) const noexcept {
-    assert(block_index < kFileBlockCapacity);
-    return meta_->block_id_[block_index];
+  uint32_t extent_num() const {
+    std::shared_lock<std::shared_mutex> lock(extent_mutex_);
+    return extents_.size();
   }
 
-  void add_block_id(uint32_t block_index, uint32_t block_id) {
-    if (!is_block_full() && block_index < kFileBlockCapacity) {
-      meta_->block_id_[block_index] = block_id;
-      ++meta_->used_block_num_;
-    }
+  uint32_t get_block_id(const uint32_t block_index) const {
+    uint32_t block_id = 0;
+    GetBlockRun(block_index, &block_id);
+    return block_id;
   }
+  // 返回block_index开始物理连续的block个数, 0表示不存在
+  uint32_t GetBlockRun(uint32_t block_index, uint32_t *block_id) const;
+  void GetBlockIds(std::vector<uint32_t> *block_ids) const;
 
-  void add_block_id(uint32_t block_id) noexcept {
-    if (!is_block_full()) {
-      meta_->block_id_[meta_->used_block_num_] = block_id;
-      ++meta_->used_block_num_;
-    }
-  }
+  void add_block_id(uint32_t block_id);
+
+  // 修改之前保存元数据, 失败时恢复元数据和内存中的extent
+  std::string SaveMeta() const;
+  void RestoreMeta(const std::string &saved);
 
   bool is_block_full() const noexcept {
     return (meta_->used_block_num_ == kFileBlockCapacity);
@@ -70,6 +88,8 @@ class FileBlock : public std::enable_shared_from_this<FileBlock> {
 
   static bool WriteMeta(int32_t fb_index);
   static void ClearMeta(FileBlockMeta *meta);
+  // extent格式只校验用到的部分
+  static uint32_t CalcCrc(FileBlockMeta *meta);
 };
 
 typedef std::shared_ptr<FileBlock> FileBlockPtr;
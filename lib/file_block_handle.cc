@@ -3,6 +3,7 @@
 #include "crc.h"
 #include "file_system.h"
 #include "spdlog/spdlog.h"
+#include "stats.h"
 
 namespace udisk::blockfs {
 
@@ -10,71 +11,137 @@ bool FileBlockHandle::InitializeMeta() {
   LOG(DEBUG)
       << "total file block num: "
       << FileSystem::Instance()->super_meta()->max_file_block_num;
-  FileBlockMeta *meta;
-  for (uint32_t index = 0;
-       index < FileSystem::Instance()->super_meta()->max_file_block_num;
-       ++index) {
-    meta = reinterpret_cast<FileBlockMeta *>(base_addr() +
-        FileSystem::Instance()->super_meta()->file_block_meta_size * index);
-    uint32_t crc =
-        Crc32(reinterpret_cast<uint8_t *>(meta) + sizeof(meta->crc_),
-              FileSystem::Instance()->super_meta()->file_block_meta_size -
-                  sizeof(meta->crc_));
-    if (meta->crc_ != crc) [[unlikely]] {
-      LOG(ERROR) << "debug file block meta: \n"
-                 << " file block index: " << index << "\n"
-                 << " crc error\n"
-                 << " read crc: " << meta->crc_ << "\n"
-                 << " cal crc: " << crc << "\n"
-                 << " used: " << meta->used_ << "\n"
-                 << " fh: " << meta->fh_ << "\n"
-                 << " used_block_num:" << meta->used_block_num_;
-      for (uint32_t i = 0; i < meta->used_block_num_; ++i) {
-        LOG(ERROR) << "block index: " << i
-                   << " block id: " << meta->block_id_[i];
+  // 按需加载时只扫描索引中在使用的FileBlockMeta
+  std::vector<int32_t> indexes;
+  lazy_ = FileSystem::Instance()->shm_manager()->lazy_file_block_meta();
+  if (lazy_ && !LoadUsedMeta(&indexes)) {
+    return false;
+  }
+  uint64_t scan_num =
+      lazy_ ? indexes.size()
+            : FileSystem::Instance()->super_meta()->max_file_block_num;
+
+  // 校验和解析extent最耗时, 分段并行; 占用block和挂到文件上在合并时按顺序做
+  uint32_t part_num = FileSystem::Instance()->scan_part_num();
+  std::vector<std::vector<FileBlockPtr>> part_fbs(part_num);
+  std::vector<std::vector<int32_t>> part_temp_fbhs(part_num);
+  std::vector<std::list<int32_t>> part_free_fbhs(part_num);
+  auto scan = [&](uint32_t part, uint64_t begin, uint64_t end) {
+    uint64_t file_block_meta_size =
+        FileSystem::Instance()->super_meta()->file_block_meta_size;
+    for (uint64_t i = begin; i < end; ++i) {
+      int32_t index = lazy_ ? indexes[i] : static_cast<int32_t>(i);
+      FileBlockMeta *meta = reinterpret_cast<FileBlockMeta *>(
+          base_addr() + file_block_meta_size * index);
+      uint32_t crc = FileBlock::CalcCrc(meta);
+      if (meta->crc_ != crc) [[unlikely]] {
+        LOG(ERROR) << "debug file block meta: \n"
+                   << " file block index: " << index << "\n"
+                   << " crc error\n"
+                   << " read crc: " << meta->crc_ << "\n"
+                   << " cal crc: " << crc << "\n"
+                   << " used: " << meta->used_ << "\n"
+                   << " fh: " << meta->fh_ << "\n"
+                   << " format: " << static_cast<uint32_t>(meta->format_)
+                   << "\n"
+                   << " used_block_num:" << meta->used_block_num_;
+        for (uint32_t i = 0; meta->format_ == kFileBlockFormatIds &&
+                             i < std::min<uint64_t>(meta->used_block_num_,
+                                                    kFileBlockCapacity);
+             ++i) {
+          LOG(ERROR) << "block index: " << i
+                     << " block id: " << meta->block_id_[i];
+        }
+        return false;
+      }
+      if (!meta->used_) {
+        part_free_fbhs[part].push_back(index);
+        continue;
       }
-      return false;
-    }
-    if (meta->used_) {
       // 临时文件直接清理掉, 前面还原文件的时候直接过滤掉
       if (meta->is_temp_) {
-        LOG(WARNING) << "clear temp file block index: " << index
-                     << " fh: " << meta->fh_;
-        FileBlock::ClearMeta(meta);
-        if (!FileBlock::WriteMeta(index)) {
+        part_temp_fbhs[part].push_back(index);
+        continue;
+      }
+      if (meta->format_ == kFileBlockFormatExtent) {
+        uint64_t block_num = 0;
+        for (uint32_t i = 0;
+             i < std::min<uint64_t>(meta->extent_num_, kFileBlockMaxExtentNum);
+             ++i) {
+          block_num += meta->extents_[i].block_num_;
+        }
+        if (meta->extent_num_ > kFileBlockMaxExtentNum ||
+            block_num != meta->used_block_num_) [[unlikely]] {
+          LOG(ERROR) << "file block meta: " << index
+                     << " invalid extent num: " << meta->extent_num_
+                     << " block num: " << block_num
+                     << " used_block_num: " << meta->used_block_num_;
           return false;
         }
-        continue;
       }
+      part_fbs[part].push_back(std::make_shared<FileBlock>(index, meta));
+    }
+    return true;
+  };
+  if (!FileSystem::Instance()->ParallelScan(scan_num, scan)) {
+    return false;
+  }
+
+  for (uint32_t part = 0; part < part_num; ++part) {
+    for (int32_t index : part_temp_fbhs[part]) {
+      FileBlockMeta *meta = reinterpret_cast<FileBlockMeta *>(
+          base_addr() +
+          FileSystem::Instance()->super_meta()->file_block_meta_size * index);
+      LOG(WARNING) << "clear temp file block index: " << index
+                   << " fh: " << meta->fh_;
+      FileBlock::ClearMeta(meta);
+      if (!FileBlock::WriteMeta(index)) {
+        return false;
+      }
+    }
+    for (const FileBlockPtr &fb : part_fbs[part]) {
       const FilePtr &file =
-          FileSystem::Instance()->file_handle()->GetCreatedFileNoLock(meta->fh_);
+          FileSystem::Instance()->file_handle()->GetCreatedFileNoLock(fb->fh());
       if (!file) [[unlikely]] {
-        LOG(ERROR) << "file block meta: " << index
-                   << " invalid for fh: " << meta->fh_
-                   << " is_temp: " << meta->is_temp_
-                   << " used_block_num: " << meta->used_block_num_;
-        for (uint32_t i = 0; i < meta->used_block_num_; ++i) {
-          // LOG(ERROR) << "block index: " << i
-          //            << " block id: " << meta->block_id_[i];
-        }
+        LOG(ERROR) << "file block meta: " << fb->index()
+                   << " invalid for fh: " << fb->fh()
+                   << " used_block_num: " << fb->used_block_num();
         return false;
       }
-      FileBlockPtr fb = std::make_shared<FileBlock>(index, meta);
       // 把Block从空闲列表中摘出来, 不能被分配出去
-      for (uint32_t i = 0; i < fb->used_block_num(); ++i) {
+      std::vector<uint32_t> block_ids;
+      fb->GetBlockIds(&block_ids);
+      for (uint32_t i = 0; i < block_ids.size(); ++i) {
         LOG(DEBUG) << file->file_name() << " block index: " << i
-                   << " block id: " << fb->get_block_id(i);
+                   << " block id: " << block_ids[i];
         if (!FileSystem::Instance()->block_handle()->GetSpecificBlockId(
-                fb->get_block_id(i))) {
+                block_ids[i])) {
           return false;
         }
       }
       file->AddFileBlockNoLock(fb);
-    } else {
-      free_fbhs_.push_back(index);
+    }
+    if (!lazy_) {
+      free_fbhs_.splice(free_fbhs_.end(), part_free_fbhs[part]);
     }
   }
-  return true;
+  if (lazy_) {
+    // 没有加载的都是空闲的, 加载了但是没有使用的说明索引过期了
+    for (uint32_t index = 0; index < loaded_.size(); ++index) {
+      if (!loaded_[index]) {
+        free_fbhs_.push_back(index);
+      } else if (!meta_at(index)->used_) {
+        free_fbhs_.push_back(index);
+        if (!UpdateIndex(index, false)) {
+          return false;
+        }
+      }
+    }
+    SPDLOG_INFO("load used file block meta num: {} free num: {}",
+                indexes.size(), free_fbhs_.size());
+    return true;
+  }
+  return !has_index() || SyncIndex();
 }
 
 bool FileBlockHandle::FormatAllMeta() {
@@ -93,10 +160,10 @@ bool FileBlockHandle::FormatAllMeta() {
     meta->used_ = false;
     meta->fh_ = -1;
     meta->index_ = i;
-    meta->crc_ =
-        Crc32(reinterpret_cast<uint8_t *>(meta) + sizeof(meta->crc_),
-              FileSystem::Instance()->super_meta()->file_block_meta_size -
-                  sizeof(meta->crc_));
+    meta->crc_ = FileSystem::Instance()->MetaCrc(
+        reinterpret_cast<uint8_t *>(meta) + sizeof(meta->crc_),
+        FileSystem::Instance()->super_meta()->file_block_meta_size -
+            sizeof(meta->crc_));
   }
   int64_t ret = FileSystem::Instance()->dev()->PwriteDirect(
       buffer->data(),
@@ -109,10 +176,33 @@ bool FileBlockHandle::FormatAllMeta() {
     return false;
   }
   SPDLOG_INFO("write all file block meta success");
+
+  if (!has_index()) {
+    return true;
+  }
+  uint64_t index_size =
+      FileSystem::Instance()->super_meta()->file_block_index_size_;
+  AlignBufferPtr index_buffer = std::make_shared<AlignBuffer>(
+      index_size, FileSystem::Instance()->dev()->block_size());
+  for (uint32_t i = 0; i < index_size / kBlockFsPageSize; ++i) {
+    FileBlockIndexPage *page = reinterpret_cast<FileBlockIndexPage *>(
+        index_buffer->data() + i * kBlockFsPageSize);
+    page->page_index_ = i;
+    page->crc_ = IndexCrc(page);
+  }
+  ret = FileSystem::Instance()->dev()->PwriteDirect(
+      index_buffer->data(), index_size,
+      FileSystem::Instance()->super_meta()->file_block_index_offset_);
+  if (ret != static_cast<int64_t>(index_size)) {
+    LOG(ERROR) << "write file block index error size:" << ret;
+    return false;
+  }
+  SPDLOG_INFO("write file block index success");
   return true;
 }
 
 FileBlockPtr FileBlockHandle::GetFileBlockLock() {
+  StatTimer timer(kStatAllocFileBlock);
   META_HANDLE_LOCK();
   if (free_fbhs_.empty()) [[unlikely]] {
     LOG(ERROR) << "file block is exhausted";
@@ -121,12 +211,204 @@ FileBlockPtr FileBlockHandle::GetFileBlockLock() {
 
   uint32_t index = free_fbhs_.front();
   free_fbhs_.pop_front();
-  FileBlockMeta *meta = reinterpret_cast<FileBlockMeta *>(
+  if (!LoadMeta(index)) [[unlikely]] {
+    // 坏的元数据不再放回空闲链表, 否则之后的分配都会卡在它上面
+    SPDLOG_ERROR("quarantine file block meta {}, free num: {}", index,
+                 free_fbhs_.size());
+    return nullptr;
+  }
+  FileBlockMeta *fb_meta = meta_at(index);
+  assert(fb_meta->used_ == false);
+  assert(fb_meta->used_block_num_ == 0);
+  return std::make_shared<FileBlock>(index, fb_meta);
+}
+
+bool FileBlockHandle::has_index() const {
+  return FileSystem::Instance()->super_meta()->file_block_index_size_ > 0;
+}
+
+FileBlockIndexPage *FileBlockHandle::index_page(uint32_t page) {
+  // 索引区域和FileBlockMeta区域在shm中是连续的
+  const SuperBlockMeta *super = FileSystem::Instance()->super_meta();
+  return reinterpret_cast<FileBlockIndexPage *>(
+      base_addr() + super->file_block_index_offset_ -
+      super->file_block_meta_offset_ + page * kBlockFsPageSize);
+}
+
+FileBlockMeta *FileBlockHandle::meta_at(int32_t index) {
+  return reinterpret_cast<FileBlockMeta *>(
       base_addr() +
       FileSystem::Instance()->super_meta()->file_block_meta_size * index);
-  assert(meta->used_ == false);
-  assert(meta->used_block_num_ == 0);
-  return std::make_shared<FileBlock>(index, meta);
+}
+
+uint32_t FileBlockHandle::IndexCrc(FileBlockIndexPage *page) {
+  return FileSystem::Instance()->MetaCrc(
+      reinterpret_cast<uint8_t *>(page) + sizeof(page->crc_),
+      kBlockFsPageSize - sizeof(page->crc_));
+}
+
+bool FileBlockHandle::CheckIndex() {
+  uint32_t page_num =
+      FileSystem::Instance()->super_meta()->file_block_index_size_ /
+      kBlockFsPageSize;
+  for (uint32_t i = 0; i < page_num; ++i) {
+    FileBlockIndexPage *page = index_page(i);
+    uint32_t crc = IndexCrc(page);
+    if (page->crc_ != crc || page->page_index_ != i) [[unlikely]] {
+      SPDLOG_ERROR("file block index page {} invalid, crc: {} cal: {} page: {}",
+                   i, static_cast<uint32_t>(page->crc_), crc,
+                   static_cast<uint32_t>(page->page_index_));
+      return false;
+    }
+  }
+  return true;
+}
+
+bool FileBlockHandle::SyncIndex() {
+  uint64_t max_file_block_num =
+      FileSystem::Instance()->super_meta()->max_file_block_num;
+  uint32_t page_num =
+      FileSystem::Instance()->super_meta()->file_block_index_size_ /
+      kBlockFsPageSize;
+  std::lock_guard<std::mutex> lock(index_mutex_);
+  for (uint32_t i = 0; i < page_num; ++i) {
+    FileBlockIndexPage *page = index_page(i);
+    bool dirty = page->page_index_ != i || page->crc_ != IndexCrc(page);
+    page->page_index_ = i;
+    for (uint32_t w = 0; w < kFileBlockIndexBitsPerPage / 64; ++w) {
+      uint64_t bits = 0;
+      for (uint32_t b = 0; b < 64; ++b) {
+        uint64_t index = static_cast<uint64_t>(i) * kFileBlockIndexBitsPerPage +
+                         w * 64 + b;
+        if (index < max_file_block_num && meta_at(index)->used_) {
+          bits |= 1ULL << b;
+        }
+      }
+      if (page->bits_[w] != bits) {
+        page->bits_[w] = bits;
+        dirty = true;
+      }
+    }
+    if (!dirty) {
+      continue;
+    }
+    SPDLOG_WARN("rewrite file block index page: {}", i);
+    page->crc_ = IndexCrc(page);
+    if (!FileSystem::Instance()->WriteMetaPage(
+            page, kBlockFsPageSize,
+            FileSystem::Instance()->super_meta()->file_block_index_offset_ +
+                i * kBlockFsPageSize)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool FileBlockHandle::LoadUsedMeta(std::vector<int32_t> *indexes) {
+  const SuperBlockMeta *super = FileSystem::Instance()->super_meta();
+  if (!CheckIndex()) {
+    // 索引不可信, 退化成读取全部FileBlockMeta, 扫描完之后重新生成索引
+    SPDLOG_WARN("file block index invalid, read all file block meta");
+    int64_t ret = FileSystem::Instance()->dev()->PreadDirect(
+        base_addr(), super->file_block_meta_total_size_,
+        super->file_block_meta_offset_);
+    if (ret != static_cast<int64_t>(super->file_block_meta_total_size_))
+        [[unlikely]] {
+      SPDLOG_ERROR("read all file block meta error size: {}", ret);
+      return false;
+    }
+    lazy_ = false;
+    return true;
+  }
+
+  loaded_.assign(super->max_file_block_num, false);
+  std::vector<DeviceIo> ios;
+  for (uint32_t index = 0; index < super->max_file_block_num; ++index) {
+    const FileBlockIndexPage *page =
+        index_page(index / kFileBlockIndexBitsPerPage);
+    uint32_t bit = index % kFileBlockIndexBitsPerPage;
+    if (!(page->bits_[bit / 64] & (1ULL << (bit % 64)))) {
+      continue;
+    }
+    indexes->push_back(index);
+    loaded_[index] = true;
+    // 连续的FileBlockMeta合并成一次读
+    uint64_t offset = super->file_block_meta_size * index;
+    if (!ios.empty() && ios.back().offset + ios.back().len ==
+                            super->file_block_meta_offset_ + offset) {
+      ios.back().len += super->file_block_meta_size;
+    } else {
+      ios.push_back({base_addr() + offset, super->file_block_meta_size,
+                     super->file_block_meta_offset_ + offset, 0});
+    }
+  }
+  // 复用的共享内存中已经有这些FileBlockMeta
+  if (ios.empty() || FileSystem::Instance()->shm_manager()->reused()) {
+    return true;
+  }
+  int64_t need = static_cast<int64_t>(indexes->size()) *
+                 super->file_block_meta_size;
+  int64_t ret =
+      FileSystem::Instance()->dev()->PreadBatch(ios.data(), ios.size(), true);
+  if (ret != need) [[unlikely]] {
+    SPDLOG_ERROR("read used file block meta error size: {} need: {}", ret,
+                 need);
+    return false;
+  }
+  return true;
+}
+
+bool FileBlockHandle::LoadMeta(int32_t index) {
+  if (!lazy_ || loaded_[index]) {
+    return true;
+  }
+  uint64_t file_block_meta_size =
+      FileSystem::Instance()->super_meta()->file_block_meta_size;
+  FileBlockMeta *fb_meta = meta_at(index);
+  int64_t ret = FileSystem::Instance()->dev()->PreadDirect(
+      fb_meta, file_block_meta_size,
+      FileSystem::Instance()->super_meta()->file_block_meta_offset_ +
+          file_block_meta_size * index);
+  if (ret != static_cast<int64_t>(file_block_meta_size)) [[unlikely]] {
+    SPDLOG_ERROR("load file block meta {} error size: {}", index, ret);
+    return false;
+  }
+  uint32_t crc = FileBlock::CalcCrc(fb_meta);
+  if (fb_meta->crc_ != crc || fb_meta->used_) [[unlikely]] {
+    SPDLOG_ERROR("load file block meta {} invalid, crc: {} cal: {} used: {}",
+                 index, static_cast<uint32_t>(fb_meta->crc_), crc,
+                 static_cast<bool>(fb_meta->used_));
+    return false;
+  }
+  loaded_[index] = true;
+  return true;
+}
+
+bool FileBlockHandle::UpdateIndex(int32_t index, bool used) {
+  if (!has_index()) {
+    return true;
+  }
+  uint32_t page_index = index / kFileBlockIndexBitsPerPage;
+  uint32_t bit = index % kFileBlockIndexBitsPerPage;
+  FileBlockIndexPage *page = index_page(page_index);
+  {
+    std::lock_guard<std::mutex> lock(index_mutex_);
+    uint64_t mask = 1ULL << (bit % 64);
+    bool old_used = page->bits_[bit / 64] & mask;
+    if (old_used == used) {
+      return true;
+    }
+    if (used) {
+      page->bits_[bit / 64] |= mask;
+    } else {
+      page->bits_[bit / 64] &= ~mask;
+    }
+    page->crc_ = IndexCrc(page);
+  }
+  return FileSystem::Instance()->WriteMetaPage(
+      page, kBlockFsPageSize,
+      FileSystem::Instance()->super_meta()->file_block_index_offset_ +
+          page_index * kBlockFsPageSize);
 }
 
 }
\ No newline at end of file
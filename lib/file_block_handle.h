@@ -14,6 +14,23 @@ class FileBlockHandle : public MetaHandle {
  private:
   std::list<int32_t> free_fbhs_;  // 文件块Meta的空闲链表
 
+  // 按需加载时只有用到的FileBlockMeta在内存中, 空闲的在分配时再读取
+  bool lazy_ = false;
+  std::vector<bool> loaded_;
+  std::mutex index_mutex_;  // 保护FileBlockMeta使用索引
+
+ private:
+  bool has_index() const;
+  FileBlockIndexPage *index_page(uint32_t page);
+  FileBlockMeta *meta_at(int32_t index);
+  uint32_t IndexCrc(FileBlockIndexPage *page);
+  bool CheckIndex();
+  // 根据FileBlockMeta重新生成索引, 不一致的页重新落盘
+  bool SyncIndex();
+  // 读取索引中在使用的FileBlockMeta, 索引损坏时读取全部
+  bool LoadUsedMeta(std::vector<int32_t> *indexes);
+  bool LoadMeta(int32_t index);
+
  public:
   FileBlockHandle() = default;
   ~FileBlockHandle() = default;
@@ -22,6 +39,8 @@ class FileBlockHandle : public MetaHandle {
   virtual bool FormatAllMeta() override;
 
   FileBlockPtr GetFileBlockLock();
+  // 更新FileBlockMeta的使用索引, 和FileBlockMeta在同一个事务中落盘
+  bool UpdateIndex(int32_t index, bool used);
 
   void PutFileBlockLock(uint32_t index) {
     META_HANDLE_LOCK();
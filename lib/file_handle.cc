@@ -8,30 +8,33 @@
 namespace udisk::blockfs {
 
 const static FilePtr kEmptyFilePtr;
-const static OpenFilePtr kEmptyOpenFilePtr;
 
 bool FileHandle::InitializeMeta() {
-  FileMeta *meta;
-  for (ino_t fh = 0;
-       fh < FileSystem::Instance()->super_meta()->max_file_num; ++fh) {
-    meta = reinterpret_cast<FileMeta *>(base_addr() +
-        FileSystem::Instance()->super_meta()->file_meta_size_ * fh);
-    uint32_t crc = Crc32(reinterpret_cast<uint8_t *>(meta) + sizeof(meta->crc_),
-                         FileSystem::Instance()->super_meta()->file_meta_size_ -
-                             sizeof(meta->crc_));
-    if (meta->crc_ != crc) [[unlikely]] {
-      LOG(ERROR) << "file meta " << fh << " crc error, read:" << meta->crc_
-                 << " cal: " << crc << " file name: " << meta->file_name_;
-      return false;
-    }
-    if (meta->used_) {
-      // 临时文件直接清理掉
+  // 分段并行校验, 临时文件的清理和插入映射表在合并时按顺序做
+  uint32_t part_num = FileSystem::Instance()->scan_part_num();
+  std::vector<std::vector<FilePtr>> part_files(part_num);
+  std::vector<std::vector<FileMeta *>> part_temp_metas(part_num);
+  std::vector<std::list<ino_t>> part_free_fhs(part_num);
+  auto scan = [&](uint32_t part, uint64_t begin, uint64_t end) {
+    uint64_t file_meta_size =
+        FileSystem::Instance()->super_meta()->file_meta_size_;
+    for (ino_t fh = begin; fh < static_cast<ino_t>(end); ++fh) {
+      FileMeta *meta =
+          reinterpret_cast<FileMeta *>(base_addr() + file_meta_size * fh);
+      uint32_t crc = FileSystem::Instance()->MetaCrc(
+          reinterpret_cast<uint8_t *>(meta) + sizeof(meta->crc_),
+          file_meta_size - sizeof(meta->crc_));
+      if (meta->crc_ != crc) [[unlikely]] {
+        LOG(ERROR) << "file meta " << fh << " crc error, read:" << meta->crc_
+                   << " cal: " << crc << " file name: " << meta->file_name_;
+        return false;
+      }
+      if (!meta->used_) {
+        part_free_fhs[part].push_back(fh);
+        continue;
+      }
       if (meta->is_temp_) {
-        LOG(WARNING) << "clean temp file handle: " << meta->fh_;
-        File::ClearMeta(meta);
-        if (!File::WriteMeta(meta->fh_)) {
-          return false;
-        }
+        part_temp_metas[part].push_back(meta);
         continue;
       }
       LOG(DEBUG) << "file handle: " << fh << " name: " << meta->file_name_
@@ -47,12 +50,28 @@ bool FileHandle::InitializeMeta() {
         SPDLOG_ERROR("file meta {} used but fh invalid", fh);
         return false;
       }
+      part_files[part].push_back(std::make_shared<File>(meta));
+    }
+    return true;
+  };
+  if (!FileSystem::Instance()->ParallelScan(
+          FileSystem::Instance()->super_meta()->max_file_num, scan)) {
+    return false;
+  }
 
-      FilePtr file = std::make_shared<File>(meta);
-      if (!file) return false;
+  for (uint32_t part = 0; part < part_num; ++part) {
+    // 临时文件直接清理掉
+    for (FileMeta *meta : part_temp_metas[part]) {
+      LOG(WARNING) << "clean temp file handle: " << meta->fh_;
+      File::ClearMeta(meta);
+      if (!File::WriteMeta(meta->fh_)) {
+        return false;
+      }
+    }
+    for (const FilePtr &file : part_files[part]) {
       if (file->child_fh() > 0) {
         SPDLOG_DEBUG("this is parent file, only add to fh map");
-        created_fhs_[file->fh()] = file;
+        created_fhs_.InsertOrAssign(file->fh(), file);
         // ParentFilePtr parent = ParentFile::NewParentFile();
       } else {
         // LOG(WARNING) << "This is child file, add to fh and name map";
@@ -60,17 +79,17 @@ bool FileHandle::InitializeMeta() {
       }
 
       // DH索引只在加载元数据时查找文件夹, 因为文件没有记录文件夹的绝对路径
-      const DirectoryPtr &dir =
+      DirectoryPtr dir =
           FileSystem::Instance()->dir_handle()->GetCreatedDirectoryNolock(
-              meta->dh_);
+              file->dh());
       if (!dir) [[unlikely]] {
-        LOG(ERROR) << "file meta " << fh << " cannot find parent directory";
+        LOG(ERROR) << "file meta " << file->fh()
+                   << " cannot find parent directory";
         return false;
       }
       dir->AddChildFileNoLock(file);
-    } else {
-      AddFile2FreeNolock(fh);
     }
+    free_fhs_.splice(free_fhs_.end(), part_free_fhs[part]);
   }
   // TODO: 全部加入到文件列表, 最后来过滤一遍, 去掉child_fh
   SPDLOG_DEBUG("read file meta success, free num: {}", free_meta_size());
@@ -93,9 +112,10 @@ bool FileHandle::FormatAllMeta() {
     meta->fh_ = fh;
     meta->child_fh_ = -1;
     meta->parent_fh_ = -1;
-    meta->crc_ = Crc32(reinterpret_cast<uint8_t *>(meta) + sizeof(meta->crc_),
-                       FileSystem::Instance()->super_meta()->file_meta_size_ -
-                           sizeof(meta->crc_));
+    meta->crc_ = FileSystem::Instance()->MetaCrc(
+        reinterpret_cast<uint8_t *>(meta) + sizeof(meta->crc_),
+        FileSystem::Instance()->super_meta()->file_meta_size_ -
+            sizeof(meta->crc_));
   }
   int64_t ret = FileSystem::Instance()->dev()->PwriteDirect(
       buffer->data(),
@@ -117,19 +137,20 @@ bool FileHandle::FormatAllMeta() {
  * \param new_dirname 文件夹的绝对目录
  * \param new_filename 文件的名字
  */
-bool FileHandle::TransformPath(const std::string &filename,
-                               std::string &new_dirname,
-                               std::string &new_filename) {
-  if (filename[filename.size() - 1] == '/') [[unlikely]] {
+bool FileHandle::TransformPath(std::string_view filename,
+                               std::string_view *new_dirname,
+                               std::string_view *new_filename) {
+  if (filename.empty() || filename.back() == '/') [[unlikely]] {
     SPDLOG_ERROR("file cannot endwith dir separator: {}", filename);
     errno = ENOTDIR;
     return false;
   }
-  new_dirname = GetDirName(filename);
-  new_filename = GetFileName(filename);
-  SPDLOG_INFO("transformPath dirname: {}, filename: {}", new_dirname, new_filename);
-  if (new_filename.size() >= kBlockFsMaxFileNameLen) [[unlikely]] {
-    SPDLOG_ERROR("file name exceed size: {}", new_filename);
+  *new_dirname = GetDirNameView(filename);
+  *new_filename = GetFileNameView(filename);
+  SPDLOG_DEBUG("transformPath dirname: {}, filename: {}", *new_dirname,
+               *new_filename);
+  if (new_filename->size() >= kBlockFsMaxFileNameLen) [[unlikely]] {
+    SPDLOG_ERROR("file name exceed size: {}", *new_filename);
     errno = ENAMETOOLONG;
     return false;
   }
@@ -249,8 +270,8 @@ FilePtr FileHandle::NewFreeTmpFileNolock(int32_t dh) {
   return file;
 }
 
-bool FileHandle::NewFile(const std::string &dirname,
-                         const std::string &filename, bool tmpfile,
+bool FileHandle::NewFile(std::string_view dirname, std::string_view filename,
+                         bool tmpfile,
                          std::pair<DirectoryPtr, FilePtr> *dirs) {
   const DirectoryPtr &dir =
       FileSystem::Instance()->dir_handle()->GetCreatedDirectory(dirname);
@@ -264,14 +285,13 @@ bool FileHandle::NewFile(const std::string &dirname,
 
   META_HANDLE_LOCK();
   if (!tmpfile) {
-    FileNameKey key = std::make_pair(dir->dh(), filename);
-    auto itor = created_files_.find(key);
-    if (itor != created_files_.end()) [[unlikely]] {
+    if (created_files_.Contains(FileNameKeyView(dir->dh(), filename)))
+        [[unlikely]] {
       SPDLOG_WARN("file has already exist: {} {}", dirname, filename);
       errno = EEXIST;
       return false;
     }
-    FilePtr file = NewFreeFileNolock(dir->dh(), filename);
+    FilePtr file = NewFreeFileNolock(dir->dh(), std::string(filename));
     if (!file) {
       return false;
     }
@@ -291,9 +311,9 @@ bool FileHandle::NewFile(const std::string &dirname,
 }
 
 void FileHandle::AddFileNoLock(const FilePtr &file) noexcept {
-  created_fhs_[file->fh()] = file;
-  FileNameKey key = std::make_pair(file->dh(), file->file_name());
-  created_files_[key] = file;
+  created_fhs_.InsertOrAssign(file->fh(), file);
+  created_files_.InsertOrAssign(FileNameKey(file->dh(), file->file_name()),
+                                file);
 }
 
 void FileHandle::AddFileToDirectory(const DirectoryPtr &parent,
@@ -305,18 +325,31 @@ void FileHandle::AddFileToDirectory(const DirectoryPtr &parent,
 }
 
 bool FileHandle::RemoveFileNoLock(const FilePtr &file) noexcept {
-  FileNameKey key = std::make_pair(file->dh(), file->file_name());
-  if (created_files_.erase(key) != 1) {
+  if (!created_files_.Erase(FileNameKey(file->dh(), file->file_name()))) {
     SPDLOG_ERROR("failed to remove file name map: {}", file->file_name());
     return false;
   }
-  if (created_fhs_.erase(file->fh()) != 1) {
+  if (!created_fhs_.Erase(file->fh())) {
     SPDLOG_ERROR("failed to remove file fh map: {}", file->file_name());
     return false;
   }
   return true;
 }
 
+bool FileHandle::RenameFileNoLock(const FilePtr &file,
+                                  const FileNameKey &old_key) {
+  FileNameKey key(file->dh(), file->file_name());
+  if (!created_files_.Insert(key, file)) [[unlikely]] {
+    SPDLOG_ERROR("file name has exist: {}", file->file_name());
+    return false;
+  }
+  if (!created_files_.Erase(old_key)) [[unlikely]] {
+    SPDLOG_ERROR("failed to remove file name map: {}", old_key.name_);
+    return false;
+  }
+  return true;
+}
+
 bool FileHandle::RemoveFileFromoDirectory(const DirectoryPtr &parent,
                                           const FilePtr &file) {
   if (!parent->RemoveChildFile(file)) {
@@ -335,23 +368,16 @@ bool FileHandle::RemoveFileFromoDirectoryNolock(const DirectoryPtr &parent,
 }
 
 bool FileHandle::AddParentFile(const ParentFilePtr &parent) {
-  META_HANDLE_LOCK();
-  auto it = parent_files_.find(parent->fh());
-  if (it != parent_files_.end()) [[unlikely]] {
-    return false;
-  }
-  parent_files_[parent->fh()] = parent;
-  return true;
+  return parent_files_.Insert(parent->fh(), parent);
 }
 
 bool FileHandle::RemoveParentFile(ino_t fh) {
   META_HANDLE_LOCK();
-  auto it = parent_files_.find(fh);
-  if (it == parent_files_.end()) [[unlikely]] {
+  ParentFilePtr parent = parent_files_.Find(fh);
+  if (!parent) [[unlikely]] {
     return false;
   }
-  ParentFilePtr parent = (ParentFilePtr)it->second;
-  parent_files_.erase(fh);
+  parent_files_.Erase(fh);
   return parent->Recycle();
 }
 
@@ -371,48 +397,45 @@ uint32_t FileHandle::PageAlignIndex(uint32_t index) {
   return index - (index % FILE_ALIGN);
 }
 
-bool FileHandle::FindFile(const std::string &dirname,
-                          const std::string &filename,
+bool FileHandle::FindFile(std::string_view dirname, std::string_view filename,
                           std::pair<DirectoryPtr, FilePtr> *dirs) {
-  const DirectoryPtr &dir =
+  DirectoryPtr dir =
       FileSystem::Instance()->dir_handle()->GetCreatedDirectory(dirname);
   if (!dir) [[unlikely]] {
-    LOG(ERROR) << "parent directory not exist: " << dirname;
+    SPDLOG_ERROR("parent directory not exist: {}", dirname);
     errno = ENOENT;
     return false;
   }
   // 找到父文件夹
   dirs->first = dir;
 
-  META_HANDLE_LOCK();
-  FileNameKey key = std::make_pair(dir->dh(), filename);
-  auto itor = created_files_.find(key);
-  if (itor == created_files_.end()) [[unlikely]] {
-    LOG(WARNING) << "file not exist: " << dirname << filename;
+  dirs->second = created_files_.Find(FileNameKeyView(dir->dh(), filename));
+  if (!dirs->second) [[unlikely]] {
+    SPDLOG_WARN("file not exist: {}{}", dirname, filename);
     errno = ENOENT;
     return false;
   }
-  dirs->second = itor->second;
   return true;
 }
 
 bool FileHandle::UpdateMeta() {
   META_HANDLE_LOCK();
-  for (const auto &it : created_files_) {
-    if (!it.second->UpdateMeta()) {
-      return false;
-    }
+  MetaTransaction txn;
+  if (!created_files_.ForEach([](const FileNameKey &key, const FilePtr &file) {
+        return file->UpdateMeta();
+      })) {
+    return false;
   }
-  return true;
+  return txn.Commit();
 }
 
 FilePtr FileHandle::CreateFile(const std::string &filename, mode_t mode,
                                bool tmpfile) {
-  std::string new_dirname;
-  std::string new_filename;
+  std::string_view new_dirname;
+  std::string_view new_filename;
   if (!tmpfile) {
     SPDLOG_INFO("create file: {}", filename);
-    if (!TransformPath(filename, new_dirname, new_filename)) {
+    if (!TransformPath(filename, &new_dirname, &new_filename)) {
       return kEmptyFilePtr;
     }
   } else {
@@ -420,6 +443,8 @@ FilePtr FileHandle::CreateFile(const std::string &filename, mode_t mode,
     new_dirname = filename;
     SPDLOG_INFO("create tmp file in directory: {}", new_dirname);
   }
+  // 从分配空闲文件到写完元数据都在事务里, 避免Flush拍到一半的页
+  MetaTransaction txn;
   std::pair<DirectoryPtr, FilePtr> dirs;
   if (!NewFile(new_dirname, new_filename, tmpfile, &dirs)) [[unlikely]] {
     return kEmptyFilePtr;
@@ -435,6 +460,9 @@ FilePtr FileHandle::CreateFile(const std::string &filename, mode_t mode,
       return kEmptyFilePtr;
     }
   }
+  if (!txn.Commit()) {
+    return kEmptyFilePtr;
+  }
 
   // 添加到内存文件列表和父文件夹中
   AddFileToDirectory(parent_dir, curr_file);
@@ -468,6 +496,7 @@ int FileHandle::UnlinkFileNolock(const ino_t fh) {
     return -1;
   }
 
+  MetaTransaction txn;
   // 持久化删除fileblock
   if (!file->RemoveAllFileBlock()) {
     return -1;
@@ -482,6 +511,10 @@ int FileHandle::UnlinkFileNolock(const ino_t fh) {
   if (!RemoveFileFromoDirectoryNolock(parent_dir, file)) {
     return -1;
   }
+  if (!txn.Commit()) [[unlikely]] {
+    errno = EIO;
+    return -1;
+  }
 
   SPDLOG_INFO("remove file success: {}", file->file_name());
   errno = 0;
@@ -498,9 +531,9 @@ int FileHandle::unlink(const std::string &filename) {
     return -1;
   }
 
-  std::string new_dirname;
-  std::string new_filename;
-  if (!TransformPath(filename, new_dirname, new_filename)) {
+  std::string_view new_dirname;
+  std::string_view new_filename;
+  if (!TransformPath(filename, &new_dirname, &new_filename)) {
     return -1;
   }
 
@@ -517,6 +550,7 @@ int FileHandle::unlink(const std::string &filename) {
     return 0;
   }
 
+  MetaTransaction txn;
   // 持久化删除fileblock
   if (!curr_file->RemoveAllFileBlock()) {
     return -1;
@@ -531,6 +565,10 @@ int FileHandle::unlink(const std::string &filename) {
   if (!RemoveFileFromoDirectory(parent_dir, curr_file)) {
     return -1;
   }
+  if (!txn.Commit()) [[unlikely]] {
+    errno = EIO;
+    return -1;
+  }
 
   SPDLOG_INFO("remove file success: {}", filename);
   errno = 0;
@@ -541,71 +579,62 @@ bool FileHandle::CheckFileExist(const std::string &path) {
   return (GetCreatedFile(path) == kEmptyFilePtr);
 }
 
-const OpenFilePtr &FileHandle::GetOpenFile(ino_t fd) {
-  META_HANDLE_LOCK();
-  return GetOpenFileNolock(fd);
-}
+OpenFilePtr FileHandle::GetOpenFile(ino_t fd) { return GetOpenFileNolock(fd); }
 
-const OpenFilePtr &FileHandle::GetOpenFileNolock(ino_t fd) {
-  auto itor = open_files_.find(fd);
-  if (itor == open_files_.end()) [[unlikely]] {
+OpenFilePtr FileHandle::GetOpenFileNolock(ino_t fd) {
+  OpenFilePtr open_file = FileSystem::Instance()->fd_handle()->GetFile(fd);
+  if (!open_file) [[unlikely]] {
     SPDLOG_WARN("fd not been opened: {}", fd);
     errno = EBADF;
-    return kEmptyOpenFilePtr;
   }
-  return itor->second;
+  return open_file;
 }
 
-const FilePtr &FileHandle::GetCreatedFile(int32_t fh) {
-  META_HANDLE_LOCK();
+FilePtr FileHandle::GetCreatedFile(int32_t fh) {
   return GetCreatedFileNoLock(fh);
 }
 
-const FilePtr &FileHandle::GetCreatedFileNoLock(ino_t fh) {
-  auto itor = created_fhs_.find(fh);
-  if (itor == created_fhs_.end()) {
+FilePtr FileHandle::GetCreatedFileNoLock(ino_t fh) {
+  FilePtr file = created_fhs_.Find(fh);
+  if (!file) {
     SPDLOG_ERROR("file handle not exist: {}", fh);
-    return kEmptyFilePtr;
   }
-  return itor->second;
+  return file;
 }
 
-const FilePtr &FileHandle::GetCreatedFile(const std::string &filename) {
-  SPDLOG_INFO("get created file name: {}", filename);
-  std::string new_dirname;
-  std::string new_filename;
-  if (!TransformPath(filename, new_dirname, new_filename)) {
+// 路径拆分和两次查找都不拷贝字符串
+FilePtr FileHandle::GetCreatedFile(std::string_view filename) {
+  SPDLOG_DEBUG("get created file name: {}", filename);
+  std::string_view new_dirname;
+  std::string_view new_filename;
+  if (!TransformPath(filename, &new_dirname, &new_filename)) {
     return kEmptyFilePtr;
   }
-  const DirectoryPtr &dir =
+  DirectoryPtr dir =
       FileSystem::Instance()->dir_handle()->GetCreatedDirectory(new_dirname);
   if (!dir) [[unlikely]] {
     return kEmptyFilePtr;
   }
-  std::lock_guard lock(mutex_);
-  FileNameKey key = std::make_pair(dir->dh(), new_filename);
-  return GetCreatedFileNoLock(key);
+  return GetCreatedFileNoLock(FileNameKeyView(dir->dh(), new_filename));
 }
 
-const FilePtr &FileHandle::GetCreatedFileNoLock(const FileNameKey &key) {
-  auto itor = created_files_.find(key);
-  if (itor == created_files_.end()) [[unlikely]] {
-    SPDLOG_WARN("file not exist: {}", key.second);
+FilePtr FileHandle::GetCreatedFileNoLock(const FileNameKeyView &key) {
+  FilePtr file = created_files_.Find(key);
+  if (!file) [[unlikely]] {
+    SPDLOG_WARN("file not exist: {}", key.name_);
     /* ERROR: trying to open a file that does not exist without O_CREATE */
     errno = ENOENT;
-    return kEmptyFilePtr;
   }
-  return itor->second;
+  return file;
 }
 
-const FilePtr &FileHandle::GetCreatedFileNolock(int32_t dh,
-                                                const std::string &filename) {
-  auto itor = created_files_.find(std::make_pair(dh, filename));
-  if (itor == created_files_.end()) [[unlikely]] {
-    SPDLOG_WARN("file not exist: {}", filename);
-    return kEmptyFilePtr;
+FilePtr FileHandle::GetCreatedFileNolock(int32_t dh,
+                                         std::string_view filename) {
+  FilePtr file = created_files_.Find(FileNameKeyView(dh, filename));
+  if (!file) [[unlikely]] {
+    SPDLOG_DEBUG("file not exist: {}", filename);
   }
-  return itor->second;
+  return file;
 }
 
 static bool VerifyOpenExistFileFlag(const int32_t flags) {
@@ -672,21 +701,41 @@ int FileHandle::open(const std::string &filename, int32_t flags, mode_t mode) {
     }
   }
 
-  /* allocate a file fd for this new file */
-  ino_t fd = FileSystem::Instance()->fd_handle()->get_fd();
-  if (fd < 0) {
+  return AllocOpenFile(file, flags);
+}
+
+int FileHandle::open(const FilePtr &file, int32_t flags) {
+  if (file->deleted()) [[unlikely]] {
+    errno = ENOENT;
     return -1;
   }
-  OpenFilePtr open_file = std::make_shared<OpenFile>(file);
-  AddOpenFile(fd, open_file);
-  SPDLOG_INFO("open file name: {}, fd: {}, fh: {}", filename, fd, file->fh());
+  if (!VerifyOpenExistFileFlag(flags)) {
+    return -1;
+  }
+  if ((flags & O_TRUNC) && (flags & (O_RDWR | O_WRONLY))) {
+    if (file->ftruncate(0) < 0) {
+      return -1;
+    }
+  }
+  return AllocOpenFile(file, flags);
+}
 
+int FileHandle::AllocOpenFile(const FilePtr &file, int32_t flags) {
+  OpenFilePtr open_file = std::make_shared<OpenFile>(file);
   if (flags & O_APPEND) {
     // if O_APPEND is set, we need to place file pointer at end of file
     open_file->set_append_pos(file->file_size());
   } else {
     open_file->set_append_pos(0);
   }
+
+  /* allocate a file fd for this new file */
+  int fd = FileSystem::Instance()->fd_handle()->AllocFd(open_file);
+  if (fd < 0) {
+    return -1;
+  }
+  SPDLOG_DEBUG("open file name: {}, fd: {}, fh: {}", file->file_name(), fd,
+               file->fh());
   file->IncLinkCount();
 
   errno = 0;
@@ -694,14 +743,18 @@ int FileHandle::open(const std::string &filename, int32_t flags, mode_t mode) {
 }
 
 int FileHandle::close(ino_t fd) noexcept {
-  std::lock_guard lock(mutex_);
-  const OpenFilePtr &open_file = GetOpenFileNolock(fd);
+  // 先从fd表中摘掉, 同一个fd并发close只有一个成功
+  OpenFilePtr open_file = FileSystem::Instance()->fd_handle()->ReleaseFile(fd);
   if (!open_file) [[unlikely]] {
+    SPDLOG_WARN("fd not been opened: {}", fd);
+    errno = EBADF;
     return -1;
   }
   const FilePtr &file = open_file->file();
-  file->fsync();
-  SPDLOG_INFO("close file name: {}, fd: {}", file->file_name(), fd);
+  // 落盘不需要持有mutex_
+  file->fsync(kMetaSyncClose);
+  SPDLOG_DEBUG("close file name: {}, fd: {}", file->file_name(), fd);
+  std::lock_guard lock(mutex_);
   // 文件关闭的时候去掉文件锁
   file->set_locked(false);
   file->DecLinkCount();
@@ -715,9 +768,6 @@ int FileHandle::close(ino_t fd) noexcept {
       UnlinkFileNolock(file->fh());
     }
   }
-  // keep the reference of file pointer
-  open_files_.erase(fd);
-  FileSystem::Instance()->fd_handle()->put_fd(fd);
   errno = 0;
   return 0;
 }
@@ -731,13 +781,12 @@ int FileHandle::dup(int oldfd) {
   const FilePtr &file = old_open_file->file();
 
   /* allocate a file fd for this new file */
-  ino_t newfd = FileSystem::Instance()->fd_handle()->get_fd();
+  OpenFilePtr new_open_file = std::make_shared<OpenFile>(file);
+  int newfd = FileSystem::Instance()->fd_handle()->AllocFd(new_open_file);
   if (newfd < 0) {
     return -1;
   }
-  OpenFilePtr new_open_file = std::make_shared<OpenFile>(file);
-  AddOpenFile(newfd, new_open_file);
-  SPDLOG_INFO("dup oldfd: {}, newfd: {}, fh: {}", oldfd, newfd, file->fh());
+  SPDLOG_DEBUG("dup oldfd: {}, newfd: {}, fh: {}", oldfd, newfd, file->fh());
   file->IncLinkCount();
 
   errno = 0;
@@ -754,14 +803,15 @@ int FileHandle::fsync(ino_t fd) {
 }
 
 void FileHandle::Dump() noexcept {
-  for (auto &kv : created_files_) {
-    const FileNameKey &key = kv.first;
-    LOG(INFO) << "find dh: " << key.first << " name: " << key.second
-              << " name: " << kv.second->file_name();
-  }
-  for (auto &[fh, ptr] : created_fhs_) {
-    SPDLOG_INFO("find fh: {} name: {}", fh, ptr->file_name());
-  }
+  created_files_.ForEach([](const FileNameKey &key, const FilePtr &file) {
+    LOG(INFO) << "find dh: " << key.dh_ << " name: " << key.name_
+              << " name: " << file->file_name();
+    return true;
+  });
+  created_fhs_.ForEach([](ino_t fh, const FilePtr &file) {
+    SPDLOG_INFO("find fh: {} name: {}", fh, file->file_name());
+    return true;
+  });
 }
 
 void FileHandle::Dump(const std::string &file_name) noexcept {}
@@ -6,6 +6,7 @@
 #include "device.h"
 #include "file.h"
 #include "meta_handle.h"
+#include "sharded_map.h"
 
 namespace udisk::blockfs {
 
@@ -13,50 +14,81 @@ class Directory;
 class FileBlock;
 typedef std::shared_ptr<Directory> DirectoryPtr;
 
-// dh + file_name
-typedef std::pair<ino_t, std::string> FileNameKey;
+// 父文件夹dh和文件名一起算hash, 不同文件夹下的同名文件也能分散开
+inline std::size_t HashFileName(ino_t dh, std::string_view name) noexcept {
+  std::size_t h = std::hash<std::string_view>()(name);
+  h ^= (static_cast<std::size_t>(dh) + 0x9E3779B97F4A7C15ULL) *
+       0xBF58476D1CE4E5B9ULL;
+  return h ^ (h >> 31);
+}
+
+// dh + file_name, hash在构造时算好, 分片和map内部都直接使用
+struct FileNameKey {
+  ino_t dh_;
+  std::string name_;
+  std::size_t hash_;
+
+  FileNameKey(ino_t dh, std::string_view name)
+      : dh_(dh), name_(name), hash_(HashFileName(dh, name)) {}
+};
+
+// 查找用的key, 不拷贝文件名, 路径解析的过程中没有内存分配
+struct FileNameKeyView {
+  ino_t dh_;
+  std::string_view name_;
+  std::size_t hash_;
+
+  FileNameKeyView(ino_t dh, std::string_view name)
+      : dh_(dh), name_(name), hash_(HashFileName(dh, name)) {}
+};
 
 struct FileNameKeyHash {
-  std::size_t operator()(const FileNameKey &item) const {
-    std::size_t h1 = std::hash<int32_t>()(item.first);
-    std::size_t h2 = std::hash<std::string>()(item.second);
-    return (h1 << 1) ^ h2;
+  using is_transparent = void;
+  std::size_t operator()(const FileNameKey &item) const noexcept {
+    return item.hash_;
+  }
+  std::size_t operator()(const FileNameKeyView &item) const noexcept {
+    return item.hash_;
   }
 };
 
-typedef std::unordered_map<int32_t, ParentFilePtr> ParentFileHandleMap;
-typedef std::unordered_map<FileNameKey, FilePtr, FileNameKeyHash> FileNameMap;
+struct FileNameKeyEqual {
+  using is_transparent = void;
+  template <typename L, typename R>
+  bool operator()(const L &lhs, const R &rhs) const noexcept {
+    return lhs.hash_ == rhs.hash_ && lhs.dh_ == rhs.dh_ &&
+           lhs.name_ == rhs.name_;
+  }
+};
+
+typedef ShardedMap<int32_t, ParentFilePtr> ParentFileHandleMap;
+typedef ShardedMap<FileNameKey, FilePtr, FileNameKeyHash, FileNameKeyEqual>
+    FileNameMap;
 
+// 映射表分片加锁, 查找不需要mutex_, 打开的文件在FdHandle的fd表中
+// mutex_保护空闲链表, 并且串行化创建/删除/重命名这些需要同时修改多个映射的操作
 class FileHandle : public MetaHandle {
  private:
   std::list<ino_t> free_fhs_;  // 文件Meta的空闲链表
 
-  FileNameMap deleted_files_;                            // 待删除的目录
-  FileNameMap created_files_;                            // 已创建的文件
-  std::unordered_map<ino_t, FilePtr> created_fhs_;     // 已创建的文件
-  std::unordered_map<ino_t, OpenFilePtr> open_files_;  // 已打开的文件
-  ParentFileHandleMap parent_files_;                     // 继承的父文件
+  FileNameMap created_files_;               // 已创建的文件
+  ShardedMap<ino_t, FilePtr> created_fhs_;  // 已创建的文件
+  ParentFileHandleMap parent_files_;        // 继承的父文件
 
  private:
-  bool TransformPath(const std::string &filename, std::string &new_dirname,
-                     std::string &new_filename);
+  // 返回值指向filename, 调用者保证filename在使用期间有效
+  bool TransformPath(std::string_view filename, std::string_view *new_dirname,
+                     std::string_view *new_filename);
 
   FilePtr NewFreeFileNolock(int32_t dh, const std::string &filename);
   FilePtr NewFreeTmpFileNolock(int32_t dh);
-  bool NewFile(const std::string &dirname, const std::string &filename,
+  bool NewFile(std::string_view dirname, std::string_view filename,
                bool tmpfile, std::pair<DirectoryPtr, FilePtr> *dirs);
 
-  bool FindFile(const std::string &dirname, const std::string &filename,
+  bool FindFile(std::string_view dirname, std::string_view filename,
                 std::pair<DirectoryPtr, FilePtr> *dirs);
-
-  void AddOpenFile(ino_t fd, const OpenFilePtr &file) noexcept {
-    std::lock_guard lock(mutex_);
-    open_files_[fd] = file;
-  }
-  void RemoveOpenFile(ino_t fd, const OpenFilePtr &file) noexcept {
-    std::lock_guard lock(mutex_);
-    open_files_.erase(fd);
-  }
+  // 给打开的文件分配fd
+  int AllocOpenFile(const FilePtr &file, int32_t flags);
 
  public:
   FileHandle() = default;
@@ -82,6 +114,8 @@ class FileHandle : public MetaHandle {
 
   void AddFileNoLock(const FilePtr &file) noexcept;
   bool RemoveFileNoLock(const FilePtr &file) noexcept;
+  // 文件已经改成新的名字, 先加入新名字再去掉老名字, 查找不会看到文件消失
+  bool RenameFileNoLock(const FilePtr &file, const FileNameKey &old_key);
 
   void AddFileToDirectory(const DirectoryPtr &parent, const FilePtr &file);
   bool RemoveFileFromoDirectory(const DirectoryPtr &parent,
@@ -95,13 +129,14 @@ class FileHandle : public MetaHandle {
   bool RemoveParentFile(ino_t fh);
 
   bool CheckFileExist(const std::string &path);
-  const OpenFilePtr &GetOpenFile(ino_t fd);
-  const OpenFilePtr &GetOpenFileNolock(ino_t fd);
-  const FilePtr &GetCreatedFile(int32_t fh);
-  const FilePtr &GetCreatedFileNoLock(ino_t fh);
-  const FilePtr &GetCreatedFile(const std::string &filename);
-  const FilePtr &GetCreatedFileNoLock(const FileNameKey &key);
-  const FilePtr &GetCreatedFileNolock(int32_t dh, const std::string &filename);
+  // 返回智能指针的拷贝, 返回之后映射表可能已经被其他线程修改
+  OpenFilePtr GetOpenFile(ino_t fd);
+  OpenFilePtr GetOpenFileNolock(ino_t fd);
+  FilePtr GetCreatedFile(int32_t fh);
+  FilePtr GetCreatedFileNoLock(ino_t fh);
+  FilePtr GetCreatedFile(std::string_view filename);
+  FilePtr GetCreatedFileNoLock(const FileNameKeyView &key);
+  FilePtr GetCreatedFileNolock(int32_t dh, std::string_view filename);
 
   FilePtr CreateFile(const std::string &filename, mode_t mode,
                      bool tmpfile = false);
@@ -112,6 +147,8 @@ class FileHandle : public MetaHandle {
   int unlink(const std::string &filename);
 
   int open(const std::string &filename, int32_t flags, mode_t mode = 0);
+  // 打开已经查找到的文件, 不再解析路径, 不支持O_CREAT创建
+  int open(const FilePtr &file, int32_t flags);
   int close(ino_t fh) noexcept;
   int dup(int oldfd);
   int fsync(ino_t fh);
@@ -4,10 +4,16 @@
 #include <dirent.h>
 #include <fcntl.h>
 
+#include <algorithm>
+#include <atomic>
 #include <filesystem>
 #include <functional>
+#include <latch>
+#include <thread>
 
 #include "config_load.h"
+#include "log_ratelimit.h"
+#include "stats.h"
 #include "spdlog/spdlog.h"
 
 namespace udisk::blockfs {
@@ -35,6 +41,7 @@ int32_t FileSystem::MountFileSystem(const std::string& config_path) {
   if (!loader.ParseConfig(&mount_config_)) {
     return -1;
   }
+  Stats::set_enabled(mount_config_.stats_enable_);
 
   if (!Initialize()) {
     return -1;
@@ -43,12 +50,35 @@ int32_t FileSystem::MountFileSystem(const std::string& config_path) {
   if (!OpenTarget(mount_config_.device_uuid_)) {
     return -1;
   }
-  if (!shm_manager_->Initialize(true)) {
+  // 同一块设备只能有一个挂载者, 两个进程各自的元数据缓存会互相覆盖
+  if (!device_->LockExclusive()) {
+    return -1;
+  }
+  device_->SetIoEngine(Device::IoEngineConvert(mount_config_.io_engine_),
+                       mount_config_.io_depth_);
+  // io_uring本身就是异步提交的, 线程池只给psync使用
+  if (device_->io_engine() == kIoEnginePsync) {
+    device_->SetIoThreads(mount_config_.io_threads_);
+  }
+  if (!RecoverJournal()) {
+    return -1;
+  }
+  if (!shm_manager_->Initialize(true, true)) {
     return -1;
   }
   if (!InitializeMeta()) {
     return -1;
   }
+  // 挂载期间共享内存中的元数据和老的代数不再对应
+  if (!BumpShmGeneration()) {
+    return -1;
+  }
+  mounted_ = true;
+  journal_->StartFlusher(
+      shm_manager_->shm_addr(), shm_manager_->shm_size(),
+      mount_config_.meta_flush_interval_ms_,
+      (mount_config_.meta_sync_on_fsync_ ? kMetaSyncFsync : 0) |
+          (mount_config_.meta_sync_on_close_ ? kMetaSyncClose : 0));
   if (MakeMountPoint("/") < 0) {
     return -1;
   }
@@ -74,27 +104,26 @@ block_fs_dirent* FileSystem::ReadDirectory(BLOCKFS_DIR* dir) {
  *
  * \return success or failed
  */
-int32_t FileSystem::StatPath(const std::string& path, struct stat* buf) {
+int32_t FileSystem::StatPath(std::string_view path, struct stat* buf) {
   if (path.empty()) [[unlikely]] {
     SPDLOG_ERROR("stat path empty");
     errno = EINVAL;
     return -1;
   }
-  SPDLOG_INFO("stat path: {}", path);
-  std::string path_name = path;
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC, "stat path: {}", path);
   // 如果是带尾部分隔符,只需要判断文件夹
   // 挂载目录检查可能不带/, 所以要优先判断
-  if (path_name.back() == '/') {
-    DirectoryPtr dir = dir_handle()->GetCreatedDirectory(path_name);
+  if (path.back() == '/') {
+    DirectoryPtr dir = dir_handle()->GetCreatedDirectory(path);
     if (!dir) {
       errno = ENOENT;
       return -1;
     }
     dir->stat(buf);
   } else {
-    FilePtr file = file_handle()->GetCreatedFile(path_name);
+    FilePtr file = file_handle()->GetCreatedFile(path);
     if (!file) {
-      DirectoryPtr dir = dir_handle()->GetCreatedDirectory(path_name);
+      DirectoryPtr dir = dir_handle()->GetCreatedDirectory(path);
       if (!dir) {
         errno = ENOENT;
         return -1;
@@ -169,9 +198,11 @@ int32_t FileSystem::RenamePath(const std::string& oldpath,
     return -1;
   }
 
+  // 不做POSIX的覆盖: 目标已经存在时失败并返回EEXIST, 调用者需要先unlink
   FilePtr dest_file = file_handle()->GetCreatedFile(newpath);
   if (dest_file) {
     SPDLOG_ERROR("new file name exists, file_name: {}", newpath);
+    errno = EEXIST;
     return -1;
   }
 
@@ -209,8 +240,30 @@ int32_t FileSystem::TruncateFile(const int32_t fd, int64_t size) {
   return open_file->file()->ftruncate(size);
 }
 
+int32_t FileSystem::FallocateFile(int32_t fd, int mode, off_t offset,
+                                  off_t len) {
+  SPDLOG_DEBUG("fallocate file fd: {} mode: {} offset: {} len: {}", fd, mode,
+               offset, len);
+  if (offset < 0 || len <= 0) [[unlikely]] {
+    errno = EINVAL;
+    return -1;
+  }
+  // 文件大小之内的block都已经分配, KEEP_SIZE/PUNCH_HOLE这些都做不到
+  if (mode != 0) [[unlikely]] {
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+  OpenFilePtr open_file = file_handle()->GetOpenFile(fd);
+  if (!open_file) [[unlikely]] {
+    errno = EBADF;
+    return -1;
+  }
+  return open_file->file()->fallocate(static_cast<uint64_t>(offset) + len);
+}
+
 int64_t FileSystem::ReadFile(int32_t fd, void* buf, size_t len) {
-  SPDLOG_INFO("read file fd: {} len: {}", fd, len);
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC, "read file fd: {} len: {}", fd,
+                      len);
   const OpenFilePtr& open_file = file_handle()->GetOpenFile(fd);
   if (!open_file) {
     // errno = ENOENT;
@@ -220,7 +273,8 @@ int64_t FileSystem::ReadFile(int32_t fd, void* buf, size_t len) {
 }
 
 int64_t FileSystem::PreadFile(ino_t fd, void* buf, size_t len, off_t offset) {
-  SPDLOG_INFO("pread file fd: {} len: {} offset: {}", fd, len, offset);
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC,
+                      "pread file fd: {} len: {} offset: {}", fd, len, offset);
   OpenFilePtr open_file = file_handle()->GetOpenFile(fd);
   if (!open_file) {
     errno = ENOENT;
@@ -231,7 +285,8 @@ int64_t FileSystem::PreadFile(ino_t fd, void* buf, size_t len, off_t offset) {
 
 int64_t FileSystem::PwriteFile(ino_t fd, const void* buf, size_t len,
                                off_t offset) {
-  SPDLOG_INFO("pwrite file fd: {} len: {} offset: {}", fd, len, offset);
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC,
+                      "pwrite file fd: {} len: {} offset: {}", fd, len, offset);
   OpenFilePtr open_file = file_handle()->GetOpenFile(fd);
   if (!open_file) {
     errno = ENOENT;
@@ -240,8 +295,61 @@ int64_t FileSystem::PwriteFile(ino_t fd, const void* buf, size_t len,
   return open_file->pwrite(buf, len, offset);
 }
 
+int64_t FileSystem::PreadvFile(ino_t fd, const struct iovec* iov, int iovcnt,
+                               off_t offset) {
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC,
+                      "preadv file fd: {} iovcnt: {} offset: {}", fd, iovcnt,
+                      offset);
+  OpenFilePtr open_file = file_handle()->GetOpenFile(fd);
+  if (!open_file) {
+    errno = ENOENT;
+    return -1;
+  }
+  return open_file->preadv(iov, iovcnt, offset);
+}
+
+int64_t FileSystem::PwritevFile(ino_t fd, const struct iovec* iov, int iovcnt,
+                                off_t offset) {
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC,
+                      "pwritev file fd: {} iovcnt: {} offset: {}", fd, iovcnt,
+                      offset);
+  OpenFilePtr open_file = file_handle()->GetOpenFile(fd);
+  if (!open_file) {
+    errno = ENOENT;
+    return -1;
+  }
+  return open_file->pwritev(iov, iovcnt, offset);
+}
+
+int64_t FileSystem::PreadFile(ino_t fd, const DeviceTransfer& transfer,
+                              size_t len, off_t offset) {
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC,
+                      "pread file zero copy fd: {} len: {} offset: {}", fd,
+                      len, offset);
+  OpenFilePtr open_file = file_handle()->GetOpenFile(fd);
+  if (!open_file) {
+    errno = ENOENT;
+    return -1;
+  }
+  return open_file->pread(transfer, len, offset);
+}
+
+int64_t FileSystem::PwriteFile(ino_t fd, const DeviceTransfer& transfer,
+                               size_t len, off_t offset) {
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC,
+                      "pwrite file zero copy fd: {} len: {} offset: {}", fd,
+                      len, offset);
+  OpenFilePtr open_file = file_handle()->GetOpenFile(fd);
+  if (!open_file) {
+    errno = ENOENT;
+    return -1;
+  }
+  return open_file->pwrite(transfer, len, offset);
+}
+
 off_t FileSystem::SeekFile(ino_t fd, off_t offset, int whence) {
-  SPDLOG_INFO("lseek file fd: {} offset: {}", fd, offset);
+  BFS_DEBUG_RATELIMIT(BFS_HOT_LOG_PER_SEC, "lseek file fd: {} offset: {}", fd,
+                      offset);
   const OpenFilePtr& open_file = file_handle()->GetOpenFile(fd);
   if (!open_file) {
     // errno = ENOENT;
@@ -294,6 +402,7 @@ bool FileSystem::Initialize() {
   device_ = new Device();
   shm_manager_ = new ShmManager();
   fd_handle_ = new FdHandle();
+  journal_ = new Journal(device_);
 
   handle_vector_[kSuperBlockHandle] = new SuperBlock();
   handle_vector_[kBlockHandle] = new BlockHandle();
@@ -303,6 +412,26 @@ bool FileSystem::Initialize() {
   return true;
 }
 
+/**
+ * bump the shm generation in super block
+ *
+ * \return success or failed
+ */
+bool FileSystem::BumpShmGeneration() {
+  super_meta()->shm_generation_++;
+  if (!super()->WriteMeta()) {
+    SPDLOG_ERROR("write super block shm generation failed");
+    return false;
+  }
+  return true;
+}
+
+void FileSystem::UnmountFileSystem() {
+  Destroy();
+  // 异步日志这里只是把flush排进队列, 退出时后台线程会写完剩下的
+  spdlog::default_logger_raw()->flush();
+}
+
 /**
  * delete handle, close device, delete lock
  *
@@ -312,6 +441,20 @@ bool FileSystem::Initialize() {
  */
 void FileSystem::Destroy() {
   SPDLOG_DEBUG("close file store now");
+  // 正常卸载时推进代数, 所有元数据落盘之后共享内存的镜像才能在下次挂载复用
+  bool clean = mounted_ && BumpShmGeneration();
+  if (journal_) {
+    clean = journal_->Close() && clean;
+    delete journal_;
+    journal_ = nullptr;
+  }
+  if (clean) {
+    shm_manager_->MarkClean(super_meta()->shm_generation_);
+  }
+  mounted_ = false;
+  if (handle_vector_[kBlockHandle]) {
+    block_handle()->DrainBlockCacheLock();
+  }
   for (auto& handle : handle_vector_) {
     if (handle) {
       delete handle;
@@ -381,6 +524,10 @@ bool FileSystem::Format(const std::string& dev_name) {
       return false;
     }
   }
+  if (!journal_->Format(super_meta()->journal_offset_,
+                        super_meta()->journal_size_)) {
+    return false;
+  }
   // return FormatFSData();
   return true;
 }
@@ -401,6 +548,9 @@ bool FileSystem::Check(const std::string& dev_name,
   if (!device_->Open(dev_name)) {
     return false;
   }
+  if (!RecoverJournal()) {
+    return false;
+  }
   if (!shm_manager_->Initialize()) {
     return false;
   }
@@ -454,13 +604,66 @@ bool FileSystem::OpenTarget(const std::string& uuid) {
   return false;
 }
 
+/**
+ * replay metadata journal before reading all metadata
+ */
+bool FileSystem::RecoverJournal() {
+  SuperBlockMeta meta;
+  if (!ShmManager::PrefetchSuperMeta(meta)) {
+    return false;
+  }
+  uint32_t crc = Crc32(reinterpret_cast<uint8_t*>(&meta) + sizeof(meta.crc_),
+                       kSuperBlockSize - sizeof(meta.crc_));
+  if (meta.crc_ != crc || meta.magic_ != kBlockFsMagic) [[unlikely]] {
+    SPDLOG_ERROR("super block invalid, crc: {} cal: {} magic: {:#x}",
+                 static_cast<uint32_t>(meta.crc_), crc,
+                 static_cast<uint32_t>(meta.magic_));
+    return false;
+  }
+  return journal_->Recover(meta.journal_offset_, meta.journal_size_);
+}
+
 bool FileSystem::InitializeMeta() {
+  // 依赖顺序不变: 目录 -> 文件 -> fileblock, 每一类内部分段并行校验
+  uint32_t thread_num = std::clamp<uint32_t>(
+      std::thread::hardware_concurrency(), 1, kMountScanMaxThreads);
+  mount_pool_ = new ThreadPool("bfs_mount", thread_num,
+                               thread_num * kMountScanPartPerThread);
+  scan_part_num_ = thread_num * kMountScanPartPerThread;
+  bool success = true;
   for (auto& handle : handle_vector_) {
     if (!handle->InitializeMeta()) {
-      return false;
+      success = false;
+      break;
     }
   }
-  return true;
+  delete mount_pool_;
+  mount_pool_ = nullptr;
+  scan_part_num_ = 1;
+  return success;
+}
+
+bool FileSystem::ParallelScan(uint64_t num, const ScanFunc& scan) {
+  uint32_t part_num = scan_part_num_;
+  std::atomic<bool> success(true);
+  std::latch done(part_num);
+  for (uint32_t part = 0; part < part_num; ++part) {
+    uint64_t begin = num * part / part_num;
+    uint64_t end = num * (part + 1) / part_num;
+    auto task = [&scan, &success, &done, part, begin, end] {
+      if (begin < end && !scan(part, begin, end)) {
+        success = false;
+      }
+      done.count_down();
+    };
+    if (mount_pool_) {
+      mount_pool_->Submit(task);
+    } else {
+      task();
+    }
+  }
+  done.wait();
+  return success;
 }
 
 /**
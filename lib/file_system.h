@@ -6,6 +6,7 @@
 #include <stdint.h>
 #include <sys/statvfs.h>
 
+#include <functional>
 #include <memory>
 #include <string>
 
@@ -13,11 +14,14 @@
 #include "comm_utils.h"
 #include "bfs_fuse.h"
 #include "block_handle.h"
+#include "crc.h"
 #include "dir_handle.h"
 #include "fd_handle.h"
 #include "file_block_handle.h"
+#include "journal.h"
 #include "shm_manager.h"
 #include "super_block.h"
+#include "thread_pool.h"
 
 namespace udisk::blockfs {
 
@@ -30,13 +34,27 @@ enum MetaHandleType {
   kMetaHandleSize,
 };
 
+// 挂载时扫描元数据的线程数上限, 每个线程切分成多段, 避免某一段过慢
+constexpr uint32_t kMountScanMaxThreads = 16;
+constexpr uint32_t kMountScanPartPerThread = 4;
+
 class FileSystem {
+ public:
+  // 扫描[begin, end)之间的元数据, part是段的编号, 用于按顺序合并结果
+  typedef std::function<bool(uint32_t part, uint64_t begin, uint64_t end)>
+      ScanFunc;
+
  private:
   bfs_config_info mount_config_;
 
   Device *device_;
   ShmManager *shm_manager_;
   FdHandle *fd_handle_;
+  Journal *journal_;
+  // 只在加载元数据期间存在
+  ThreadPool *mount_pool_ = nullptr;
+  uint32_t scan_part_num_ = 1;
+  bool mounted_ = false;
 
   MetaHandle *handle_vector_[kMetaHandleSize];
 
@@ -48,7 +66,9 @@ class FileSystem {
   void Destroy();
 
   bool OpenTarget(const std::string &uuid);
+  bool RecoverJournal();
   bool InitializeMeta();
+  bool BumpShmGeneration();
   int MakeMountPoint(const std::string &mount_point);
 
  public:
@@ -61,11 +81,13 @@ class FileSystem {
 
   // Mount FileSystem
   int32_t MountFileSystem(const std::string &config_path);
+  // 正常卸载, 元数据全部落盘, 下次挂载可以复用共享内存
+  void UnmountFileSystem();
 
   block_fs_dirent *ReadDirectory(BLOCKFS_DIR *dir);
 
   // Stat
-  int32_t StatPath(const std::string &path, struct stat *fileinfo);
+  int32_t StatPath(std::string_view path, struct stat *fileinfo);
   int32_t StatPath(const int32_t fd, struct stat *fileinfo);
   int32_t StatVFS(struct statvfs *buf);
 
@@ -75,17 +97,40 @@ class FileSystem {
   // Returns 0 on success.
   int32_t TruncateFile(const std::string &filename, int64_t size);
   int32_t TruncateFile(const int32_t fd, int64_t size);
+  // 只支持mode为0: 给[offset, offset + len)分配block, 需要时扩展文件大小
+  int32_t FallocateFile(int32_t fd, int mode, off_t offset, off_t len);
 
   int64_t ReadFile(int32_t fd, void *buf, size_t len);
   int64_t PreadFile(ino_t fd, void *buf, size_t len, off_t offset);
   int64_t PwriteFile(ino_t fd, const void *buf, size_t len,
                      off_t offset);
+  // 分散的用户buffer, 每个物理连续的段一次preadv/pwritev
+  int64_t PreadvFile(ino_t fd, const struct iovec *iov, int iovcnt,
+                     off_t offset);
+  int64_t PwritevFile(ino_t fd, const struct iovec *iov, int iovcnt,
+                      off_t offset);
+  // 零拷贝读写, transfer在block锁内直接搬运设备fd上的数据
+  int64_t PreadFile(ino_t fd, const DeviceTransfer &transfer, size_t len,
+                    off_t offset);
+  int64_t PwriteFile(ino_t fd, const DeviceTransfer &transfer, size_t len,
+                     off_t offset);
   off_t SeekFile(ino_t fd, off_t offset, int whence);
   int32_t FcntlFile(int32_t fd, int16_t lock_type);
 
   void DumpFileMeta(const std::string &path);
 
   Device *dev() { return device_; }
+  Journal *journal() { return journal_; }
+  ShmManager *shm_manager() { return shm_manager_; }
+
+  // 加载元数据时把[0, num)切分成scan_part_num()段并行扫描, 全部成功返回true
+  uint32_t scan_part_num() const noexcept { return scan_part_num_; }
+  bool ParallelScan(uint64_t num, const ScanFunc &scan);
+
+  // 所有元数据页的落盘都走这里, 有journal的时候先写journal
+  bool WriteMetaPage(const void *addr, uint64_t len, uint64_t dev_offset) {
+    return journal_->Write(addr, len, dev_offset);
+  }
 
   MetaHandle *GetMetaHandle(MetaHandleType type) {
     return handle_vector_[type];
@@ -96,6 +141,15 @@ class FileSystem {
   }
   SuperBlockMeta *super_meta() { return super()->meta(); }
 
+  // 目录/文件/fileblock元数据的校验, 算法由super block决定
+  uint32_t MetaCrc(const void *chunk, size_t len, uint32_t crc = 0) {
+    const uint8_t *data = static_cast<const uint8_t *>(chunk);
+    if (super_meta()->checksum_type_ == kChecksumCrc32c) {
+      return Crc32c(crc, data, len);
+    }
+    return crc32(crc, data, len);
+  }
+
   FdHandle *fd_handle() {
     return fd_handle_;
   }
@@ -116,9 +170,4 @@ class FileSystem {
   bool Check(const std::string &dev_name, const std::string &log_level = "DEBUG");
 };
 
-
-inline ssize_t block_fs_read(int fd, void *buf, size_t len) {
-  return FileSystem::Instance()->ReadFile(fd, buf, len);
-}
-
 }
\ No newline at end of file
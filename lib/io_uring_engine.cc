@@ -0,0 +1,311 @@
+#include "io_uring_engine.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "device.h"
+#include "spdlog/spdlog.h"
+
+namespace udisk::blockfs {
+
+// 单个sqe的长度是32位, 超过的部分按照短IO的方式继续提交
+static constexpr uint64_t kMaxSqeIoSize = 1ULL << 30;
+// io_uring_enter连续出错的次数上限, 超过之后还没完成的IO都按失败返回
+static constexpr uint32_t kMaxEnterErrors = 16;
+
+static inline int io_uring_setup(uint32_t entries, struct io_uring_params *p) {
+  return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+}
+
+static inline int io_uring_enter(int fd, uint32_t to_submit,
+                                 uint32_t min_complete, uint32_t flags) {
+  return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit,
+                                    min_complete, flags, nullptr, 0));
+}
+
+static inline int io_uring_register(int fd, uint32_t opcode, const void *arg,
+                                    uint32_t nr_args) {
+  return static_cast<int>(
+      ::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+IoUringEngine::~IoUringEngine() { Destroy(); }
+
+void IoUringEngine::Destroy() {
+  if (sqes_) {
+    ::munmap(sqes_, sqes_size_);
+    sqes_ = nullptr;
+  }
+  if (cq_ring_ && cq_ring_ != sq_ring_) {
+    ::munmap(cq_ring_, cq_ring_size_);
+  }
+  cq_ring_ = nullptr;
+  if (sq_ring_) {
+    ::munmap(sq_ring_, sq_ring_size_);
+    sq_ring_ = nullptr;
+  }
+  if (ring_fd_ >= 0) {
+    ::close(ring_fd_);
+    ring_fd_ = -1;
+  }
+}
+
+bool IoUringEngine::Initialize(uint32_t entries) {
+  struct io_uring_params params;
+  ::memset(&params, 0, sizeof(params));
+  ring_fd_ = io_uring_setup(entries, &params);
+  if (ring_fd_ < 0) {
+    SPDLOG_ERROR("io_uring setup failed, entries: {} errno: {}", entries, errno);
+    return false;
+  }
+  entries_ = params.sq_entries;
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  }
+
+  sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    sq_ring_ = nullptr;
+    SPDLOG_ERROR("io_uring mmap sq ring failed, errno: {}", errno);
+    Destroy();
+    return false;
+  }
+  if (single_mmap) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      cq_ring_ = nullptr;
+      SPDLOG_ERROR("io_uring mmap cq ring failed, errno: {}", errno);
+      Destroy();
+      return false;
+    }
+  }
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes_ = static_cast<struct io_uring_sqe *>(
+      ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+  if (sqes_ == MAP_FAILED) {
+    sqes_ = nullptr;
+    SPDLOG_ERROR("io_uring mmap sqes failed, errno: {}", errno);
+    Destroy();
+    return false;
+  }
+
+  char *sq = static_cast<char *>(sq_ring_);
+  sq_head_ = reinterpret_cast<uint32_t *>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<uint32_t *>(sq + params.sq_off.tail);
+  sq_mask_ = reinterpret_cast<uint32_t *>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<uint32_t *>(sq + params.sq_off.array);
+
+  char *cq = static_cast<char *>(cq_ring_);
+  cq_head_ = reinterpret_cast<uint32_t *>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<uint32_t *>(cq + params.cq_off.tail);
+  cq_mask_ = reinterpret_cast<uint32_t *>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+  SPDLOG_INFO("io_uring setup success, ring fd: {} entries: {} features: {:#x}",
+              ring_fd_, entries_, params.features);
+  return true;
+}
+
+bool IoUringEngine::RegisterFiles(const int *fds, uint32_t num) {
+  if (io_uring_register(ring_fd_, IORING_REGISTER_FILES, fds, num) < 0) {
+    SPDLOG_WARN("io_uring register files failed, errno: {}", errno);
+    return false;
+  }
+  files_registered_ = true;
+  return true;
+}
+
+struct io_uring_sqe *IoUringEngine::GetSqe() {
+  uint32_t head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  uint32_t tail = *sq_tail_;
+  if (tail - head >= entries_) [[unlikely]] {
+    return nullptr;
+  }
+  uint32_t index = tail & *sq_mask_;
+  struct io_uring_sqe *sqe = &sqes_[index];
+  sq_array_[index] = index;
+  ::memset(sqe, 0, sizeof(*sqe));
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+void IoUringEngine::PrepareRw(struct io_uring_sqe *sqe, bool write,
+                              int file_index, void *buf, uint32_t len,
+                              uint64_t offset, uint64_t user_data) {
+  sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = file_index;
+  if (files_registered_) {
+    sqe->flags |= IOSQE_FIXED_FILE;
+  }
+  sqe->addr = reinterpret_cast<uint64_t>(buf);
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+}
+
+void IoUringEngine::PrepareRwv(struct io_uring_sqe *sqe, bool write,
+                               int file_index, const struct iovec *iov,
+                               uint32_t iovcnt, uint64_t offset,
+                               uint64_t user_data) {
+  sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+  sqe->fd = file_index;
+  if (files_registered_) {
+    sqe->flags |= IOSQE_FIXED_FILE;
+  }
+  sqe->addr = reinterpret_cast<uint64_t>(iov);
+  sqe->len = iovcnt;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+}
+
+// 跳过iov开头已经完成的done个字节, 剩下的部分放到rest中
+static void SkipIovec(const struct iovec *iov, uint32_t iovcnt, uint64_t done,
+                      std::vector<struct iovec> *rest) {
+  rest->clear();
+  for (uint32_t i = 0; i < iovcnt; ++i) {
+    if (done >= iov[i].iov_len) {
+      done -= iov[i].iov_len;
+      continue;
+    }
+    rest->push_back({static_cast<char *>(iov[i].iov_base) + done,
+                     iov[i].iov_len - done});
+    done = 0;
+  }
+}
+
+int IoUringEngine::Enter(uint32_t to_submit, uint32_t min_complete) {
+  int ret;
+  do {
+    ret = io_uring_enter(ring_fd_, to_submit, min_complete,
+                         min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+  } while (ret < 0 && errno == EINTR);
+  return ret;
+}
+
+bool IoUringEngine::SubmitAndWait(DeviceIo *ios, uint32_t num, bool write,
+                                  int file_index) {
+  // 每个段已经完成的字节数
+  std::vector<uint64_t> done(num, 0);
+  // 短IO或者EAGAIN的段需要重新提交剩余部分
+  std::vector<uint32_t> resubmit;
+  // 向量IO部分完成之后剩下的iovec, 只有短IO的时候才会用到
+  std::vector<std::vector<struct iovec>> rest;
+  // 已经有结果的段
+  std::vector<bool> finished(num, false);
+  uint32_t next = 0;
+  uint32_t inflight = 0;
+  uint32_t completed = 0;
+  uint32_t enter_errors = 0;
+  for (uint32_t i = 0; i < num; ++i) {
+    ios[i].ret = 0;
+  }
+
+  while (completed < num) {
+    while (inflight < entries_ && (!resubmit.empty() || next < num)) {
+      uint32_t index;
+      if (!resubmit.empty()) {
+        index = resubmit.back();
+        resubmit.pop_back();
+      } else {
+        index = next++;
+      }
+      struct io_uring_sqe *sqe = GetSqe();
+      if (!sqe) [[unlikely]] {
+        resubmit.push_back(index);
+        break;
+      }
+      if (ios[index].iovcnt > 0) {
+        const struct iovec *iov = ios[index].iov;
+        uint32_t iovcnt = ios[index].iovcnt;
+        if (done[index] > 0) {
+          rest.resize(num);
+          SkipIovec(iov, iovcnt, done[index], &rest[index]);
+          iov = rest[index].data();
+          iovcnt = rest[index].size();
+        }
+        PrepareRwv(sqe, write, file_index, iov, iovcnt,
+                   ios[index].offset + done[index], index);
+      } else {
+        PrepareRw(sqe, write, file_index,
+                  static_cast<char *>(ios[index].buf) + done[index],
+                  std::min(ios[index].len - done[index], kMaxSqeIoSize),
+                  ios[index].offset + done[index], index);
+      }
+      ++inflight;
+    }
+
+    uint32_t pending =
+        *sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    int ret = Enter(pending, 1);
+    if (ret < 0 && errno != EAGAIN && errno != EBUSY) [[unlikely]] {
+      int err = errno;
+      SPDLOG_ERROR("io_uring enter failed, pending: {} errno: {}", pending,
+                   err);
+      if (inflight == pending) {
+        // 没有IO在内核中, 可以安全地交给调用者回退
+        return false;
+      }
+      if (++enter_errors >= kMaxEnterErrors) {
+        // 不能无限重试, 没有完成的段都按失败返回, 实例不再复用
+        for (uint32_t i = 0; i < num; ++i) {
+          if (!finished[i]) {
+            ios[i].ret = done[i] > 0 ? static_cast<int64_t>(done[i]) : -err;
+          }
+        }
+        broken_ = true;
+        return true;
+      }
+    } else {
+      enter_errors = 0;
+    }
+
+    uint32_t head = *cq_head_;
+    uint32_t tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      struct io_uring_cqe *cqe = &cqes_[head & *cq_mask_];
+      uint32_t index = static_cast<uint32_t>(cqe->user_data);
+      int32_t res = cqe->res;
+      ++head;
+      --inflight;
+      if (res == -EAGAIN || res == -EINTR) {
+        resubmit.push_back(index);
+        continue;
+      }
+      if (res < 0) {
+        // 已经部分完成的段按短IO返回
+        ios[index].ret = done[index] > 0 ? done[index] : res;
+        finished[index] = true;
+        ++completed;
+        continue;
+      }
+      done[index] += res;
+      if (res > 0 && done[index] < ios[index].len) {
+        resubmit.push_back(index);
+        continue;
+      }
+      // res为0表示读到了设备末尾
+      ios[index].ret = done[index];
+      finished[index] = true;
+      ++completed;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+  return true;
+}
+
+}  // namespace udisk::blockfs
@@ -0,0 +1,73 @@
+#ifndef LIB_IO_URING_ENGINE_H_
+#define LIB_IO_URING_ENGINE_H_
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <vector>
+
+namespace udisk::blockfs {
+
+struct DeviceIo;
+
+// 基于原生系统调用的io_uring实例, 不依赖liburing
+// 一个实例同一时刻只能被一个线程使用, 由Device做池化管理
+class IoUringEngine {
+ private:
+  int ring_fd_ = -1;
+  uint32_t entries_ = 0;
+
+  // submission queue
+  void *sq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  uint32_t *sq_head_ = nullptr;
+  uint32_t *sq_tail_ = nullptr;
+  uint32_t *sq_mask_ = nullptr;
+  uint32_t *sq_array_ = nullptr;
+  struct io_uring_sqe *sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  // completion queue
+  void *cq_ring_ = nullptr;
+  size_t cq_ring_size_ = 0;
+  uint32_t *cq_head_ = nullptr;
+  uint32_t *cq_tail_ = nullptr;
+  uint32_t *cq_mask_ = nullptr;
+  struct io_uring_cqe *cqes_ = nullptr;
+
+  bool files_registered_ = false;
+  // io_uring_enter持续失败时放弃了还在内核中的IO, 实例不能再复用
+  bool broken_ = false;
+
+ private:
+  void PrepareRw(struct io_uring_sqe *sqe, bool write, int file_index,
+                 void *buf, uint32_t len, uint64_t offset, uint64_t user_data);
+  void PrepareRwv(struct io_uring_sqe *sqe, bool write, int file_index,
+                  const struct iovec *iov, uint32_t iovcnt, uint64_t offset,
+                  uint64_t user_data);
+  struct io_uring_sqe *GetSqe();
+  int Enter(uint32_t to_submit, uint32_t min_complete);
+  void Destroy();
+
+ public:
+  IoUringEngine() = default;
+  ~IoUringEngine();
+  IoUringEngine(const IoUringEngine &) = delete;
+  IoUringEngine &operator=(const IoUringEngine &) = delete;
+
+  bool Initialize(uint32_t entries);
+  // 注册fd, 之后按照fds中的下标来提交IO
+  bool RegisterFiles(const int *fds, uint32_t num);
+
+  // 批量提交并等待全部完成, 短IO会自动补齐剩余部分
+  // 每个段的结果写回到ios[i].ret, 字节数或者-errno
+  // 返回false表示没有IO进入内核, 调用者可以回退到同步IO
+  bool SubmitAndWait(DeviceIo *ios, uint32_t num, bool write, int file_index);
+
+  bool broken() const noexcept { return broken_; }
+};
+
+}  // namespace udisk::blockfs
+#endif
@@ -0,0 +1,671 @@
+#include "journal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+#include "crc.h"
+#include "file_system.h"
+#include "spdlog/spdlog.h"
+#include "stats.h"
+
+namespace udisk::blockfs {
+
+void MetaPages::Add(uint64_t dev_offset, const void *addr) {
+  if (offsets_.insert(dev_offset).second) {
+    pages_.emplace_back(dev_offset, static_cast<const char *>(addr));
+  }
+}
+
+void MetaPages::Merge(const MetaPages &other) {
+  for (const auto &page : other.pages_) {
+    Add(page.first, page.second);
+  }
+}
+
+// 设备和内存上都连续的页合并成一个io
+static void AddPageIo(std::vector<DeviceIo> *ios, const char *page,
+                      uint64_t dev_offset) {
+  if (!ios->empty()) {
+    DeviceIo &last = ios->back();
+    if (last.offset + last.len == dev_offset &&
+        static_cast<char *>(last.buf) + last.len == page) {
+      last.len += kBlockFsPageSize;
+      return;
+    }
+  }
+  ios->push_back({const_cast<char *>(page), kBlockFsPageSize, dev_offset, 0});
+}
+
+bool Journal::WriteHeader(uint64_t checkpoint_seq,
+                          uint64_t checkpoint_offset) {
+  AlignBuffer buffer(kBlockFsPageSize, kBlockFsPageSize);
+  JournalHeader *header = reinterpret_cast<JournalHeader *>(buffer.data());
+  header->magic_ = kJournalMagic;
+  header->journal_id_ = journal_id_;
+  header->checkpoint_seq_ = checkpoint_seq;
+  header->checkpoint_offset_ = checkpoint_offset;
+  header->crc_ =
+      Crc32c(reinterpret_cast<uint8_t *>(header) + sizeof(header->crc_),
+            kBlockFsPageSize - sizeof(header->crc_));
+  int64_t ret = dev_->PwriteDirect(header, kBlockFsPageSize, offset_);
+  if (ret != static_cast<int64_t>(kBlockFsPageSize)) [[unlikely]] {
+    SPDLOG_ERROR("write journal header error size: {} errno: {}", ret, errno);
+    return false;
+  }
+  SPDLOG_DEBUG("write journal header, checkpoint seq: {} offset: {}",
+               checkpoint_seq, checkpoint_offset);
+  return true;
+}
+
+bool Journal::Format(uint64_t offset, uint64_t size) {
+  offset_ = offset;
+  size_ = size;
+  if (!enabled()) {
+    return true;
+  }
+  journal_id_ = std::random_device()();
+  journal_id_ = (journal_id_ << 32) | static_cast<uint32_t>(::time(nullptr));
+  head_ = 0;
+  used_ = 0;
+  next_seq_ = 1;
+  if (!WriteHeader(0, 0)) {
+    return false;
+  }
+  SPDLOG_INFO("format journal success, offset: {} size: {} id: {:#x}", offset_,
+              size_, journal_id_);
+  return true;
+}
+
+AlignBufferPtr Journal::ReadRecord(uint64_t pos, uint64_t seq) {
+  if (pos + kBlockFsPageSize > area_size()) {
+    return nullptr;
+  }
+  AlignBufferPtr header_buffer =
+      std::make_shared<AlignBuffer>(kBlockFsPageSize, kBlockFsPageSize);
+  int64_t ret = dev_->PreadDirect(header_buffer->data(), kBlockFsPageSize,
+                                  area_offset() + pos);
+  if (ret != static_cast<int64_t>(kBlockFsPageSize)) [[unlikely]] {
+    SPDLOG_ERROR("read journal record error size: {} pos: {}", ret, pos);
+    return nullptr;
+  }
+  const JournalRecord *record =
+      reinterpret_cast<const JournalRecord *>(header_buffer->data());
+  if (record->magic_ != kJournalMagic || record->journal_id_ != journal_id_ ||
+      record->seq_ != seq || record->page_num_ == 0 ||
+      record->page_num_ > kJournalMaxPages) {
+    return nullptr;
+  }
+  uint64_t record_size = (record->page_num_ + 1) * kBlockFsPageSize;
+  if (pos + record_size > area_size()) [[unlikely]] {
+    return nullptr;
+  }
+  AlignBufferPtr buffer =
+      std::make_shared<AlignBuffer>(record_size, kBlockFsPageSize);
+  ret = dev_->PreadDirect(buffer->data(), record_size, area_offset() + pos);
+  if (ret != static_cast<int64_t>(record_size)) [[unlikely]] {
+    SPDLOG_ERROR("read journal record error size: {} pos: {}", ret, pos);
+    return nullptr;
+  }
+  record = reinterpret_cast<const JournalRecord *>(buffer->data());
+  uint32_t crc = Crc32c(reinterpret_cast<uint8_t *>(buffer->data()) +
+                           sizeof(record->crc_),
+                       record_size - sizeof(record->crc_));
+  if (crc != record->crc_) {
+    SPDLOG_WARN("journal record crc mismatch, seq: {} pos: {}", seq, pos);
+    return nullptr;
+  }
+  return buffer;
+}
+
+bool Journal::ApplyRecords(const std::vector<AlignBufferPtr> &records) {
+  for (const AlignBufferPtr &buffer : records) {
+    const JournalRecord *record =
+        reinterpret_cast<const JournalRecord *>(buffer->data());
+    for (uint32_t i = 0; i < record->page_num_; ++i) {
+      uint64_t dev_offset = record->page_offset_[i];
+      // 元数据都在journal区域之前
+      if (dev_offset % kBlockFsPageSize != 0 ||
+          dev_offset + kBlockFsPageSize > offset_) [[unlikely]] {
+        SPDLOG_ERROR("journal record seq: {} invalid page offset: {}",
+                     record->seq_, dev_offset);
+        return false;
+      }
+      int64_t ret =
+          dev_->PwriteDirect(buffer->data() + (i + 1) * kBlockFsPageSize,
+                             kBlockFsPageSize, dev_offset);
+      if (ret != static_cast<int64_t>(kBlockFsPageSize)) [[unlikely]] {
+        SPDLOG_ERROR("replay journal page offset: {} error size: {}",
+                     dev_offset, ret);
+        return false;
+      }
+    }
+    SPDLOG_INFO("replay journal record seq: {} page num: {}", record->seq_,
+                record->page_num_);
+  }
+  return true;
+}
+
+bool Journal::Recover(uint64_t offset, uint64_t size) {
+  offset_ = offset;
+  size_ = size;
+  if (!enabled()) {
+    SPDLOG_INFO("no metadata journal, write meta in place");
+    return true;
+  }
+  AlignBuffer buffer(kBlockFsPageSize, kBlockFsPageSize);
+  int64_t ret = dev_->PreadDirect(buffer.data(), kBlockFsPageSize, offset_);
+  if (ret != static_cast<int64_t>(kBlockFsPageSize)) [[unlikely]] {
+    SPDLOG_ERROR("read journal header error size: {}", ret);
+    return false;
+  }
+  const JournalHeader *header =
+      reinterpret_cast<const JournalHeader *>(buffer.data());
+  uint32_t crc = Crc32c(reinterpret_cast<uint8_t *>(buffer.data()) +
+                           sizeof(header->crc_),
+                       kBlockFsPageSize - sizeof(header->crc_));
+  if (header->magic_ != kJournalMagic || header->crc_ != crc) [[unlikely]] {
+    SPDLOG_ERROR("journal header invalid, magic: {:#x} crc: {} cal: {}",
+                 header->magic_, header->crc_, crc);
+    return false;
+  }
+  journal_id_ = header->journal_id_;
+
+  // 从checkpoint开始顺序回放, 只有完整的事务才会写回
+  uint64_t pos = header->checkpoint_offset_;
+  uint64_t seq = header->checkpoint_seq_ + 1;
+  uint64_t replay_num = 0;
+  std::vector<AlignBufferPtr> records;
+  while (true) {
+    AlignBufferPtr record = ReadRecord(pos, seq);
+    if (!record && pos != 0) {
+      // 尾部放不下的记录从头开始写
+      record = ReadRecord(0, seq);
+      pos = 0;
+    }
+    if (!record) {
+      break;
+    }
+    const JournalRecord *meta =
+        reinterpret_cast<const JournalRecord *>(record->data());
+    pos += (meta->page_num_ + 1) * kBlockFsPageSize;
+    ++seq;
+    records.push_back(record);
+    if (!(meta->flags_ & kJournalRecordMore)) {
+      if (!ApplyRecords(records)) {
+        return false;
+      }
+      replay_num += records.size();
+      records.clear();
+    }
+  }
+  if (!records.empty()) {
+    SPDLOG_WARN("discard {} journal records of incomplete transaction",
+                records.size());
+  }
+  if (replay_num > 0 && dev_->Fsync() < 0) {
+    return false;
+  }
+  // 已经全部写回原位置, 换一个journal id让残留的记录全部失效
+  uint64_t old_id = journal_id_;
+  journal_id_ = (old_id + std::random_device()()) | 1;
+  if (journal_id_ == old_id) {
+    ++journal_id_;
+  }
+  head_ = 0;
+  used_ = 0;
+  next_seq_ = 1;
+  if (!WriteHeader(0, 0)) {
+    return false;
+  }
+  SPDLOG_INFO("recover journal success, replay records: {} id: {:#x}",
+              replay_num, journal_id_);
+  return true;
+}
+
+bool Journal::WriteInPlace(const MetaPages &pages) {
+  std::vector<DeviceIo> ios;
+  for (uint32_t i = 0; i < pages.size(); ++i) {
+    AddPageIo(&ios, pages.addr(i), pages.offset(i));
+  }
+  int64_t total = static_cast<int64_t>(pages.size()) * kBlockFsPageSize;
+  int64_t ret = dev_->PwriteBatch(ios.data(), ios.size(), true);
+  if (ret != total) [[unlikely]] {
+    SPDLOG_ERROR("write meta pages in place error size: {} need: {}", ret,
+                 total);
+    return false;
+  }
+  return true;
+}
+
+bool Journal::Checkpoint() {
+  if (dirty_pages_.empty() && used_ == 0) {
+    return true;
+  }
+  std::vector<DeviceIo> ios;
+  for (const auto &[dev_offset, page] : dirty_pages_) {
+    AddPageIo(&ios, page, dev_offset);
+  }
+  if (!ios.empty()) {
+    int64_t total = dirty_pages_.size() * kBlockFsPageSize;
+    int64_t ret = dev_->PwriteBatch(ios.data(), ios.size(), true);
+    if (ret != total) [[unlikely]] {
+      SPDLOG_ERROR("checkpoint write meta pages error size: {} need: {}", ret,
+                   total);
+      return false;
+    }
+  }
+  // 原位置落盘之后才能推进checkpoint
+  if (dev_->Fsync() < 0) {
+    return false;
+  }
+  if (!WriteHeader(next_seq_ - 1, head_)) {
+    return false;
+  }
+  SPDLOG_INFO("journal checkpoint, seq: {} pages: {} used: {}", next_seq_ - 1,
+              dirty_pages_.size(), used_);
+  dirty_pages_.clear();
+  records_.clear();
+  used_ = 0;
+  return true;
+}
+
+// 一批页拆成的记录从head开始依次写入时占用的记录区空间,
+// 包括记录放不下时尾部浪费的部分
+uint64_t Journal::ChainSize(uint64_t head, uint32_t page_num) const {
+  uint64_t size = 0;
+  for (uint32_t start = 0; start < page_num; start += kJournalMaxPages) {
+    uint32_t num = std::min<uint32_t>(page_num - start, kJournalMaxPages);
+    uint64_t record_size = (num + 1) * kBlockFsPageSize;
+    if (head + record_size > area_size()) {
+      size += area_size() - head;
+      head = 0;
+    }
+    size += record_size;
+    head += record_size;
+  }
+  return size;
+}
+
+AlignBufferPtr Journal::WriteRecord(const MetaPages &pages, uint32_t start,
+                                    uint32_t num, uint32_t flags) {
+  uint64_t record_size = (num + 1) * kBlockFsPageSize;
+  AlignBufferPtr buffer =
+      std::make_shared<AlignBuffer>(record_size, kBlockFsPageSize);
+  JournalRecord *record = reinterpret_cast<JournalRecord *>(buffer->data());
+  record->magic_ = kJournalMagic;
+  record->journal_id_ = journal_id_;
+  record->seq_ = next_seq_;
+  record->page_num_ = num;
+  record->flags_ = flags;
+  for (uint32_t i = 0; i < num; ++i) {
+    record->page_offset_[i] = pages.offset(start + i);
+    ::memcpy(buffer->data() + (i + 1) * kBlockFsPageSize,
+             pages.addr(start + i), kBlockFsPageSize);
+  }
+  record->crc_ = Crc32c(reinterpret_cast<uint8_t *>(buffer->data()) +
+                           sizeof(record->crc_),
+                       record_size - sizeof(record->crc_));
+
+  // 记录不跨越记录区的尾部, 空间由WriteBatch事先保证
+  uint64_t pos = head_;
+  uint64_t waste = 0;
+  if (pos + record_size > area_size()) {
+    waste = area_size() - pos;
+    pos = 0;
+  }
+  assert(used_ + waste + record_size <= area_size());
+  int64_t ret =
+      dev_->PwriteDirect(buffer->data(), record_size, area_offset() + pos);
+  if (ret != static_cast<int64_t>(record_size)) [[unlikely]] {
+    SPDLOG_ERROR("write journal record seq: {} error size: {} need: {}",
+                 next_seq_, ret, record_size);
+    return nullptr;
+  }
+  SPDLOG_DEBUG("write journal record seq: {} pos: {} page num: {}", next_seq_,
+               pos, num);
+  head_ = pos + record_size;
+  used_ += waste + record_size;
+  ++next_seq_;
+  return buffer;
+}
+
+bool Journal::WriteBatch(const MetaPages &pages) {
+  if (broken_) [[unlikely]] {
+    return false;
+  }
+  // 一批页是一个事务, 拆成的记录链写完之前不能checkpoint,
+  // 否则链中前面的记录会先写回原位置, 崩溃之后只剩半个事务
+  uint64_t need = ChainSize(head_, pages.size());
+  if (used_ + need > area_size()) {
+    if (!Checkpoint()) [[unlikely]] {
+      // checkpoint失败时header没有推进, 记录区还是完整的
+      SPDLOG_ERROR("journal checkpoint failed, used: {} need: {}", used_,
+                   need);
+      return false;
+    }
+    // checkpoint之后整个记录区都可以用, 放不下时从头开始写
+    // 回放时checkpoint位置没有记录会从记录区开头找
+    if (need > area_size()) {
+      head_ = 0;
+      need = ChainSize(head_, pages.size());
+    }
+  }
+  if (need > area_size()) [[unlikely]] {
+    // 不能拆成多个事务提交
+    SPDLOG_ERROR("meta batch is larger than journal, page num: {} need: {} "
+                 "journal area: {}",
+                 pages.size(), need, area_size());
+    return false;
+  }
+
+  std::vector<AlignBufferPtr> records;
+  for (uint32_t start = 0; start < pages.size(); start += kJournalMaxPages) {
+    uint32_t num = std::min<uint32_t>(pages.size() - start, kJournalMaxPages);
+    uint32_t flags = start + num < pages.size() ? kJournalRecordMore : 0;
+    AlignBufferPtr record = WriteRecord(pages, start, num, flags);
+    if (!record) [[unlikely]] {
+      // 记录区残留了不完整的记录链, 原地写也不是原子的,
+      // 不能假装写成功, 之后的元数据修改都返回错误
+      SPDLOG_CRITICAL("write journal failed, metadata is read only now");
+      broken_ = true;
+      return false;
+    }
+    records.push_back(record);
+  }
+  // 整个记录链都写下去之后, 这些页才能在checkpoint时写回原位置
+  for (const AlignBufferPtr &buffer : records) {
+    const JournalRecord *record =
+        reinterpret_cast<const JournalRecord *>(buffer->data());
+    for (uint32_t i = 0; i < record->page_num_; ++i) {
+      dirty_pages_[record->page_offset_[i]] =
+          buffer->data() + (i + 1) * kBlockFsPageSize;
+    }
+    records_.push_back(buffer);
+  }
+  if (used_ > area_size() / 2 && !Checkpoint()) {
+    SPDLOG_WARN("journal checkpoint failed, used: {}", used_);
+  }
+  return true;
+}
+
+void Journal::AcquireCommitter(std::unique_lock<std::mutex> &lock) {
+  cond_.wait(lock, [this] { return !committing_; });
+  committing_ = true;
+}
+
+void Journal::ReleaseCommitter(std::unique_lock<std::mutex> &lock) {
+  committing_ = false;
+  cond_.notify_all();
+}
+
+bool Journal::Commit(const MetaPages &pages) {
+  if (pages.empty()) {
+    return true;
+  }
+  if (broken_) [[unlikely]] {
+    errno = EROFS;
+    return false;
+  }
+  StatTimer timer(kStatMetaCommit);
+  if (deferred()) {
+    return MarkDirty(pages);
+  }
+  return CommitNow(pages);
+}
+
+bool Journal::CommitNow(const MetaPages &pages) {
+  if (!enabled()) {
+    return WriteInPlace(pages);
+  }
+  std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+  LockWithStat(lock, kStatLockJournal);
+  if (!pending_) {
+    pending_ = std::make_shared<Batch>();
+  }
+  std::shared_ptr<Batch> batch = pending_;
+  batch->pages.Merge(pages);
+  while (!batch->done) {
+    if (committing_) {
+      cond_.wait(lock);
+      continue;
+    }
+    // 没有其他的提交者, 把当前积攒的一批一起写下去
+    AcquireCommitter(lock);
+    std::shared_ptr<Batch> current = std::move(pending_);
+    pending_ = nullptr;
+    lock.unlock();
+    bool success = WriteBatch(current->pages);
+    lock.lock();
+    current->success = success;
+    current->done = true;
+    ReleaseCommitter(lock);
+  }
+  return batch->success;
+}
+
+bool Journal::Write(const void *addr, uint64_t len, uint64_t dev_offset) {
+  assert(len % kBlockFsPageSize == 0 && dev_offset % kBlockFsPageSize == 0);
+  const char *page = static_cast<const char *>(addr);
+  MetaTransaction *txn = MetaTransaction::current();
+  if (txn && enabled()) {
+    for (uint64_t i = 0; i < len; i += kBlockFsPageSize) {
+      txn->Add(dev_offset + i, page + i);
+    }
+    return true;
+  }
+  MetaPages pages;
+  for (uint64_t i = 0; i < len; i += kBlockFsPageSize) {
+    pages.Add(dev_offset + i, page + i);
+  }
+  return Commit(pages);
+}
+
+bool Journal::MarkDirty(const MetaPages &pages) {
+  std::lock_guard<std::mutex> lock(dirty_mutex_);
+  for (uint32_t i = 0; i < pages.size(); ++i) {
+    uint64_t page = pages.offset(i) / kBlockFsPageSize;
+    assert(pages.addr(i) == meta_base_ + pages.offset(i));
+    uint64_t bit = 1ULL << (page % 64);
+    if (!(dirty_bits_[page / 64] & bit)) {
+      dirty_bits_[page / 64] |= bit;
+      ++dirty_num_;
+    }
+  }
+  if (dirty_num_ >= kMetaFlushBatchPages) {
+    flusher_cond_.notify_one();
+  }
+  return true;
+}
+
+bool Journal::BeginTransaction() {
+  if (!deferred()) {
+    return false;
+  }
+  txn_gate_.lock_shared();
+  return true;
+}
+
+void Journal::EndTransaction() { txn_gate_.unlock_shared(); }
+
+bool Journal::Flush() {
+  assert(!MetaTransaction::current());
+  if (broken_) [[unlikely]] {
+    return false;
+  }
+  std::lock_guard<std::mutex> flush_lock(flush_mutex_);
+  MetaPages pages;
+  // 脏页的快照, 写journal的时候事务可以继续修改元数据
+  MetaPages copies;
+  AlignBufferPtr snapshot;
+  {
+    std::unique_lock<std::shared_mutex> gate(txn_gate_, std::defer_lock);
+    LockWithStat(gate, kStatLockJournal);
+    std::lock_guard<std::mutex> lock(dirty_mutex_);
+    if (dirty_num_ == 0) {
+      return true;
+    }
+    // 按设备偏移的顺序收集, 相邻的页在记录和原位置都是连续的
+    for (uint64_t i = 0; i < dirty_bits_.size(); ++i) {
+      uint64_t bits = dirty_bits_[i];
+      while (bits) {
+        uint64_t dev_offset =
+            (i * 64 + __builtin_ctzll(bits)) * kBlockFsPageSize;
+        pages.Add(dev_offset, meta_base_ + dev_offset);
+        bits &= bits - 1;
+      }
+      dirty_bits_[i] = 0;
+    }
+    dirty_num_ = 0;
+    snapshot = std::make_shared<AlignBuffer>(
+        pages.size() * kBlockFsPageSize, kBlockFsPageSize, false);
+    for (uint32_t i = 0; i < pages.size(); ++i) {
+      char *copy = snapshot->data() + i * kBlockFsPageSize;
+      ::memcpy(copy, pages.addr(i), kBlockFsPageSize);
+      copies.Add(pages.offset(i), copy);
+    }
+  }
+  if (!CommitNow(copies)) [[unlikely]] {
+    SPDLOG_ERROR("flush meta pages failed, page num: {}", pages.size());
+    MarkDirty(pages);
+    return false;
+  }
+  SPDLOG_DEBUG("flush meta pages, page num: {}", pages.size());
+  return true;
+}
+
+bool Journal::Sync(MetaSyncPoint point) {
+  if (!deferred() || !(sync_points_ & point)) {
+    return true;
+  }
+  return Flush();
+}
+
+void Journal::FlusherLoop() {
+  std::unique_lock<std::mutex> lock(dirty_mutex_);
+  while (!flusher_stop_) {
+    flusher_cond_.wait_for(
+        lock, std::chrono::milliseconds(flush_interval_ms_), [this] {
+          return flusher_stop_ || dirty_num_ >= kMetaFlushBatchPages;
+        });
+    if (flusher_stop_ || dirty_num_ == 0) {
+      continue;
+    }
+    lock.unlock();
+    Flush();
+    lock.lock();
+  }
+}
+
+void Journal::StartFlusher(const char *meta_base, uint64_t meta_size,
+                           uint32_t interval_ms, uint32_t sync_points) {
+  if (interval_ms == 0 || flusher_.joinable()) {
+    return;
+  }
+  meta_base_ = meta_base;
+  sync_points_ = sync_points;
+  uint64_t page_num = meta_size / kBlockFsPageSize;
+  dirty_bits_.assign((page_num + 63) / 64, 0);
+  flusher_stop_ = false;
+  flush_interval_ms_ = interval_ms;
+  flusher_ = std::thread(&Journal::FlusherLoop, this);
+  SPDLOG_INFO("start meta flusher, interval: {}ms sync points: {:#x}",
+              interval_ms, sync_points);
+}
+
+void Journal::StopFlusher() {
+  if (!flusher_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(dirty_mutex_);
+    flusher_stop_ = true;
+  }
+  flusher_cond_.notify_one();
+  flusher_.join();
+}
+
+bool Journal::Close() {
+  // 后台线程停止之后还没有提交的脏页同步写下去, 之后的提交直接落盘
+  StopFlusher();
+  flush_interval_ms_ = 0;
+  bool success = Flush();
+  if (!enabled()) {
+    return success;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  AcquireCommitter(lock);
+  lock.unlock();
+  // 出错之后内存中的元数据比磁盘新, 只把完整的事务写回原位置
+  success = Checkpoint() && success && !broken_;
+  lock.lock();
+  ReleaseCommitter(lock);
+  return success;
+}
+
+thread_local MetaTransaction *MetaTransaction::current_ = nullptr;
+
+MetaTransaction::MetaTransaction() : outer_(current_) {
+  if (!outer_) {
+    gated_ = FileSystem::Instance()->journal()->BeginTransaction();
+    current_ = this;
+  }
+}
+
+MetaTransaction::~MetaTransaction() {
+  // 没有提交就离开作用域的都是失败路径, 暂存的页不能落盘
+  if (!done_) {
+    Abort();
+  }
+}
+
+bool MetaTransaction::Commit() {
+  if (outer_) {
+    done_ = true;
+    return !outer_->aborted_;
+  }
+  if (done_) {
+    return !aborted_;
+  }
+  current_ = nullptr;
+  done_ = true;
+  Journal *journal = FileSystem::Instance()->journal();
+  bool success = !aborted_;
+  if (success) {
+    // 标记脏页之后才释放gate, Flush看到的是完整的事务
+    success = journal->Commit(pages_);
+  } else {
+    SPDLOG_WARN("meta transaction aborted, discard page num: {}",
+                pages_.size());
+  }
+  if (gated_) {
+    journal->EndTransaction();
+  }
+  return success;
+}
+
+void MetaTransaction::Abort() {
+  if (done_) {
+    return;
+  }
+  done_ = true;
+  if (outer_) {
+    outer_->aborted_ = true;
+    return;
+  }
+  current_ = nullptr;
+  aborted_ = true;
+  if (gated_) {
+    FileSystem::Instance()->journal()->EndTransaction();
+  }
+  if (!pages_.empty()) {
+    SPDLOG_WARN("abort meta transaction, discard page num: {}",
+                pages_.size());
+  }
+}
+
+}  // namespace udisk::blockfs
@@ -0,0 +1,180 @@
+#ifndef LIB_JOURNAL_H_
+#define LIB_JOURNAL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "aligned_buffer.h"
+#include "meta_defines.h"
+
+namespace udisk::blockfs {
+
+class Device;
+
+// 一组需要一起落盘的元数据页, 记录设备偏移和内存中的地址
+// 提交时才从内存拷贝, 保证写入的是页的最新内容
+class MetaPages {
+ private:
+  std::vector<std::pair<uint64_t, const char *>> pages_;
+  std::unordered_set<uint64_t> offsets_;
+
+ public:
+  void Add(uint64_t dev_offset, const void *addr);
+  void Merge(const MetaPages &other);
+
+  uint32_t size() const noexcept { return pages_.size(); }
+  bool empty() const noexcept { return pages_.empty(); }
+  uint64_t offset(uint32_t i) const noexcept { return pages_[i].first; }
+  const char *addr(uint32_t i) const noexcept { return pages_[i].second; }
+};
+
+// 延迟落盘时需要把脏的元数据页写下去的时机, 可以组合
+enum MetaSyncPoint : uint32_t {
+  kMetaSyncFsync = 1U << 0,
+  kMetaSyncClose = 1U << 1,
+};
+
+// 脏页积攒到这么多的时候不等定时器, 提前唤醒后台线程
+constexpr uint64_t kMetaFlushBatchPages = 1024;
+
+// 元数据的redo journal
+// 并发的元数据修改合并成一批, 作为一条记录顺序写入journal区域(group commit)
+// 写回原位置延迟到checkpoint, 挂载时回放checkpoint之后的记录
+class Journal {
+ private:
+  struct Batch {
+    MetaPages pages;
+    bool done = false;
+    bool success = false;
+  };
+
+  Device *dev_;
+  uint64_t offset_ = 0;  // journal区域在设备上的偏移
+  uint64_t size_ = 0;    // 为0表示老的文件系统, 元数据直接原地写
+  uint64_t journal_id_ = 0;
+  uint64_t head_ = 0;  // 下一条记录在记录区中的偏移
+  uint64_t used_ = 0;  // 上次checkpoint之后记录区使用的空间
+  uint64_t next_seq_ = 1;
+  // 写journal出错之后不知道记录区中残留了什么, 之后的元数据修改全部失败
+  std::atomic<bool> broken_ = false;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool committing_ = false;
+  std::shared_ptr<Batch> pending_;
+
+  // 已经提交但还没有写回原位置的页, 指向最后一次提交的记录内容
+  // 只有持有committing_的线程可以访问
+  std::map<uint64_t, const char *> dirty_pages_;
+  std::vector<AlignBufferPtr> records_;
+
+  // 延迟落盘: 提交只在位图中标记脏页, 后台线程定时把所有脏页作为一批提交
+  // 同一页的多次修改只写一次, 相邻的页合并成大的顺序写
+  uint32_t flush_interval_ms_ = 0;  // 为0表示提交时直接落盘
+  uint32_t sync_points_ = 0;
+  const char *meta_base_ = nullptr;  // 元数据镜像, 页的地址是meta_base_ + 偏移
+  std::mutex dirty_mutex_;
+  std::condition_variable flusher_cond_;
+  std::vector<uint64_t> dirty_bits_;
+  uint64_t dirty_num_ = 0;
+  bool flusher_stop_ = false;
+  std::thread flusher_;
+  // 保证Flush返回时, 之前标记的脏页都已经持久化
+  std::mutex flush_mutex_;
+  // 事务从开始到提交持有共享的gate, Flush独占gate收集和拷贝脏页,
+  // 批量提交的内容总是落在事务的边界上
+  std::shared_mutex txn_gate_;
+
+ private:
+  uint64_t area_size() const noexcept { return size_ - kBlockFsPageSize; }
+  uint64_t area_offset() const noexcept { return offset_ + kBlockFsPageSize; }
+
+  bool WriteHeader(uint64_t checkpoint_seq, uint64_t checkpoint_offset);
+  bool WriteInPlace(const MetaPages &pages);
+  bool WriteBatch(const MetaPages &pages);
+  uint64_t ChainSize(uint64_t head, uint32_t page_num) const;
+  AlignBufferPtr WriteRecord(const MetaPages &pages, uint32_t start,
+                             uint32_t num, uint32_t flags);
+  bool Checkpoint();
+  AlignBufferPtr ReadRecord(uint64_t pos, uint64_t seq);
+  bool ApplyRecords(const std::vector<AlignBufferPtr> &records);
+  bool CommitNow(const MetaPages &pages);
+  bool MarkDirty(const MetaPages &pages);
+  void FlusherLoop();
+  void StopFlusher();
+
+  // 成为提交者, 保证同一时间只有一个线程写journal
+  void AcquireCommitter(std::unique_lock<std::mutex> &lock);
+  void ReleaseCommitter(std::unique_lock<std::mutex> &lock);
+
+ public:
+  explicit Journal(Device *dev) : dev_(dev) {}
+  ~Journal() { StopFlusher(); }
+  Journal(const Journal &) = delete;
+  Journal &operator=(const Journal &) = delete;
+
+  bool enabled() const noexcept { return size_ > 0; }
+  bool broken() const noexcept { return broken_; }
+  bool deferred() const noexcept { return flush_interval_ms_ > 0; }
+
+  // 格式化journal区域
+  bool Format(uint64_t offset, uint64_t size);
+  // 回放checkpoint之后的记录, 必须在读取元数据之前调用
+  bool Recover(uint64_t offset, uint64_t size);
+  // 写入元数据页, 当前线程有事务时只暂存
+  bool Write(const void *addr, uint64_t len, uint64_t dev_offset);
+  // 提交一组元数据页, 返回时已经持久化
+  bool Commit(const MetaPages &pages);
+  // 开启延迟落盘, [meta_base, meta_base + meta_size)是设备开头的元数据镜像
+  void StartFlusher(const char *meta_base, uint64_t meta_size,
+                    uint32_t interval_ms, uint32_t sync_points);
+  // 延迟落盘时事务开始前调用, 返回true表示持有了gate, 需要EndTransaction
+  bool BeginTransaction();
+  void EndTransaction();
+  // 把当前所有的脏页提交下去, 不能在事务中调用
+  bool Flush();
+  // 在同步点上调用, 配置了这个同步点时等价于Flush
+  bool Sync(MetaSyncPoint point);
+  // 卸载时把所有的记录写回原位置
+  bool Close();
+};
+
+// 同一个线程内的元数据写入合并成一条journal记录, 要么都生效要么都不生效
+// 支持嵌套, 只有最外层的事务提交, 任何一层放弃整个事务都放弃
+// 没有提交就析构的事务自动放弃, 内存中已经做的修改由调用者恢复
+class MetaTransaction {
+ private:
+  static thread_local MetaTransaction *current_;
+  MetaPages pages_;
+  MetaTransaction *outer_;  // 嵌套时指向最外层的事务
+  bool gated_ = false;      // 持有journal的事务gate
+  bool done_ = false;
+  bool aborted_ = false;
+
+ public:
+  MetaTransaction();
+  ~MetaTransaction();
+  MetaTransaction(const MetaTransaction &) = delete;
+  MetaTransaction &operator=(const MetaTransaction &) = delete;
+
+  static MetaTransaction *current() noexcept { return current_; }
+
+  void Add(uint64_t dev_offset, const void *addr) {
+    pages_.Add(dev_offset, addr);
+  }
+  // 事务已经被放弃时返回false
+  bool Commit();
+  // 丢弃暂存的页
+  void Abort();
+};
+
+}  // namespace udisk::blockfs
+#endif
@@ -0,0 +1,79 @@
+#ifndef LIB_LOG_RATELIMIT_H_
+#define LIB_LOG_RATELIMIT_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+
+#include "spdlog/spdlog.h"
+
+namespace udisk::blockfs {
+
+// 每个打印点一个, 每秒最多放过max_per_sec条, 多出来的只计数
+// 下一条放过的日志会在末尾带上这段时间被丢掉的条数
+class LogRateLimiter {
+ public:
+  explicit constexpr LogRateLimiter(uint32_t max_per_sec)
+      : max_per_sec_(max_per_sec) {}
+
+  bool Allow(uint64_t *suppressed) {
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    int64_t sec = ts.tv_sec;
+    int64_t window = window_.load(std::memory_order_relaxed);
+    // 换窗口的竞争不需要很精确, 多放过几条也没关系
+    if (sec != window &&
+        window_.compare_exchange_strong(window, sec,
+                                        std::memory_order_relaxed)) {
+      count_.store(0, std::memory_order_relaxed);
+    }
+    if (count_.fetch_add(1, std::memory_order_relaxed) >= max_per_sec_) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    *suppressed = dropped_.exchange(0, std::memory_order_relaxed);
+    return true;
+  }
+
+ private:
+  const uint32_t max_per_sec_;
+  std::atomic<int64_t> window_{0};
+  std::atomic<uint32_t> count_{0};
+  std::atomic<uint64_t> dropped_{0};
+};
+
+}  // namespace udisk::blockfs
+
+// 数据路径上每次调用都会走到的日志, fmt必须是字符串字面量
+// 先判断运行时级别, 关掉的时候只有一次load, 不会碰限速器
+#define BFS_LOG_RATELIMIT(lvl, max_per_sec, fmt, ...)                        \
+  do {                                                                       \
+    if (spdlog::default_logger_raw()->should_log(lvl)) {                     \
+      static ::udisk::blockfs::LogRateLimiter bfs_log_limiter_(max_per_sec); \
+      uint64_t bfs_log_suppressed_ = 0;                                      \
+      if (bfs_log_limiter_.Allow(&bfs_log_suppressed_)) {                    \
+        if (bfs_log_suppressed_ == 0) {                                      \
+          SPDLOG_LOGGER_CALL(spdlog::default_logger_raw(), lvl, fmt,         \
+                             ##__VA_ARGS__);                                 \
+        } else {                                                             \
+          SPDLOG_LOGGER_CALL(spdlog::default_logger_raw(), lvl,              \
+                             fmt " (suppressed: {})", ##__VA_ARGS__,         \
+                             bfs_log_suppressed_);                           \
+        }                                                                    \
+      }                                                                      \
+    }                                                                        \
+  } while (0)
+
+// 编译期级别高于DEBUG时整条语句连同参数求值一起消失
+#if SPDLOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_DEBUG
+#define BFS_DEBUG_RATELIMIT(max_per_sec, ...) \
+  BFS_LOG_RATELIMIT(spdlog::level::debug, max_per_sec, __VA_ARGS__)
+#else
+#define BFS_DEBUG_RATELIMIT(max_per_sec, ...) (void)0
+#endif
+
+// 每个打印点每秒最多的条数, 足够看清请求的形状, 又不会把日志刷爆
+#define BFS_HOT_LOG_PER_SEC 20
+
+#endif
@@ -49,6 +49,18 @@ constexpr uint64_t kFileBlockCapacity = 1000;
 constexpr uint64_t kBlockFsFileBlockMetaSize = kBlockFsPageSize;
 constexpr uint64_t kBlockFsFileMetaIndexSize = kBlockFsPageSize;
 
+// 元数据journal的大小, 老的文件系统没有journal区域
+constexpr uint64_t kJournalSize = 64 * M;
+constexpr uint32_t kJournalMagic = 0x4A424653;
+
+// FileBlockMeta的格式, 老的文件系统只有block id数组
+constexpr uint8_t kFileBlockFormatIds = 0;
+constexpr uint8_t kFileBlockFormatExtent = 1;
+
+// 元数据(super block除外)的校验算法, 老的文件系统都是zlib crc32
+constexpr uint32_t kChecksumZlib = 0;
+constexpr uint32_t kChecksumCrc32c = 1;
+
 /* 文件系统的超级块
  * 大小: 4K
  * 作用: 记录文件系统的一些规格参数
@@ -87,6 +99,19 @@ union SuperBlockMeta {
     // variable according to the udisk device size
     uint64_t device_size;  // current udisk size (device size)
     uint64_t curr_block_num;   // current udisk supported block number
+    // 0: file block meta only stores block id array, 1: extent allowed
+    uint32_t file_block_format_;
+    // metadata journal region, journal_size_ 0 means no journal
+    uint64_t journal_offset_;
+    uint64_t journal_size_;
+    // checksum of dir/file/file block meta, super block always uses zlib
+    uint32_t checksum_type_;
+    // used index of file block meta, file_block_index_size_ 0 means no index
+    uint64_t file_block_index_offset_;
+    uint64_t file_block_index_size_;
+    // bumped on every mount and clean unmount, the shm image is reusable
+    // only when it carries the same generation
+    uint64_t shm_generation_;
   } __attribute__((packed));
   char reserved_[kSuperBlockSize];
 };
@@ -141,6 +166,17 @@ union FileMeta {
 static_assert(sizeof(FileMeta) == kBlockFsFileMetaSize,
               "FileMeta size must be 256 Bytes");
 
+// 物理连续的一段block
+struct FileBlockExtent {
+  uint32_t start_block_;
+  uint32_t block_num_;
+} __attribute__((packed));
+
+// extent和block id数组共用同一块空间, 放不下的时候退化成block id数组
+constexpr uint64_t kFileBlockMaxExtentNum =
+    (kFileBlockCapacity * sizeof(uint32_t) - sizeof(uint32_t)) /
+    sizeof(FileBlockExtent);
+
 union FileBlockMeta {
   struct {
     uint32_t crc_;
@@ -150,7 +186,15 @@ union FileBlockMeta {
     uint32_t used_block_num_;
     bool used_;
     bool is_temp_;
-    uint32_t block_id_[kFileBlockCapacity];
+    union {
+      uint32_t block_id_[kFileBlockCapacity];
+      struct {
+        uint32_t extent_num_;
+        FileBlockExtent extents_[kFileBlockMaxExtentNum];
+      } __attribute__((packed));
+    };
+    // kFileBlockFormatIds或者kFileBlockFormatExtent
+    uint8_t format_;
   } __attribute__((packed));
   char reserved_[kBlockFsFileBlockMetaSize];
 
@@ -163,4 +207,67 @@ union FileBlockMeta {
 static_assert(sizeof(FileBlockMeta) == kBlockFsFileBlockMetaSize,
               "BlockFsBlockMeta size must be 4096 Bytes");
 
+/* FileBlockMeta的使用索引
+ * 每一位表示对应的FileBlockMeta是否在使用, 挂载时只读取用到的FileBlockMeta
+ * 和FileBlockMeta一起通过journal落盘, 老的文件系统没有索引
+ **/
+constexpr uint32_t kFileBlockIndexBitsPerPage =
+    (kBlockFsPageSize - 2 * sizeof(uint32_t)) * 8;
+
+union FileBlockIndexPage {
+  struct {
+    uint32_t crc_;
+    uint32_t page_index_;
+    uint64_t bits_[kFileBlockIndexBitsPerPage / 64];
+  } __attribute__((packed));
+  char reserved_[kBlockFsPageSize];
+};
+
+static_assert(sizeof(FileBlockIndexPage) == kBlockFsPageSize,
+              "FileBlockIndexPage size must be 4096 Bytes");
+
+/* 元数据journal的头部
+ * 大小: 4K, 位于journal区域的开始, 后面是循环使用的记录区
+ * 作用: 记录checkpoint的位置, 挂载时从这里开始回放
+ **/
+union JournalHeader {
+  struct {
+    uint32_t crc_;
+    uint32_t magic_;
+    uint64_t journal_id_;         // 格式化时随机生成, 区分残留的老记录
+    uint64_t checkpoint_seq_;     // 小于等于这个序号的记录已经写回原位置
+    uint64_t checkpoint_offset_;  // 下一条记录在记录区中的偏移
+  } __attribute__((packed));
+  char reserved_[kBlockFsPageSize];
+};
+
+static_assert(sizeof(JournalHeader) == kBlockFsPageSize,
+              "JournalHeader size must be 4096 Bytes");
+
+constexpr uint32_t kJournalRecordHeaderSize = 32;
+constexpr uint32_t kJournalMaxPages =
+    (kBlockFsPageSize - kJournalRecordHeaderSize) / sizeof(uint64_t);
+// 一个事务超过一条记录的容量时, 除了最后一条其他记录都带这个标志
+constexpr uint32_t kJournalRecordMore = 0x1;
+
+/* 元数据journal的记录
+ * 大小: 4K的记录头 + page_num_个4K的元数据页
+ * 作用: 一次group commit写入的元数据页, 回放时写回page_offset_
+ **/
+union JournalRecord {
+  struct {
+    uint32_t crc_;  // 覆盖记录头(除crc)和后面所有的页
+    uint32_t magic_;
+    uint64_t journal_id_;
+    uint64_t seq_;
+    uint32_t page_num_;
+    uint32_t flags_;
+    uint64_t page_offset_[kJournalMaxPages];
+  } __attribute__((packed));
+  char reserved_[kBlockFsPageSize];
+};
+
+static_assert(sizeof(JournalRecord) == kBlockFsPageSize,
+              "JournalRecord size must be 4096 Bytes");
+
 }  // namespace udisk::blockfs
\ No newline at end of file
@@ -0,0 +1,143 @@
+#ifndef LIB_SHARDED_MAP_H_
+#define LIB_SHARDED_MAP_H_
+
+#include <array>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include "comm_utils.h"
+
+namespace udisk::blockfs {
+
+// 按key的hash分片的map, 每个分片一把读写锁
+// 查找只持有一个分片的读锁并返回值的拷贝(一般是智能指针), 不会和其他分片竞争
+// 需要原子地修改多个map的地方(创建/删除/重命名)由调用者在外面加锁串行
+// Hash和KeyEqual是transparent时, 查找可以直接用string_view之类的key, 不用构造Key
+template <typename Key, typename Value, typename Hash = std::hash<Key>,
+          typename KeyEqual = std::equal_to<Key>, uint32_t kShardNum = 64>
+class ShardedMap {
+ private:
+  static_assert((kShardNum & (kShardNum - 1)) == 0,
+                "shard num must be power of 2");
+
+  struct alignas(hardware_destructive_interference_size) Shard {
+    mutable std::shared_mutex mutex;
+    std::unordered_map<Key, Value, Hash, KeyEqual> map;
+  };
+  std::array<Shard, kShardNum> shards_;
+
+  template <typename K>
+  Shard &shard(const K &key) {
+    return shards_[ShardIndex(Hash()(key))];
+  }
+  template <typename K>
+  const Shard &shard(const K &key) const {
+    return shards_[ShardIndex(Hash()(key))];
+  }
+  // 连续的整数key的hash是它本身, 高位混合进来避免只用到低位
+  static uint32_t ShardIndex(std::size_t hash) {
+    hash ^= hash >> 32;
+    hash *= 0x9E3779B97F4A7C15ULL;
+    return (hash >> 40) & (kShardNum - 1);
+  }
+
+ public:
+  ShardedMap() = default;
+  ShardedMap(const ShardedMap &) = delete;
+  ShardedMap &operator=(const ShardedMap &) = delete;
+
+  // 不存在时返回默认构造的值
+  template <typename K = Key>
+  Value Find(const K &key) const {
+    const Shard &s = shard(key);
+    std::shared_lock lock(s.mutex);
+    auto it = s.map.find(key);
+    return it == s.map.end() ? Value() : it->second;
+  }
+
+  template <typename K = Key>
+  bool Contains(const K &key) const {
+    const Shard &s = shard(key);
+    std::shared_lock lock(s.mutex);
+    return s.map.contains(key);
+  }
+
+  // key已经存在时不覆盖, 返回false
+  bool Insert(const Key &key, const Value &value) {
+    Shard &s = shard(key);
+    std::unique_lock lock(s.mutex);
+    return s.map.emplace(key, value).second;
+  }
+
+  void InsertOrAssign(const Key &key, const Value &value) {
+    Shard &s = shard(key);
+    std::unique_lock lock(s.mutex);
+    s.map.insert_or_assign(key, value);
+  }
+
+  // C++20的unordered_map::erase不支持异构的key, 先find再按迭代器删除
+  template <typename K = Key>
+  bool Erase(const K &key) {
+    Shard &s = shard(key);
+    std::unique_lock lock(s.mutex);
+    auto it = s.map.find(key);
+    if (it == s.map.end()) {
+      return false;
+    }
+    s.map.erase(it);
+    return true;
+  }
+
+  // 删除并返回原来的值, 并发删除同一个key时只有一个能拿到
+  template <typename K = Key>
+  Value Extract(const K &key) {
+    Shard &s = shard(key);
+    std::unique_lock lock(s.mutex);
+    auto it = s.map.find(key);
+    if (it == s.map.end()) {
+      return Value();
+    }
+    Value value = std::move(it->second);
+    s.map.erase(it);
+    return value;
+  }
+
+  // 在分片的写锁内修改key对应的值, 不存在时先插入默认构造的值
+  // 回调返回false时删除这一项, 用于引用计数这类读改写必须原子的场景
+  template <typename Func>
+  void Update(const Key &key, Func &&func) {
+    Shard &s = shard(key);
+    std::unique_lock lock(s.mutex);
+    auto it = s.map.try_emplace(key).first;
+    if (!func(it->second)) {
+      s.map.erase(it);
+    }
+  }
+
+  // 依次持有每个分片的读锁遍历, 回调返回false时停止
+  template <typename Func>
+  bool ForEach(Func &&func) const {
+    for (const Shard &s : shards_) {
+      std::shared_lock lock(s.mutex);
+      for (const auto &[key, value] : s.map) {
+        if (!func(key, value)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  std::size_t size() const {
+    std::size_t num = 0;
+    for (const Shard &s : shards_) {
+      std::shared_lock lock(s.mutex);
+      num += s.map.size();
+    }
+    return num;
+  }
+};
+
+}  // namespace udisk::blockfs
+#endif  // LIB_SHARDED_MAP_H_
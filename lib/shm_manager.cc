@@ -2,6 +2,7 @@
 #include "shm_manager.h"
 
 #include <dirent.h>
+#include <sys/stat.h>
 #include <sys/sysinfo.h>
 #include <unistd.h>
 
@@ -58,7 +59,9 @@ bool ShmManager::PrefetchSuperMeta() {
   LOG(DEBUG) << "read super block success";
   LOG(DEBUG) << "block_data_start_offset: " << super_.block_data_start_offset_;
 
-  shm_size_ = super_.block_data_start_offset_;
+  // journal区域不需要常驻内存
+  shm_size_ = super_.journal_size_ > 0 ? super_.journal_offset_
+                                       : super_.block_data_start_offset_;
   shm_name_ = kMetaShmNamePrefix + super_.uuid_;
 
   LOG(DEBUG) << "shm name: " << shm_name_;
@@ -88,7 +91,7 @@ bool ShmManager::ShmOpen() {
     return false;
   }
 
-  shm_fd_ = ::shm_open(shm_name_.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0666);
+  shm_fd_ = ::shm_open(shm_name_.c_str(), O_CREAT | O_RDWR, 0666);
   if (shm_fd_ < 0) [[unlikely]] {
     LOG(ERROR) << "posix shm open failed, errno: " << errno;
     return false;
@@ -104,21 +107,16 @@ bool ShmManager::ShmOpen() {
  * \return success or failed
  */
 bool ShmManager::MemMap() {
-  if (::ftruncate(shm_fd_, shm_size_) < 0) {
-    LOG(ERROR) << "ftruncate shm fd failed, errno: " << errno;
-    return false;
-  }
-  shm_addr_ = (char *)::mmap(0, shm_size_, PROT_READ | PROT_WRITE | PROT_EXEC,
-                             MAP_SHARED | MAP_FIXED, shm_fd_, 0);
-  if (shm_addr_ == MAP_FAILED) {
+  void *addr = ::mmap(nullptr, kShmHeaderSize + shm_size_,
+                      PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd_, 0);
+  ::close(shm_fd_);
+  shm_fd_ = -1;
+  if (addr == MAP_FAILED) {
     LOG(ERROR) << "mmap shm fd failed, errno: " << errno;
     return false;
   }
-  ::close(shm_fd_);
-  shm_fd_ = -1;
-
-  // 每次重启都清除?
-  // ::memset(shm_addr_, 0, shm_size_);
+  shm_header_ = static_cast<ShmHeader *>(addr);
+  shm_addr_ = static_cast<char *>(addr) + kShmHeaderSize;
   return true;
 }
 
@@ -135,6 +133,118 @@ bool ShmManager::MemUnMap() {
     ::close(shm_fd_);
     shm_fd_ = -1;
   }
+  if (shm_header_) {
+    ::munmap(shm_header_, kShmHeaderSize + shm_size_);
+    shm_header_ = nullptr;
+    shm_addr_ = static_cast<char *>(MAP_FAILED);
+  }
+  return true;
+}
+
+uint32_t ShmManager::HeaderCrc() const {
+  return Crc32c(reinterpret_cast<const uint8_t *>(shm_header_) +
+                    sizeof(shm_header_->crc_),
+                sizeof(ShmHeader) - sizeof(shm_header_->crc_));
+}
+
+// 头部的crc只保护头部, 镜像本身单独校验, 避免复用写了一半的镜像
+// 按需加载时FileBlockMeta区域不计算, 没有加载的页不会因此分配内存,
+// 已经加载的FileBlockMeta有自己的crc
+uint32_t ShmManager::ImageCrc() const {
+  const uint8_t *image = reinterpret_cast<const uint8_t *>(shm_addr_);
+  if (!shm_header_->lazy_file_block_meta_) {
+    return Crc32c(image, shm_size_);
+  }
+  uint32_t crc = Crc32c(image, super_.file_block_meta_offset_);
+  return Crc32c(crc, image + super_.file_block_index_offset_,
+                shm_size_ - super_.file_block_index_offset_);
+}
+
+/**
+ * attach the shm left by the last clean unmount
+ *
+ * \return false if there is no reusable shm
+ */
+bool ShmManager::AttachShm() {
+  shm_fd_ = ::shm_open(shm_name_.c_str(), O_RDWR, 0666);
+  if (shm_fd_ < 0) {
+    LOG(INFO) << "no shm to reuse: " << shm_name_;
+    return false;
+  }
+  struct stat st;
+  if (::fstat(shm_fd_, &st) < 0 ||
+      st.st_size != static_cast<off_t>(kShmHeaderSize + shm_size_)) {
+    LOG(WARNING) << "shm size mismatch, cannot reuse: " << shm_name_;
+    MemUnMap();
+    return false;
+  }
+  if (!MemMap()) {
+    return false;
+  }
+  // 按需加载的镜像中没有全部的FileBlockMeta, 不能用于全部加载
+  bool valid = shm_header_->magic_ == kShmMagic &&
+               shm_header_->crc_ == HeaderCrc() &&
+               shm_header_->meta_size_ == static_cast<uint64_t>(shm_size_) &&
+               shm_header_->clean_ &&
+               shm_header_->generation_ == super_.shm_generation_ &&
+               (!shm_header_->lazy_file_block_meta_ || lazy_file_block_meta_);
+  // 头部有效之后才计算镜像的校验和
+  valid = valid && shm_header_->image_crc_ == ImageCrc();
+  if (!valid) {
+    LOG(WARNING) << "shm cannot reuse, generation: "
+                 << shm_header_->generation_
+                 << " super generation: " << super_.shm_generation_
+                 << " clean: " << shm_header_->clean_;
+    MemUnMap();
+    return false;
+  }
+  // 镜像里的FileBlockMeta以本次的加载方式为准
+  shm_header_->lazy_file_block_meta_ = lazy_file_block_meta_;
+  reused_ = true;
+  LOG(INFO) << "reuse shm meta, generation: " << super_.shm_generation_;
+  return true;
+}
+
+bool ShmManager::NewShm() {
+  LOG(DEBUG) << "using posix shm meta: " << shm_name_;
+  if (!ShmOpen()) {
+    return false;
+  }
+  // 先截断为0丢掉老的内容, 新的空间读取之前不占用物理内存
+  if (::ftruncate(shm_fd_, 0) < 0 ||
+      ::ftruncate(shm_fd_, kShmHeaderSize + shm_size_) < 0) {
+    LOG(ERROR) << "ftruncate shm fd failed, errno: " << errno;
+    MemUnMap();
+    return false;
+  }
+  if (!MemMap()) {
+    return false;
+  }
+  shm_header_->magic_ = kShmMagic;
+  shm_header_->meta_size_ = shm_size_;
+  shm_header_->lazy_file_block_meta_ = lazy_file_block_meta_;
+  return true;
+}
+
+bool ShmManager::MarkDirty() {
+  if (!shm_header_) {
+    return true;
+  }
+  shm_header_->clean_ = false;
+  shm_header_->generation_ = 0;
+  shm_header_->crc_ = HeaderCrc();
+  return true;
+}
+
+bool ShmManager::MarkClean(uint64_t generation) {
+  if (!shm_header_) {
+    return true;
+  }
+  shm_header_->generation_ = generation;
+  shm_header_->image_crc_ = ImageCrc();
+  shm_header_->clean_ = true;
+  shm_header_->crc_ = HeaderCrc();
+  LOG(INFO) << "shm meta clean, generation: " << generation;
   return true;
 }
 
@@ -144,8 +254,10 @@ bool ShmManager::NewPosixAlignMem() {
     return false;
   }
   LOG(DEBUG) << "using posix mem aligned meta";
+  // 大块内存由mmap分配, 不清零的话没有访问过的FileBlockMeta页不占用物理内存
   buffer_ = std::make_shared<AlignBuffer>(
-      shm_size_, FileSystem::Instance()->dev()->block_size());
+      shm_size_, FileSystem::Instance()->dev()->block_size(),
+      !lazy_file_block_meta_);
 
   shm_addr_ = buffer_->data();
   return true;
@@ -159,6 +271,22 @@ bool ShmManager::NewPosixAlignMem() {
  * \return success or failed
  */
 bool ShmManager::ReadAllMeta() {
+  if (lazy_file_block_meta_) {
+    // FileBlockMeta之前的元数据和使用索引, FileBlockMeta由FileBlockHandle加载
+    DeviceIo ios[2] = {
+        {shm_addr_, super_.file_block_meta_offset_, 0, 0},
+        {shm_addr_ + super_.file_block_index_offset_,
+         shm_size_ - super_.file_block_index_offset_,
+         super_.file_block_index_offset_, 0}};
+    int64_t need = ios[0].len + ios[1].len;
+    int64_t ret = FileSystem::Instance()->dev()->PreadBatch(ios, 2, true);
+    if (ret != need) [[unlikely]] {
+      LOG(ERROR) << "read meta error size: " << ret << " need: " << need;
+      return false;
+    }
+    LOG(DEBUG) << "read meta except file block meta into shm success";
+    return true;
+  }
   ::memset(shm_addr_, 0, shm_size_);
   int64_t ret =
       FileSystem::Instance()->dev()->PreadDirect(shm_addr_, shm_size_, 0);
@@ -173,21 +301,27 @@ bool ShmManager::ReadAllMeta() {
 /**
  * Initialize shm management and read all metadata
  */
-bool ShmManager::Initialize(bool create) {
+bool ShmManager::Initialize(bool shared, bool lazy) {
   if (!PrefetchSuperMeta()) {
     return false;
   }
+  lazy_file_block_meta_ = lazy && super_.file_block_index_size_ > 0;
 
-  if (create) {
-    if (!NewPosixAlignMem()) {
+  if (shared) {
+    if (!AttachShm() && !NewShm()) {
       return false;
     }
+  } else if (!NewPosixAlignMem()) {
+    return false;
   }
 
-  if (!ReadAllMeta()) {
+  if (!reused_ && !ReadAllMeta()) {
     return false;
   }
   RegistMetaBaseAddr();
+  if (!MarkDirty()) {
+    return false;
+  }
   LOG(DEBUG) << "init and register meta success";
   return true;
 }
@@ -14,13 +14,41 @@
 
 namespace udisk::blockfs {
 
+constexpr uint32_t kShmMagic = 0x42465348;
+constexpr uint64_t kShmHeaderSize = 4096;
+
+// 共享内存段的头部, 后面紧跟着元数据的镜像
+// 只有正常卸载, 代数和super block一致并且镜像的校验和正确的时候,
+// 镜像才能在重启后直接使用
+struct ShmHeader {
+  uint32_t crc_;
+  uint32_t magic_;
+  uint64_t generation_;
+  uint64_t meta_size_;
+  uint32_t clean_;
+  uint32_t lazy_file_block_meta_;
+  uint32_t image_crc_;  // 卸载时整个镜像的校验和
+} __attribute__((packed));
+
 class ShmManager {
  public:
   ShmManager();
   ~ShmManager();
 
   std::string uuid() const { return super_.uuid_; }
-  bool Initialize(bool create = true);
+  // shared为true时元数据放在posix共享内存中, 重启时可以直接复用
+  // lazy为true并且文件系统有FileBlockMeta使用索引时, 不读取FileBlockMeta区域
+  bool Initialize(bool shared = false, bool lazy = false);
+  bool lazy_file_block_meta() const { return lazy_file_block_meta_; }
+  // 共享内存中的元数据是上次正常卸载留下的, 没有从磁盘读取
+  bool reused() const { return reused_; }
+  // 设备开头的元数据在内存中的镜像
+  const char *shm_addr() const { return shm_addr_; }
+  int64_t shm_size() const { return shm_size_; }
+  // 挂载期间共享内存中的元数据可能比磁盘新, 重启时不能复用
+  bool MarkDirty();
+  // 元数据全部落盘之后调用, 记录对应的super block代数
+  bool MarkClean(uint64_t generation);
   bool Destroy() __attribute__((unused));
   static void CleanupDirtyShareMemory();
   static bool PrefetchSuperMeta(SuperBlockMeta &meta);
@@ -32,6 +60,10 @@ class ShmManager {
   bool ShmOpen();
   bool MemMap();
   bool MemUnMap();
+  bool AttachShm();
+  bool NewShm();
+  uint32_t HeaderCrc() const;
+  uint32_t ImageCrc() const;
   bool ReadAllMeta();
   void RegistMetaBaseAddr();
 
@@ -40,9 +72,12 @@ class ShmManager {
 
   int shm_fd_ = -1;
   char *shm_addr_;
+  ShmHeader *shm_header_ = nullptr;  // 只有共享内存有头部
 
   std::string shm_name_;
   int64_t shm_size_ = 0;
+  bool lazy_file_block_meta_ = false;
+  bool reused_ = false;
 
   SuperBlockMeta super_;
 };
@@ -0,0 +1,270 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <iterator>
+#include <mutex>
+#include <vector>
+
+#include "spdlog/fmt/fmt.h"
+
+namespace udisk::blockfs {
+
+static const char *kStatNames[] = {
+    "fuse_lookup",
+    "fuse_forget",
+    "fuse_getattr",
+    "fuse_setattr",
+    "fuse_mknod",
+    "fuse_mkdir",
+    "fuse_unlink",
+    "fuse_rmdir",
+    "fuse_rename",
+    "fuse_truncate",
+    "fuse_open",
+    "fuse_create",
+    "fuse_read",
+    "fuse_write",
+    "fuse_statfs",
+    "fuse_flush",
+    "fuse_release",
+    "fuse_fsync",
+    "fuse_opendir",
+    "fuse_readdir",
+    "fuse_releasedir",
+    "fuse_lock",
+    "fuse_flock",
+    "fuse_copy_file_range",
+    "fuse_lseek",
+    "dev_read_direct",
+    "dev_write_direct",
+    "dev_read_cache",
+    "dev_write_cache",
+    "meta_write_super",
+    "meta_write_dir",
+    "meta_write_file",
+    "meta_write_file_block",
+    "meta_commit",
+    "alloc_block",
+    "free_block",
+    "alloc_file_block",
+    "lock_block_read",
+    "lock_block_write",
+    "lock_file",
+    "lock_journal",
+    "lock_block_bitmap",
+};
+static_assert(sizeof(kStatNames) / sizeof(kStatNames[0]) == kStatNum,
+              "stat names mismatch");
+
+// 设备读写才有字节数, 其他项输出时省略
+static bool HasBytes(uint32_t id) {
+  return id >= kStatDevReadDirect && id <= kStatDevWriteCache;
+}
+
+// 报告的分位数
+static const double kQuantiles[] = {0.5, 0.9, 0.99, 0.999};
+static const char *kQuantileNames[] = {"p50", "p90", "p99", "p999"};
+
+namespace {
+
+// 每个值只有一个线程写, 用relaxed的load+store代替原子加
+inline void Add(std::atomic<uint64_t> &a, uint64_t v) {
+  a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+struct StatCell {
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> sum_ns{0};
+  std::atomic<uint64_t> max_ns{0};
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> buckets[LatencyHistogram::kBuckets] = {};
+
+  void Record(uint64_t ns, uint64_t bytes_done) {
+    Add(buckets[LatencyHistogram::Index(ns)], 1);
+    Add(count, 1);
+    Add(sum_ns, ns);
+    Add(bytes, bytes_done);
+    if (ns > max_ns.load(std::memory_order_relaxed)) {
+      max_ns.store(ns, std::memory_order_relaxed);
+    }
+  }
+
+  void AddTo(StatSnapshot *s) const {
+    s->count += count.load(std::memory_order_relaxed);
+    s->sum_ns += sum_ns.load(std::memory_order_relaxed);
+    s->max_ns = std::max(s->max_ns, max_ns.load(std::memory_order_relaxed));
+    s->bytes += bytes.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i < LatencyHistogram::kBuckets; ++i) {
+      s->buckets[i] += buckets[i].load(std::memory_order_relaxed);
+    }
+  }
+
+  // 只在注册表的锁内调用
+  void Merge(const StatCell &other) {
+    Add(count, other.count.load(std::memory_order_relaxed));
+    Add(sum_ns, other.sum_ns.load(std::memory_order_relaxed));
+    Add(bytes, other.bytes.load(std::memory_order_relaxed));
+    uint64_t max = other.max_ns.load(std::memory_order_relaxed);
+    if (max > max_ns.load(std::memory_order_relaxed)) {
+      max_ns.store(max, std::memory_order_relaxed);
+    }
+    for (uint32_t i = 0; i < LatencyHistogram::kBuckets; ++i) {
+      Add(buckets[i], other.buckets[i].load(std::memory_order_relaxed));
+    }
+  }
+};
+
+struct ThreadStats {
+  StatCell cells[kStatNum];
+};
+
+// 进程退出时还可能有线程在记录, 注册表不析构
+struct StatsRegistry {
+  std::mutex mutex;
+  std::vector<ThreadStats *> threads;
+  ThreadStats retired;  // 已经退出的线程累加到这里
+
+  static StatsRegistry *Instance() {
+    static StatsRegistry *g_registry = new StatsRegistry();
+    return g_registry;
+  }
+};
+
+struct ThreadStatsHolder {
+  ThreadStats *stats = nullptr;
+
+  ThreadStats *Get() {
+    if (!stats) [[unlikely]] {
+      stats = new ThreadStats();
+      StatsRegistry *registry = StatsRegistry::Instance();
+      std::lock_guard<std::mutex> lock(registry->mutex);
+      registry->threads.push_back(stats);
+    }
+    return stats;
+  }
+
+  ~ThreadStatsHolder() {
+    if (!stats) {
+      return;
+    }
+    StatsRegistry *registry = StatsRegistry::Instance();
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    for (uint32_t i = 0; i < kStatNum; ++i) {
+      registry->retired.cells[i].Merge(stats->cells[i]);
+    }
+    std::erase(registry->threads, stats);
+    delete stats;
+  }
+};
+
+thread_local ThreadStatsHolder t_stats;
+
+}  // namespace
+
+std::atomic<bool> Stats::enabled_{true};
+
+uint64_t StatSnapshot::Percentile(double p) const {
+  uint64_t total = 0;
+  for (uint64_t n : buckets) {
+    total += n;
+  }
+  if (total == 0) {
+    return 0;
+  }
+  // 第rank个样本落在的桶
+  uint64_t rank =
+      std::max<uint64_t>(1, static_cast<uint64_t>(p * total + 0.5));
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < LatencyHistogram::kBuckets; ++i) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      return std::min(LatencyHistogram::UpperBound(i), max_ns);
+    }
+  }
+  return max_ns;
+}
+
+void Stats::Record(StatId id, uint64_t ns, uint64_t bytes) {
+  t_stats.Get()->cells[id].Record(ns, bytes);
+}
+
+void Stats::Snapshot(StatSnapshot *out) {
+  for (uint32_t i = 0; i < kStatNum; ++i) {
+    out[i] = StatSnapshot();
+  }
+  StatsRegistry *registry = StatsRegistry::Instance();
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  for (uint32_t i = 0; i < kStatNum; ++i) {
+    registry->retired.cells[i].AddTo(&out[i]);
+    for (const ThreadStats *stats : registry->threads) {
+      stats->cells[i].AddTo(&out[i]);
+    }
+  }
+}
+
+const char *Stats::Name(StatId id) { return kStatNames[id]; }
+
+std::string Stats::DumpJson() {
+  std::vector<StatSnapshot> snaps(kStatNum);
+  Snapshot(snaps.data());
+  std::string out;
+  fmt::format_to(std::back_inserter(out), "{{\n  \"enabled\": {},\n",
+                 enabled());
+  out += "  \"unit\": \"ns\",\n  \"stats\": {\n";
+  for (uint32_t i = 0; i < kStatNum; ++i) {
+    const StatSnapshot &s = snaps[i];
+    fmt::format_to(std::back_inserter(out),
+                   "    \"{}\": {{\"count\": {}, \"sum\": {}, \"max\": {}",
+                   kStatNames[i], s.count, s.sum_ns, s.max_ns);
+    for (uint32_t q = 0; q < std::size(kQuantiles); ++q) {
+      fmt::format_to(std::back_inserter(out), ", \"{}\": {}",
+                     kQuantileNames[q], s.Percentile(kQuantiles[q]));
+    }
+    if (HasBytes(i)) {
+      fmt::format_to(std::back_inserter(out), ", \"bytes\": {}", s.bytes);
+    }
+    out += i + 1 < kStatNum ? "},\n" : "}\n";
+  }
+  out += "  }\n}\n";
+  return out;
+}
+
+std::string Stats::DumpPrometheus() {
+  std::vector<StatSnapshot> snaps(kStatNum);
+  Snapshot(snaps.data());
+  std::string out;
+  out += "# HELP bfs_latency_seconds Latency of blockfs operations.\n";
+  out += "# TYPE bfs_latency_seconds summary\n";
+  for (uint32_t i = 0; i < kStatNum; ++i) {
+    const StatSnapshot &s = snaps[i];
+    for (double q : kQuantiles) {
+      fmt::format_to(
+          std::back_inserter(out),
+          "bfs_latency_seconds{{op=\"{}\",quantile=\"{}\"}} {:.9f}\n",
+          kStatNames[i], q, s.Percentile(q) / 1e9);
+    }
+    fmt::format_to(std::back_inserter(out),
+                   "bfs_latency_seconds_sum{{op=\"{}\"}} {:.9f}\n"
+                   "bfs_latency_seconds_count{{op=\"{}\"}} {}\n",
+                   kStatNames[i], s.sum_ns / 1e9, kStatNames[i], s.count);
+  }
+  out += "# HELP bfs_latency_max_seconds Slowest blockfs operation.\n";
+  out += "# TYPE bfs_latency_max_seconds gauge\n";
+  for (uint32_t i = 0; i < kStatNum; ++i) {
+    fmt::format_to(std::back_inserter(out),
+                   "bfs_latency_max_seconds{{op=\"{}\"}} {:.9f}\n",
+                   kStatNames[i], snaps[i].max_ns / 1e9);
+  }
+  out += "# HELP bfs_bytes_total Bytes moved by blockfs device operations.\n";
+  out += "# TYPE bfs_bytes_total counter\n";
+  for (uint32_t i = 0; i < kStatNum; ++i) {
+    if (HasBytes(i)) {
+      fmt::format_to(std::back_inserter(out),
+                     "bfs_bytes_total{{op=\"{}\"}} {}\n", kStatNames[i],
+                     snaps[i].bytes);
+    }
+  }
+  return out;
+}
+
+}  // namespace udisk::blockfs
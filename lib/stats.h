@@ -0,0 +1,183 @@
+#ifndef LIB_STATS_H_
+#define LIB_STATS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+#include <string>
+#include <string_view>
+
+namespace udisk::blockfs {
+
+// 统计项, 输出的名字见stats.cc的kStatNames
+enum StatId : uint32_t {
+  // FUSE请求, 高层和low-level两个前端共用
+  kStatFuseLookup,
+  kStatFuseForget,
+  kStatFuseGetattr,
+  kStatFuseSetattr,
+  kStatFuseMknod,
+  kStatFuseMkdir,
+  kStatFuseUnlink,
+  kStatFuseRmdir,
+  kStatFuseRename,
+  kStatFuseTruncate,
+  kStatFuseOpen,
+  kStatFuseCreate,
+  kStatFuseRead,
+  kStatFuseWrite,
+  kStatFuseStatfs,
+  kStatFuseFlush,
+  kStatFuseRelease,
+  kStatFuseFsync,
+  kStatFuseOpendir,
+  kStatFuseReaddir,
+  kStatFuseReleasedir,
+  kStatFuseLock,
+  kStatFuseFlock,
+  kStatFuseCopyFileRange,
+  kStatFuseLseek,
+  // Device的读写, 同时统计字节数
+  kStatDevReadDirect,
+  kStatDevWriteDirect,
+  kStatDevReadCache,
+  kStatDevWriteCache,
+  // 元数据
+  kStatMetaWriteSuper,
+  kStatMetaWriteDir,
+  kStatMetaWriteFile,
+  kStatMetaWriteFileBlock,
+  kStatMetaCommit,
+  // 分配器
+  kStatAllocBlock,
+  kStatFreeBlock,
+  kStatAllocFileBlock,
+  // 锁等待, 只统计没有立即拿到锁的那些
+  kStatLockBlockRead,
+  kStatLockBlockWrite,
+  kStatLockFile,
+  kStatLockJournal,
+  kStatLockBlockBitmap,
+  kStatNum
+};
+
+// HDR风格的直方图: 小于8ns每个值一个桶, 之后每个2的幂区间线性切成8个桶
+// 相对误差不超过12.5%, 上限2^40ns(约18分钟), 更大的值落在最后一个桶
+class LatencyHistogram {
+ public:
+  static constexpr uint32_t kSubBits = 3;
+  static constexpr uint32_t kSubBuckets = 1U << kSubBits;
+  static constexpr uint32_t kMaxBits = 40;
+  static constexpr uint32_t kBuckets = (kMaxBits - kSubBits + 1) * kSubBuckets;
+
+  static uint32_t Index(uint64_t ns) noexcept {
+    if (ns < kSubBuckets) {
+      return ns;
+    }
+    uint32_t bits = 63 - __builtin_clzll(ns);
+    if (bits >= kMaxBits) [[unlikely]] {
+      return kBuckets - 1;
+    }
+    uint32_t shift = bits - kSubBits;
+    return (shift + 1) * kSubBuckets + ((ns >> shift) & (kSubBuckets - 1));
+  }
+
+  // 桶内最大的值, 分位数按这个值报告
+  static uint64_t UpperBound(uint32_t index) noexcept {
+    if (index < kSubBuckets) {
+      return index;
+    }
+    uint32_t shift = index / kSubBuckets - 1;
+    uint64_t low = static_cast<uint64_t>(kSubBuckets + index % kSubBuckets)
+                   << shift;
+    return low + (1ULL << shift) - 1;
+  }
+};
+
+// 所有线程累加之后的一项统计
+struct StatSnapshot {
+  uint64_t count = 0;
+  uint64_t sum_ns = 0;
+  uint64_t max_ns = 0;
+  uint64_t bytes = 0;
+  uint64_t buckets[LatencyHistogram::kBuckets] = {};
+
+  // p取值(0, 1], 没有样本时返回0
+  uint64_t Percentile(double p) const;
+};
+
+// 每个线程第一次记录时分配自己的统计块, 之后只有本线程写, 不加锁
+// 读取时在注册表的锁内把所有线程(包括已经退出的)累加起来
+class Stats {
+ public:
+  static bool enabled() noexcept {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+  static void set_enabled(bool enabled) noexcept {
+    enabled_.store(enabled, std::memory_order_relaxed);
+  }
+
+  static uint64_t NowNs() noexcept {
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  static void Record(StatId id, uint64_t ns, uint64_t bytes);
+  // out指向kStatNum个元素
+  static void Snapshot(StatSnapshot *out);
+  static const char *Name(StatId id);
+
+  static std::string DumpJson();
+  static std::string DumpPrometheus();
+
+  // 挂载点根目录下的只读虚拟文件, 打开时生成一次内容
+  static bool IsStatsFile(std::string_view name) noexcept {
+    return name == kJsonFile || name == kPrometheusFile;
+  }
+  static std::string DumpFile(std::string_view name) {
+    return name == kPrometheusFile ? DumpPrometheus() : DumpJson();
+  }
+  static constexpr std::string_view kJsonFile = ".bfs_stats";
+  static constexpr std::string_view kPrometheusFile = ".bfs_stats.prom";
+
+ private:
+  static std::atomic<bool> enabled_;
+};
+
+// 作用域计时, 析构时记录, 关闭统计的时候不读时钟
+class StatTimer {
+ public:
+  explicit StatTimer(StatId id) noexcept
+      : id_(id), start_(Stats::enabled() ? Stats::NowNs() : 0) {}
+  ~StatTimer() {
+    if (start_ != 0) {
+      Stats::Record(id_, Stats::NowNs() - start_, bytes_);
+    }
+  }
+  StatTimer(const StatTimer &) = delete;
+  StatTimer &operator=(const StatTimer &) = delete;
+
+  // 失败的返回值不计入字节数
+  void set_bytes(int64_t bytes) noexcept { bytes_ = bytes > 0 ? bytes : 0; }
+
+ private:
+  const StatId id_;
+  const uint64_t start_;
+  uint64_t bytes_ = 0;
+};
+
+// 先try_lock, 拿不到才计时等待, 没有竞争的时候不读时钟
+// Lock是defer_lock构造的unique_lock/shared_lock
+template <typename Lock>
+inline void LockWithStat(Lock &lock, StatId id) {
+  if (!lock.try_lock()) {
+    StatTimer timer(id);
+    lock.lock();
+  }
+}
+
+}  // namespace udisk::blockfs
+
+#endif
@@ -4,6 +4,7 @@
 #include "file_system.h"
 #include "logging.h"
 #include "spdlog/spdlog.h"
+#include "stats.h"
 
 /**
  * get the total super metadata on the shared udisk
@@ -86,8 +87,20 @@ bool SuperBlock::FormatAllMeta() {
       ROUND_UP((tmpSize1 + tmpSize2), kBlockFsPageSize);
   meta->max_file_block_num = tmpNum1 + tmpNum2;
 
-  meta->block_data_start_offset_ =
+  /* 6. FileBlockMeta使用索引区域: 紧跟在文件块区域之后 */
+  meta->file_block_index_offset_ =
       meta->file_block_meta_offset_ + meta->file_block_meta_total_size_;
+  meta->file_block_index_size_ =
+      ALIGN_UP(meta->max_file_block_num, kFileBlockIndexBitsPerPage) *
+      kBlockFsPageSize;
+  meta->block_data_start_offset_ =
+      meta->file_block_index_offset_ + meta->file_block_index_size_;
+
+  /* 7. 元数据journal区域: 位于元数据和数据之间 */
+  meta->journal_offset_ =
+      ROUND_UP(meta->block_data_start_offset_, kBlockFsPageSize);
+  meta->journal_size_ = kJournalSize;
+  meta->block_data_start_offset_ = meta->journal_offset_ + meta->journal_size_;
 
   // 元数据区域大小保证4M对齐,也就是数据区域的起始位置是4M对齐的
   meta->block_data_start_offset_ =
@@ -97,6 +110,8 @@ bool SuperBlock::FormatAllMeta() {
   uint64_t free_udisk_size =
       meta->device_size - meta->block_data_start_offset_;
   meta->curr_block_num = free_udisk_size / kBlockSize;
+  meta->file_block_format_ = kFileBlockFormatExtent;
+  meta->checksum_type_ = kChecksumCrc32c;
 
   // 最大支持12T的block个数
   meta->max_support_block_num_ =
@@ -152,17 +167,26 @@ void SuperBlock::Dump() noexcept {
             << "\n"
             << "data_start_offset: " << meta()->block_data_start_offset_ << "\n"
             << "device_size: " << meta()->device_size << "\n"
-            << "curr_block_num: " << meta()->curr_block_num;
+            << "curr_block_num: " << meta()->curr_block_num << "\n"
+            << "file_block_format: " << meta()->file_block_format_ << "\n"
+            << "journal_offset: " << meta()->journal_offset_ << "\n"
+            << "journal_size: " << meta()->journal_size_ << "\n"
+            << "checksum_type: " << meta()->checksum_type_ << "\n"
+            << "file_block_index_offset: " << meta()->file_block_index_offset_
+            << "\n"
+            << "file_block_index_size: " << meta()->file_block_index_size_
+            << "\n"
+            << "shm_generation: " << meta()->shm_generation_;
 }
 
 bool SuperBlock::WriteMeta() {
+  StatTimer timer(kStatMetaWriteSuper);
   meta()->crc_ =
       Crc32(reinterpret_cast<uint8_t *>(base_addr()) + sizeof(meta()->crc_),
             kSuperBlockSize - sizeof(meta()->crc_));
-  int64_t ret = FileSystem::Instance()->dev()->PwriteDirect(
-      base_addr(), kSuperBlockSize, kSuperBlockOffset);
-  if (ret != static_cast<int64_t>(kSuperBlockSize)) {
-    SPDLOG_ERROR("write super block error size:{}", ret);
+  if (!FileSystem::Instance()->WriteMetaPage(base_addr(), kSuperBlockSize,
+                                             kSuperBlockOffset)) {
+    SPDLOG_ERROR("write super block failed");
     return false;
   }
   SPDLOG_INFO("write super block success");
@@ -0,0 +1,71 @@
+#include "thread_pool.h"
+
+#include <pthread.h>
+
+#include "spdlog/spdlog.h"
+
+namespace udisk::blockfs {
+
+ThreadPool::ThreadPool(const std::string &name, uint32_t thread_num,
+                       uint32_t max_queue_size)
+    : name_(name), max_queue_size_(max_queue_size) {
+  threads_.reserve(thread_num);
+  for (uint32_t i = 0; i < thread_num; ++i) {
+    threads_.emplace_back(&ThreadPool::WorkerLoop, this, i);
+  }
+  SPDLOG_INFO("thread pool {} started, threads: {} max queue: {}", name_,
+              thread_num, max_queue_size_);
+}
+
+ThreadPool::~ThreadPool() { Stop(); }
+
+void ThreadPool::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopped_) {
+      return;
+    }
+    stopped_ = true;
+  }
+  cond_.notify_all();
+  for (std::thread &t : threads_) {
+    if (t.joinable()) {
+      t.join();
+    }
+  }
+  SPDLOG_INFO("thread pool {} stopped", name_);
+}
+
+bool ThreadPool::Submit(Task task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!stopped_ && tasks_.size() < max_queue_size_) {
+      tasks_.emplace_back(std::move(task));
+      cond_.notify_one();
+      return true;
+    }
+  }
+  task();
+  return false;
+}
+
+void ThreadPool::WorkerLoop(uint32_t index) {
+  std::string thread_name = name_.substr(0, 12) + "_" + std::to_string(index);
+  ::pthread_setname_np(::pthread_self(), thread_name.c_str());
+  while (true) {
+    Task task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this] { return stopped_ || !tasks_.empty(); });
+      // 停止之前把队列中的任务执行完, 提交者可能还在等待
+      if (tasks_.empty()) {
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
+
+}  // namespace udisk::blockfs
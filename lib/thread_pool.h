@@ -0,0 +1,48 @@
+#ifndef LIB_THREAD_POOL_H_
+#define LIB_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace udisk::blockfs {
+
+// 固定线程数和有界队列的线程池
+// 队列满的时候由提交者自己执行, 不会无限堆积也不会死锁
+class ThreadPool {
+ public:
+  typedef std::function<void()> Task;
+
+ private:
+  std::string name_;
+  uint32_t max_queue_size_;
+  std::vector<std::thread> threads_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<Task> tasks_;
+  bool stopped_ = false;
+
+ private:
+  void WorkerLoop(uint32_t index);
+
+ public:
+  ThreadPool(const std::string &name, uint32_t thread_num,
+             uint32_t max_queue_size);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  uint32_t thread_num() const { return threads_.size(); }
+
+  // 返回false表示队列已满或者已经停止, 任务在当前线程执行
+  bool Submit(Task task);
+  void Stop();
+};
+
+}  // namespace udisk::blockfs
+#endif
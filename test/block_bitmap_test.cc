@@ -0,0 +1,175 @@
+// Copyright (c) 2020 UCloud All rights reserved.
+#include "block_bitmap.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <random>
+#include <set>
+
+using namespace udisk::blockfs;
+
+// 参考实现: 最长的空闲区间
+static uint32_t LongestRun(const std::vector<bool> &free_map) {
+  uint32_t longest = 0, run = 0;
+  for (bool is_free : free_map) {
+    run = is_free ? run + 1 : 0;
+    longest = std::max(longest, run);
+  }
+  return longest;
+}
+
+static bool IsContiguous(const std::vector<uint32_t> &ids) {
+  for (size_t i = 1; i < ids.size(); ++i) {
+    if (ids[i] != ids[i - 1] + 1) return false;
+  }
+  return true;
+}
+
+TEST(BlockBitmap, ResizeAcquireRelease) {
+  BlockBitmap bitmap;
+  bitmap.Resize(100);
+  EXPECT_EQ(bitmap.size(), 100u);
+  EXPECT_EQ(bitmap.free_num(), 100u);
+  EXPECT_TRUE(bitmap.IsFree(99));
+  EXPECT_FALSE(bitmap.IsFree(100));
+
+  EXPECT_TRUE(bitmap.Acquire(63));
+  EXPECT_FALSE(bitmap.Acquire(63));
+  EXPECT_FALSE(bitmap.IsFree(63));
+  EXPECT_EQ(bitmap.free_num(), 99u);
+  EXPECT_FALSE(bitmap.Acquire(100));
+
+  EXPECT_TRUE(bitmap.Release(63));
+  EXPECT_FALSE(bitmap.Release(63));
+  EXPECT_FALSE(bitmap.Release(100));
+  EXPECT_EQ(bitmap.free_num(), 100u);
+
+  // 扩容不会影响已占用的block
+  EXPECT_TRUE(bitmap.Acquire(10));
+  bitmap.Resize(5000);
+  EXPECT_EQ(bitmap.free_num(), 4999u);
+  EXPECT_FALSE(bitmap.IsFree(10));
+  EXPECT_TRUE(bitmap.IsFree(4999));
+}
+
+TEST(BlockBitmap, AllocateContiguous) {
+  BlockBitmap bitmap;
+  bitmap.Resize(10000);
+  std::vector<uint32_t> ids;
+  ASSERT_TRUE(bitmap.Allocate(100, &ids));
+  ASSERT_EQ(ids.size(), 100u);
+  EXPECT_TRUE(IsContiguous(ids));
+  EXPECT_EQ(ids.front(), 0u);
+  // 从上次分配的位置往后顺序分配
+  ASSERT_TRUE(bitmap.Allocate(10, &ids));
+  EXPECT_EQ(ids.front(), 100u);
+  EXPECT_TRUE(IsContiguous(ids));
+  EXPECT_EQ(bitmap.free_num(), 10000u - 110u);
+
+  EXPECT_FALSE(bitmap.Allocate(0, &ids));
+  EXPECT_TRUE(ids.empty());
+  EXPECT_FALSE(bitmap.Allocate(10000, &ids));
+}
+
+TEST(BlockBitmap, RunAcrossRegions) {
+  // 每个区域4096个block, 只留下跨过区域边界的一段空闲
+  BlockBitmap bitmap;
+  bitmap.Resize(3 * 4096);
+  for (uint32_t id = 0; id < 3 * 4096; ++id) {
+    if (id < 4096 - 100 || id >= 2 * 4096 + 100) {
+      ASSERT_TRUE(bitmap.Acquire(id));
+    }
+  }
+  // 中间还要能找到一个区域内部的短区间
+  ASSERT_TRUE(bitmap.Release(5));
+  std::vector<uint32_t> ids;
+  ASSERT_TRUE(bitmap.Allocate(4096 + 200, &ids));
+  EXPECT_TRUE(IsContiguous(ids));
+  EXPECT_EQ(ids.front(), 4096u - 100u);
+  ASSERT_TRUE(bitmap.Allocate(1, &ids));
+  EXPECT_EQ(ids.front(), 5u);
+  EXPECT_EQ(bitmap.free_num(), 0u);
+}
+
+TEST(BlockBitmap, RunBeforeHint) {
+  BlockBitmap bitmap;
+  bitmap.Resize(4 * 4096);
+  std::vector<uint32_t> ids;
+  ASSERT_TRUE(bitmap.Allocate(3 * 4096, &ids));
+  ASSERT_TRUE(bitmap.Allocate(4096, &ids));
+  EXPECT_EQ(bitmap.free_num(), 0u);
+  // 释放开头的一段, 分配位置已经在末尾, 需要绕回来找
+  for (uint32_t id = 1000; id < 1300; ++id) {
+    ASSERT_TRUE(bitmap.Release(id));
+  }
+  ASSERT_TRUE(bitmap.Allocate(300, &ids));
+  EXPECT_EQ(ids.front(), 1000u);
+  EXPECT_TRUE(IsContiguous(ids));
+}
+
+TEST(BlockBitmap, AllocateFragmented) {
+  // 每隔一个block空闲, 没有长度为2的连续区间, 只能拼凑
+  BlockBitmap bitmap;
+  bitmap.Resize(10000);
+  for (uint32_t id = 0; id < 10000; id += 2) {
+    ASSERT_TRUE(bitmap.Acquire(id));
+  }
+  std::vector<uint32_t> ids;
+  ASSERT_TRUE(bitmap.Allocate(2000, &ids));
+  ASSERT_EQ(ids.size(), 2000u);
+  std::set<uint32_t> uniq(ids.begin(), ids.end());
+  EXPECT_EQ(uniq.size(), ids.size());
+  for (uint32_t id : ids) {
+    EXPECT_EQ(id % 2, 1u);
+    EXPECT_FALSE(bitmap.IsFree(id));
+  }
+  EXPECT_EQ(bitmap.free_num(), 3000u);
+  ASSERT_TRUE(bitmap.Allocate(3000, &ids));
+  EXPECT_EQ(bitmap.free_num(), 0u);
+  EXPECT_FALSE(bitmap.Allocate(1, &ids));
+}
+
+TEST(BlockBitmap, RandomAgainstReference) {
+  const uint32_t kSize = 5 * 4096 + 77;
+  BlockBitmap bitmap;
+  bitmap.Resize(kSize);
+  std::vector<bool> free_map(kSize, true);
+  std::vector<uint32_t> used;
+  std::mt19937 rng(20201);
+
+  for (int round = 0; round < 3000; ++round) {
+    if (!used.empty() && (rng() % 2 == 0 || bitmap.free_num() < 200)) {
+      // 随机释放一部分
+      uint32_t num = rng() % std::min<size_t>(used.size(), 300) + 1;
+      for (uint32_t i = 0; i < num; ++i) {
+        size_t pos = rng() % used.size();
+        uint32_t id = used[pos];
+        used[pos] = used.back();
+        used.pop_back();
+        ASSERT_TRUE(bitmap.Release(id));
+        free_map[id] = true;
+      }
+    } else {
+      uint32_t num = std::min<uint32_t>(rng() % 400 + 1, bitmap.free_num());
+      uint32_t longest = LongestRun(free_map);
+      std::vector<uint32_t> ids;
+      ASSERT_TRUE(bitmap.Allocate(num, &ids));
+      ASSERT_EQ(ids.size(), num);
+      // 存在足够长的连续区间时必须返回连续的block
+      if (longest >= num) {
+        ASSERT_TRUE(IsContiguous(ids)) << "round " << round;
+      }
+      for (uint32_t id : ids) {
+        ASSERT_LT(id, kSize);
+        ASSERT_TRUE(free_map[id]) << "block " << id << " allocated twice";
+        free_map[id] = false;
+        used.push_back(id);
+      }
+    }
+    ASSERT_EQ(bitmap.free_num(), kSize - used.size());
+  }
+  for (uint32_t id = 0; id < kSize; ++id) {
+    ASSERT_EQ(bitmap.IsFree(id), free_map[id]);
+  }
+}
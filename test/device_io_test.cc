@@ -0,0 +1,160 @@
+// Copyright (c) 2020 UCloud All rights reserved.
+#include "device.h"
+
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "aligned_buffer.h"
+
+using namespace udisk::blockfs;
+
+// 普通文件当作设备, 验证DeviceIo带iovec时的分散读写
+// 参数: io引擎和psync的线程数
+class DeviceIoTest
+    : public ::testing::TestWithParam<std::pair<IoEngineType, uint32_t>> {
+ protected:
+  static constexpr uint64_t kImageSize = 4 * M;
+  const std::string kImagePath = "device_io_test.img";
+
+  Device dev_;
+
+  void SetUp() override {
+    int fd = ::open(kImagePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(::ftruncate(fd, kImageSize), 0);
+    ::close(fd);
+    ASSERT_TRUE(dev_.OpenImage(kImagePath));
+    auto [engine, threads] = GetParam();
+    if (!dev_.SetIoEngine(engine, 0)) {
+      GTEST_SKIP() << "io_uring not available";
+    }
+    dev_.SetIoThreads(threads);
+  }
+
+  void TearDown() override {
+    dev_.Close();
+    ::unlink(kImagePath.c_str());
+  }
+
+  // 按lens把buffer切成iovec
+  static std::vector<struct iovec> Split(char *buffer,
+                                         const std::vector<uint64_t> &lens) {
+    std::vector<struct iovec> iov;
+    for (uint64_t len : lens) {
+      iov.push_back({buffer, len});
+      buffer += len;
+    }
+    return iov;
+  }
+
+  static DeviceIo VectorIo(const std::vector<struct iovec> &iov,
+                           uint64_t offset) {
+    uint64_t len = 0;
+    for (const struct iovec &piece : iov) {
+      len += piece.iov_len;
+    }
+    DeviceIo io = {nullptr, len, offset, 0};
+    io.iov = iov.data();
+    io.iovcnt = iov.size();
+    return io;
+  }
+
+  static void Fill(char *buffer, uint64_t len, uint32_t seed) {
+    for (uint64_t i = 0; i < len; ++i) {
+      buffer[i] = static_cast<char>((i * 131 + seed) % 251);
+    }
+  }
+};
+
+TEST_P(DeviceIoTest, ScatterWriteGatherRead) {
+  const uint64_t kLen = 16 * K;
+  std::vector<char> data(3 * kLen);
+  Fill(data.data(), data.size(), 7);
+  // 三个不连续的段: 普通buf, 奇数长度的iovec, 两个iovec
+  std::vector<struct iovec> second =
+      Split(data.data() + kLen, {1, 4095, 100, 3900, 8288});
+  std::vector<struct iovec> third =
+      Split(data.data() + 2 * kLen, {kLen / 2, kLen / 2});
+  DeviceIo writes[3] = {{data.data(), kLen, 0, 0}, VectorIo(second, 64 * K),
+                        VectorIo(third, 256 * K)};
+  ASSERT_EQ(dev_.PwriteBatch(writes, 3, false),
+            static_cast<int64_t>(3 * kLen));
+
+  // 用不同的切分方式读回来
+  std::vector<char> out(3 * kLen, 0);
+  std::vector<struct iovec> first_out = Split(out.data(), {kLen - 3, 3});
+  std::vector<struct iovec> second_out =
+      Split(out.data() + kLen, {kLen / 4, kLen / 4, kLen / 4, kLen / 4});
+  DeviceIo reads[3] = {VectorIo(first_out, 0), VectorIo(second_out, 64 * K),
+                       {out.data() + 2 * kLen, kLen, 256 * K, 0}};
+  ASSERT_EQ(dev_.PreadBatch(reads, 3, false), static_cast<int64_t>(3 * kLen));
+  EXPECT_EQ(::memcmp(data.data(), out.data(), data.size()), 0);
+  for (const DeviceIo &io : reads) {
+    EXPECT_EQ(io.ret, static_cast<int64_t>(io.len));
+  }
+
+  // 单个段走同步路径, 和普通的pread读到的一致
+  std::vector<char> plain(kLen);
+  ASSERT_EQ(dev_.PreadCache(plain.data(), kLen, 64 * K),
+            static_cast<int64_t>(kLen));
+  EXPECT_EQ(::memcmp(plain.data(), data.data() + kLen, kLen), 0);
+}
+
+TEST_P(DeviceIoTest, DirectAlignedIovecs) {
+  const uint64_t kLen = 64 * K;
+  AlignBuffer data(kLen, kBlockFsPageSize);
+  AlignBuffer out(kLen, kBlockFsPageSize);
+  Fill(data.data(), kLen, 3);
+  ::memset(out.data(), 0, kLen);
+  // O_DIRECT要求每个iovec都按扇区对齐
+  std::vector<struct iovec> iov =
+      Split(data.data(), {4 * K, 16 * K, 8 * K, 4 * K});
+  std::vector<struct iovec> tail = Split(data.data() + 32 * K, {32 * K});
+  DeviceIo writes[2] = {VectorIo(iov, 1 * M), VectorIo(tail, 2 * M)};
+  ASSERT_EQ(dev_.PwriteBatch(writes, 2, true), static_cast<int64_t>(kLen));
+
+  std::vector<struct iovec> iov_out =
+      Split(out.data(), {8 * K, 8 * K, 8 * K, 8 * K});
+  DeviceIo reads[2] = {VectorIo(iov_out, 1 * M),
+                       {out.data() + 32 * K, 32 * K, 2 * M, 0}};
+  ASSERT_EQ(dev_.PreadBatch(reads, 2, true), static_cast<int64_t>(kLen));
+  EXPECT_EQ(::memcmp(data.data(), out.data(), kLen), 0);
+}
+
+TEST_P(DeviceIoTest, IovMaxPieces) {
+  const uint64_t kPiece = 16;
+  std::vector<char> data(IOV_MAX * kPiece);
+  Fill(data.data(), data.size(), 11);
+  std::vector<uint64_t> lens(IOV_MAX, kPiece);
+  std::vector<struct iovec> iov = Split(data.data(), lens);
+  DeviceIo writes[2] = {VectorIo(iov, 0), {data.data(), kPiece, 1 * M, 0}};
+  ASSERT_EQ(dev_.PwriteBatch(writes, 2, false),
+            static_cast<int64_t>(data.size() + kPiece));
+
+  std::vector<char> out(data.size());
+  ASSERT_EQ(dev_.PreadCache(out.data(), out.size(), 0),
+            static_cast<int64_t>(out.size()));
+  EXPECT_EQ(::memcmp(data.data(), out.data(), data.size()), 0);
+}
+
+TEST_P(DeviceIoTest, OutOfRange) {
+  std::vector<char> data(8 * K);
+  std::vector<struct iovec> iov = Split(data.data(), {4 * K, 4 * K});
+  DeviceIo ios[2] = {{data.data(), 4 * K, 0, 0},
+                     VectorIo(iov, kImageSize - 4 * K)};
+  errno = 0;
+  EXPECT_EQ(dev_.PreadBatch(ios, 2, false), -1);
+  EXPECT_EQ(errno, EINVAL);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Engines, DeviceIoTest,
+    ::testing::Values(std::make_pair(kIoEnginePsync, 0U),
+                      std::make_pair(kIoEnginePsync, 2U),
+                      std::make_pair(kIoEngineIoUring, 0U)));
@@ -0,0 +1,111 @@
+// Copyright (c) 2020 UCloud All rights reserved.
+#include "dir_handle.h"
+
+#include <gtest/gtest.h>
+#include <string.h>
+
+#include <deque>
+
+using namespace udisk::blockfs;
+
+// 不挂载文件系统, 只在内存里搭目录树, 验证按(父dh, 名字)索引的dentry
+class DirHandleTest : public ::testing::Test {
+ protected:
+  DirHandle dir_handle_;
+  std::deque<DirMeta> metas_;
+  DirectoryPtr root_;
+
+  DirectoryPtr AddDir(ino_t dh, const DirectoryPtr &parent,
+                      const std::string &name) {
+    DirMeta &meta = metas_.emplace_back();
+    ::memset(&meta, 0, sizeof(meta));
+    meta.dh_ = dh;
+    meta.used_ = true;
+    std::string path = parent ? parent->dir_name() + name + "/" : "/";
+    ::strncpy(meta.dir_name_, path.c_str(), sizeof(meta.dir_name_) - 1);
+    DirectoryPtr dir = std::make_shared<Directory>(&meta);
+    if (parent) {
+      dir->set_dentry(parent->dh(), name);
+      EXPECT_TRUE(parent->AddChildDirectory(dir));
+    }
+    EXPECT_TRUE(dir_handle_.AddDirectory2CreateNolock(dir));
+    return dir;
+  }
+
+  void SetUp() override { root_ = AddDir(0, nullptr, ""); }
+};
+
+TEST_F(DirHandleTest, LookupByPath) {
+  DirectoryPtr a = AddDir(1, root_, "a");
+  DirectoryPtr b = AddDir(2, a, "b");
+  EXPECT_EQ(dir_handle_.GetCreatedDirectoryNolock("/"), root_);
+  EXPECT_EQ(dir_handle_.GetCreatedDirectoryNolock("/a"), a);
+  EXPECT_EQ(dir_handle_.GetCreatedDirectoryNolock("/a/"), a);
+  EXPECT_EQ(dir_handle_.GetCreatedDirectoryNolock("/a/b"), b);
+  EXPECT_EQ(dir_handle_.GetChildDirectory(1, "b"), b);
+  EXPECT_EQ(dir_handle_.GetCreatedDirectoryNolock(2), b);
+  EXPECT_FALSE(dir_handle_.GetCreatedDirectoryNolock("/b"));
+  EXPECT_FALSE(dir_handle_.GetCreatedDirectoryNolock("/a/b/c"));
+  // 同一个父文件夹下不能重名
+  DirMeta meta;
+  ::memset(&meta, 0, sizeof(meta));
+  meta.dh_ = 3;
+  ::strcpy(meta.dir_name_, "/a/");
+  DirectoryPtr dup = std::make_shared<Directory>(&meta);
+  dup->set_dentry(0, "a");
+  EXPECT_FALSE(dir_handle_.AddDirectory2CreateNolock(dup));
+}
+
+TEST_F(DirHandleTest, RenameSubtreeAndRollback) {
+  DirectoryPtr a = AddDir(1, root_, "a");
+  DirectoryPtr b = AddDir(2, a, "b");
+  DirectoryPtr c = AddDir(3, b, "c");
+  DirectoryPtr d = AddDir(4, root_, "d");
+
+  // 子树整体挂到/d/x下面, 子树里的索引项不用动
+  ASSERT_TRUE(dir_handle_.RenameDirectoryNolock(a, d, "x"));
+  EXPECT_FALSE(dir_handle_.GetCreatedDirectoryNolock("/a"));
+  EXPECT_EQ(dir_handle_.GetCreatedDirectoryNolock("/d/x"), a);
+  EXPECT_EQ(dir_handle_.GetCreatedDirectoryNolock("/d/x/b/c"), c);
+  EXPECT_EQ(a->parent_dh(), d->dh());
+  EXPECT_EQ(a->name(), "x");
+  std::vector<DirectoryPtr> children;
+  d->GetSubDirectories(&children);
+  EXPECT_EQ(children.size(), 3u);
+  children.clear();
+  root_->GetSubDirectories(&children);
+  EXPECT_EQ(children.size(), 4u);
+
+  // 提交失败时反向重命名, 目录树回到原样
+  ASSERT_TRUE(dir_handle_.RenameDirectoryNolock(a, root_, "a"));
+  EXPECT_FALSE(dir_handle_.GetCreatedDirectoryNolock("/d/x"));
+  EXPECT_EQ(dir_handle_.GetCreatedDirectoryNolock("/a/b/c"), c);
+  EXPECT_EQ(a->parent_dh(), root_->dh());
+  EXPECT_EQ(a->name(), "a");
+  children.clear();
+  d->GetSubDirectories(&children);
+  EXPECT_TRUE(children.empty());
+}
+
+TEST_F(DirHandleTest, RenameOntoExistingName) {
+  DirectoryPtr a = AddDir(1, root_, "a");
+  DirectoryPtr b = AddDir(2, root_, "b");
+  errno = 0;
+  EXPECT_FALSE(dir_handle_.RenameDirectoryNolock(a, root_, "b"));
+  EXPECT_EQ(errno, EEXIST);
+  // 失败之后两边的索引项都还在
+  EXPECT_EQ(dir_handle_.GetCreatedDirectoryNolock("/a"), a);
+  EXPECT_EQ(dir_handle_.GetCreatedDirectoryNolock("/b"), b);
+  EXPECT_EQ(a->name(), "a");
+}
+
+TEST_F(DirHandleTest, RenameInPlace) {
+  DirectoryPtr a = AddDir(1, root_, "a");
+  DirectoryPtr b = AddDir(2, a, "b");
+  ASSERT_TRUE(dir_handle_.RenameDirectoryNolock(a, root_, "z"));
+  EXPECT_FALSE(dir_handle_.GetCreatedDirectoryNolock("/a"));
+  EXPECT_EQ(dir_handle_.GetCreatedDirectoryNolock("/z/b"), b);
+  std::vector<DirectoryPtr> children;
+  root_->GetSubDirectories(&children);
+  EXPECT_EQ(children.size(), 2u);
+}
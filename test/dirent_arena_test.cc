@@ -0,0 +1,84 @@
+// Copyright (c) 2020 UCloud All rights reserved.
+#include "dirent_arena.h"
+
+#include <dirent.h>
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+using namespace udisk::blockfs;
+
+TEST(DirentArena, AppendAndIterate) {
+  DirentArena arena;
+  std::vector<std::string> names = {"a", "bb", "ccccccc", "dddddddd", ""};
+  for (uint32_t i = 0; i < names.size(); ++i) {
+    arena.Append(i, 100 + i, 4096 * i, 1000 + i, i % 2 ? DT_DIR : DT_REG,
+                 names[i]);
+  }
+  uint32_t offset = 0;
+  for (uint32_t i = 0; i < names.size(); ++i) {
+    ASSERT_LT(offset, arena.size());
+    // 记录按8字节对齐
+    EXPECT_EQ(offset % 8, 0u);
+    const DirentRecord *record = arena.at(offset);
+    EXPECT_EQ(record->pos, i);
+    EXPECT_EQ(record->ino, static_cast<ino_t>(100 + i));
+    EXPECT_EQ(record->size, 4096u * i);
+    EXPECT_EQ(record->time, static_cast<time_t>(1000 + i));
+    EXPECT_EQ(record->type, i % 2 ? DT_DIR : DT_REG);
+    EXPECT_EQ(record->name_len, names[i].size());
+    EXPECT_STREQ(record->name(), names[i].c_str());
+    offset = arena.next(offset);
+  }
+  EXPECT_EQ(offset, arena.size());
+}
+
+TEST(DirentArena, ResetReusesMemory) {
+  DirentArena arena;
+  for (int i = 0; i < 100; ++i) {
+    arena.Append(i, i, 0, 0, DT_REG, "file_" + std::to_string(i));
+  }
+  uint32_t capacity = arena.capacity();
+  ASSERT_GT(capacity, 0u);
+  arena.Reset();
+  EXPECT_EQ(arena.size(), 0u);
+  // 同样大小的一批不再扩容
+  for (int i = 0; i < 100; ++i) {
+    arena.Append(i, i, 0, 0, DT_REG, "file_" + std::to_string(i));
+  }
+  EXPECT_EQ(arena.capacity(), capacity);
+  EXPECT_STREQ(arena.at(0)->name(), "file_0");
+}
+
+TEST(DirentArena, GrowKeepsRecords) {
+  DirentArena arena;
+  const int kNum = 5000;
+  // 超过初始容量之后扩容, 已经写入的记录要原样拷过去
+  for (int i = 0; i < kNum; ++i) {
+    arena.Append(i, i, i, i, DT_REG, "name_" + std::to_string(i));
+  }
+  EXPECT_GT(arena.capacity(), 16u * 1024);
+  EXPECT_LE(arena.size(), arena.capacity());
+  uint32_t offset = 0;
+  for (int i = 0; i < kNum; ++i) {
+    const DirentRecord *record = arena.at(offset);
+    ASSERT_EQ(record->pos, static_cast<uint64_t>(i));
+    ASSERT_EQ(std::string(record->name()), "name_" + std::to_string(i));
+    offset = arena.next(offset);
+  }
+  EXPECT_EQ(offset, arena.size());
+}
+
+TEST(DirentArena, LongName) {
+  DirentArena arena;
+  arena.Append(0, 1, 0, 0, DT_REG, "short");
+  // 一条记录比整个初始容量还大
+  std::string name(40 * 1024, 'x');
+  arena.Append(1, 2, 0, 0, DT_REG, name);
+  EXPECT_GE(arena.capacity(), arena.size());
+  EXPECT_STREQ(arena.at(0)->name(), "short");
+  const DirentRecord *record = arena.at(arena.next(0));
+  EXPECT_EQ(record->name_len, name.size());
+  EXPECT_EQ(std::string(record->name()), name);
+}
@@ -0,0 +1,117 @@
+// Copyright (c) 2020 UCloud All rights reserved.
+#include "fd_handle.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "directory.h"
+
+using namespace udisk::blockfs;
+
+// fd表只保存指针, 用不挂元数据的Directory对象即可
+TEST(FdHandle, AllocGetRelease) {
+  FdHandle fds;
+  DirectoryPtr dir = std::make_shared<Directory>();
+  int32_t fd = fds.AllocFd(dir);
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ(fds.used_num(), 1u);
+  EXPECT_EQ(fds.GetDirectory(fd), dir);
+  // 文件夹的fd不能当成文件访问
+  EXPECT_FALSE(fds.GetFile(fd));
+  EXPECT_FALSE(fds.ReleaseFile(fd));
+
+  EXPECT_EQ(fds.ReleaseDirectory(fd), dir);
+  EXPECT_FALSE(fds.GetDirectory(fd));
+  EXPECT_FALSE(fds.ReleaseDirectory(fd));
+  EXPECT_EQ(fds.used_num(), 0u);
+
+  EXPECT_FALSE(fds.GetDirectory(-1));
+  EXPECT_FALSE(fds.GetDirectory(INT32_MAX));
+}
+
+TEST(FdHandle, StaleFdAfterSlotReuse) {
+  FdHandle fds;
+  DirectoryPtr first = std::make_shared<Directory>();
+  DirectoryPtr second = std::make_shared<Directory>();
+  int32_t old_fd = fds.AllocFd(first);
+  ASSERT_GE(old_fd, 0);
+  ASSERT_EQ(fds.ReleaseDirectory(old_fd), first);
+  // 刚释放的槽位在栈顶, 复用同一个下标但是代数不同
+  int32_t new_fd = fds.AllocFd(second);
+  ASSERT_GE(new_fd, 0);
+  EXPECT_NE(new_fd, old_fd);
+  EXPECT_FALSE(fds.GetDirectory(old_fd));
+  // 老的fd关闭两次不能把新打开的关掉
+  EXPECT_FALSE(fds.ReleaseDirectory(old_fd));
+  EXPECT_EQ(fds.GetDirectory(new_fd), second);
+  EXPECT_EQ(fds.ReleaseDirectory(new_fd), second);
+}
+
+TEST(FdHandle, Exhausted) {
+  FdHandle fds;
+  DirectoryPtr dir = std::make_shared<Directory>();
+  std::vector<int32_t> opened;
+  int32_t fd;
+  while ((fd = fds.AllocFd(dir)) >= 0) {
+    opened.push_back(fd);
+  }
+  EXPECT_EQ(errno, EMFILE);
+  EXPECT_EQ(opened.size(), kMaxFileNum << 1);
+  EXPECT_EQ(fds.used_num(), opened.size());
+
+  ASSERT_EQ(fds.ReleaseDirectory(opened.back()), dir);
+  fd = fds.AllocFd(dir);
+  EXPECT_GE(fd, 0);
+  EXPECT_NE(fd, opened.back());
+}
+
+TEST(FdHandle, ConcurrentReleaseOnlyOnce) {
+  FdHandle fds;
+  const int kThreadNum = 4;
+  const int kRoundNum = 2000;
+  for (int round = 0; round < kRoundNum; ++round) {
+    DirectoryPtr dir = std::make_shared<Directory>();
+    int32_t fd = fds.AllocFd(dir);
+    ASSERT_GE(fd, 0);
+    std::atomic<int> released{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreadNum; ++t) {
+      threads.emplace_back([&] {
+        if (fds.ReleaseDirectory(fd)) {
+          released.fetch_add(1);
+        }
+      });
+    }
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+    ASSERT_EQ(released.load(), 1) << "round " << round;
+  }
+  EXPECT_EQ(fds.used_num(), 0u);
+}
+
+TEST(FdHandle, ConcurrentAllocRelease) {
+  FdHandle fds;
+  const int kThreadNum = 4;
+  const int kRoundNum = 20000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreadNum; ++t) {
+    threads.emplace_back([&] {
+      DirectoryPtr dir = std::make_shared<Directory>();
+      for (int round = 0; round < kRoundNum; ++round) {
+        int32_t fd = fds.AllocFd(dir);
+        ASSERT_GE(fd, 0);
+        // 无锁栈没有把同一个槽位分给两个线程
+        ASSERT_EQ(fds.GetDirectory(fd), dir);
+        ASSERT_EQ(fds.ReleaseDirectory(fd), dir);
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(fds.used_num(), 0u);
+}
@@ -0,0 +1,204 @@
+// Copyright (c) 2020 UCloud All rights reserved.
+#include "file_block.h"
+
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "file_system.h"
+
+using namespace udisk::blockfs;
+
+// 不挂载文件系统: Format在打开设备之前创建各个handle, 设备名为空时直接失败,
+// 之后把super block和FileBlockMeta区域指到测试自己的内存, 设备换成普通文件
+class FileBlockTest : public ::testing::Test {
+ protected:
+  static constexpr uint32_t kMetaNum = 4;
+  static constexpr uint64_t kImageSize = kMetaNum * kBlockFsFileBlockMetaSize;
+  static inline const std::string kImagePath = "file_block_test.img";
+  static inline AlignBuffer *super_buffer_ = nullptr;
+  static inline AlignBuffer *meta_buffer_ = nullptr;
+
+  static void SetUpTestSuite() {
+    FileSystem *fs = FileSystem::Instance();
+    ASSERT_FALSE(fs->Format(""));
+    super_buffer_ = new AlignBuffer(kSuperBlockSize, kBlockFsPageSize);
+    meta_buffer_ = new AlignBuffer(kImageSize, kBlockFsPageSize);
+    fs->super()->set_base_addr(super_buffer_->data());
+    fs->file_block_handle()->set_base_addr(meta_buffer_->data());
+
+    int fd = ::open(kImagePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(::ftruncate(fd, kImageSize), 0);
+    ::close(fd);
+    ASSERT_TRUE(fs->dev()->OpenImage(kImagePath));
+  }
+
+  static void TearDownTestSuite() {
+    FileSystem::Instance()->dev()->Close();
+    ::unlink(kImagePath.c_str());
+  }
+
+  void SetUp() override {
+    ::memset(super_buffer_->data(), 0, kSuperBlockSize);
+    ::memset(meta_buffer_->data(), 0, kImageSize);
+    SuperBlockMeta *super = FileSystem::Instance()->super_meta();
+    super->file_block_meta_size = kBlockFsFileBlockMetaSize;
+    super->file_block_format_ = kFileBlockFormatExtent;
+    super->checksum_type_ = kChecksumCrc32c;
+  }
+
+  static FileBlockMeta *meta(uint32_t index) {
+    return reinterpret_cast<FileBlockMeta *>(
+        meta_buffer_->data() + index * kBlockFsFileBlockMetaSize);
+  }
+
+  static std::vector<uint32_t> BlockIds(const FileBlock &block) {
+    std::vector<uint32_t> ids;
+    block.GetBlockIds(&ids);
+    return ids;
+  }
+};
+
+TEST_F(FileBlockTest, LoadIdArray) {
+  FileBlockMeta *m = meta(0);
+  std::vector<uint32_t> ids = {10, 11, 12, 20, 21, 5};
+  m->format_ = kFileBlockFormatIds;
+  m->used_block_num_ = ids.size();
+  for (uint32_t i = 0; i < ids.size(); ++i) {
+    m->block_id_[i] = ids[i];
+  }
+
+  FileBlock block(0, m);
+  // 物理连续的block合并成一个extent
+  EXPECT_EQ(block.extent_num(), 3u);
+  EXPECT_EQ(BlockIds(block), ids);
+  uint32_t block_id = 0;
+  EXPECT_EQ(block.GetBlockRun(0, &block_id), 3u);
+  EXPECT_EQ(block_id, 10u);
+  EXPECT_EQ(block.GetBlockRun(2, &block_id), 1u);
+  EXPECT_EQ(block_id, 12u);
+  EXPECT_EQ(block.GetBlockRun(4, &block_id), 1u);
+  EXPECT_EQ(block_id, 21u);
+  EXPECT_EQ(block.GetBlockRun(5, &block_id), 1u);
+  EXPECT_EQ(block_id, 5u);
+  // 超过已经分配的block返回0
+  EXPECT_EQ(block.GetBlockRun(6, &block_id), 0u);
+  EXPECT_EQ(block.get_block_id(3), 20u);
+}
+
+TEST_F(FileBlockTest, StoreExtentsRoundTrip) {
+  FileBlock block(0, meta(0));
+  for (uint32_t id : {100, 101, 102, 7, 8, 300}) {
+    block.add_block_id(id);
+  }
+  EXPECT_EQ(block.used_block_num(), 6u);
+  EXPECT_EQ(block.extent_num(), 3u);
+  ASSERT_TRUE(block.WriteMeta());
+  FileBlockMeta *m = meta(0);
+  EXPECT_EQ(m->format_, kFileBlockFormatExtent);
+  ASSERT_EQ(m->extent_num_, 3u);
+  EXPECT_EQ(m->extents_[1].start_block_, 7u);
+  EXPECT_EQ(m->extents_[1].block_num_, 2u);
+  EXPECT_EQ(m->crc_, FileBlock::CalcCrc(m));
+
+  // 写到设备上的内容和内存一致, 重新解析得到同样的extent
+  AlignBuffer disk(kBlockFsFileBlockMetaSize, kBlockFsPageSize);
+  ASSERT_EQ(FileSystem::Instance()->dev()->PreadDirect(
+                disk.data(), kBlockFsFileBlockMetaSize, 0),
+            static_cast<int64_t>(kBlockFsFileBlockMetaSize));
+  EXPECT_EQ(::memcmp(disk.data(), m, kBlockFsFileBlockMetaSize), 0);
+  FileBlock loaded(1, reinterpret_cast<FileBlockMeta *>(disk.data()));
+  EXPECT_EQ(BlockIds(loaded), BlockIds(block));
+  EXPECT_EQ(loaded.extent_num(), 3u);
+}
+
+TEST_F(FileBlockTest, FallbackToIdArray) {
+  FileBlock block(0, meta(0));
+  // 每个block都不连续, extent数超过kFileBlockMaxExtentNum
+  const uint32_t kNum = kFileBlockMaxExtentNum + 1;
+  ASSERT_LE(kNum, kFileBlockCapacity);
+  for (uint32_t i = 0; i < kNum; ++i) {
+    block.add_block_id(i * 2);
+  }
+  EXPECT_EQ(block.extent_num(), kNum);
+  ASSERT_TRUE(block.WriteMeta());
+  FileBlockMeta *m = meta(0);
+  EXPECT_EQ(m->format_, kFileBlockFormatIds);
+  for (uint32_t i = 0; i < kNum; ++i) {
+    ASSERT_EQ(m->block_id_[i], i * 2);
+  }
+  EXPECT_EQ(m->crc_, FileBlock::CalcCrc(m));
+  FileBlock loaded(1, m);
+  EXPECT_EQ(BlockIds(loaded), BlockIds(block));
+
+  // 刚好放得下的时候仍然使用extent格式
+  FileBlock fit(2, meta(2));
+  for (uint32_t i = 0; i < kFileBlockMaxExtentNum; ++i) {
+    fit.add_block_id(i * 2);
+  }
+  ASSERT_TRUE(fit.WriteMeta());
+  EXPECT_EQ(meta(2)->format_, kFileBlockFormatExtent);
+  EXPECT_EQ(meta(2)->extent_num_, kFileBlockMaxExtentNum);
+}
+
+TEST_F(FileBlockTest, OldFormatStoresIdArray) {
+  FileSystem::Instance()->super_meta()->file_block_format_ =
+      kFileBlockFormatIds;
+  FileBlock block(0, meta(0));
+  block.add_block_id(1);
+  block.add_block_id(2);
+  ASSERT_TRUE(block.WriteMeta());
+  EXPECT_EQ(meta(0)->format_, kFileBlockFormatIds);
+  EXPECT_EQ(meta(0)->block_id_[0], 1u);
+  EXPECT_EQ(meta(0)->block_id_[1], 2u);
+}
+
+TEST_F(FileBlockTest, CalcCrc) {
+  FileBlockMeta *m = meta(0);
+  m->format_ = kFileBlockFormatExtent;
+  m->used_block_num_ = 3;
+  m->extent_num_ = 1;
+  m->extents_[0] = {50, 3};
+  uint32_t crc = FileBlock::CalcCrc(m);
+  // extent格式只校验用到的extent, 后面的垃圾不影响
+  m->extents_[5] = {1, 1};
+  EXPECT_EQ(FileBlock::CalcCrc(m), crc);
+  m->extents_[0].block_num_ = 4;
+  EXPECT_NE(FileBlock::CalcCrc(m), crc);
+  m->extents_[0].block_num_ = 3;
+  // format字段在extent之后, 也要校验
+  m->format_ = kFileBlockFormatIds;
+  uint32_t ids_crc = FileBlock::CalcCrc(m);
+  EXPECT_NE(ids_crc, crc);
+  // id数组格式校验整个元数据
+  m->reserved_[kBlockFsFileBlockMetaSize - 1] ^= 1;
+  EXPECT_NE(FileBlock::CalcCrc(m), ids_crc);
+  m->reserved_[kBlockFsFileBlockMetaSize - 1] ^= 1;
+
+  // 算法由super block决定
+  FileSystem::Instance()->super_meta()->checksum_type_ = kChecksumZlib;
+  EXPECT_NE(FileBlock::CalcCrc(m), ids_crc);
+}
+
+TEST_F(FileBlockTest, SaveRestoreMeta) {
+  FileBlock block(0, meta(0));
+  block.add_block_id(10);
+  block.add_block_id(11);
+  ASSERT_TRUE(block.WriteMeta());
+  std::string saved = block.SaveMeta();
+  EXPECT_EQ(saved.size(), kBlockFsFileBlockMetaSize);
+
+  block.add_block_id(40);
+  block.add_block_id(41);
+  ASSERT_TRUE(block.WriteMeta());
+  EXPECT_EQ(block.used_block_num(), 4u);
+
+  block.RestoreMeta(saved);
+  EXPECT_EQ(block.used_block_num(), 2u);
+  EXPECT_EQ(BlockIds(block), (std::vector<uint32_t>{10, 11}));
+  EXPECT_EQ(::memcmp(meta(0), saved.data(), saved.size()), 0);
+}
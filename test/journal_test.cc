@@ -0,0 +1,349 @@
+// Copyright (c) 2020 UCloud All rights reserved.
+#include "journal.h"
+
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <map>
+#include <thread>
+#include <vector>
+
+#include "device.h"
+
+using namespace udisk::blockfs;
+
+// 普通文件当作设备: 开头是元数据页, 后面是journal区域
+class JournalTest : public ::testing::Test {
+ protected:
+  static constexpr uint64_t kMetaSize = 4 * M;
+  const std::string kImagePath = "journal_test.img";
+
+  Device dev_;
+
+  void SetUp() override {
+    int fd = ::open(kImagePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(::ftruncate(fd, kMetaSize + 16 * M), 0);
+    ::close(fd);
+    ASSERT_TRUE(dev_.OpenImage(kImagePath));
+  }
+
+  void TearDown() override {
+    dev_.Close();
+    ::unlink(kImagePath.c_str());
+  }
+
+  // 原位置上元数据页的第一个字节
+  char ReadPage(uint64_t page) {
+    AlignBuffer buffer(kBlockFsPageSize, kBlockFsPageSize);
+    EXPECT_EQ(dev_.PreadDirect(buffer.data(), kBlockFsPageSize,
+                               page * kBlockFsPageSize),
+              static_cast<int64_t>(kBlockFsPageSize));
+    return buffer.data()[0];
+  }
+
+  // 提交一个事务, 把[first, first + num)的页都填成value
+  bool CommitPages(Journal *journal, uint64_t first, uint32_t num,
+                   char value) {
+    AlignBuffer buffer(num * kBlockFsPageSize, kBlockFsPageSize);
+    ::memset(buffer.data(), value, buffer.size());
+    MetaPages pages;
+    for (uint32_t i = 0; i < num; ++i) {
+      pages.Add((first + i) * kBlockFsPageSize,
+                buffer.data() + i * kBlockFsPageSize);
+    }
+    return journal->Commit(pages);
+  }
+};
+
+TEST_F(JournalTest, ReplayMultiRecordTransaction) {
+  const uint64_t kJournalOffset = kMetaSize;
+  const uint64_t kJournalSize = 8 * M;
+  const uint32_t kPageNum = kJournalMaxPages + 10;
+  {
+    Journal journal(&dev_);
+    ASSERT_TRUE(journal.Format(kJournalOffset, kJournalSize));
+    ASSERT_TRUE(CommitPages(&journal, 0, kPageNum, 'a'));
+    // 没有checkpoint, 只写了journal
+    EXPECT_EQ(ReadPage(0), 0);
+    EXPECT_EQ(ReadPage(kPageNum - 1), 0);
+  }
+
+  // 一个事务拆成两条记录, 第一条带kJournalRecordMore
+  AlignBuffer buffer(kBlockFsPageSize, kBlockFsPageSize);
+  ASSERT_EQ(dev_.PreadDirect(buffer.data(), kBlockFsPageSize,
+                             kJournalOffset + kBlockFsPageSize),
+            static_cast<int64_t>(kBlockFsPageSize));
+  const JournalRecord *record =
+      reinterpret_cast<const JournalRecord *>(buffer.data());
+  EXPECT_EQ(record->page_num_, kJournalMaxPages);
+  EXPECT_TRUE(record->flags_ & kJournalRecordMore);
+
+  // 没有Close就是崩溃, 挂载时回放
+  Journal journal(&dev_);
+  ASSERT_TRUE(journal.Recover(kJournalOffset, kJournalSize));
+  for (uint64_t page = 0; page < kPageNum; ++page) {
+    ASSERT_EQ(ReadPage(page), 'a') << "page " << page;
+  }
+  EXPECT_EQ(ReadPage(kPageNum), 0);
+}
+
+TEST_F(JournalTest, DiscardIncompleteTransaction) {
+  const uint64_t kJournalOffset = kMetaSize;
+  const uint64_t kJournalSize = 8 * M;
+  const uint32_t kPageNum = kJournalMaxPages + 10;
+  {
+    Journal journal(&dev_);
+    ASSERT_TRUE(journal.Format(kJournalOffset, kJournalSize));
+    ASSERT_TRUE(CommitPages(&journal, 0, 1, 'a'));
+    ASSERT_TRUE(CommitPages(&journal, 1, kPageNum, 'b'));
+  }
+  // 第二个事务的最后一条记录没有写下去
+  uint64_t last_record = kJournalOffset + kBlockFsPageSize +
+                         2 * kBlockFsPageSize +
+                         (kJournalMaxPages + 1) * kBlockFsPageSize;
+  AlignBuffer zero(kBlockFsPageSize, kBlockFsPageSize);
+  ASSERT_EQ(dev_.PwriteDirect(zero.data(), kBlockFsPageSize, last_record),
+            static_cast<int64_t>(kBlockFsPageSize));
+
+  Journal journal(&dev_);
+  ASSERT_TRUE(journal.Recover(kJournalOffset, kJournalSize));
+  EXPECT_EQ(ReadPage(0), 'a');
+  for (uint64_t page = 1; page <= kPageNum; ++page) {
+    ASSERT_EQ(ReadPage(page), 0) << "page " << page;
+  }
+}
+
+TEST_F(JournalTest, ReplayAcrossWrapAround) {
+  // 记录区16个页, 每条记录2个页, 用量超过一半时checkpoint
+  // 第5条之后checkpoint, 第6到第8条写到记录区末尾, 第9条绕回开头
+  const uint64_t kJournalOffset = kMetaSize;
+  const uint64_t kJournalSize = 17 * kBlockFsPageSize;
+  {
+    Journal journal(&dev_);
+    ASSERT_TRUE(journal.Format(kJournalOffset, kJournalSize));
+    for (uint32_t round = 0; round < 9; ++round) {
+      ASSERT_TRUE(CommitPages(&journal, round % 8, 1, 'A' + round));
+    }
+    // checkpoint之前的写回了原位置, 之后的只在journal里
+    EXPECT_EQ(ReadPage(0), 'A');
+    EXPECT_EQ(ReadPage(4), 'E');
+    EXPECT_EQ(ReadPage(5), 0);
+  }
+
+  Journal journal(&dev_);
+  ASSERT_TRUE(journal.Recover(kJournalOffset, kJournalSize));
+  EXPECT_EQ(ReadPage(0), 'I');
+  for (uint32_t page = 1; page < 8; ++page) {
+    EXPECT_EQ(ReadPage(page), 'A' + page) << "page " << page;
+  }
+}
+
+TEST_F(JournalTest, CheckpointBeforeChain) {
+  // 记录区600个页, 第二个事务拆成两条记录, 写之前要先checkpoint,
+  // 从当前位置写不下时从记录区开头写
+  const uint64_t kJournalOffset = kMetaSize;
+  const uint64_t kJournalSize = 601 * kBlockFsPageSize;
+  const uint32_t kPageNum = kJournalMaxPages + 10;
+  {
+    Journal journal(&dev_);
+    ASSERT_TRUE(journal.Format(kJournalOffset, kJournalSize));
+    ASSERT_TRUE(CommitPages(&journal, 0, 200, 'a'));
+    EXPECT_EQ(ReadPage(0), 0);
+    ASSERT_TRUE(CommitPages(&journal, 100, kPageNum, 'b'));
+    EXPECT_EQ(ReadPage(0), 'a');
+  }
+  AlignBuffer buffer(kBlockFsPageSize, kBlockFsPageSize);
+  ASSERT_EQ(dev_.PreadDirect(buffer.data(), kBlockFsPageSize,
+                             kJournalOffset + kBlockFsPageSize),
+            static_cast<int64_t>(kBlockFsPageSize));
+  const JournalRecord *record =
+      reinterpret_cast<const JournalRecord *>(buffer.data());
+  EXPECT_EQ(record->seq_, 2u);
+  EXPECT_TRUE(record->flags_ & kJournalRecordMore);
+
+  Journal journal(&dev_);
+  ASSERT_TRUE(journal.Recover(kJournalOffset, kJournalSize));
+  EXPECT_EQ(ReadPage(99), 'a');
+  for (uint64_t page = 100; page < 100 + kPageNum; ++page) {
+    ASSERT_EQ(ReadPage(page), 'b') << "page " << page;
+  }
+}
+
+TEST_F(JournalTest, BatchLargerThanJournal) {
+  // 事务不能拆开提交, 放不下时失败, journal还可以继续使用
+  const uint64_t kJournalOffset = kMetaSize;
+  const uint64_t kJournalSize = 17 * kBlockFsPageSize;
+  Journal journal(&dev_);
+  ASSERT_TRUE(journal.Format(kJournalOffset, kJournalSize));
+  EXPECT_FALSE(CommitPages(&journal, 0, 20, 'a'));
+  EXPECT_FALSE(journal.broken());
+  EXPECT_EQ(ReadPage(0), 0);
+  ASSERT_TRUE(CommitPages(&journal, 0, 2, 'b'));
+  ASSERT_TRUE(journal.Close());
+  EXPECT_EQ(ReadPage(0), 'b');
+}
+
+TEST_F(JournalTest, FailedRecordMakesReadOnly) {
+  const uint64_t kJournalOffset = kMetaSize;
+  const uint64_t kJournalSize = 8 * M;
+  const uint32_t kPageNum = kJournalMaxPages + 10;
+  // 限制文件大小, 记录链的第二条记录写失败
+  struct rlimit old_limit;
+  ASSERT_EQ(::getrlimit(RLIMIT_FSIZE, &old_limit), 0);
+  ::signal(SIGXFSZ, SIG_IGN);
+  {
+    Journal journal(&dev_);
+    ASSERT_TRUE(journal.Format(kJournalOffset, kJournalSize));
+    struct rlimit limit = old_limit;
+    limit.rlim_cur =
+        kJournalOffset + (kJournalMaxPages + 2) * kBlockFsPageSize;
+    ASSERT_EQ(::setrlimit(RLIMIT_FSIZE, &limit), 0);
+    EXPECT_FALSE(CommitPages(&journal, 0, kPageNum, 'a'));
+    ASSERT_EQ(::setrlimit(RLIMIT_FSIZE, &old_limit), 0);
+    // 不会退化成原地写, 之后的提交都失败
+    EXPECT_TRUE(journal.broken());
+    EXPECT_EQ(ReadPage(0), 0);
+    EXPECT_FALSE(CommitPages(&journal, 0, 1, 'b'));
+    EXPECT_FALSE(journal.Close());
+    EXPECT_EQ(ReadPage(0), 0);
+  }
+  // 残留的半个事务不会回放
+  Journal journal(&dev_);
+  ASSERT_TRUE(journal.Recover(kJournalOffset, kJournalSize));
+  for (uint64_t page = 0; page < kPageNum; ++page) {
+    ASSERT_EQ(ReadPage(page), 0) << "page " << page;
+  }
+}
+
+TEST_F(JournalTest, CheckpointAndClose) {
+  // 大小不同的记录反复checkpoint和绕回
+  const uint64_t kJournalOffset = kMetaSize;
+  const uint64_t kJournalSize = 17 * kBlockFsPageSize;
+  const uint32_t kPageRange = 8;
+  std::map<uint64_t, char> expect;
+  {
+    Journal journal(&dev_);
+    ASSERT_TRUE(journal.Format(kJournalOffset, kJournalSize));
+    for (uint32_t round = 0; round < 101; ++round) {
+      uint64_t first = round % kPageRange;
+      uint32_t num = round % 4 + 1;
+      char value = 'A' + round % 50;
+      ASSERT_TRUE(CommitPages(&journal, first, num, value)) << round;
+      for (uint32_t i = 0; i < num; ++i) {
+        expect[first + i] = value;
+      }
+    }
+  }
+
+  Journal journal(&dev_);
+  ASSERT_TRUE(journal.Recover(kJournalOffset, kJournalSize));
+  for (const auto &[page, value] : expect) {
+    ASSERT_EQ(ReadPage(page), value) << "page " << page;
+  }
+
+  // 回放之后新的记录从头开始, 卸载时全部写回原位置
+  ASSERT_TRUE(CommitPages(&journal, 0, 2, 'z'));
+  ASSERT_TRUE(journal.Close());
+  EXPECT_EQ(ReadPage(0), 'z');
+  EXPECT_EQ(ReadPage(1), 'z');
+  Journal remount(&dev_);
+  ASSERT_TRUE(remount.Recover(kJournalOffset, kJournalSize));
+  EXPECT_EQ(ReadPage(0), 'z');
+  EXPECT_EQ(ReadPage(2), expect[2]);
+}
+
+TEST_F(JournalTest, DeferredFlush) {
+  const uint64_t kJournalOffset = kMetaSize;
+  const uint64_t kJournalSize = 8 * M;
+  // 延迟落盘时页的地址必须在元数据镜像中
+  AlignBuffer meta(kMetaSize, kBlockFsPageSize);
+  {
+    Journal journal(&dev_);
+    ASSERT_TRUE(journal.Format(kJournalOffset, kJournalSize));
+    journal.StartFlusher(meta.data(), kMetaSize, 3600 * 1000, kMetaSyncFsync);
+    ASSERT_TRUE(journal.deferred());
+    for (uint64_t page = 0; page < 4; ++page) {
+      char *addr = meta.data() + page * kBlockFsPageSize;
+      ::memset(addr, 'd', kBlockFsPageSize);
+      MetaPages pages;
+      pages.Add(page * kBlockFsPageSize, addr);
+      ASSERT_TRUE(journal.Commit(pages));
+    }
+    // 没有配置的同步点不落盘, journal里还没有记录
+    ASSERT_TRUE(journal.Sync(kMetaSyncClose));
+    AlignBuffer buffer(kBlockFsPageSize, kBlockFsPageSize);
+    ASSERT_EQ(dev_.PreadDirect(buffer.data(), kBlockFsPageSize,
+                               kJournalOffset + kBlockFsPageSize),
+              static_cast<int64_t>(kBlockFsPageSize));
+    EXPECT_NE(reinterpret_cast<JournalRecord *>(buffer.data())->magic_,
+              kJournalMagic);
+    ASSERT_TRUE(journal.Sync(kMetaSyncFsync));
+    // Flush之后的修改没有标记脏页, 不会落盘
+    ::memset(meta.data(), 'x', kBlockFsPageSize);
+  }
+  Journal journal(&dev_);
+  ASSERT_TRUE(journal.Recover(kJournalOffset, kJournalSize));
+  for (uint64_t page = 0; page < 4; ++page) {
+    EXPECT_EQ(ReadPage(page), 'd') << "page " << page;
+  }
+}
+
+TEST_F(JournalTest, FlushWithConcurrentTransactions) {
+  const uint64_t kJournalOffset = kMetaSize;
+  const uint64_t kJournalSize = 8 * M;
+  const int kThreadNum = 4;
+  const int kRoundNum = 2000;
+  AlignBuffer meta(kMetaSize, kBlockFsPageSize);
+  ::memset(meta.data(), 0, kMetaSize);
+  {
+    Journal journal(&dev_);
+    ASSERT_TRUE(journal.Format(kJournalOffset, kJournalSize));
+    journal.StartFlusher(meta.data(), kMetaSize, 1, kMetaSyncFsync);
+    // 每个线程模拟create/rename: 事务里分两次改两页, 中间让出CPU,
+    // Flush如果没有被gate挡住就会拍到半页或者只改了一页的快照
+    std::vector<std::thread> writers;
+    for (int t = 0; t < kThreadNum; ++t) {
+      writers.emplace_back([&, t] {
+        for (int round = 1; round <= kRoundNum; ++round) {
+          char value = static_cast<char>('a' + round % 26);
+          MetaPages pages;
+          bool gated = journal.BeginTransaction();
+          for (uint64_t page = 2 * t; page < 2 * t + 2; ++page) {
+            char *addr = meta.data() + page * kBlockFsPageSize;
+            ::memset(addr, value, kBlockFsPageSize / 2);
+            std::this_thread::yield();
+            ::memset(addr + kBlockFsPageSize / 2, value, kBlockFsPageSize / 2);
+            pages.Add(page * kBlockFsPageSize, addr);
+          }
+          EXPECT_TRUE(journal.Commit(pages));
+          if (gated) {
+            journal.EndTransaction();
+          }
+        }
+      });
+    }
+    for (int i = 0; i < 200; ++i) {
+      EXPECT_TRUE(journal.Sync(kMetaSyncFsync));
+    }
+    for (std::thread &writer : writers) {
+      writer.join();
+    }
+    // 不Close, 只靠journal里的记录恢复
+  }
+  Journal journal(&dev_);
+  ASSERT_TRUE(journal.Recover(kJournalOffset, kJournalSize));
+  AlignBuffer buffer(2 * kBlockFsPageSize, kBlockFsPageSize);
+  for (int t = 0; t < kThreadNum; ++t) {
+    ASSERT_EQ(dev_.PreadDirect(buffer.data(), buffer.size(),
+                               2 * t * kBlockFsPageSize),
+              static_cast<int64_t>(buffer.size()));
+    for (uint64_t i = 1; i < buffer.size(); ++i) {
+      ASSERT_EQ(buffer.data()[i], buffer.data()[0])
+          << "thread " << t << " offset " << i;
+    }
+  }
+}
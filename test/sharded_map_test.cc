@@ -0,0 +1,115 @@
+// Copyright (c) 2020 UCloud All rights reserved.
+#include "sharded_map.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <memory>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "file_handle.h"
+
+using namespace udisk::blockfs;
+
+TEST(ShardedMap, InsertFindErase) {
+  ShardedMap<int32_t, std::shared_ptr<int>> map;
+  EXPECT_TRUE(map.Insert(1, std::make_shared<int>(10)));
+  // 已经存在时不覆盖
+  EXPECT_FALSE(map.Insert(1, std::make_shared<int>(11)));
+  EXPECT_EQ(*map.Find(1), 10);
+  EXPECT_TRUE(map.Contains(1));
+  // 不存在时返回默认构造的值
+  EXPECT_EQ(map.Find(2), nullptr);
+
+  map.InsertOrAssign(1, std::make_shared<int>(12));
+  EXPECT_EQ(*map.Find(1), 12);
+  EXPECT_EQ(map.size(), 1u);
+
+  std::shared_ptr<int> value = map.Extract(1);
+  ASSERT_TRUE(value);
+  EXPECT_EQ(*value, 12);
+  EXPECT_FALSE(map.Extract(1));
+  EXPECT_FALSE(map.Erase(1));
+  EXPECT_EQ(map.size(), 0u);
+}
+
+TEST(ShardedMap, UpdateRemovesOnFalse) {
+  ShardedMap<int32_t, int> refs;
+  auto ref = [&refs](int32_t key, int delta) {
+    refs.Update(key, [delta](int &count) {
+      count += delta;
+      return count > 0;
+    });
+  };
+  ref(7, 1);
+  ref(7, 1);
+  EXPECT_EQ(refs.Find(7), 2);
+  ref(7, -1);
+  EXPECT_TRUE(refs.Contains(7));
+  ref(7, -1);
+  EXPECT_FALSE(refs.Contains(7));
+}
+
+TEST(ShardedMap, ForEachVisitsAllShards) {
+  ShardedMap<uint64_t, uint64_t> map;
+  const uint64_t kNum = 10000;
+  for (uint64_t i = 0; i < kNum; ++i) {
+    ASSERT_TRUE(map.Insert(i, i * 2));
+  }
+  EXPECT_EQ(map.size(), kNum);
+  std::set<uint64_t> keys;
+  EXPECT_TRUE(map.ForEach([&keys](uint64_t key, uint64_t value) {
+    EXPECT_EQ(value, key * 2);
+    keys.insert(key);
+    return true;
+  }));
+  EXPECT_EQ(keys.size(), kNum);
+  // 回调返回false时停止
+  uint64_t visited = 0;
+  EXPECT_FALSE(map.ForEach([&visited](uint64_t, uint64_t) {
+    return ++visited < 10;
+  }));
+  EXPECT_EQ(visited, 10u);
+}
+
+TEST(ShardedMap, HeterogeneousLookup) {
+  ShardedMap<FileNameKey, int, FileNameKeyHash, FileNameKeyEqual> map;
+  EXPECT_TRUE(map.Insert(FileNameKey(1, "a"), 1));
+  EXPECT_TRUE(map.Insert(FileNameKey(2, "a"), 2));
+  std::string name = "a";
+  // 用string_view查找, 不构造FileNameKey
+  EXPECT_EQ(map.Find(FileNameKeyView(1, name)), 1);
+  EXPECT_EQ(map.Find(FileNameKeyView(2, name)), 2);
+  EXPECT_FALSE(map.Contains(FileNameKeyView(3, name)));
+  EXPECT_TRUE(map.Erase(FileNameKeyView(1, name)));
+  EXPECT_FALSE(map.Contains(FileNameKey(1, "a")));
+}
+
+TEST(ShardedMap, ConcurrentExtractOnlyOnce) {
+  ShardedMap<int32_t, std::shared_ptr<int>> map;
+  const int kNum = 1000;
+  const int kThreadNum = 4;
+  for (int i = 0; i < kNum; ++i) {
+    map.Insert(i, std::make_shared<int>(i));
+  }
+  // 并发删除同一个key时只有一个线程能拿到值
+  std::atomic<int> extracted{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreadNum; ++t) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < kNum; ++i) {
+        if (map.Extract(i)) {
+          extracted.fetch_add(1);
+        }
+        map.Find(i);
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(extracted.load(), kNum);
+  EXPECT_EQ(map.size(), 0u);
+}
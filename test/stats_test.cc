@@ -0,0 +1,98 @@
+// Copyright (c) 2020 UCloud All rights reserved.
+#include "stats.h"
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace udisk::blockfs;
+
+TEST(LatencyHistogram, SmallValuesExact) {
+  for (uint64_t ns = 0; ns < LatencyHistogram::kSubBuckets; ++ns) {
+    EXPECT_EQ(LatencyHistogram::Index(ns), ns);
+    EXPECT_EQ(LatencyHistogram::UpperBound(ns), ns);
+  }
+}
+
+TEST(LatencyHistogram, BucketBoundaries) {
+  // 每个桶的上界落在自己的桶里, 上界加一落在下一个桶
+  for (uint32_t i = 0; i + 1 < LatencyHistogram::kBuckets; ++i) {
+    uint64_t upper = LatencyHistogram::UpperBound(i);
+    ASSERT_EQ(LatencyHistogram::Index(upper), i) << "bucket " << i;
+    ASSERT_EQ(LatencyHistogram::Index(upper + 1), i + 1) << "bucket " << i;
+  }
+  // 超过上限的值都落在最后一个桶
+  EXPECT_EQ(LatencyHistogram::Index(1ULL << LatencyHistogram::kMaxBits),
+            LatencyHistogram::kBuckets - 1);
+  EXPECT_EQ(LatencyHistogram::Index(UINT64_MAX),
+            LatencyHistogram::kBuckets - 1);
+}
+
+TEST(LatencyHistogram, RelativeError) {
+  std::mt19937_64 rng(42);
+  for (int i = 0; i < 100000; ++i) {
+    uint64_t ns = rng() >> (rng() % 61 + 3);
+    if (ns >= (1ULL << LatencyHistogram::kMaxBits)) {
+      continue;
+    }
+    uint32_t index = LatencyHistogram::Index(ns);
+    ASSERT_LT(index, LatencyHistogram::kBuckets);
+    uint64_t upper = LatencyHistogram::UpperBound(index);
+    ASSERT_GE(upper, ns);
+    // 报告的值比真实值最多大12.5%
+    ASSERT_LE(upper - ns, ns / LatencyHistogram::kSubBuckets) << ns;
+  }
+}
+
+TEST(StatSnapshot, Percentile) {
+  StatSnapshot snap;
+  EXPECT_EQ(snap.Percentile(0.5), 0u);
+
+  // 1..1000ns各一个样本
+  for (uint64_t ns = 1; ns <= 1000; ++ns) {
+    ++snap.buckets[LatencyHistogram::Index(ns)];
+    ++snap.count;
+    snap.max_ns = ns;
+  }
+  uint64_t p50 = snap.Percentile(0.5);
+  EXPECT_GE(p50, 500u);
+  EXPECT_LE(p50, 500u + 500u / LatencyHistogram::kSubBuckets);
+  uint64_t p99 = snap.Percentile(0.99);
+  EXPECT_GE(p99, 990u);
+  EXPECT_LE(p99, 1000u);
+  // 最大的分位数不超过记录到的最大值
+  EXPECT_EQ(snap.Percentile(1.0), 1000u);
+  // 很小的p至少取第一个样本
+  EXPECT_EQ(snap.Percentile(0.0001), 1u);
+}
+
+TEST(Stats, SnapshotIncludesExitedThreads) {
+  StatSnapshot before[kStatNum];
+  Stats::Snapshot(before);
+  const int kThreadNum = 4;
+  const int kRecordNum = 1000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreadNum; ++t) {
+    threads.emplace_back([] {
+      for (int i = 0; i < kRecordNum; ++i) {
+        Stats::Record(kStatFuseRead, 1000, 4096);
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  StatSnapshot after[kStatNum];
+  Stats::Snapshot(after);
+  const StatSnapshot &read = after[kStatFuseRead];
+  EXPECT_EQ(read.count - before[kStatFuseRead].count,
+            static_cast<uint64_t>(kThreadNum * kRecordNum));
+  EXPECT_EQ(read.bytes - before[kStatFuseRead].bytes,
+            static_cast<uint64_t>(kThreadNum * kRecordNum) * 4096);
+  EXPECT_EQ(read.max_ns, 1000u);
+  EXPECT_EQ(read.buckets[LatencyHistogram::Index(1000)] -
+                before[kStatFuseRead].buckets[LatencyHistogram::Index(1000)],
+            static_cast<uint64_t>(kThreadNum * kRecordNum));
+}
@@ -210,5 +210,6 @@ int main(int argc, char *argv[]) {
   // daemonize(true, false);
 
   block_fs_fuse_mount(FileSystem::Instance()->mount_config());
+  FileSystem::Instance()->UnmountFileSystem();
   return 0;
 }
\ No newline at end of file
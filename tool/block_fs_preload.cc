@@ -0,0 +1,725 @@
+// LD_PRELOAD垫片: 挂载点下面的文件操作转给进程内的libblock_fs, 其他的走libc
+//
+// LD_PRELOAD=libblock_fs_preload.so BLOCK_FS_CONFIG=/data/blockfs/conf/bfs.cnf mysqld
+//   BLOCK_FS_CONFIG: 配置文件, 默认和block_fs_mount一样
+//   BLOCK_FS_PREFIX: 转发的路径前缀, 必须显式指定, 没有设置时什么都不转发;
+//                    不能默认用fuse_mount_point, 否则会和FUSE进程同时挂载
+//
+// 第一次访问前缀下的路径时才挂载, 挂载失败之后所有路径都走libc. blockfs的fd和内核的fd不在一个命名空间,
+// 每个blockfs fd占一个打开/dev/null的内核fd作为占位, 按内核fd查表转发
+// 不支持: dup/fcntl/mmap, fork之后在子进程中访问, 以及跨前缀的rename
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+
+#include "block_fs.h"
+
+namespace {
+
+constexpr const char *kDefaultConfigPath = "/data/blockfs/conf/bfs.cnf";
+constexpr const char *kPlaceholderPath = "/dev/null";
+// fd表的上限, 超过的占位fd直接报EMFILE
+constexpr rlim_t kMaxFdTableSize = 1 << 20;
+
+static_assert(sizeof(struct dirent) == sizeof(struct dirent64),
+              "readdir64 reuses struct dirent");
+
+// 第一次调用时从下一个库里找到libc的实现
+#define REAL(name)                                                        \
+  ([]() {                                                                 \
+    static auto fn =                                                      \
+        reinterpret_cast<decltype(&::name)>(::dlsym(RTLD_NEXT, #name));   \
+    return fn;                                                            \
+  }())
+
+// 把path转换成去掉.和..的绝对路径, 相对路径以当前工作目录为基准
+bool NormalizePath(const char *path, std::string *out) {
+  std::string full;
+  if (path[0] != '/') {
+    char cwd[PATH_MAX];
+    if (!::getcwd(cwd, sizeof(cwd))) {
+      return false;
+    }
+    full = cwd;
+    full += '/';
+  }
+  full += path;
+
+  out->clear();
+  std::string_view rest(full);
+  while (!rest.empty()) {
+    std::size_t pos = rest.find('/');
+    std::string_view name = rest.substr(0, pos);
+    rest = pos == std::string_view::npos ? std::string_view()
+                                         : rest.substr(pos + 1);
+    if (name.empty() || name == ".") {
+      continue;
+    }
+    if (name == "..") {
+      std::size_t slash = out->rfind('/');
+      out->resize(slash == std::string::npos ? 0 : slash);
+      continue;
+    }
+    *out += '/';
+    *out += name;
+  }
+  if (out->empty()) {
+    *out = "/";
+  }
+  return true;
+}
+
+class Preload {
+ private:
+  std::string config_path_;
+  std::string prefix_;  // 规范化之后的前缀, 不带结尾的'/'
+  std::once_flag mount_once_;
+  std::atomic<bool> mounted_{false};
+
+  // 下标是占位的内核fd, 值是blockfs fd + 1, 0表示不是blockfs的fd
+  std::unique_ptr<std::atomic<int32_t>[]> fds_;
+  int32_t fd_table_size_ = 0;
+
+  std::mutex dirs_mutex_;
+  std::unordered_set<const void *> dirs_;
+
+ public:
+  Preload() {
+    const char *config = ::getenv("BLOCK_FS_CONFIG");
+    config_path_ = config ? config : kDefaultConfigPath;
+
+    const char *env_prefix = ::getenv("BLOCK_FS_PREFIX");
+    std::string prefix = env_prefix ? env_prefix : "";
+    // 前缀为空或者是根目录的时候什么都不转发
+    if (!prefix.empty() && prefix[0] == '/') {
+      NormalizePath(prefix.c_str(), &prefix_);
+      if (prefix_ == "/") {
+        prefix_.clear();
+      }
+    }
+
+    struct rlimit limit;
+    rlim_t size = 1024;
+    if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+        limit.rlim_cur != RLIM_INFINITY) {
+      size = limit.rlim_cur;
+    }
+    fd_table_size_ = std::min(size, kMaxFdTableSize);
+    fds_.reset(new std::atomic<int32_t>[fd_table_size_]());
+  }
+
+  bool enabled() const noexcept { return !prefix_.empty(); }
+
+  // 前缀下的路径返回true, bfs_path是blockfs内部的路径
+  bool Route(const char *path, std::string *bfs_path) {
+    if (!enabled() || !path || !path[0]) {
+      return false;
+    }
+    // 绝对路径连前缀都不匹配的时候不用规范化
+    if (path[0] == '/' && ::strncmp(path, prefix_.c_str(), prefix_.size())) {
+      return false;
+    }
+    std::string full;
+    if (!NormalizePath(path, &full)) {
+      return false;
+    }
+    if (full.compare(0, prefix_.size(), prefix_) != 0 ||
+        (full.size() > prefix_.size() && full[prefix_.size()] != '/')) {
+      return false;
+    }
+    std::call_once(mount_once_, [this]() {
+      if (block_fs_mount(config_path_.c_str()) < 0) {
+        ::fprintf(stderr, "block_fs preload mount %s failed: %s\n",
+                  config_path_.c_str(), ::strerror(errno));
+        return;
+      }
+      mounted_.store(true, std::memory_order_release);
+      // 正常退出时把元数据落盘, 下次挂载可以复用共享内存
+      // spdlog的logger和异步线程池在挂载时才创建, 之后注册的退出函数先于
+      // 它们析构执行, 卸载过程中还能打日志
+      ::atexit([]() { block_fs_unmount(); });
+    });
+    // 挂载失败(比如设备已经被别的进程挂载)时交给libc, 不能全部报错
+    if (!mounted_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *bfs_path =
+        full.size() == prefix_.size() ? "/" : full.substr(prefix_.size());
+    return true;
+  }
+
+  // 不是blockfs的fd时返回-1
+  int32_t Lookup(int fd) const noexcept {
+    if (fd < 0 || fd >= fd_table_size_) {
+      return -1;
+    }
+    return fds_[fd].load(std::memory_order_acquire) - 1;
+  }
+
+  // 给blockfs fd分配一个占位的内核fd, 失败时关掉blockfs fd
+  int Attach(int32_t bfs_fd) {
+    int fd = REAL(open)(kPlaceholderPath, O_RDONLY | O_CLOEXEC);
+    if (fd >= fd_table_size_) {
+      REAL(close)(fd);
+      fd = -1;
+      errno = EMFILE;
+    }
+    if (fd < 0) {
+      int err = errno;
+      block_fs_close(bfs_fd);
+      errno = err;
+      return -1;
+    }
+    fds_[fd].store(bfs_fd + 1, std::memory_order_release);
+    return fd;
+  }
+
+  // 先从表中摘掉再关闭占位fd, 内核复用这个fd的时候表项已经是空的
+  int Detach(int fd) {
+    int32_t bfs_fd = fds_[fd].exchange(0, std::memory_order_acq_rel) - 1;
+    if (bfs_fd < 0) {
+      errno = EBADF;
+      return -1;
+    }
+    int ret = block_fs_close(bfs_fd);
+    int err = errno;
+    REAL(close)(fd);
+    errno = err;
+    return ret;
+  }
+
+  void AddDir(const void *dir) {
+    std::lock_guard lock(dirs_mutex_);
+    dirs_.insert(dir);
+  }
+  bool IsDir(const void *dir) {
+    std::lock_guard lock(dirs_mutex_);
+    return dirs_.contains(dir);
+  }
+  bool RemoveDir(const void *dir) {
+    std::lock_guard lock(dirs_mutex_);
+    return dirs_.erase(dir) > 0;
+  }
+};
+
+// 构造完成之前的调用(包括构造函数自己读配置文件)都直接走libc
+std::atomic<Preload *> g_preload{nullptr};
+
+__attribute__((constructor)) void PreloadInit() {
+  g_preload.store(new Preload(), std::memory_order_release);
+}
+
+Preload *preload() { return g_preload.load(std::memory_order_acquire); }
+
+bool Route(const char *path, std::string *bfs_path) {
+  Preload *p = preload();
+  return p && p->Route(path, bfs_path);
+}
+
+bool RouteAt(int dirfd, const char *path, std::string *bfs_path) {
+  if (dirfd != AT_FDCWD && path && path[0] != '/') {
+    return false;
+  }
+  return Route(path, bfs_path);
+}
+
+int32_t BfsFd(int fd) {
+  Preload *p = preload();
+  return p ? p->Lookup(fd) : -1;
+}
+
+bool NeedMode(int flags) {
+  return (flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE;
+}
+
+int OpenBfs(const std::string &path, int flags, mode_t mode) {
+  int32_t bfs_fd = block_fs_open(path.c_str(), flags, mode);
+  if (bfs_fd < 0) {
+    return -1;
+  }
+  return preload()->Attach(bfs_fd);
+}
+
+// 没有偏移的readv/writev用文件位置, 和block_fs_read一样不是原子的
+ssize_t ReadvBfs(int32_t bfs_fd, const struct iovec *iov, int iovcnt) {
+  off_t pos = block_fs_lseek(bfs_fd, 0, SEEK_CUR);
+  if (pos < 0) {
+    return -1;
+  }
+  ssize_t ret = block_fs_preadv(bfs_fd, iov, iovcnt, pos);
+  if (ret > 0) {
+    block_fs_lseek(bfs_fd, pos + ret, SEEK_SET);
+  }
+  return ret;
+}
+
+ssize_t WritevBfs(int32_t bfs_fd, const struct iovec *iov, int iovcnt) {
+  off_t pos = block_fs_lseek(bfs_fd, 0, SEEK_CUR);
+  if (pos < 0) {
+    return -1;
+  }
+  ssize_t ret = block_fs_pwritev(bfs_fd, iov, iovcnt, pos);
+  if (ret > 0) {
+    block_fs_lseek(bfs_fd, pos + ret, SEEK_SET);
+  }
+  return ret;
+}
+
+int AccessBfs(const std::string &path) {
+  struct stat buf;
+  return block_fs_stat(path.c_str(), &buf);
+}
+
+}  // namespace
+
+extern "C" {
+
+int open(const char *path, int flags, ...) {
+  mode_t mode = 0;
+  if (NeedMode(flags)) {
+    va_list ap;
+    va_start(ap, flags);
+    mode = va_arg(ap, mode_t);
+    va_end(ap);
+  }
+  std::string bfs_path;
+  if (Route(path, &bfs_path)) {
+    return OpenBfs(bfs_path, flags, mode);
+  }
+  return REAL(open)(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...) {
+  mode_t mode = 0;
+  if (NeedMode(flags)) {
+    va_list ap;
+    va_start(ap, flags);
+    mode = va_arg(ap, mode_t);
+    va_end(ap);
+  }
+  std::string bfs_path;
+  if (Route(path, &bfs_path)) {
+    return OpenBfs(bfs_path, flags, mode);
+  }
+  return REAL(open64)(path, flags, mode);
+}
+
+int openat(int dirfd, const char *path, int flags, ...) {
+  mode_t mode = 0;
+  if (NeedMode(flags)) {
+    va_list ap;
+    va_start(ap, flags);
+    mode = va_arg(ap, mode_t);
+    va_end(ap);
+  }
+  std::string bfs_path;
+  if (RouteAt(dirfd, path, &bfs_path)) {
+    return OpenBfs(bfs_path, flags, mode);
+  }
+  return REAL(openat)(dirfd, path, flags, mode);
+}
+
+int openat64(int dirfd, const char *path, int flags, ...) {
+  mode_t mode = 0;
+  if (NeedMode(flags)) {
+    va_list ap;
+    va_start(ap, flags);
+    mode = va_arg(ap, mode_t);
+    va_end(ap);
+  }
+  std::string bfs_path;
+  if (RouteAt(dirfd, path, &bfs_path)) {
+    return OpenBfs(bfs_path, flags, mode);
+  }
+  return REAL(openat64)(dirfd, path, flags, mode);
+}
+
+int creat(const char *path, mode_t mode) {
+  return open(path, O_CREAT | O_WRONLY | O_TRUNC, mode);
+}
+
+int creat64(const char *path, mode_t mode) {
+  return open64(path, O_CREAT | O_WRONLY | O_TRUNC, mode);
+}
+
+int close(int fd) {
+  if (BfsFd(fd) >= 0) {
+    return preload()->Detach(fd);
+  }
+  return REAL(close)(fd);
+}
+
+ssize_t read(int fd, void *buf, size_t count) {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_read(bfs_fd, buf, count);
+  }
+  return REAL(read)(fd, buf, count);
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_write(bfs_fd, buf, count);
+  }
+  return REAL(write)(fd, buf, count);
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_pread(bfs_fd, buf, count, offset);
+  }
+  return REAL(pread)(fd, buf, count, offset);
+}
+
+ssize_t pread64(int fd, void *buf, size_t count, off64_t offset) {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_pread(bfs_fd, buf, count, offset);
+  }
+  return REAL(pread64)(fd, buf, count, offset);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_pwrite(bfs_fd, buf, count, offset);
+  }
+  return REAL(pwrite)(fd, buf, count, offset);
+}
+
+ssize_t pwrite64(int fd, const void *buf, size_t count, off64_t offset) {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_pwrite(bfs_fd, buf, count, offset);
+  }
+  return REAL(pwrite64)(fd, buf, count, offset);
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return ReadvBfs(bfs_fd, iov, iovcnt);
+  }
+  return REAL(readv)(fd, iov, iovcnt);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return WritevBfs(bfs_fd, iov, iovcnt);
+  }
+  return REAL(writev)(fd, iov, iovcnt);
+}
+
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_preadv(bfs_fd, iov, iovcnt, offset);
+  }
+  return REAL(preadv)(fd, iov, iovcnt, offset);
+}
+
+ssize_t preadv64(int fd, const struct iovec *iov, int iovcnt,
+                 off64_t offset) {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_preadv(bfs_fd, iov, iovcnt, offset);
+  }
+  return REAL(preadv64)(fd, iov, iovcnt, offset);
+}
+
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_pwritev(bfs_fd, iov, iovcnt, offset);
+  }
+  return REAL(pwritev)(fd, iov, iovcnt, offset);
+}
+
+ssize_t pwritev64(int fd, const struct iovec *iov, int iovcnt,
+                  off64_t offset) {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_pwritev(bfs_fd, iov, iovcnt, offset);
+  }
+  return REAL(pwritev64)(fd, iov, iovcnt, offset);
+}
+
+off_t lseek(int fd, off_t offset, int whence) noexcept {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_lseek(bfs_fd, offset, whence);
+  }
+  return REAL(lseek)(fd, offset, whence);
+}
+
+off64_t lseek64(int fd, off64_t offset, int whence) noexcept {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_lseek(bfs_fd, offset, whence);
+  }
+  return REAL(lseek64)(fd, offset, whence);
+}
+
+int fsync(int fd) {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_fsync(bfs_fd);
+  }
+  return REAL(fsync)(fd);
+}
+
+int fdatasync(int fd) {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_fdatasync(bfs_fd);
+  }
+  return REAL(fdatasync)(fd);
+}
+
+int fstat(int fd, struct stat *buf) noexcept {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_fstat(bfs_fd, buf);
+  }
+  return REAL(fstat)(fd, buf);
+}
+
+int fstat64(int fd, struct stat64 *buf) noexcept {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_fstat(bfs_fd, reinterpret_cast<struct stat *>(buf));
+  }
+  return REAL(fstat64)(fd, buf);
+}
+
+int stat(const char *path, struct stat *buf) noexcept {
+  std::string bfs_path;
+  if (Route(path, &bfs_path)) {
+    return block_fs_stat(bfs_path.c_str(), buf);
+  }
+  return REAL(stat)(path, buf);
+}
+
+int stat64(const char *path, struct stat64 *buf) noexcept {
+  std::string bfs_path;
+  if (Route(path, &bfs_path)) {
+    return block_fs_stat(bfs_path.c_str(),
+                         reinterpret_cast<struct stat *>(buf));
+  }
+  return REAL(stat64)(path, buf);
+}
+
+// blockfs没有软链接, lstat和stat一样
+int lstat(const char *path, struct stat *buf) noexcept {
+  std::string bfs_path;
+  if (Route(path, &bfs_path)) {
+    return block_fs_stat(bfs_path.c_str(), buf);
+  }
+  return REAL(lstat)(path, buf);
+}
+
+int lstat64(const char *path, struct stat64 *buf) noexcept {
+  std::string bfs_path;
+  if (Route(path, &bfs_path)) {
+    return block_fs_stat(bfs_path.c_str(),
+                         reinterpret_cast<struct stat *>(buf));
+  }
+  return REAL(lstat64)(path, buf);
+}
+
+int fstatat(int dirfd, const char *path, struct stat *buf,
+            int flags) noexcept {
+  std::string bfs_path;
+  if (RouteAt(dirfd, path, &bfs_path)) {
+    return block_fs_stat(bfs_path.c_str(), buf);
+  }
+  return REAL(fstatat)(dirfd, path, buf, flags);
+}
+
+int ftruncate(int fd, off_t length) noexcept {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_ftruncate(bfs_fd, length);
+  }
+  return REAL(ftruncate)(fd, length);
+}
+
+int ftruncate64(int fd, off64_t length) noexcept {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_ftruncate(bfs_fd, length);
+  }
+  return REAL(ftruncate64)(fd, length);
+}
+
+int truncate(const char *path, off_t length) noexcept {
+  std::string bfs_path;
+  if (Route(path, &bfs_path)) {
+    return block_fs_truncate(bfs_path.c_str(), length);
+  }
+  return REAL(truncate)(path, length);
+}
+
+int fallocate(int fd, int mode, off_t offset, off_t len) {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_fallocate(bfs_fd, mode, offset, len);
+  }
+  return REAL(fallocate)(fd, mode, offset, len);
+}
+
+int fallocate64(int fd, int mode, off64_t offset, off64_t len) {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_fallocate(bfs_fd, mode, offset, len);
+  }
+  return REAL(fallocate64)(fd, mode, offset, len);
+}
+
+// posix_fallocate不设置errno, 直接返回错误码
+int posix_fallocate(int fd, off_t offset, off_t len) {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_fallocate(bfs_fd, 0, offset, len) < 0 ? errno : 0;
+  }
+  return REAL(posix_fallocate)(fd, offset, len);
+}
+
+int posix_fallocate64(int fd, off64_t offset, off64_t len) {
+  int32_t bfs_fd = BfsFd(fd);
+  if (bfs_fd >= 0) {
+    return block_fs_fallocate(bfs_fd, 0, offset, len) < 0 ? errno : 0;
+  }
+  return REAL(posix_fallocate64)(fd, offset, len);
+}
+
+int rename(const char *oldpath, const char *newpath) noexcept {
+  std::string old_bfs_path, new_bfs_path;
+  bool old_routed = Route(oldpath, &old_bfs_path);
+  bool new_routed = Route(newpath, &new_bfs_path);
+  if (old_routed && new_routed) {
+    return block_fs_rename(old_bfs_path.c_str(), new_bfs_path.c_str());
+  }
+  if (old_routed || new_routed) {
+    errno = EXDEV;
+    return -1;
+  }
+  return REAL(rename)(oldpath, newpath);
+}
+
+int renameat(int olddirfd, const char *oldpath, int newdirfd,
+             const char *newpath) noexcept {
+  std::string old_bfs_path, new_bfs_path;
+  bool old_routed = RouteAt(olddirfd, oldpath, &old_bfs_path);
+  bool new_routed = RouteAt(newdirfd, newpath, &new_bfs_path);
+  if (old_routed && new_routed) {
+    return block_fs_rename(old_bfs_path.c_str(), new_bfs_path.c_str());
+  }
+  if (old_routed || new_routed) {
+    errno = EXDEV;
+    return -1;
+  }
+  return REAL(renameat)(olddirfd, oldpath, newdirfd, newpath);
+}
+
+int unlink(const char *path) noexcept {
+  std::string bfs_path;
+  if (Route(path, &bfs_path)) {
+    return block_fs_unlink(bfs_path.c_str());
+  }
+  return REAL(unlink)(path);
+}
+
+int unlinkat(int dirfd, const char *path, int flags) noexcept {
+  std::string bfs_path;
+  if (RouteAt(dirfd, path, &bfs_path)) {
+    return (flags & AT_REMOVEDIR) ? block_fs_rmdir(bfs_path.c_str())
+                                  : block_fs_unlink(bfs_path.c_str());
+  }
+  return REAL(unlinkat)(dirfd, path, flags);
+}
+
+int mkdir(const char *path, mode_t mode) noexcept {
+  std::string bfs_path;
+  if (Route(path, &bfs_path)) {
+    return block_fs_mkdir(bfs_path.c_str(), mode);
+  }
+  return REAL(mkdir)(path, mode);
+}
+
+int rmdir(const char *path) noexcept {
+  std::string bfs_path;
+  if (Route(path, &bfs_path)) {
+    return block_fs_rmdir(bfs_path.c_str());
+  }
+  return REAL(rmdir)(path);
+}
+
+// 没有权限检查, 存在就可以访问
+int access(const char *path, int mode) noexcept {
+  std::string bfs_path;
+  if (Route(path, &bfs_path)) {
+    return AccessBfs(bfs_path);
+  }
+  return REAL(access)(path, mode);
+}
+
+DIR *opendir(const char *path) {
+  std::string bfs_path;
+  if (Route(path, &bfs_path)) {
+    block_fs_dir *dir = block_fs_opendir(bfs_path.c_str());
+    if (!dir) {
+      return nullptr;
+    }
+    preload()->AddDir(dir);
+    return reinterpret_cast<DIR *>(dir);
+  }
+  return REAL(opendir)(path);
+}
+
+struct dirent *readdir(DIR *dirp) {
+  Preload *p = preload();
+  if (p && p->IsDir(dirp)) {
+    return block_fs_readdir(reinterpret_cast<block_fs_dir *>(dirp));
+  }
+  return REAL(readdir)(dirp);
+}
+
+struct dirent64 *readdir64(DIR *dirp) {
+  Preload *p = preload();
+  if (p && p->IsDir(dirp)) {
+    return reinterpret_cast<struct dirent64 *>(
+        block_fs_readdir(reinterpret_cast<block_fs_dir *>(dirp)));
+  }
+  return REAL(readdir64)(dirp);
+}
+
+int closedir(DIR *dirp) {
+  Preload *p = preload();
+  if (p && p->RemoveDir(dirp)) {
+    return block_fs_closedir(reinterpret_cast<block_fs_dir *>(dirp));
+  }
+  return REAL(closedir)(dirp);
+}
+
+}  // extern "C"
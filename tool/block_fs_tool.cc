@@ -10,6 +10,7 @@
 #include "crc.h"
 #include "file_system.h"
 #include "logging.h"
+#include "stats.h"
 
 using namespace udisk::blockfs;
 
@@ -21,12 +22,15 @@ class BlockFsTool {
     BLOCKFS_DUMP,
     BLOCKFS_BLK,
     BLOCKFS_FILE_META,  // file meta
+    BLOCKFS_STATS,      // latency stats of a mounted fs
   };
   ToolType tool_type_ = BLOCKFS_NONE;
   std::string dump_arg_;
   std::string dev_name_;
   std::string blk_info_;  // offset and size
   std::string file_name_;
+  std::string mount_point_;
+  bool stats_prometheus_ = false;
 
  private:
   void HelpInfo();
@@ -40,6 +44,7 @@ class BlockFsTool {
  public:
   void PrintFileMetadata(const std::string &file_name);
   bool ExportBlkDeviceContents();
+  bool PrintStats();
 };
 
 void BlockFsTool::ParseOption(int argc, char **argv) {
@@ -52,9 +57,11 @@ void BlockFsTool::ParseOption(int argc, char **argv) {
         {"dump", required_argument, nullptr, 'p'},
         {"meta", required_argument, nullptr, 'm'},
         {"blk", required_argument, nullptr, 'b'},
+        {"stats", required_argument, nullptr, 's'},
+        {"prom", no_argument, nullptr, 'P'},
         {"help", no_argument, nullptr, 'h'},
         {0, 0, 0, 0}};
-    c = ::getopt_long(argc, argv, "m:b:d:p:fh", longOpts, &optIndex);
+    c = ::getopt_long(argc, argv, "m:b:d:p:s:Pfh", longOpts, &optIndex);
     if (c == -1) {
       break;
     }
@@ -125,6 +132,18 @@ void BlockFsTool::ParseOption(int argc, char **argv) {
         file_name_ = std::string(optarg);
         LOG(INFO) << "file name: " << blk_info_;
       } break;
+      case 's': {
+        if (tool_type_ != BLOCKFS_NONE) {
+          LOG(ERROR) << "other option already exist, Please check";
+          HelpInfo();
+          exit(1);
+        }
+        tool_type_ = BLOCKFS_STATS;
+        mount_point_ = std::string(optarg);
+      } break;
+      case 'P':
+        stats_prometheus_ = true;
+        break;
       case 'h':
       default: {
         HelpInfo();
@@ -148,6 +167,8 @@ void BlockFsTool::HelpInfo() {
             << " -p, --dump     Dump device, xxx args.\n"
             << " -m, --meta     Dump file meta content.\n"
             << " -b, --blk      Export blk device content.\n"
+            << " -s, --stats    Print latency stats of a mount point.\n"
+            << " -P, --prom     Stats in prometheus text format.\n"
             << " -h, --help     Print help info.\n";
 
   std::cout << "Examples:\n"
@@ -160,7 +181,9 @@ void BlockFsTool::HelpInfo() {
             << "\t dump    : ./block_fs_tool -d /dev/vdb -p all\n"
             << "\t meta    : ./block_fs_tool -d /dev/vdb -m file_name\n"
             << "\t dump    : ./block_fs_tool -d /dev/vdb --dump xxx\n"
-            << "\t blk     : ./block_fs_tool -d /dev/vdb -b offset:size\n";
+            << "\t blk     : ./block_fs_tool -d /dev/vdb -b offset:size\n"
+            << "\t stats   : ./block_fs_tool -s /mnt/bfs\n"
+            << "\t stats   : ./block_fs_tool -s /mnt/bfs --prom\n";
 }
 
 std::vector<std::string> StringSplit(const std::string &s,
@@ -249,7 +272,32 @@ bool BlockFsTool::ExportBlkDeviceContents() {
   return true;
 }
 
+// 统计由挂载进程在内存里维护, 读挂载点根目录下的虚拟文件, 不碰设备
+bool BlockFsTool::PrintStats() {
+  std::string path = mount_point_ + "/" +
+                     std::string(stats_prometheus_ ? Stats::kPrometheusFile
+                                                   : Stats::kJsonFile);
+  int32_t fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(ERROR) << "failed to open stats file: " << path << ", error:" << errno;
+    return false;
+  }
+  char buf[16 * 1024];
+  int64_t ret;
+  while ((ret = ::read(fd, buf, sizeof(buf))) > 0) {
+    std::cout.write(buf, ret);
+  }
+  if (ret < 0) {
+    LOG(ERROR) << "failed to read stats file: " << path << ", error:" << errno;
+  }
+  ::close(fd);
+  return ret == 0;
+}
+
 bool BlockFsTool::DoBlockFsTool() {
+  if (tool_type_ == BLOCKFS_STATS) {
+    return PrintStats();
+  }
   bool is_success = false;
   auto start = std::chrono::high_resolution_clock::now();
   if (tool_type_ == BLOCKFS_FORMAT) {